@@ -0,0 +1,205 @@
+/*
+ * servebench.c
+ * Throughput of "dsh --serve" with many concurrent submitters, compared with
+ * starting a fresh dsh for every submission.
+ *
+ * usage: servebench [-d dsh] [-c clients] [-n requests] [-e cmdline]
+ *   -d  dsh binary to test (default ./dsh)
+ *   -c  concurrent submitters (default 8)
+ *   -n  submissions per submitter (default 200)
+ *   -e  command line submitted (default "true")
+ *
+ * Prints one key=value line per mode.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "../serve.h"
+
+//how long to wait for the server to come up
+#define SERVER_START_TRIES 200
+#define SERVER_START_SLEEP_US 10000
+
+//seconds since some fixed point
+static double now(void);
+
+//one submission over the socket; returns the exit status or -1
+static int submit(const char* path, const char* script, int devNull);
+
+//one submission through a freshly exec'd dsh; returns the exit status or -1
+static int submitCold(const char* dsh, const char* script, int devNull);
+
+//runs clients x requests submissions and returns the elapsed seconds
+static double run(int clients, int requests, const char* dsh, const char* path,
+                  const char* script, int cold);
+
+int main(int argc, char* argv[]){
+   const char* dsh = "./dsh";
+   const char* cmdline = "true";
+   int clients = 8;
+   int requests = 200;
+   int opt;
+
+   while((opt = getopt(argc, argv, "d:c:n:e:")) != -1){
+      switch(opt){
+         case 'd': dsh = optarg; break;
+         case 'c': clients = atoi(optarg); break;
+         case 'n': requests = atoi(optarg); break;
+         case 'e': cmdline = optarg; break;
+         default:
+            fprintf(stderr, "usage: %s [-d dsh] [-c clients] [-n requests] [-e cmdline]\n", argv[0]);
+            exit(EXIT_FAILURE);
+      }
+   }
+
+   char script[4096];
+   snprintf(script, sizeof(script), "%s\n", cmdline);
+   char path[108];
+   snprintf(path, sizeof(path), "/tmp/dsh-servebench.%d.sock", (int) getpid());
+
+   //start the server and wait for its socket
+   pid_t server = fork();
+   if(server == 0){
+      int devNull = open("/dev/null", O_RDWR);
+      dup2(devNull, STDIN_FILENO);
+      dup2(devNull, STDERR_FILENO);
+      execl(dsh, dsh, "--serve", path, (char*) NULL);
+      _exit(127);
+   }
+   int tries;
+   for(tries = 0; tries < SERVER_START_TRIES && access(path, F_OK) != 0; tries++){
+      usleep(SERVER_START_SLEEP_US);
+   }
+   if(tries == SERVER_START_TRIES){
+      fprintf(stderr, "servebench: %s --serve did not start\n", dsh);
+      kill(server, SIGTERM);
+      exit(EXIT_FAILURE);
+   }
+
+   int total = clients * requests;
+   double served = run(clients, requests, dsh, path, script, 0);
+   double cold = run(clients, requests, dsh, path, script, 1);
+   printf("mode=serve clients=%d requests=%d seconds=%.3f req_per_sec=%.1f\n",
+          clients, total, served, total / served);
+   printf("mode=cold clients=%d requests=%d seconds=%.3f req_per_sec=%.1f\n",
+          clients, total, cold, total / cold);
+
+   kill(server, SIGTERM);
+   waitpid(server, NULL, 0);
+   unlink(path);
+   return 0;
+}
+
+//seconds since some fixed point
+static double now(void){
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//runs clients x requests submissions and returns the elapsed seconds
+static double run(int clients, int requests, const char* dsh, const char* path,
+                  const char* script, int cold){
+   pid_t* pids = (pid_t*) calloc(clients, sizeof(pid_t));
+   double start = now();
+   for(int c = 0; c < clients; c++){
+      if((pids[c] = fork()) == 0){
+         int devNull = open("/dev/null", O_RDWR);
+         int failed = 0;
+         for(int r = 0; r < requests; r++){
+            int status = cold ? submitCold(dsh, script, devNull) : submit(path, script, devNull);
+            failed += (status != 0);
+         }
+         _exit(failed ? EXIT_FAILURE : 0);
+      }
+   }
+   int status;
+   int failures = 0;
+   for(int c = 0; c < clients; c++){ //not wait(): the server is our child too
+      if(pids[c] > 0 && waitpid(pids[c], &status, 0) == pids[c]){
+         failures += !(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+      }
+   }
+   free(pids);
+   if(failures > 0){
+      fprintf(stderr, "servebench: %d submitters saw failures\n", failures);
+   }
+   return now() - start;
+}
+
+//one submission over the socket; returns the exit status or -1
+static int submit(const char* path, const char* script, int devNull){
+   struct sockaddr_un addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+   int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+   if(conn < 0 || connect(conn, (struct sockaddr*) &addr, sizeof(addr)) < 0){
+      if(conn >= 0) close(conn);
+      return -1;
+   }
+
+   uint32_t len = strlen(script);
+   dsh_request_t req = { DSH_SERVE_MAGIC, DSH_SERVE_PASS_FDS, len };
+   int fds[DSH_SERVE_NFDS] = { devNull, devNull, devNull };
+   char control[CMSG_SPACE(sizeof(fds))];
+   memset(control, 0, sizeof(control));
+   struct iovec iov = { &req, sizeof(req) };
+   struct msghdr msg;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = control;
+   msg.msg_controllen = sizeof(control);
+   struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type = SCM_RIGHTS;
+   cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+   memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+   int32_t code = -1;
+   dsh_frame_t frame;
+   if(sendmsg(conn, &msg, 0) == (ssize_t) sizeof(req) && write(conn, script, len) == (ssize_t) len
+      && read(conn, &frame, sizeof(frame)) == (ssize_t) sizeof(frame) && frame.type == DSH_FRAME_EXIT
+      && read(conn, &code, sizeof(code)) != (ssize_t) sizeof(code)){
+      code = -1;
+   }
+   close(conn);
+   return code;
+}
+
+//one submission through a freshly exec'd dsh; returns the exit status or -1
+static int submitCold(const char* dsh, const char* script, int devNull){
+   int in[2];
+   if(pipe(in) < 0){
+      return -1;
+   }
+   pid_t pid = fork();
+   if(pid == 0){
+      dup2(in[0], STDIN_FILENO);
+      dup2(devNull, STDOUT_FILENO);
+      dup2(devNull, STDERR_FILENO);
+      close(in[0]);
+      close(in[1]);
+      execl(dsh, dsh, (char*) NULL);
+      _exit(127);
+   }
+   close(in[0]);
+   ssize_t put = write(in[1], script, strlen(script));
+   close(in[1]);
+   int status;
+   if(pid < 0 || put < 0 || waitpid(pid, &status, 0) != pid){
+      return -1;
+   }
+   return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
@@ -0,0 +1,430 @@
+/*
+ * shellbench.c
+ * End-to-end benchmark of dsh in batch mode: generates a script for each
+ * workload, runs dsh < script with stdout to /dev/null and measures it.
+ *
+ *   spawn     trivial commands, one process each
+ *   pipeline  three stage pipelines (ls | sort | wc)
+ *   bg        background jobs, with jobs polled now and then, then wait
+ *   longline  command lines with thousands of arguments (from a glob,
+ *             as a typed line is limited to MAX_LEN_CMDLINE)
+ *   redirect  large files copied through < and >
+ *
+ * usage: shellbench [-d dsh] [-n cmds] [-s MB] [-r runs] [-b baseline] [-w]
+ *   -d  dsh binary to test (default ./dsh)
+ *   -n  command lines of the spawn and bg scripts, the others run a
+ *       fraction of it (default 2000)
+ *   -s  size of the file of the redirect script in MB (default 64)
+ *   -r  runs of each script, the best is kept (default 3)
+ *   -b  baseline to compare with; written with these results if missing
+ *   -w  write the results to the baseline even if it is there
+ *
+ * Prints one key=value line per workload: command lines per second of the
+ * best run, percentiles of how long each command line ran (from one more
+ * run under dsh --record), peak RSS of dsh and what it ran, and bytes per
+ * second through the redirections. Against a baseline the line also has
+ * the change of each number in percent, and regressed=yes when the command
+ * lines per second dropped by more than REGRESSION_PCT.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+//bytes written per write() while generating the redirect input
+#define GEN_BUF_LEN (1 << 20)
+
+//files listed by the glob of the longline script
+#define LONGLINE_FILES 4000
+
+//background jobs started between two jobs of the bg script
+#define BG_POLL_EVERY 100
+
+//drop of cmds_per_sec against the baseline reported as a regression
+#define REGRESSION_PCT 10.0
+
+//most workloads a baseline file may have
+#define MAX_WORKLOADS 16
+
+//what was measured of one workload
+typedef struct {
+   char name[32];
+   long cmds;                 //command lines in the script
+   double seconds;            //best run
+   double cmdsPerSec;
+   long p50, p90, p99, max;   //us a command line ran
+   long peakRssKb;
+   double bytesPerSec;        //0 if the workload moves no data
+} result;
+
+//seconds since some fixed point
+static double now(void);
+
+//writes the script of a workload to path; *cmds and *bytes get the command
+//lines in it and the bytes it copies
+static int writeScript(const char* workload, const char* path, const char* dir,
+                       long n, long mb, long* cmds, long* bytes);
+
+//writes mb MB of data to path
+static int generate(const char* path, long mb);
+
+//runs dsh (with --record trace if not NULL) on script, stdout to /dev/null;
+//returns the elapsed seconds and the peak RSS in *rssKb, -1 on failure
+static double runDsh(const char* dsh, const char* script, const char* trace, long* rssKb);
+
+//percentiles of the run time column of a trace
+static int readLatencies(const char* trace, result* r);
+
+//reads the results of a baseline file; the count, -1 if there is none
+static int readBaseline(const char* path, result* base, int max);
+
+//prints r, with its change against base if not NULL, to out
+static void printResult(FILE* out, const result* r, const result* base);
+
+//change from b to a in percent
+static double change(double a, double b);
+
+//ascending order of longs
+static int longCmp(const void* a, const void* b);
+
+static const char* workloads[] = { "spawn", "pipeline", "bg", "longline", "redirect" };
+
+int main(int argc, char* argv[]){
+   const char* dsh = "./dsh";
+   const char* baseline = NULL;
+   long n = 2000;
+   long mb = 64;
+   int runs = 3;
+   int rewrite = 0;
+   int opt;
+
+   while((opt = getopt(argc, argv, "d:n:s:r:b:w")) != -1){
+      switch(opt){
+         case 'd': dsh = optarg; break;
+         case 'n': n = atol(optarg); break;
+         case 's': mb = atol(optarg); break;
+         case 'r': runs = atoi(optarg); break;
+         case 'b': baseline = optarg; break;
+         case 'w': rewrite = 1; break;
+         default:
+            fprintf(stderr, "usage: %s [-d dsh] [-n cmds] [-s MB] [-r runs] [-b baseline] [-w]\n", argv[0]);
+            exit(EXIT_FAILURE);
+      }
+   }
+   if(n < 10 || mb < 1 || runs < 1){
+      fprintf(stderr, "shellbench: -n must be at least 10, -s and -r at least 1\n");
+      exit(EXIT_FAILURE);
+   }
+   if(rewrite && baseline == NULL){
+      fprintf(stderr, "shellbench: -w needs -b baseline\n");
+      exit(EXIT_FAILURE);
+   }
+
+   result base[MAX_WORKLOADS];
+   int nbase = (baseline != NULL && !rewrite) ? readBaseline(baseline, base, MAX_WORKLOADS) : -1;
+
+   //the rc file is not part of the workload
+   setenv("DSH_RC", "", 1);
+
+   char dir[64];
+   char script[96];
+   char trace[96];
+   snprintf(dir, sizeof(dir), "/tmp/dsh-shellbench.%d", (int) getpid());
+   snprintf(script, sizeof(script), "%s/script", dir);
+   snprintf(trace, sizeof(trace), "%s/trace", dir);
+   if(mkdir(dir, S_IRWXU) < 0){
+      perror(dir);
+      exit(EXIT_FAILURE);
+   }
+
+   int nworkloads = sizeof(workloads) / sizeof(workloads[0]);
+   result results[MAX_WORKLOADS];
+   int failed = 0;
+   for(int w = 0; w < nworkloads; w++){
+      result* r = &results[w];
+      memset(r, 0, sizeof(result));
+      snprintf(r->name, sizeof(r->name), "%s", workloads[w]);
+      long bytes = 0;
+      if(!writeScript(workloads[w], script, dir, n, mb, &r->cmds, &bytes)){
+         perror(workloads[w]);
+         failed = 1;
+         break;
+      }
+
+      for(int i = 0; i < runs; i++){
+         long rss = 0;
+         double s = runDsh(dsh, script, NULL, &rss);
+         if(s < 0){
+            fprintf(stderr, "shellbench: %s failed on the %s script\n", dsh, workloads[w]);
+            failed = 1;
+            break;
+         }
+         r->seconds = (i == 0 || s < r->seconds) ? s : r->seconds;
+         r->peakRssKb = (rss > r->peakRssKb) ? rss : r->peakRssKb;
+      }
+      long rss = 0;
+      if(failed || runDsh(dsh, script, trace, &rss) < 0 || !readLatencies(trace, r)){
+         fprintf(stderr, "shellbench: no latencies for the %s script\n", workloads[w]);
+         failed = 1;
+         break;
+      }
+      r->cmdsPerSec = r->cmds / r->seconds;
+      r->bytesPerSec = bytes / r->seconds;
+
+      const result* b = NULL;
+      for(int i = 0; i < nbase; i++){
+         if(!strcmp(base[i].name, r->name)){
+            b = &base[i];
+         }
+      }
+      printResult(stdout, r, b);
+      fflush(stdout);
+   }
+
+   //the first results become the baseline
+   if(!failed && baseline != NULL && nbase < 0){
+      FILE* out = fopen(baseline, "w");
+      if(out == NULL){
+         perror(baseline);
+      } else {
+         for(int w = 0; w < nworkloads; w++){
+            printResult(out, &results[w], NULL);
+         }
+         fclose(out);
+         fprintf(stderr, "shellbench: baseline written to %s\n", baseline);
+      }
+   }
+
+   //whatever the scripts left behind
+   char cmd[128];
+   snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+   if(system(cmd) != 0){
+      fprintf(stderr, "shellbench: could not remove %s\n", dir);
+   }
+   return failed ? EXIT_FAILURE : 0;
+}
+
+//seconds since some fixed point
+static double now(void){
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//writes the script of a workload to path; *cmds and *bytes get the command
+//lines in it and the bytes it copies
+static int writeScript(const char* workload, const char* path, const char* dir,
+                       long n, long mb, long* cmds, long* bytes){
+   FILE* out = fopen(path, "w");
+   if(out == NULL){
+      return 0;
+   }
+   *cmds = 0;
+   *bytes = 0;
+   if(!strcmp(workload, "spawn")){
+      for(long i = 0; i < n; i++, (*cmds)++){
+         fprintf(out, "/bin/true\n");
+      }
+   } else if(!strcmp(workload, "pipeline")){
+      for(long i = 0; i < n / 4; i++, (*cmds)++){
+         fprintf(out, "ls / | sort | wc -l\n");
+      }
+   } else if(!strcmp(workload, "bg")){
+      for(long i = 0; i < n; i++, (*cmds)++){
+         fprintf(out, (i % BG_POLL_EVERY == BG_POLL_EVERY - 1) ? "jobs\n" : "/bin/true &\n");
+      }
+      fprintf(out, "wait\n");
+      (*cmds)++;
+   } else if(!strcmp(workload, "longline")){
+      char files[96];
+      snprintf(files, sizeof(files), "%s/files", dir);
+      if(mkdir(files, S_IRWXU) < 0 && errno != EEXIST){
+         fclose(out);
+         return 0;
+      }
+      for(int i = 0; i < LONGLINE_FILES; i++){
+         char file[128];
+         snprintf(file, sizeof(file), "%s/argument-%05d", files, i);
+         int fd = open(file, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+         if(fd < 0){
+            fclose(out);
+            return 0;
+         }
+         close(fd);
+      }
+      for(long i = 0; i < n / 20; i++, (*cmds)++){
+         fprintf(out, "/bin/echo %s/*\n", files);
+      }
+   } else if(!strcmp(workload, "redirect")){
+      char in[96];
+      char copy[96];
+      snprintf(in, sizeof(in), "%s/input", dir);
+      snprintf(copy, sizeof(copy), "%s/copy", dir);
+      if(!generate(in, mb)){
+         fclose(out);
+         return 0;
+      }
+      for(int i = 0; i < 8; i++, (*cmds)++){
+         fprintf(out, "cat < %s > %s\n", (i % 2) ? copy : in, (i % 2) ? in : copy);
+         *bytes += mb << 20;
+      }
+   }
+   return fclose(out) == 0;
+}
+
+//writes mb MB of data to path
+static int generate(const char* path, long mb){
+   char* buf = (char*) malloc(GEN_BUF_LEN);
+   int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+   if(buf == NULL || fd < 0){
+      free(buf);
+      if(fd >= 0) close(fd);
+      return 0;
+   }
+   for(int i = 0; i < GEN_BUF_LEN; i++){
+      buf[i] = (i % 64 == 63) ? '\n' : 'a' + (i * 7) % 26;
+   }
+   int ok = 1;
+   for(long i = 0; ok && i < mb; i++){
+      ok = write(fd, buf, GEN_BUF_LEN) == GEN_BUF_LEN;
+   }
+   free(buf);
+   return close(fd) == 0 && ok;
+}
+
+//runs dsh (with --record trace if not NULL) on script, stdout to /dev/null;
+//returns the elapsed seconds and the peak RSS in *rssKb, -1 on failure
+static double runDsh(const char* dsh, const char* script, const char* trace, long* rssKb){
+   double start = now();
+   pid_t pid = fork();
+   if(pid == 0){
+      int in = open(script, O_RDONLY);
+      int devNull = open("/dev/null", O_RDWR);
+      if(in < 0 || devNull < 0){
+         _exit(127);
+      }
+      dup2(in, STDIN_FILENO);
+      dup2(devNull, STDOUT_FILENO);
+      dup2(devNull, STDERR_FILENO);
+      close(in);
+      close(devNull);
+      if(trace != NULL){
+         execl(dsh, dsh, "--record", trace, (char*) NULL);
+      } else {
+         execl(dsh, dsh, (char*) NULL);
+      }
+      _exit(127);
+   }
+   int status;
+   struct rusage usage;
+   if(pid < 0 || wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status)
+      || WEXITSTATUS(status) == 127){
+      return -1;
+   }
+   *rssKb = usage.ru_maxrss;
+   return now() - start;
+}
+
+//percentiles of the run time column of a trace
+static int readLatencies(const char* trace, result* r){
+   FILE* in = fopen(trace, "r");
+   if(in == NULL){
+      return 0;
+   }
+   long cap = 1024;
+   long count = 0;
+   long* us = (long*) malloc(cap * sizeof(long));
+   char* line = NULL;
+   size_t len = 0;
+   while(us != NULL && getline(&line, &len, in) > 0){
+      long since, ran;
+      if(line[0] == '#' || sscanf(line, "%ld\t%ld", &since, &ran) != 2){
+         continue; //header
+      }
+      if(count == cap){
+         cap *= 2;
+         long* more = (long*) realloc(us, cap * sizeof(long));
+         if(more == NULL){
+            free(us);
+            us = NULL;
+            break;
+         }
+         us = more;
+      }
+      us[count++] = ran;
+   }
+   free(line);
+   fclose(in);
+   if(us == NULL || count == 0){
+      free(us);
+      return 0;
+   }
+   qsort(us, count, sizeof(long), longCmp);
+   r->p50 = us[(count - 1) * 50 / 100];
+   r->p90 = us[(count - 1) * 90 / 100];
+   r->p99 = us[(count - 1) * 99 / 100];
+   r->max = us[count - 1];
+   free(us);
+   return 1;
+}
+
+//reads the results of a baseline file; the count, -1 if there is none
+static int readBaseline(const char* path, result* base, int max){
+   FILE* in = fopen(path, "r");
+   if(in == NULL){
+      return -1;
+   }
+   int n = 0;
+   char line[512];
+   while(n < max && fgets(line, sizeof(line), in) != NULL){
+      result* b = &base[n];
+      memset(b, 0, sizeof(result));
+      if(sscanf(line, "bench=%31s cmds=%ld seconds=%lf cmds_per_sec=%lf p50_us=%ld p90_us=%ld"
+                " p99_us=%ld max_us=%ld peak_rss_kb=%ld bytes_per_sec=%lf",
+                b->name, &b->cmds, &b->seconds, &b->cmdsPerSec, &b->p50, &b->p90,
+                &b->p99, &b->max, &b->peakRssKb, &b->bytesPerSec) == 10){
+         n++;
+      }
+   }
+   fclose(in);
+   return n;
+}
+
+//prints r, with its change against base if not NULL, to out
+static void printResult(FILE* out, const result* r, const result* base){
+   fprintf(out, "bench=%s cmds=%ld seconds=%.3f cmds_per_sec=%.1f p50_us=%ld p90_us=%ld"
+           " p99_us=%ld max_us=%ld peak_rss_kb=%ld bytes_per_sec=%.0f",
+           r->name, r->cmds, r->seconds, r->cmdsPerSec, r->p50, r->p90,
+           r->p99, r->max, r->peakRssKb, r->bytesPerSec);
+   if(base != NULL){
+      double speed = change(r->cmdsPerSec, base->cmdsPerSec);
+      fprintf(out, " cmds_per_sec_pct=%+.1f p50_pct=%+.1f p99_pct=%+.1f peak_rss_pct=%+.1f",
+              speed, change(r->p50, base->p50), change(r->p99, base->p99),
+              change(r->peakRssKb, base->peakRssKb));
+      if(base->bytesPerSec > 0){
+         fprintf(out, " bytes_per_sec_pct=%+.1f", change(r->bytesPerSec, base->bytesPerSec));
+      }
+      fprintf(out, " regressed=%s", (speed < -REGRESSION_PCT) ? "yes" : "no");
+   }
+   fprintf(out, "\n");
+}
+
+//change from b to a in percent
+static double change(double a, double b){
+   return (b != 0) ? (a - b) * 100 / b : 0;
+}
+
+//ascending order of longs
+static int longCmp(const void* a, const void* b){
+   long la = *(const long*) a;
+   long lb = *(const long*) b;
+   return (la > lb) - (la < lb);
+}
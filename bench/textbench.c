@@ -0,0 +1,244 @@
+/*
+ * textbench.c
+ * Built-in wc and grep against the external tools: runs each command line
+ * through dsh once as typed (the shell runs wc/grep itself) and once with
+ * the tool's full path (exec'd as before), on a generated text file.
+ *
+ * usage: textbench [-d dsh] [-s MB] [-f file] [-r runs]
+ *   -d  dsh binary to test (default ./dsh)
+ *   -s  size of the generated input in MB (default 1024)
+ *   -f  use this file instead of generating one
+ *   -r  runs of each command, the best is kept (default 3)
+ *
+ * Prints one key=value line per command; same=yes when both runs printed
+ * the same output.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/wait.h>
+
+//bytes written per write() while generating the input
+#define GEN_BUF_LEN (1 << 20)
+
+//word looked for by the grep commands; about one line in NEEDLE_EVERY has it
+#define NEEDLE "dshneedle"
+#define NEEDLE_EVERY 50
+
+//commands run; %s is the tool (wc or grep, or its path), %s the input
+static const char* commands[][2] = {
+   { "wc", "%s -l %s" },
+   { "wc", "%s %s" },
+   { "wc", "cat %s | %s -l" },
+   { "grep", "%s -c " NEEDLE " %s" },
+   { "grep", "cat %s | %s -c " NEEDLE },
+   { "grep", "%s -v " NEEDLE " %s" },
+};
+
+//seconds since some fixed point
+static double now(void);
+
+//writes mb MB of text lines to path
+static int generate(const char* path, long mb);
+
+//full path of tool on $PATH, NULL if not found
+static char* findTool(const char* tool);
+
+//runs cmdline through dsh with stdout to out; returns the elapsed seconds
+static double runDsh(const char* dsh, const char* cmdline, const char* out);
+
+//true if files a and b have the same contents
+static int sameFile(const char* a, const char* b);
+
+int main(int argc, char* argv[]){
+   const char* dsh = "./dsh";
+   const char* input = NULL;
+   long mb = 1024;
+   int runs = 3;
+   int opt;
+
+   while((opt = getopt(argc, argv, "d:s:f:r:")) != -1){
+      switch(opt){
+         case 'd': dsh = optarg; break;
+         case 's': mb = atol(optarg); break;
+         case 'f': input = optarg; break;
+         case 'r': runs = atoi(optarg); break;
+         default:
+            fprintf(stderr, "usage: %s [-d dsh] [-s MB] [-f file] [-r runs]\n", argv[0]);
+            exit(EXIT_FAILURE);
+      }
+   }
+
+   char generated[64];
+   if(input == NULL){
+      snprintf(generated, sizeof(generated), "/tmp/dsh-textbench.%d.txt", (int) getpid());
+      if(!generate(generated, mb)){
+         perror(generated);
+         unlink(generated);
+         exit(EXIT_FAILURE);
+      }
+      input = generated;
+   }
+   char outBuiltin[64];
+   char outExternal[64];
+   snprintf(outBuiltin, sizeof(outBuiltin), "/tmp/dsh-textbench.%d.b", (int) getpid());
+   snprintf(outExternal, sizeof(outExternal), "/tmp/dsh-textbench.%d.e", (int) getpid());
+
+   for(size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++){
+      char* path = findTool(commands[i][0]);
+      if(path == NULL){
+         fprintf(stderr, "textbench: %s not found on $PATH\n", commands[i][0]);
+         continue;
+      }
+      //the input comes first for "cat %s | %s"
+      int catFirst = !strncmp(commands[i][1], "cat", 3);
+      char builtin[PATH_MAX * 2];
+      char external[PATH_MAX * 2];
+      snprintf(builtin, sizeof(builtin), commands[i][1], catFirst ? input : commands[i][0],
+               catFirst ? commands[i][0] : input);
+      snprintf(external, sizeof(external), commands[i][1], catFirst ? input : path,
+               catFirst ? path : input);
+
+      double bestBuiltin = 0;
+      double bestExternal = 0;
+      for(int r = 0; r < runs; r++){
+         double b = runDsh(dsh, builtin, outBuiltin);
+         double e = runDsh(dsh, external, outExternal);
+         bestBuiltin = (r == 0 || b < bestBuiltin) ? b : bestBuiltin;
+         bestExternal = (r == 0 || e < bestExternal) ? e : bestExternal;
+      }
+      printf("cmd=\"%s\" builtin_s=%.3f external_s=%.3f speedup=%.2f same=%s\n",
+             builtin, bestBuiltin, bestExternal, bestExternal / bestBuiltin,
+             sameFile(outBuiltin, outExternal) ? "yes" : "no");
+      fflush(stdout);
+      free(path);
+   }
+
+   unlink(outBuiltin);
+   unlink(outExternal);
+   if(input == generated){
+      unlink(generated);
+   }
+   return 0;
+}
+
+//seconds since some fixed point
+static double now(void){
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//writes mb MB of text lines to path: words of varied length, some tabs
+//and runs of spaces, and the needle now and then
+static int generate(const char* path, long mb){
+   static const char* words[] = { "the", "shell", "forks", "a", "pipeline", "of", "processes",
+                                  "while\tit", "waits", "for", "status", "reports", "and  then",
+                                  "prints", "prompt", "again" };
+   int nWords = sizeof(words) / sizeof(words[0]);
+   int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if(fd < 0){
+      return 0;
+   }
+   char* buf = (char*) malloc(GEN_BUF_LEN + 256);
+   unsigned long seed = 12345;
+   long long left = mb * (1LL << 20);
+   long line = 0;
+   while(left > 0){
+      size_t len = 0;
+      while(len < GEN_BUF_LEN){
+         int n = 3 + (int) ((seed >> 16) % 12);
+         for(int w = 0; w < n; w++){
+            seed = seed * 1103515245 + 12345;
+            const char* word = (line % NEEDLE_EVERY == 0 && w == n / 2) ? NEEDLE : words[(seed >> 16) % nWords];
+            size_t wl = strlen(word);
+            memcpy(buf + len, word, wl);
+            len += wl;
+            buf[len++] = (w == n - 1) ? '\n' : ' ';
+         }
+         line++;
+      }
+      size_t chunk = (left < (long long) len) ? (size_t) left : len;
+      if(write(fd, buf, chunk) != (ssize_t) chunk){
+         free(buf);
+         close(fd);
+         return 0;
+      }
+      left -= chunk;
+   }
+   //end on a whole line
+   if(write(fd, "\n", 1) != 1){
+      free(buf);
+      close(fd);
+      return 0;
+   }
+   free(buf);
+   close(fd);
+   return 1;
+}
+
+//full path of tool on $PATH, NULL if not found
+static char* findTool(const char* tool){
+   const char* path = getenv("PATH");
+   char candidate[PATH_MAX];
+   while(path != NULL && *path != '\0'){
+      const char* colon = strchr(path, ':');
+      int len = (colon != NULL) ? (int) (colon - path) : (int) strlen(path);
+      snprintf(candidate, sizeof(candidate), "%.*s/%s", len, path, tool);
+      if(len > 0 && access(candidate, X_OK) == 0){
+         return strdup(candidate);
+      }
+      path = (colon != NULL) ? colon + 1 : NULL;
+   }
+   return NULL;
+}
+
+//runs cmdline through dsh with stdout to out; returns the elapsed seconds
+static double runDsh(const char* dsh, const char* cmdline, const char* out){
+   int in[2];
+   if(pipe(in) < 0){
+      return -1;
+   }
+   double start = now();
+   pid_t pid = fork();
+   if(pid == 0){
+      int outFd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      int devNull = open("/dev/null", O_WRONLY);
+      dup2(in[0], STDIN_FILENO);
+      dup2(outFd, STDOUT_FILENO);
+      dup2(devNull, STDERR_FILENO);
+      close(in[0]);
+      close(in[1]);
+      execl(dsh, dsh, (char*) NULL);
+      _exit(127);
+   }
+   close(in[0]);
+   dprintf(in[1], "%s\n", cmdline);
+   close(in[1]);
+   waitpid(pid, NULL, 0);
+   return now() - start;
+}
+
+//true if files a and b have the same contents
+static int sameFile(const char* a, const char* b){
+   FILE* fa = fopen(a, "r");
+   FILE* fb = fopen(b, "r");
+   int same = (fa != NULL && fb != NULL);
+   while(same){
+      int ca = getc(fa);
+      int cb = getc(fb);
+      same = (ca == cb);
+      if(ca == EOF || cb == EOF){
+         break;
+      }
+   }
+   if(fa != NULL) fclose(fa);
+   if(fb != NULL) fclose(fb);
+   return same;
+}
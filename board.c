@@ -0,0 +1,204 @@
+/*
+ * board.c
+ * Job status board: keeps a copy of the job table (pgid, state, command,
+ * start time and CPU time) in a seqlock-protected shared memory segment so
+ * monitors can sample it without signalling or parsing the shell (layout in
+ * dshboard.h, reader in dshboard.c).
+ */
+
+#include "dsh.h"
+#include "dshboard.h"
+
+#include <pthread.h>    /* refresh thread */
+#include <sys/mman.h>   /* shm_open(), mmap() */
+#include <time.h>       /* clock_gettime() */
+
+//bytes of /proc/<pid>/stat read to get at utime and stime
+#define BOARD_STAT_BUF_LEN 512
+
+#define NSEC_PER_SEC 1000000000LL
+#define NSEC_PER_MSEC 1000000LL
+
+//the mapped board, NULL while there is none
+static dsh_board_t* board = NULL;
+
+//shm_open() name of the board and the shell that owns it (children that
+//fail to exec run our atexit handlers too)
+static char boardName[32];
+static pid_t boardOwner = -1;
+
+//guards the job table against the refresh thread
+static pthread_mutex_t boardMutex = PTHREAD_MUTEX_INITIALIZER;
+
+//wakes the refresh thread when the job table changed
+static pthread_cond_t boardWake = PTHREAD_COND_INITIALIZER;
+static bool boardDirty = false;
+
+//entries are collected here first so the seqlock is held for a memcpy only
+static dsh_board_job_t staged[DSH_BOARD_MAX_JOBS];
+
+//republishes the board; called with boardMutex held
+static void publish(void);
+
+//refresh thread: republishes on changes, and periodically while jobs run
+static void* refreshBoard(void* arg);
+
+//removes the segment when the shell exits
+static void removeBoard(void);
+
+//now on CLOCK_REALTIME in ns
+static int64_t nowNs(void);
+
+//creates the board and its refresh thread, see dsh.h
+void board_start(void){
+   const char* enabled = getenv("DSH_BOARD");
+   if(board != NULL || (enabled != NULL && !strcmp(enabled, "0"))){
+      return;
+   }
+
+   snprintf(boardName, sizeof(boardName), DSH_BOARD_NAME_FMT, (int) getpid());
+   int fd = shm_open(boardName, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+   if(fd < 0){
+      perror("dsh: shm_open");
+      return;
+   }
+   void* mem = MAP_FAILED;
+   if(ftruncate(fd, sizeof(dsh_board_t)) == 0){
+      mem = mmap(NULL, sizeof(dsh_board_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   }
+   close(fd);
+   if(mem == MAP_FAILED){
+      perror("dsh: job board");
+      shm_unlink(boardName);
+      return;
+   }
+
+   board = (dsh_board_t*) mem; //zero filled by ftruncate()
+   board->version = DSH_BOARD_VERSION;
+   board->pid = getpid();
+   board->updated_ns = nowNs();
+   __atomic_store_n(&board->magic, DSH_BOARD_MAGIC, __ATOMIC_RELEASE);
+   boardOwner = getpid();
+   atexit(removeBoard);
+
+   //signals are for the main thread only
+   sigset_t all, old;
+   sigfillset(&all);
+   pthread_sigmask(SIG_BLOCK, &all, &old);
+   pthread_t thread;
+   if(pthread_create(&thread, NULL, refreshBoard, NULL) == 0){
+      pthread_detach(thread);
+   } else {
+      perror("dsh: job board thread");
+   }
+   pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+//takes the job table from the refresh thread
+void board_lock(void){
+   pthread_mutex_lock(&boardMutex);
+}
+
+//hands the job table back and has the board republished
+void board_unlock(void){
+   boardDirty = true;
+   pthread_cond_signal(&boardWake);
+   pthread_mutex_unlock(&boardMutex);
+}
+
+//has the board republished after a job changed state
+void board_changed(void){
+   board_lock();
+   board_unlock();
+}
+
+//user + system CPU time of a process from /proc/<pid>/stat, 0 if it is gone
+uint64_t board_cpu_ns(pid_t pid){
+   static long ticksPerSec = 0;
+   char path[32];
+   char buf[BOARD_STAT_BUF_LEN];
+
+   snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+   int fd = open(path, O_RDONLY | O_CLOEXEC);
+   if(fd < 0){
+      return 0;
+   }
+   ssize_t got = read(fd, buf, sizeof(buf) - 1);
+   close(fd);
+   if(got <= 0){
+      return 0;
+   }
+   buf[got] = '\0';
+
+   //the command name (field 2) may hold spaces and parentheses, so count
+   //from the last ')': state is field 3, utime and stime fields 14 and 15
+   char* fields = strrchr(buf, ')');
+   unsigned long utime, stime;
+   if(fields == NULL || sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                               &utime, &stime) != 2){
+      return 0;
+   }
+   if(ticksPerSec == 0){
+      ticksPerSec = sysconf(_SC_CLK_TCK);
+   }
+   return (uint64_t) (utime + stime) * NSEC_PER_SEC / ticksPerSec;
+}
+
+//republishes the board; called with boardMutex held
+static void publish(void){
+   int total = board_collect(staged, DSH_BOARD_MAX_JOBS);
+   int n = (total < DSH_BOARD_MAX_JOBS) ? total : DSH_BOARD_MAX_JOBS;
+
+   //seqlock: odd while writing, readers retry if it moved under them
+   uint32_t seq = board->seq;
+   __atomic_store_n(&board->seq, seq + 1, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+   memcpy(board->jobs, staged, n * sizeof(dsh_board_job_t));
+   board->njobs = n;
+   board->njobs_total = total;
+   board->updates++;
+   board->updated_ns = nowNs();
+   __atomic_store_n(&board->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+//refresh thread: republishes on changes, and periodically while jobs run
+static void* refreshBoard(void* arg){
+   pthread_mutex_lock(&boardMutex);
+   bool running = false;
+   while(1){
+      if(running){ //CPU times move: come back even if nothing changes
+         struct timespec until;
+         clock_gettime(CLOCK_REALTIME, &until);
+         until.tv_nsec += DSH_BOARD_REFRESH_MS * NSEC_PER_MSEC;
+         until.tv_sec += until.tv_nsec / NSEC_PER_SEC;
+         until.tv_nsec %= NSEC_PER_SEC;
+         while(!boardDirty && pthread_cond_timedwait(&boardWake, &boardMutex, &until) == 0);
+      } else {
+         while(!boardDirty){
+            pthread_cond_wait(&boardWake, &boardMutex);
+         }
+      }
+      boardDirty = false;
+
+      publish();
+      running = false;
+      for(uint32_t i = 0; i < board->njobs; i++){
+         running |= (board->jobs[i].state == DSH_JOB_RUNNING);
+      }
+   }
+   return NULL; /* NOT REACHED */
+}
+
+//removes the segment when the shell exits
+static void removeBoard(void){
+   if(board != NULL && getpid() == boardOwner){
+      shm_unlink(boardName);
+   }
+}
+
+//now on CLOCK_REALTIME in ns
+static int64_t nowNs(void){
+   struct timespec now;
+   clock_gettime(CLOCK_REALTIME, &now);
+   return (int64_t) now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
@@ -0,0 +1,552 @@
+/*
+ * cache.c
+ * Content-addressed result cache for deterministic commands: the stdout and
+ * exit status of a job are stored under a hash of everything the job reads
+ * (argv, executables, cwd, selected environment and input files) so a later
+ * run with the same inputs is replayed without spawning anything.
+ */
+
+#include "dsh.h"
+
+#include <dirent.h>      /* scanning the store for eviction */
+#include <limits.h>      /* PATH_MAX */
+#ifdef __linux__
+#include <sys/sendfile.h> /* sendfile() */
+#endif
+
+//where entries live when neither $DSH_CACHE_DIR nor a home directory is set
+#define CACHE_FALLBACK_DIR "/tmp/dsh-cache"
+
+//bytes kept in the store unless $DSH_CACHE_MAX says otherwise
+#define CACHE_DEFAULT_MAX_BYTES (64 << 20)
+
+//eviction stops once the store is down to this share of its maximum (in %)
+#define CACHE_EVICT_TO_PERCENT 75
+
+//bytes of an input file hashed per read() when hashing by content
+#define CACHE_HASH_BUF_LEN 65536
+
+//bytes copied per read() when sendfile() is not available
+#define CACHE_COPY_BUF_LEN 65536
+
+//entry file header magic, "DSC1"
+#define CACHE_MAGIC 0x31435344u
+
+//entry names are the key hash in hex
+#define CACHE_NAME_LEN 16
+
+//FNV-1a 64 bit; the check hash starts from a different basis so a clash on
+//the file name is caught when the entry is read back
+#define FNV_PRIME 0x100000001b3ULL
+#define FNV_BASIS 0xcbf29ce484222325ULL
+#define FNV_CHECK_BASIS 0x84222325cbf29ce4ULL
+
+//what an entry file starts with; the captured stdout follows
+typedef struct _cacheEntryHeader {
+   uint32_t magic;  //CACHE_MAGIC
+   int32_t status;  //exit status of the job
+   uint64_t check;  //key.check of the job
+   uint64_t len;    //bytes of stdout following the header
+} cacheEntryHeader;
+
+//one entry seen while scanning the store
+typedef struct _cacheEntry {
+   char name[CACHE_NAME_LEN + 1];
+   struct timespec used; //mtime, bumped on every hit
+   off_t size;
+} cacheEntry;
+
+//counters shown by the stats builtin
+static unsigned long hits = 0;
+static unsigned long misses = 0;
+static unsigned long stores = 0;
+static unsigned long evictions = 0;
+static unsigned long uncacheable = 0;
+static unsigned long long bytesReplayed = 0;
+
+//store location and size, worked out on first use
+static char* storeDir = NULL;
+static bool storeRefused = false; //not ours alone: told once, then no caching
+static unsigned long long maxBytes = 0;
+static unsigned long long storeBytes = 0;
+static bool storeScanned = false;
+
+//commands that are always run through the cache
+static char** allowed = NULL;
+static int nAllowed = 0;
+
+//works out (and creates) the store directory
+static bool openStore(void);
+
+//mkdir -p
+static bool makeDirs(char* path);
+
+//feeds len bytes into both hashes of the key
+static void hashBytes(cache_key_t* key, const void* data, size_t len);
+
+//feeds a NUL terminated string (and its terminator) into the key
+static void hashString(cache_key_t* key, const char* s);
+
+//feeds what identifies the contents of a file into the key: its metadata,
+//or every byte of it when byContent is set; false if it cannot be read
+static bool hashFile(cache_key_t* key, const char* path, bool byContent);
+
+//feeds every byte of the open file fd (a here-document memfd) into the key,
+//leaving its offset alone; false if it cannot be read
+static bool hashDescriptor(cache_key_t* key, int fd);
+
+//path of the entry file for key
+static void entryPath(const cache_key_t* key, char* path, size_t len);
+
+//sums the store and evicts least recently used entries while it is too big
+static void evictEntries(void);
+
+//oldest use first
+static int entryCmp(const void* a, const void* b);
+
+//builds the key of j, see dsh.h
+bool cache_make_key(job_t* j, char** vars, int nvars, char** inputs, int ninputs,
+                    bool by_content, cache_key_t* key){
+   key->hash = FNV_BASIS;
+   key->check = FNV_CHECK_BASIS;
+   hashString(key, "dsh-cache-1");
+
+   const char* cwd = shell_cwd();
+   if(*cwd == '\0'){
+      uncacheable++;
+      return false;
+   }
+   hashString(key, cwd);
+
+   //the environment subset: PATH picks the executables, the rest is declared
+   hashString(key, "PATH");
+   hashString(key, getenv("PATH") ? getenv("PATH") : "");
+   for(int i = 0; i < nvars; i++){
+      char* value = getenv(vars[i]);
+      hashString(key, vars[i]);
+      hashString(key, value ? value : "\001unset");
+   }
+
+   process_t* p;
+   char exe[PATH_MAX];
+   for(p = j->first_process; p != NULL; p = p->next){
+      ///dev/fd paths of <(...) and >(...) have no contents to hash
+      if(p->nkeepfds > 0 || !resolve_command(p->argv[0], exe, sizeof(exe))
+         || !hashFile(key, exe, false)){
+         uncacheable++;
+         return false;
+      }
+      hashString(key, "\001argv");
+      for(int i = 0; i < p->argc; i++){
+         hashString(key, p->argv[i]);
+         struct stat sb;
+         if(i > 0 && stat(p->argv[i], &sb) == 0 && S_ISREG(sb.st_mode)){
+            hashFile(key, p->argv[i], by_content); //operands naming files
+         }
+      }
+      hashString(key, "\001ifile");
+      if(p->ifile != NULL){
+         hashString(key, p->ifile);
+         if(!hashFile(key, p->ifile, by_content)){ //the job would fail anyway
+            uncacheable++;
+            return false;
+         }
+      }
+      hashString(key, "\001heredoc"); //the body as expanded, it is stdin
+      if(p->herefd >= 0 && !hashDescriptor(key, p->herefd)){
+         uncacheable++;
+         return false;
+      }
+   }
+
+   hashString(key, "\001inputs");
+   for(int i = 0; i < ninputs; i++){
+      hashString(key, inputs[i]);
+      if(!hashFile(key, inputs[i], by_content)){
+         hashString(key, "\001missing"); //its absence is an input too
+      }
+   }
+   return true;
+}
+
+//writes the stored stdout for key to out, see dsh.h
+bool cache_replay(const cache_key_t* key, int out, int* status){
+   char path[PATH_MAX];
+   if(!openStore()){
+      return false;
+   }
+   entryPath(key, path, sizeof(path));
+
+   int fd = open(path, O_RDONLY | O_CLOEXEC);
+   if(fd < 0){
+      misses++;
+      return false;
+   }
+
+   cacheEntryHeader hdr;
+   struct stat sb;
+   if(read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || fstat(fd, &sb) < 0
+      || hdr.magic != CACHE_MAGIC || hdr.check != key->check
+      || (uint64_t) sb.st_size != sizeof(hdr) + hdr.len){
+      close(fd);
+      unlink(path); //a clash or a torn entry, it will be stored again
+      misses++;
+      return false;
+   }
+
+   futimens(fd, NULL); //most recently used now
+   bool ok = cache_copy(fd, sizeof(hdr), hdr.len, out);
+   close(fd);
+   if(ok){
+      hits++;
+      bytesReplayed += hdr.len;
+      *status = hdr.status;
+   }
+   return ok;
+}
+
+//stores len bytes of output from fd under key, see dsh.h
+void cache_store(const cache_key_t* key, int status, int fd, size_t len){
+   if(!openStore() || len + sizeof(cacheEntryHeader) > maxBytes / 2){
+      return; //an entry that big would flush the whole store
+   }
+
+   char path[PATH_MAX];
+   char tmp[PATH_MAX + sizeof(".XXXXXX")];
+   entryPath(key, path, sizeof(path));
+   snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+
+   int out = mkstemp(tmp);
+   if(out < 0){
+      return;
+   }
+   cacheEntryHeader hdr = { CACHE_MAGIC, status, key->check, len };
+   bool ok = (write(out, &hdr, sizeof(hdr)) == sizeof(hdr)) && cache_copy(fd, 0, len, out);
+   if(close(out) < 0 || !ok || rename(tmp, path) < 0){ //readers never see half an entry
+      unlink(tmp);
+      return;
+   }
+
+   stores++;
+   storeBytes += sizeof(hdr) + len;
+   if(!storeScanned || storeBytes > maxBytes){
+      evictEntries();
+   }
+   return;
+}
+
+//copies len bytes of from starting at offset to the end of to, see dsh.h
+bool cache_copy(int from, off_t offset, size_t len, int to){
+   ssize_t got;
+#ifdef __linux__
+   while(len > 0){ //in the kernel, no trip through a buffer
+      got = sendfile(to, from, &offset, len);
+      if(got < 0 && errno == EINTR){
+         continue;
+      } else if(got <= 0){
+         break;
+      }
+      len -= got;
+   }
+   if(len == 0){
+      return true;
+   }
+#endif
+   char buf[CACHE_COPY_BUF_LEN];
+   while(len > 0){
+      got = pread(from, buf, (len < sizeof(buf)) ? len : sizeof(buf), offset);
+      if(got < 0 && errno == EINTR){
+         continue;
+      } else if(got <= 0){
+         return false;
+      }
+      for(ssize_t put = 0, n; put < got; put += n){
+         n = write(to, buf + put, got - put);
+         if(n < 0 && errno == EINTR){
+            n = 0;
+         } else if(n <= 0){
+            return false;
+         }
+      }
+      offset += got;
+      len -= got;
+   }
+   return true;
+}
+
+//true if name was marked with the cacheable builtin
+bool cache_allowed(const char* name){
+   for(int i = 0; i < nAllowed; i++){
+      if(!strcmp(allowed[i], name)){
+         return true;
+      }
+   }
+   return false;
+}
+
+//marks name so it is always run through the cache
+void cache_allow(const char* name){
+   if(cache_allowed(name)){
+      return;
+   }
+   char** grown = (char**) realloc(allowed, (nAllowed + 1) * sizeof(char*));
+   if(grown == NULL){
+      fprintf(stderr, "%s\n", "malloc: no space");
+      return;
+   }
+   allowed = grown;
+   allowed[nAllowed++] = strdup(name);
+   return;
+}
+
+//prints the commands marked with the cacheable builtin
+void cache_print_allowed(void){
+   for(int i = 0; i < nAllowed; i++){
+      printf("%s\n", allowed[i]);
+   }
+   return;
+}
+
+//prints the cache counters for the stats builtin
+void cache_print_stats(void){
+   unsigned long lookups = hits + misses;
+   printf("cache hits: %lu\n", hits);
+   printf("cache misses: %lu\n", misses);
+   printf("cache hit rate: %.1f%%\n", lookups ? 100.0 * hits / lookups : 0.0);
+   printf("cache uncacheable: %lu\n", uncacheable);
+   printf("cache stores: %lu\n", stores);
+   printf("cache evictions: %lu\n", evictions);
+   printf("cache bytes replayed: %llu\n", bytesReplayed);
+   if(storeDir != NULL){
+      printf("cache store: %s (%llu of %llu bytes)\n", storeDir, storeBytes, maxBytes);
+   }
+   return;
+}
+
+//works out (and creates) the store directory:
+//$DSH_CACHE_DIR, else $XDG_CACHE_HOME/dsh, else $HOME/.cache/dsh
+static bool openStore(void){
+   if(storeDir != NULL || storeRefused){
+      return storeDir != NULL;
+   }
+
+   char path[PATH_MAX];
+   char* env;
+   if((env = getenv("DSH_CACHE_DIR")) != NULL && *env){
+      snprintf(path, sizeof(path), "%s", env);
+   } else if((env = getenv("XDG_CACHE_HOME")) != NULL && *env){
+      snprintf(path, sizeof(path), "%s/dsh", env);
+   } else if((env = getenv("HOME")) != NULL && *env){
+      snprintf(path, sizeof(path), "%s/.cache/dsh", env);
+   } else {
+      snprintf(path, sizeof(path), "%s", CACHE_FALLBACK_DIR);
+   }
+   if(!makeDirs(path)){
+      perror("cache: cannot create store");
+      return false;
+   }
+   //entries are replayed as our commands' output: nobody else may plant
+   //them, e.g. in a CACHE_FALLBACK_DIR another user made first
+   struct stat st;
+   if(lstat(path, &st) < 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid()
+      || (st.st_mode & (S_IWGRP | S_IWOTH))){
+      fprintf(stderr, "cache: %s is not a directory only we can write, not caching\n", path);
+      storeRefused = true;
+      return false;
+   }
+
+   //$DSH_CACHE_MAX in bytes, with an optional K, M or G
+   maxBytes = CACHE_DEFAULT_MAX_BYTES;
+   if((env = getenv("DSH_CACHE_MAX")) != NULL && *env){
+      char* unit;
+      unsigned long long n = strtoull(env, &unit, 10);
+      switch(*unit){
+         case 'G': case 'g': n <<= 10; /* fall through */
+         case 'M': case 'm': n <<= 10; /* fall through */
+         case 'K': case 'k': n <<= 10;
+      }
+      if(n > 0){
+         maxBytes = n;
+      }
+   }
+
+   storeDir = strdup(path);
+   return storeDir != NULL;
+}
+
+//mkdir -p
+static bool makeDirs(char* path){
+   for(char* slash = strchr(path + 1, '/'); ; slash = strchr(slash + 1, '/')){
+      if(slash != NULL){
+         *slash = '\0';
+      }
+      bool ok = (mkdir(path, S_IRWXU) == 0 || errno == EEXIST);
+      if(slash == NULL){
+         return ok;
+      }
+      *slash = '/';
+      if(!ok){
+         return false;
+      }
+   }
+}
+
+//feeds len bytes into both hashes of the key
+static void hashBytes(cache_key_t* key, const void* data, size_t len){
+   const unsigned char* b = (const unsigned char*) data;
+   uint64_t h = key->hash;
+   uint64_t c = key->check;
+   for(size_t i = 0; i < len; i++){
+      h = (h ^ b[i]) * FNV_PRIME;
+      c = (c ^ b[i]) * FNV_PRIME;
+   }
+   key->hash = h;
+   key->check = c;
+   return;
+}
+
+//feeds a NUL terminated string (and its terminator) into the key, so
+//"ab" "c" and "a" "bc" hash differently
+static void hashString(cache_key_t* key, const char* s){
+   hashBytes(key, s, strlen(s) + 1);
+   return;
+}
+
+//feeds what identifies the contents of a file into the key: its metadata,
+//or every byte of it when byContent is set; false if it cannot be read
+static bool hashFile(cache_key_t* key, const char* path, bool byContent){
+   struct stat sb;
+   if(stat(path, &sb) < 0){
+      return false;
+   }
+   if(!byContent || !S_ISREG(sb.st_mode)){
+      uint64_t meta[6] = { sb.st_dev, sb.st_ino, sb.st_size, sb.st_mtim.tv_sec,
+                           sb.st_mtim.tv_nsec, sb.st_mode };
+      hashBytes(key, meta, sizeof(meta));
+      return true;
+   }
+
+   int fd = open(path, O_RDONLY | O_CLOEXEC);
+   if(fd < 0){
+      return false;
+   }
+#ifdef POSIX_FADV_SEQUENTIAL
+   posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+   char* buf = (char*) malloc(CACHE_HASH_BUF_LEN);
+   ssize_t got = -1;
+   while(buf != NULL && (got = read(fd, buf, CACHE_HASH_BUF_LEN)) > 0){
+      hashBytes(key, buf, got);
+   }
+   free(buf);
+   close(fd);
+   return got == 0;
+}
+
+//feeds every byte of the open file fd (a here-document memfd) into the key,
+//leaving its offset alone; false if it cannot be read
+static bool hashDescriptor(cache_key_t* key, int fd){
+   char* buf = (char*) malloc(CACHE_HASH_BUF_LEN);
+   off_t at = 0;
+   ssize_t got = -1;
+   while(buf != NULL && (got = pread(fd, buf, CACHE_HASH_BUF_LEN, at)) > 0){
+      hashBytes(key, buf, got);
+      at += got;
+   }
+   free(buf);
+   return got == 0;
+}
+
+//finds the executable execvp() would run for name
+bool resolve_command(const char* name, char* path, size_t len){
+   if(strchr(name, '/') != NULL){
+      snprintf(path, len, "%s", name);
+      return access(path, X_OK) == 0;
+   }
+
+   char* dirs = getenv("PATH");
+   if(dirs == NULL){
+      dirs = "/bin:/usr/bin";
+   }
+   while(*dirs){
+      size_t n = strcspn(dirs, ":");
+      snprintf(path, len, "%.*s%s%s", (int) n, n ? dirs : ".", "/", name);
+      struct stat sb;
+      if(stat(path, &sb) == 0 && S_ISREG(sb.st_mode) && access(path, X_OK) == 0){
+         return true;
+      }
+      dirs += n + (dirs[n] == ':');
+   }
+   return false;
+}
+
+//path of the entry file for key
+static void entryPath(const cache_key_t* key, char* path, size_t len){
+   snprintf(path, len, "%s/%016llx", storeDir, (unsigned long long) key->hash);
+   return;
+}
+
+//sums the store and evicts least recently used entries while it is too big
+//(other shells share the store, so the total is only trusted after a scan)
+static void evictEntries(void){
+   DIR* dir = opendir(storeDir);
+   if(dir == NULL){
+      return;
+   }
+
+   cacheEntry* entries = NULL;
+   int n = 0;
+   int cap = 0;
+   char path[PATH_MAX];
+   struct dirent* d;
+   storeBytes = 0;
+   while((d = readdir(dir)) != NULL){
+      struct stat sb;
+      if(strlen(d->d_name) != CACHE_NAME_LEN){ //., .. and entries being written
+         continue;
+      }
+      snprintf(path, sizeof(path), "%s/%s", storeDir, d->d_name);
+      if(stat(path, &sb) < 0 || !S_ISREG(sb.st_mode)){
+         continue;
+      }
+      if(n == cap){
+         cap = cap ? cap * 2 : 64;
+         cacheEntry* grown = (cacheEntry*) realloc(entries, cap * sizeof(cacheEntry));
+         if(grown == NULL){
+            break;
+         }
+         entries = grown;
+      }
+      strcpy(entries[n].name, d->d_name);
+      entries[n].used = sb.st_mtim;
+      entries[n].size = sb.st_size;
+      storeBytes += sb.st_size;
+      n++;
+   }
+   closedir(dir);
+   storeScanned = true;
+
+   if(storeBytes > maxBytes){
+      unsigned long long target = maxBytes / 100 * CACHE_EVICT_TO_PERCENT;
+      qsort(entries, n, sizeof(cacheEntry), entryCmp);
+      for(int i = 0; i < n && storeBytes > target; i++){
+         snprintf(path, sizeof(path), "%s/%s", storeDir, entries[i].name);
+         if(unlink(path) == 0){
+            storeBytes -= entries[i].size;
+            evictions++;
+         }
+      }
+   }
+   free(entries);
+   return;
+}
+
+//oldest use first
+static int entryCmp(const void* a, const void* b){
+   const struct timespec* ta = &((const cacheEntry*) a)->used;
+   const struct timespec* tb = &((const cacheEntry*) b)->used;
+   if(ta->tv_sec != tb->tv_sec){
+      return (ta->tv_sec > tb->tv_sec) - (ta->tv_sec < tb->tv_sec);
+   }
+   return (ta->tv_nsec > tb->tv_nsec) - (ta->tv_nsec < tb->tv_nsec);
+}
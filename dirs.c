@@ -0,0 +1,372 @@
+/*
+ * dirs.c
+ * Directory index for cd: every directory cd lands in is recorded, with
+ * how often and when it was last visited, in a file the shell keeps mapped.
+ * When the argument of cd is not a directory, cd goes to the known
+ * directory whose path matches its words with the best frecency (visits
+ * weighted by how recent the last one was).
+ *
+ * The file ($DSH_DIRS, else $XDG_DATA_HOME/dsh/dirs, else
+ * $HOME/.local/share/dsh/dirs) is a header, the entries sorted by path so
+ * a directory is found by binary search, then the paths:
+ *    dirsHeader | dirsEntry[count] | NUL terminated paths
+ * A visit of a known directory updates its entry in the mapping; a new one
+ * rewrites the file (into a temporary file renamed over it). Once the
+ * visits add up to DIRS_MAX_AGE every entry is scaled down and the
+ * directories left with less than one visit are forgotten.
+ */
+
+#include "dsh.h"
+
+#include <sys/mman.h>   /* mmap() */
+#include <limits.h>     /* PATH_MAX */
+#include <time.h>       /* time() */
+
+//first word of the file, "dirs" when read as text on little endian
+#define DIRS_MAGIC 0x73726964
+#define DIRS_VERSION 1
+
+//visits kept in total before they are all aged by DIRS_AGE_FACTOR
+#define DIRS_MAX_AGE 10000.0
+#define DIRS_AGE_FACTOR 0.9
+
+#define SECS_PER_HOUR 3600
+#define SECS_PER_DAY (24 * SECS_PER_HOUR)
+#define SECS_PER_WEEK (7 * SECS_PER_DAY)
+
+typedef struct {
+   uint32_t magic;
+   uint32_t version;
+   uint32_t count;            //entries
+   uint32_t poolLen;          //bytes of paths after them
+   double total;              //sum of the ranks
+} dirsHeader;
+
+typedef struct {
+   uint32_t path;             //offset of the path in the pool
+   uint32_t len;
+   double rank;               //visits, aged
+   int64_t last;              //time of the last visit
+} dirsEntry;
+
+//a directory that matched, for dirs_list()
+typedef struct {
+   const char* path;
+   double score;
+} dirsMatch;
+
+//the mapped file (NULL while there is none), and which file it is
+static dirsHeader* db = NULL;
+static size_t dbLen = 0;
+static dev_t dbDev;
+static ino_t dbIno;
+static char dbPath[PATH_MAX];
+
+//maps the file again if it is not the one mapped (another shell renamed
+//a new one over it); false if there is none or it is not a dirs file
+static bool openDb(void);
+
+//entries and paths of the mapped file
+static dirsEntry* entries(void);
+static const char* pool(void);
+
+//index of the entry for path, or -1 with *at where it would go
+static int findEntry(const char* path, int* at);
+
+//writes the file again with path added (if not NULL) and, if the visits
+//add up to DIRS_MAX_AGE, all of them aged
+static bool rewrite(const char* path, int at);
+
+//rank of e weighted by how long ago its last visit was
+static double frecency(const dirsEntry* e, time_t now);
+
+//true if the words are found in path in order, ignoring case, with the
+//last one in its last component
+static bool matches(const char* path, int nwords, char** words);
+
+//highest score first
+static int matchCmp(const void* a, const void* b);
+
+//records a visit of dir, an absolute path
+void dirs_visit(const char* dir){
+   if(dir == NULL || dir[0] != '/' || strlen(dir) >= PATH_MAX){
+      return;
+   }
+   int at = 0;
+   int i = openDb() ? findEntry(dir, &at) : -1;
+   if(i >= 0 && db->total + 1 < DIRS_MAX_AGE){ //in place, no write()
+      dirsEntry* e = &entries()[i];
+      e->rank += 1;
+      e->last = time(NULL);
+      db->total += 1;
+      return;
+   }
+   rewrite((i >= 0) ? NULL : dir, (i >= 0) ? i : at);
+}
+
+//the existing directory other than skip whose path matches the words with
+//the best frecency (malloc'd), NULL if there is none
+char* dirs_match(int nwords, char** words, const char* skip){
+   if(nwords < 1 || !openDb()){
+      return NULL;
+   }
+   time_t now = time(NULL);
+   const char* best = NULL;
+   double bestScore = 0;
+   for(uint32_t i = 0; i < db->count; i++){
+      const dirsEntry* e = &entries()[i];
+      const char* path = pool() + e->path;
+      double score = frecency(e, now);
+      if(score <= bestScore || (skip != NULL && !strcmp(path, skip)) || !matches(path, nwords, words)){
+         continue;
+      }
+      struct stat st;
+      if(stat(path, &st) == 0 && S_ISDIR(st.st_mode)){ //it may be gone
+         best = path;
+         bestScore = score;
+      }
+   }
+   return (best != NULL) ? strdup(best) : NULL;
+}
+
+//prints the known directories matching the words (all with none), best
+//first, with their frecency
+void dirs_list(int nwords, char** words){
+   if(!openDb()){
+      return;
+   }
+   dirsMatch* found = (dirsMatch*) malloc((db->count + 1) * sizeof(dirsMatch));
+   if(found == NULL){
+      fprintf(stderr, "%s\n", "malloc: no space");
+      return;
+   }
+   time_t now = time(NULL);
+   int n = 0;
+   for(uint32_t i = 0; i < db->count; i++){
+      const dirsEntry* e = &entries()[i];
+      const char* path = pool() + e->path;
+      if(nwords == 0 || matches(path, nwords, words)){
+         found[n].path = path;
+         found[n++].score = frecency(e, now);
+      }
+   }
+   qsort(found, n, sizeof(dirsMatch), matchCmp);
+   for(int i = 0; i < n; i++){
+      printf("%10.2f  %s\n", found[i].score, found[i].path);
+   }
+   free(found);
+}
+
+//maps the file again if it is not the one mapped
+static bool openDb(void){
+   if(dbPath[0] == '\0'){
+      char* env;
+      if((env = getenv("DSH_DIRS")) != NULL && *env){
+         snprintf(dbPath, sizeof(dbPath), "%s", env);
+      } else if((env = getenv("XDG_DATA_HOME")) != NULL && *env){
+         snprintf(dbPath, sizeof(dbPath), "%s/dsh/dirs", env);
+      } else if((env = getenv("HOME")) != NULL && *env){
+         snprintf(dbPath, sizeof(dbPath), "%s/.local/share/dsh/dirs", env);
+      } else {
+         return false;
+      }
+   }
+
+   struct stat st;
+   if(stat(dbPath, &st) < 0){
+      return false;
+   }
+   if(db != NULL && st.st_dev == dbDev && st.st_ino == dbIno){
+      return true;
+   }
+   if(db != NULL){
+      munmap(db, dbLen);
+      db = NULL;
+   }
+   int fd = open(dbPath, O_RDWR | O_CLOEXEC);
+   if(fd < 0 || st.st_size < (off_t) sizeof(dirsHeader)){
+      if(fd >= 0){
+         close(fd);
+      }
+      return false;
+   }
+   void* mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if(mem == MAP_FAILED){
+      return false;
+   }
+   dirsHeader* h = (dirsHeader*) mem;
+   if(h->magic != DIRS_MAGIC || h->version != DIRS_VERSION
+      || sizeof(dirsHeader) + (size_t) h->count * sizeof(dirsEntry) + h->poolLen != (size_t) st.st_size){
+      munmap(mem, st.st_size);
+      return false;
+   }
+   //every path must lie in the pool and end there: a truncated or corrupt
+   //file is taken as no file rather than read past the mapping
+   const dirsEntry* e = (const dirsEntry*) (h + 1);
+   const char* paths = (const char*) (e + h->count);
+   for(uint32_t i = 0; i < h->count; i++){
+      if((uint64_t) e[i].path + e[i].len >= h->poolLen || paths[e[i].path + e[i].len] != '\0'){
+         munmap(mem, st.st_size);
+         return false;
+      }
+   }
+   db = h;
+   dbLen = st.st_size;
+   dbDev = st.st_dev;
+   dbIno = st.st_ino;
+   return true;
+}
+
+//entries and paths of the mapped file
+static dirsEntry* entries(void){
+   return (dirsEntry*) (db + 1);
+}
+
+static const char* pool(void){
+   return (const char*) (entries() + db->count);
+}
+
+//index of the entry for path, or -1 with *at where it would go
+static int findEntry(const char* path, int* at){
+   int lo = 0;
+   int hi = (int) db->count;
+   while(lo < hi){
+      int mid = lo + (hi - lo) / 2;
+      int cmp = strcmp(path, pool() + entries()[mid].path);
+      if(cmp == 0){
+         return mid;
+      } else if(cmp < 0){
+         hi = mid;
+      } else {
+         lo = mid + 1;
+      }
+   }
+   *at = lo;
+   return -1;
+}
+
+//writes the file again with path added at index at (if not NULL) and, if
+//the visits add up to DIRS_MAX_AGE, all of them aged; a visit of the
+//entry at index at is counted when path is NULL
+static bool rewrite(const char* path, int at){
+   uint32_t count = (db != NULL) ? db->count : 0;
+   size_t addLen = (path != NULL) ? strlen(path) + 1 : 0;
+   size_t room = sizeof(dirsHeader) + (count + 1) * sizeof(dirsEntry) + ((db != NULL) ? db->poolLen : 0) + addLen;
+   char* image = (char*) malloc(room);
+   const char** from = (const char**) malloc((count + 1) * sizeof(char*));
+   if(image == NULL || from == NULL){
+      free(image);
+      free(from);
+      return false;
+   }
+   dirsHeader* h = (dirsHeader*) image;
+   dirsEntry* to = (dirsEntry*) (h + 1);
+   time_t now = time(NULL);
+   double total = ((db != NULL) ? db->total : 0) + 1;
+   double age = (total >= DIRS_MAX_AGE) ? DIRS_AGE_FACTOR : 1.0;
+
+   //entries first, the paths are copied behind them once they are counted
+   uint32_t n = 0;
+   size_t poolLen = 0;
+   for(uint32_t i = 0; i <= count; i++){
+      if(path != NULL && i == (uint32_t) at){
+         to[n].len = addLen - 1;
+         to[n].rank = 1;
+         to[n].last = now;
+         to[n].path = poolLen;
+         poolLen += addLen;
+         from[n++] = path;
+      }
+      if(i == count){
+         break;
+      }
+      dirsEntry e = entries()[i];
+      if(path == NULL && i == (uint32_t) at){
+         e.rank += 1;
+         e.last = now;
+      }
+      e.rank *= age;
+      if(e.rank < 1){
+         continue; //forgotten
+      }
+      to[n] = e;
+      to[n].path = poolLen;
+      poolLen += e.len + 1;
+      from[n++] = pool() + e.path;
+   }
+   char* paths = (char*) (to + n);
+   total = 0;
+   for(uint32_t i = 0; i < n; i++){
+      total += to[i].rank;
+   }
+   for(uint32_t i = 0; i < n; i++){
+      memcpy(paths + to[i].path, from[i], to[i].len + 1);
+   }
+   h->magic = DIRS_MAGIC;
+   h->version = DIRS_VERSION;
+   h->count = n;
+   h->poolLen = poolLen;
+   h->total = total;
+   size_t len = sizeof(dirsHeader) + n * sizeof(dirsEntry) + poolLen;
+
+   //into a temporary file renamed over the old one, so other shells see
+   //either file whole
+   char tmp[PATH_MAX + 16];
+   snprintf(tmp, sizeof(tmp), "%s.%d", dbPath, (int) getpid());
+   char* slash = strrchr(tmp, '/');
+   if(slash != NULL && slash != tmp){ //make sure the directory is there
+      for(char* s = strchr(tmp + 1, '/'); s != NULL && s <= slash; s = strchr(s + 1, '/')){
+         *s = '\0';
+         mkdir(tmp, S_IRWXU);
+         *s = '/';
+      }
+   }
+   int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+   bool ok = (fd >= 0 && write(fd, image, len) == (ssize_t) len);
+   if(fd >= 0){
+      close(fd);
+   }
+   ok = ok && rename(tmp, dbPath) == 0;
+   if(!ok){
+      unlink(tmp);
+   }
+   free(image);
+   free(from);
+   openDb();
+   return ok;
+}
+
+//rank of e weighted by how long ago its last visit was
+static double frecency(const dirsEntry* e, time_t now){
+   int64_t ago = now - e->last;
+   if(ago < SECS_PER_HOUR){
+      return e->rank * 4;
+   } else if(ago < SECS_PER_DAY){
+      return e->rank * 2;
+   } else if(ago < SECS_PER_WEEK){
+      return e->rank / 2;
+   }
+   return e->rank / 4;
+}
+
+//true if the words are found in path in order, ignoring case, with the
+//last one in its last component
+static bool matches(const char* path, int nwords, char** words){
+   const char* from = path;
+   const char* found = NULL;
+   for(int i = 0; i < nwords; i++){
+      if((found = strcasestr(from, words[i])) == NULL){
+         return false;
+      }
+      from = found + strlen(words[i]);
+   }
+   return from > strrchr(path, '/');
+}
+
+//highest score first
+static int matchCmp(const void* a, const void* b){
+   double sa = ((const dirsMatch*) a)->score;
+   double sb = ((const dirsMatch*) b)->score;
+   return (sa < sb) - (sa > sb);
+}
@@ -5,17 +5,27 @@
  */
 
 #include "dsh.h"
+#include "dshboard.h"   /* job board entries */
+
+#include <poll.h>       /* poll() for watch */
+#include <time.h>       /* clock_gettime() for job start times */
+
+#ifdef __linux__
+#include <sys/mman.h>   /* memfd_create() */
+#include <sys/syscall.h> /* SYS_close_range, SYS_pidfd_open */
+#include <sys/inotify.h> /* watch */
+#endif
 
 //length of prompt string including \0
 #define PROMPT_BUF_LEN 15
 
-//length of buffer for string to hold path
-#define PATH_BUF_LEN 18
-
 //flags for IO files
 #define INPUT_FILE_FLAGS      O_RDONLY
 #define OUTPUT_FILE_FLAGS    (O_WRONLY | O_TRUNC | O_CREAT)
-#define NEW_FILE_PERMISSIONS (S_IRUSR | S_IWUSR)
+#define APPEND_FILE_FLAGS    (O_WRONLY | O_APPEND | O_CREAT)
+
+//bytes of a < file the kernel is asked to start reading right away
+#define READAHEAD_BYTES (4 << 20)
 
 //path to the black hole to redirect output for a 
 //child whoes parent seizes tty late
@@ -30,20 +40,184 @@
 //generic error code used in many functions
 #define GENERAL_ERROR -1
 
+//bytes read from a forall item list per read() call
+#define FORALL_CHUNK_LEN 65536
+
+//default cap on items handed to one exec when the template allows batching
+#define FORALL_DEFAULT_BATCH 32
+
+//cap on the item bytes batched into one exec
+#define FORALL_BATCH_BYTES 65536
+
+//word in a forall template that is replaced by the item(s)
+#define FORALL_PLACEHOLDER "{}"
+
+//where forall children read their stdin from
+#define FORALL_STDIN_PATH DEV_NULL_PATH
+
+//initial size of the buffer a $(...) is captured into
+#define CAPTURE_BUF_LEN 4096
+
+//captured output beyond this is spliced into a memfd instead of
+//growing the buffer one read at a time
+#define CAPTURE_SPLICE_THRESHOLD (1 << 20)
+
+//highest fd swept when close_range() is not available
+#define MAX_SWEPT_FD 4096
+
+//bytes of ARG_MAX left unused when splitting argv into batches
+#define ARGV_HEADROOM 4096
+
+//exit status reported for a process killed by a signal, as in sh
+#define SIGNAL_STATUS_BASE 128
+
+//word in front of a command that sends it through the result cache
+#define CACHED_PREFIX "cached"
+
+//word in front of a command that gives it a deadline
+#define TIMEOUT_PREFIX "timeout"
+
+//time a job that overran has between SIGTERM and SIGKILL, unless
+//$DSH_TIMEOUT_GRACE says otherwise
+#define TIMEOUT_GRACE_MS 2000
+
+//exit status of a foreground job that overran, as with timeout(1)
+#define TIMEOUT_STATUS 124
+
+//prompt for the lines of a loop that is not done yet
+#define LOOP_PROMPT "> "
+
+//quiet time after the last change to an input before a watched job reruns (ms)
+#define WATCH_DEBOUNCE_MS 20
+
+//time a stale watched run gets to exit after SIGTERM before SIGKILL (ms)
+#define WATCH_KILL_GRACE_MS 500
+
+//how often a watched run is checked on when pidfds are not available (ms)
+#define WATCH_POLL_MS 50
+
+//bytes of inotify events read at once
+#define WATCH_EVENT_BUF_LEN 4096
+
+//initial size of the buffer a coprocess's replies are read into
+#define COPROC_BUF_LEN 4096
+
+//restarts of a coprocess that keeps dying before it answers again
+#define COPROC_MAX_RESTARTS 5
+
+//time a coprocess gets to exit after SIGTERM before SIGKILL (ms)
+#define COPROC_KILL_GRACE_MS 200
+
+//how often wait looks at running jobs when pidfds are not available (ms)
+#define WAIT_POLL_MS 50
+
+//exit status of wait for a job it does not know
+#define WAIT_UNKNOWN_STATUS 127
+
+//changes to a watched directory (or to a file watched through its directory)
+#ifdef __linux__
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE)
+#endif
+
 typedef struct _activeList {
    job_t* job; //the job that is active
    bool crashed; //true is a process in the job crashed
    bool killed;
+   bool timedOut; //set by the deadline thread when the job overran
    struct _activeList* next; //the next node in the LList
 } activeJobNode;
 
 //list of active jobs
 activeJobNode* activeList;
 
+//the shell's cwd, NULL until it is asked for again after a chdir()
+char* cwdCache = NULL;
+
 //string for the prompt
 //saves us mallocing and freeing everytime
 char promptString[PROMPT_BUF_LEN];
 
+//jobs started for the <(...) and >(...) of the job being run
+job_t** procSubstJobs = NULL;
+int nProcSubstJobs = 0;
+
+//exit status of the last foreground job (0 for builtins)
+int lastStatus = 0;
+
+//a command whose trailing arguments may be split over several execs
+typedef struct _batchable {
+   char* name;   //argv[0] as typed
+   int parallel; //batches run at once
+} batchableCmd;
+
+//commands that are safe to run as several execs over parts of their args
+batchableCmd* batchableCmds = NULL;
+int nBatchableCmds = 0;
+
+//what break and continue ask of the loop being run, and return of the
+//function being run
+typedef enum { LOOP_NONE, LOOP_BREAK, LOOP_CONTINUE, LOOP_RETURN } loopControl_t;
+loopControl_t loopControl = LOOP_NONE;
+
+//loops being run, break and continue outside of one do nothing
+int loopNesting = 0;
+
+//functions being run, return outside of one is an error
+int funcNesting = 0;
+
+//an input of a watched job; files are watched through their directory so
+//a save that renames a new file over the old one is still seen
+typedef struct _watchedInput {
+   int wd;     //inotify watch of the directory
+   char* name; //file in it, NULL when the directory itself is the input
+} watchedInput;
+
+//set by SIGINT to end a watch
+volatile sig_atomic_t watchInterrupted = 0;
+
+//a long lived child the shell talks to over a pair of pipes
+typedef struct _coproc {
+   char* name;
+   job_t* tmpl;  //what to start (again)
+   job_t* job;   //running instance, in activeList
+   int toFd;     //its stdin
+   int fromFd;   //its stdout
+   char* buf;    //read from it, starting with the line handed out last
+   size_t len;
+   size_t cap;
+   size_t handed; //bytes of that line
+   int restarts; //since it last answered
+} coproc;
+
+//coprocesses by name
+coproc* coprocs = NULL;
+int nCoprocs = 0;
+
+//shell that started them; a forked child must not kill them on its way out
+pid_t coprocOwner = -1;
+
+//where a job of the after dependency graph is
+typedef enum { AFTER_PENDING, AFTER_RUNNING, AFTER_DONE, AFTER_SKIPPED } afterState_t;
+
+//a job of the after dependency graph: one declared with after, spawned in
+//the background once its prerequisites are done, or a plain background job
+//that one of them (or wait) refers to by pgid
+typedef struct _afterJob {
+   char* name;               //after -n name, NULL if it has none
+   job_t* job;               //to spawn, NULL once spawned
+   struct _afterJob** deps;  //prerequisites
+   int ndeps;
+   job_t* spawned;           //while it is in the job list, NULL once gone
+   pid_t pgid;               //-1 until spawned
+   afterState_t state;
+   int status;               //exit status once done or skipped
+   bool waited;              //held by wait, not to be forgotten yet
+   struct _afterJob* next;
+} afterJob;
+
+//the dependency graph, newest first
+afterJob* afterJobs = NULL;
+
 /* given functions */
 /* Grab control of the terminal for the calling process pgid.  */
 void seize_tty(pid_t callingprocess_pgid); 
@@ -71,7 +245,13 @@ void cycleThroughEachJob(job_t* firstJob); //does each job
 char* getCurrentPath(void);
 
 //updates the IO stream of child process to be for a file
-int changeStreamToFile(char* fileName, int stream, int flags);
+int changeStreamToFile(char* fileName, int stream, bool output, bool append, bool direct);
+
+//opens the file of a redirection, with I/O hints
+int openRedirection(char* fileName, bool output, bool append, bool direct);
+
+//value of a size variable like DSH_PREALLOC, 0 if unset
+off_t sizeVariable(const char* name);
 
 //makes a job node (malloc's it)
 activeJobNode* newJobNode(job_t* j);
@@ -107,35 +287,340 @@ void freeJob(job_t* j);
 //updates status fields from value reported from waitpid()
 void examineProcesses(job_t* j, activeJobNode* aj);
 
+//records a waitpid() status of one stage of a job
+void noteStageStatus(activeJobNode* aj, process_t* p, int status);
+
+//stage of j with this pid, NULL if there is none
+process_t* findStage(job_t* j, pid_t pid);
+
+//stops the stages before stage after it failed
+void tearDownUpstream(job_t* j, process_t* stage);
+
+//sets $PIPESTATUS from the stages of j
+void setPipeStatus(job_t* j);
+
 //check processes are not dead
 void checkOnProcesses(activeJobNode* jobNode);
 
 //make all stopped processes in non-stopped state
 void unStopStoppedProcesses(job_t* j);
 
+//finds the active job node and process with the given pid
+activeJobNode* findNodeByPID(pid_t pid, process_t** proc);
+
+//records a status reported by waitpid() against the process that owns it
+void recordProcessStatus(pid_t pid, int status);
+
+//forall builtin: runs a template command for every line of its < list
+void forallCmd(job_t* job, int argc, char** argv);
+
+//builds a managed job running the forall template over nItems items
+job_t* newForallJob(char** tmpl, int tmplc, char** items, int nItems);
+
+//copies word with every placeholder replaced by item
+char* replacePlaceholder(char* word, char* item);
+
+//blocks until one forall child exits, frees its slot
+void reapForallChild(pid_t* slots, int nSlots, int* running);
+
+//true if the builtin runs in the shell and prints, so $(...) needs no fork
+bool isPureBuiltin(char* name);
+
+//runs a pure builtin with stdout sent into a buffer
+bool captureBuiltin(job_t* j, char** buf, size_t* len, size_t* cap);
+
+//spawns j with stdout on a pipe and reads it all into a buffer
+bool captureJob(job_t* j, char** buf, size_t* len, size_t* cap);
+
+//reads fd until EOF onto the end of a growable buffer
+bool readAllInto(int fd, char** buf, size_t* len, size_t* cap);
+
+//blocks until every process of j has terminated
+void waitForJob(job_t* j);
+
+//finds the active job node for j
+activeJobNode* findNodeByJob(job_t* j);
+
+//pipe() with both ends close-on-exec
+int cloexecPipe(int fds[2]);
+
+//file for captured output that never touches the filesystem if possible
+int anonymousFile(void);
+
+//closes every descriptor above stderr except the ones p keeps across exec
+void closeInheritedFds(process_t* p);
+
+//closes the shell's copies of the fds p keeps across exec
+void closeKeptFds(job_t* j);
+
+//runs a foreground job ending in wc or grep with that stage in the shell
+bool runTextBuiltin(job_t* j);
+
+//waits for (or, for background jobs, lets go of) the <(...)/>(...) jobs
+void reapProcSubsts(bool bg);
+
+//exit status of a finished job: the last stage, or the first failed batch
+int jobStatus(job_t* j);
+
+//sh style exit status (128+signal when killed) from a waitpid() status
+int exitCode(int status);
+
+//batchable builtin: lists or marks commands whose argv may be split
+void batchableCmd_(int argc, char** argv);
+
+//finds the batchable entry for a command, NULL if it is not batchable
+batchableCmd* findBatchable(char* name);
+
+//splits a batchable single command whose argv is over ARG_MAX into batches
+void splitOversizedArgv(job_t* j);
+
+//bytes execve() needs for argv[from..to) (strings plus pointers)
+size_t argvBytes(char** argv, int from, int to);
+
+//waits for one of the running batches of j
+void waitForBatch(job_t* j);
+
+//blocks until a running batch of j may have ended
+void sleepOnBatches(job_t* j);
+
+//runs the argv batches of a background job from a child of the shell
+void spawnBatchRunner(job_t* j);
+
+//true if j is to be run through the result cache
+bool isCachedJob(job_t* j);
+
+//runs j through the result cache
+void runCached(job_t* j);
+
+//watch builtin: reruns a job whenever one of its inputs changes
+void watchCmd(job_t* job, int argc, char** argv);
+
+//adds an inotify watch for path to the list of watched inputs
+bool addWatchedInput(int ifd, char* path, watchedInput** inputs, int* nInputs);
+
+//reads the pending inotify events; true if one was for a watched input
+bool readWatchEvents(int ifd, watchedInput* inputs, int nInputs, bool* dirChanged);
+
+//spawns a copy of tmpl for a watched run; *doneFd becomes readable when it ends
+job_t* startWatchRun(job_t* tmpl, int* doneFd, int runs);
+
+//true if the last stage of a watched run has exited
+bool watchRunDone(job_t* run, int doneFd, int timeout);
+
+//reaps a watched run and drops it from the job list
+void finishWatchRun(job_t* run, int doneFd);
+
+//SIGINT during watch
+void watchInterrupt(int sig);
+
+//coproc builtin: starts, lists or kills coprocesses
+void coprocCmd(job_t* job, int argc, char** argv);
+
+//send, recv and ask builtins: talk to a coprocess
+void coprocIoCmd(int argc, char** argv);
+
+//finds the coprocess called name
+coproc* findCoproc(char* name);
+
+//starts (or restarts) the instance of c
+bool startCoproc(coproc* c);
+
+//kills and reaps the instance of c
+void stopCoproc(coproc* c);
+
+//true if the instance of c is still running; reaps it if not
+bool coprocAlive(coproc* c);
+
+//restarts c if it died; false if it cannot be brought back
+bool ensureCoproc(coproc* c);
+
+//writes a line to c
+bool sendToCoproc(coproc* c, int argc, char** argv);
+
+//reads a line from c into *line (valid until the next read)
+bool recvFromCoproc(coproc* c, char** line, size_t* len);
+
+//kills every coprocess when the shell exits
+void killCoprocs(void);
+
+//true if the first word of j is word
+bool isKeyword(job_t* j, char* word);
+
+//true if j starts a loop (for or while, maybe after a do)
+bool loopOpens(job_t* j);
+
+//true if j ends a loop
+bool loopCloses(job_t* j);
+
+//loops opened but not done in the list of jobs starting at j
+int loopDepth(job_t* j);
+
+//runs the loop whose header is j; returns the job after its done
+job_t* runLoop(job_t* header);
+
+//runs a copy of the parsed loop body once
+void runLoopBody(job_t* body);
+
+//drops the first n words of the first process of j
+void dropWords(job_t* j, int n);
+
+//test and [ builtins: evaluates the expression in argv
+int testExpr(int argc, char** argv);
+
+//after builtin: declares a job that runs once its prerequisites are done
+void afterCmd(job_t* job, int argc, char** argv);
+
+//wait builtin: waits for background jobs
+void waitCmd(int argc, char** argv);
+
+//finds the job of the dependency graph with this name or pgid
+afterJob* findAfterJob(char* id);
+
+//updates the running jobs of the dependency graph
+void updateAfterJobs(void);
+
+//spawns or skips the pending jobs whose prerequisites are done
+void dispatchAfterJobs(void);
+
+//blocks until a running job of the dependency graph may have ended
+void sleepOnAfterJobs(void);
+
+//records the status of a job of the dependency graph leaving the job list
+void afterJobGone(job_t* j);
+
+//runs the pending jobs of the dependency graph before the shell exits
+void drainAfterJobs(void);
+
+//mux builtin: sends the output of concurrent jobs through the multiplexer
+void muxCmd(int argc, char** argv);
+
+//gives stage p a pipe into the multiplexer for its stdout or stderr
+int muxStage(job_t* j, process_t* p, bool err, int* to);
+
+//takes a timeout DURATION prefix off j as its deadline
+bool takeTimeout(job_t* j);
+
+//how long j may run: its timeout prefix or $DSH_TIMEOUT, 0 for no limit
+int64_t jobDeadline(job_t* j);
+
+//time an overrun job has between SIGTERM and SIGKILL
+int64_t graceNs(void);
+
+//cd builtin: changes directory, by frecency if the path is not one
+void cdCmd(int argc, char** argv);
+
+//runs the rc file, from its snapshot when that is up to date
+void loadRc(void);
+
+//name() { body }: defines the function and frees its parsed jobs
+job_t* defineFunction(job_t* header);
+
+//true if j calls a function the shell can run itself
+bool isFunctionCall(job_t* j);
+
+//runs the function j calls, with the words of j as $1, $2...
+void callFunction(job_t* j);
+
+//return [N]: leaves the function being run
+void returnCmd(int argc, char** argv);
+
+//alias [name[=words]] and unalias name...
+void aliasCmd(int argc, char** argv);
+
+//export without names lists the environment; unset name... forgets them
+void exportCmd(int argc, char** argv);
+
+//where a tee stage at the end of j writes, as new_child() would set up its
+//stdout (a descriptor of its own), -1 if it cannot be opened
+int teeOutput(job_t* j, process_t* p);
+
 
 int main(int argc, char* argv[]) {
+   const char* record = NULL;
+   const char* replay = NULL;
+   bool paced = false;
+   if(argc == 3 && !strcmp(argv[1], "--serve")){ //daemon mode
+      return serve_commands(argv[2]);
+   } else if(argc == 3 && !strcmp(argv[1], "--record")){ //trace the session
+      record = argv[2];
+   } else if((argc == 3 || (argc == 4 && !strcmp(argv[3], "--paced"))) && !strcmp(argv[1], "--replay")){
+      replay = argv[2];
+      paced = (argc == 4);
+   } else if(argc > 1){
+      fprintf(stderr, "usage: %s [--serve socket | --record trace | --replay trace [--paced]]\n", argv[0]);
+      exit(EXIT_FAILURE);
+   }
+
    init_dsh();
+   board_start();
    DEBUG("Successfully initialized\n");
-   
-   //head of a linked list of all jobs that are active
-   activeJobNode* activeList = NULL;
+
+   if(replay == NULL){
+      loadRc(); //aliases and functions
+   }
+
+   if(replay != NULL){
+      fflush(stdout);
+      exit(trace_replay(replay, paced));
+   }
+   if(record != NULL && !trace_record_start(record, stdin)){
+      exit(EXIT_FAILURE);
+   }
+
+   prefetch_script(stdin); //a script: get its commands off the disk early
+   run_commands(stdin);
+   drainAfterJobs();
+
+   /* End of file (ctrl-d) */
+   fflush(stdout);
+   printf("\n");
+   exit(EXIT_SUCCESS);
+}
+
+//reads, parses and runs command lines from in until it runs out
+int run_commands(FILE* in){
+   FILE* prevSource = set_cmd_source(in);
 
    job_t* j;
    while(1) {
       j = NULL;
       if(!(j = readcmdline(promptmsg(getpid())))) {
-         if (feof(stdin)) { /* End of file (ctrl-d) */
-            fflush(stdout);
-            printf("\n");
-            exit(EXIT_SUCCESS);
+         if (feof(in) || ferror(in)) { /* End of file (ctrl-d) */
+            break;
          }
+         trace_record_end(in, lastStatus); //e.g. a comment or a syntax error
          continue; /* NOOP; user entered return or spaces with return */
       }
       
+      //a loop goes on until its done, which may be a few lines down
+      while(loopDepth(j) > 0){
+         job_t* more = readcmdline(isatty(fileno(in)) ? LOOP_PROMPT : "");
+         if(more != NULL){
+            job_t* last = j;
+            while(last->next != NULL){
+               last = last->next;
+            }
+            last->next = more;
+         } else if(feof(in) || ferror(in)){
+            fprintf(stderr, "%s\n", "syntax error: loop without done or function without }");
+            while(j != NULL){
+               job_t* next = j->next;
+               freeJob(j);
+               j = next;
+            }
+         }
+      }
+
       //do each job
+      rc_record(in, j); //into the snapshot, if in is the rc file
       cycleThroughEachJob(j);
-    }
+      glob_cache_reset(); //listings are only trusted within a command line
+      trace_record_end(in, lastStatus);
+      dispatchAfterJobs(); //some prerequisites may have finished meanwhile
+   }
+
+   set_cmd_source(prevSource);
+   return lastStatus;
 }
 
 //does each job
@@ -146,13 +631,66 @@ void cycleThroughEachJob(job_t* firstJob){
   
   /////////////////// currently only supports builtin in as argv[0]
   
+  job_t* nextJob;
   while(currentJob != NULL){ //while not at end of list
-     if(!builtin_cmd(currentJob, 
-                     currentJob->first_process->argc,
-                     currentJob->first_process->argv)){ //for process
-        spawn_job(currentJob);
+     nextJob = currentJob->next; //the job may be freed once it is done
+     bool bg = currentJob->bg;
+     if(loopControl != LOOP_NONE){ //break or continue: skip the rest
+        freeJob(currentJob);
+     } else if(loopOpens(currentJob)){
+        nextJob = runLoop(currentJob); //runs (and frees) up to its done
+     } else if(func_opens(currentJob)){
+        nextJob = defineFunction(currentJob); //frees up to its }
+     } else if(isKeyword(currentJob, "do") || loopCloses(currentJob) || func_closes(currentJob)){
+        fprintf(stderr, "syntax error near %s\n", currentJob->first_process->argv[0]);
+        lastStatus = EXIT_FAILURE;
+        freeJob(currentJob);
+     } else if(is_assignment_job(currentJob)){
+        lastStatus = assign_job(currentJob) ? 0 : EXIT_FAILURE;
+        freeJob(currentJob);
+     } else if(is_export_job(currentJob)){
+        //before expand_job(): the values are not split or globbed
+        lastStatus = export_job(currentJob) ? 0 : EXIT_FAILURE;
+        freeJob(currentJob);
+     } else if(!expand_job(currentJob)){
+        lastStatus = EXIT_FAILURE;
+        closeKeptFds(currentJob);
+        freeJob(currentJob);
+     } else if(currentJob->first_process->argc == 0){
+        //nothing to run
+        closeKeptFds(currentJob);
+        freeJob(currentJob);
+     } else if(!takeTimeout(currentJob)){
+        lastStatus = EXIT_FAILURE;
+        closeKeptFds(currentJob);
+        freeJob(currentJob);
+     } else if(isKeyword(currentJob, "return")){
+        //not a builtin: no arguments means the status of the last command
+        returnCmd(currentJob->first_process->argc, currentJob->first_process->argv);
+        closeKeptFds(currentJob);
+        freeJob(currentJob);
+     } else if(isFunctionCall(currentJob)){
+        callFunction(currentJob);
+        closeKeptFds(currentJob);
+        freeJob(currentJob);
+     } else {
+        lastStatus = 0; //builtins succeed unless they say otherwise
+        if(!builtin_cmd(currentJob,
+                        currentJob->first_process->argc,
+                        currentJob->first_process->argv)){ //for process
+           if(isCachedJob(currentJob)){
+              runCached(currentJob);
+           } else if(!runTextBuiltin(currentJob)){
+              splitOversizedArgv(currentJob);
+              spawn_job(currentJob);
+           }
+        } else {
+           closeKeptFds(currentJob); //builtins do not use /dev/fd paths
+           freeJob(currentJob);      //and nothing else holds on to their job
+        }
      }
-     currentJob = currentJob->next; //check out next job
+     reapProcSubsts(bg);
+     currentJob = nextJob; //check out next job
   }
   return;
 }
@@ -163,7 +701,7 @@ int new_child(job_t *j, process_t *p, int inPipe, int outPipe)
    p->pid = getpid();
    
    int blackHole = NO_BLACKHOLE;
-   if(j->bg){ //if background, and parent hasn't seized tty yet
+   if(j->bg && !(j->managed)){ //if background, and parent hasn't seized tty yet
       //we will redirect to a black hole
       blackHole = open(DEV_NULL_PATH, O_WRONLY);
       if(dup2(blackHole, STDOUT_FILENO) == GENERAL_ERROR){
@@ -181,12 +719,21 @@ int new_child(job_t *j, process_t *p, int inPipe, int outPipe)
         perror("Failed to set up input pipe");
       }
    } else if(p->ifile != NULL){
-      if(changeStreamToFile(p->ifile, STDIN_FILENO, INPUT_FILE_FLAGS) == GENERAL_ERROR){
+      if(changeStreamToFile(p->ifile, STDIN_FILENO, false, false, false) == GENERAL_ERROR){
         //perror("Error updating input stream");
         return blackHole; //if error, return, don't exec
       }
-   } else if(!(j->bg)){
-      seize_tty(p->pid);
+   } else if(p->herefd >= 0){ //<<WORD or <<< word, a sealed memfd
+      if(dup2(p->herefd, STDIN_FILENO) == GENERAL_ERROR){
+        perror("Failed to set up here-document");
+      }
+   } else if(j->mystdin != STDIN_FILENO && j->mystdin != INPUT_FD){
+      //the shell handed us its own channel (e.g. >(...) pipe)
+      if(dup2(j->mystdin, STDIN_FILENO) == GENERAL_ERROR){
+        perror("Failed to set up input channel");
+      }
+   } else if(!(j->bg) && !(j->managed)){
+      seize_tty(j->pgid); //our pid, unless we are a later argv batch
    }
 
    /* DEALING WITH OUTPUT - PIPE OR FILE */
@@ -195,15 +742,53 @@ int new_child(job_t *j, process_t *p, int inPipe, int outPipe)
       if(dup2(outPipe, STDOUT_FILENO) == GENERAL_ERROR){
         perror("Failed to set up output pipe");
       }
-   } else if(changeStreamToFile(p->ofile, STDOUT_FILENO, OUTPUT_FILE_FLAGS) == GENERAL_ERROR){
+   } else if(p->muxout >= 0){ //the shell writes it out, line by line
+      if(dup2(p->muxout, STDOUT_FILENO) == GENERAL_ERROR){
+        perror("Failed to set up output multiplexer");
+      }
+   } else if(p->ofile == NULL && j->mystdout != STDOUT_FILENO && j->mystdout != OUTPUT_FD){
+      //the shell handed us its own channel (e.g. $(...) capture pipe)
+      if(dup2(j->mystdout, STDOUT_FILENO) == GENERAL_ERROR){
+        perror("Failed to set up output channel");
+      }
+   } else if(changeStreamToFile(p->ofile, STDOUT_FILENO, true, p->oappend, true) == GENERAL_ERROR){
       //perror("Error updating output stream");
       return blackHole; //if error, return, don't exec
    }
+
+   /* DEALING WITH ERRORS - FILE, OR WHEREVER THE OUTPUT WENT */
+   if(p->muxerr >= 0){
+      if(dup2(p->muxerr, STDERR_FILENO) == GENERAL_ERROR){
+        perror("Failed to set up error multiplexer");
+      }
+   } else if(p->efile != NULL){
+      if(changeStreamToFile(p->efile, STDERR_FILENO, true, p->eappend, false) == GENERAL_ERROR){
+         return blackHole;
+      }
+   } else if(j->mystderr != STDERR_FILENO){
+      //the shell opened the 2> file for all argv batches
+      if(dup2(j->mystderr, STDERR_FILENO) == GENERAL_ERROR){
+        perror("Failed to set up error channel");
+      }
+   }
+   if(p->errtoout && dup2(STDOUT_FILENO, STDERR_FILENO) == GENERAL_ERROR){
+      perror("Failed to send errors to the output");
+   }
    
    /* Set the handling for job control signals back to the default. */
    signal(SIGTTOU, SIG_DFL);
+   signal(SIGPIPE, SIG_DFL); //ignored by a serving shell
+
+   //only stdio and the /dev/fd paths in argv survive the exec
+   closeInheritedFds(p);
    
+   if(func_exists(p->argv[0])){ //it would take a shell of its own
+      fprintf(stderr, "%s: functions run in the shell, not in a pipeline or in the background\n", p->argv[0]);
+      _exit(EXIT_FAILURE); //exit() would rewind a script the shell reads
+   }
+
    //never coming back after this
+   env_exec(p);
    execvp(p->argv[0], p->argv);
 
    return blackHole; //if failed to exec we come here
@@ -215,7 +800,9 @@ int set_child_pgid(job_t *j, process_t *p, bool child)
     if (j->pgid < 0){ /* first child: use its pid for job pgid */
         j->pgid = p->pid;
 
-       if(child && j->bg){
+       if(child && j->managed){
+          //builtins which spawn jobs report on them themselves
+       } else if(child && j->bg){
           printf("EXECUTING [%d] (background): %s\n", j->pgid, j->commandinfo);
        } else if(child){
           printf("EXECUTING [%d] (foreground): %s\n", j->pgid, j->commandinfo);
@@ -226,15 +813,16 @@ int set_child_pgid(job_t *j, process_t *p, bool child)
     return(setpgid(p->pid,j->pgid)); //set pgid of process to put it in the group
 }
 
-//updates the IO stream of child process to be for a file
-int changeStreamToFile(char* fileName, int stream, int flags){
+//updates the IO stream of child process to be for a file (direct as for
+//openRedirection())
+int changeStreamToFile(char* fileName, int stream, bool output, bool append, bool direct){
    int newFd;         //for the file we open
    int result = 0;    //for the result of dup2
    //0 by default because if fileName == NULL, 
    //there was no input file andwe do nothing
 
    if(fileName != NULL){              //if we have a file we continue
-      newFd  = open(fileName, flags, NEW_FILE_PERMISSIONS); //get fd for file
+      newFd  = openRedirection(fileName, output, append, direct); //get fd for file
       if(newFd < 0){ //error handling
          return GENERAL_ERROR;
       }
@@ -246,6 +834,64 @@ int changeStreamToFile(char* fileName, int stream, int flags){
    return result; //return result fo dup2
 }
 
+//opens the file of a <, >, >> or 2> redirection (close-on-exec), with
+//I/O hints: < files are read sequentially, so the kernel is told and
+//starts reading ahead; outputs get $DSH_PREALLOC bytes preallocated (a
+//size hint, e.g. 4G) and, if direct (the stdout of a command that is
+//exec'd), O_DIRECT with $DSH_DIRECT=1 where the file system allows it.
+//Returns the fd, or -1 with errno set
+int openRedirection(char* fileName, bool output, bool append, bool direct){
+   struct stat st;
+   if(!output){
+      int fd = open(fileName, INPUT_FILE_FLAGS | O_CLOEXEC);
+#ifdef __linux__
+      if(fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)){
+         posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+         readahead(fd, 0, READAHEAD_BYTES);
+      }
+#endif
+      return fd;
+   }
+
+   int flags = (append ? APPEND_FILE_FLAGS : OUTPUT_FILE_FLAGS) | O_CLOEXEC;
+   int fd = GENERAL_ERROR;
+#ifdef __linux__
+   //the writer must then write whole, aligned blocks (e.g. dd bs=1M)
+   const char* asked = direct ? get_var("DSH_DIRECT") : NULL;
+   if(asked != NULL && !strcmp(asked, "1")){
+      fd = open(fileName, flags | O_DIRECT, NEW_FILE_PERMISSIONS);
+   }
+#endif
+   if(fd < 0){ //not asked for, or not supported (EINVAL, e.g. on tmpfs)
+      fd = open(fileName, flags, NEW_FILE_PERMISSIONS);
+   }
+#ifdef __linux__
+   //reserve the blocks without changing the size: a short write leaves no
+   //zeros behind, and the fs can lay the file out in one extent
+   off_t hint = sizeVariable("DSH_PREALLOC");
+   if(fd >= 0 && hint > 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)){
+      fallocate(fd, FALLOC_FL_KEEP_SIZE, append ? st.st_size : 0, hint); //a hint only
+   }
+#endif
+   return fd;
+}
+
+//value of a size variable (bytes, or with a K, M or G suffix); 0 if unset
+off_t sizeVariable(const char* name){
+   const char* value = get_var(name);
+   if(value == NULL || *value == '\0'){
+      return 0;
+   }
+   char* unit;
+   unsigned long long n = strtoull(value, &unit, 10);
+   switch(*unit){
+      case 'G': case 'g': n <<= 10; /* fall through */
+      case 'M': case 'm': n <<= 10; /* fall through */
+      case 'K': case 'k': n <<= 10;
+   }
+   return (off_t) n;
+}
+
 /* Spawning a process with job control. fg is true if the 
  * newly-created process is to be placed in the foreground. 
  * (This implicitly puts the calling process in the background, 
@@ -263,6 +909,9 @@ void spawn_job(job_t *j)
 	process_t *p;
 
   //register this job as active
+  struct timespec started;
+  clock_gettime(CLOCK_REALTIME, &started);
+  j->start_ns = (int64_t) started.tv_sec * 1000000000LL + started.tv_nsec;
   activeJobNode* aj = addJobToActiveList(j);
 
   //setup for pipes between the processes
@@ -275,13 +924,43 @@ void spawn_job(job_t *j)
 	  /* Builtin commands are already taken care earlier */
     
     close(pipeWrite);
-	  if(p->next != NULL){ //if there is a pipe here
+    if(j->batchjobs > 0 && j->bg){ //the shell does not wait in the background
+       spawnBatchRunner(j);
+       break;
+    }
+    if(j->batchjobs > 0){ //batches: keep at most batchjobs running
+       int running = 0;
+       for(process_t* q = j->first_process; q != p; q = q->next){
+          running += !(q->completed);
+       }
+       while(running-- >= j->batchjobs){
+          waitForBatch(j);
+       }
+    }
+	  if(p->next != NULL && j->batchjobs == 0){ //if there is a pipe here
        pipe(fds); //get a pipe
        pipeWrite = fds[1];
     } else {
        pipeWrite = NO_PIPE;
     }
+    if(p != j->first_process && j->batchjobs == 0 && tee_stage(p->argc, p->argv)){
+       //copied by a thread of the shell, not exec'd
+       int out = (pipeWrite != NO_PIPE) ? pipeWrite : teeOutput(j, p);
+       p->completed = true;
+       p->status = (out >= 0 && tee_start(pipeRead, out, p->argc, p->argv, j->pgid)) ? 0 : EXIT_FAILURE << 8;
+       if(out < 0){
+          close(pipeRead);
+       }
+       pipeRead = fds[0];
+       pipeWrite = NO_PIPE; //the thread's now
+       continue;
+    }
+    int muxTo[2] = {NO_PIPE, NO_PIPE};
+    int muxRead[2] = {muxStage(j, p, false, &muxTo[0]), muxStage(j, p, true, &muxTo[1])};
 
+    prefetch_note_exec(p->argv[0]);
+    env_block(NULL); //packed here once, not in every child
+    fflush(stdout); //or the child inherits our buffered output
 	  switch (pid = fork()) {
 
       case GENERAL_ERROR: /* fork failure */
@@ -300,16 +979,36 @@ void spawn_job(job_t *j)
         /* YOUR CODE HERE?  Child-side code for new process. */
         kill(j->pgid, SIGCHLD); //tell parent of failure
         perror("Failed to execute process");
-        exit(EXIT_FAILURE);  /* NOT REACHED */
+        fflush(stdout);
+        _exit(EXIT_FAILURE); //exit() would rewind a script and run the shell's atexit()s
         break;    /* NOT REACHED */
 
       default: /* parent */
         /* establish child process group */
         p->pid = pid;
         set_child_pgid(j, p, false);
+        if(p->nkeepfds > 0){ //the child has its /dev/fd copies now
+           for(int i = 0; i < p->nkeepfds; i++){
+              close(p->keepfds[i]);
+           }
+           p->nkeepfds = 0;
+        }
+        if(p->herefd >= 0){ //and its here-document
+           close(p->herefd);
+           p->herefd = -1;
+        }
         close(pipeWrite);
         close(pipeRead);
         pipeRead = fds[0];
+        for(int k = 0; k < 2; k++){ //the multiplexer reads what it writes now
+           if(muxRead[k] != NO_PIPE){
+              close(k ? p->muxerr : p->muxout);
+              if(!mux_add(muxRead[k], muxTo[k], j->pgid)){
+                 close(muxRead[k]);
+              }
+           }
+        }
+        p->muxout = p->muxerr = -1;
         
         if(j->bg){             // if background job
           seize_tty(getpid()); // take the terminal
@@ -322,8 +1021,42 @@ void spawn_job(job_t *j)
    
    }
 
+   board_changed(); //it has a pgid now
+
+   int64_t deadline = jobDeadline(j);
+   if(deadline > 0){
+      timeout_arm(j->pgid, deadline, graceNs(), &(aj->timedOut));
+   }
+
+   //argv batches got the > and 2> files from the shell, the children have them now
+   if(j->batchjobs > 0 && j->mystdout != STDOUT_FILENO && j->mystdout != OUTPUT_FD){
+      close(j->mystdout);
+   }
+   if(j->batchjobs > 0 && j->mystderr != STDERR_FILENO){
+      close(j->mystderr);
+   }
+
    //get all the status values of the processes
-   examineProcesses(j, aj);
+   //(managed jobs are reaped by the builtin that spawned them)
+   if(!(j->managed)){
+      examineProcesses(j, aj);
+      if(!(j->bg)){
+         lastStatus = jobStatus(j);
+         setPipeStatus(j);
+         mux_settle(j->pgid); //parallel batches: their last lines first
+      }
+      if(job_is_completed(j)){
+         timeout_cancel(j->pgid);
+         if(!(j->bg)){
+            tee_wait(j->pgid); //the output of a tee at the end comes before the prompt
+         }
+      }
+      if(!(j->bg) && aj->timedOut){
+         printf("\nJob %d timed out.\n", j->pgid);
+         lastStatus = TIMEOUT_STATUS;
+      }
+      board_changed();
+   }
    
    //now we might be finished with the job
    if((!job_is_completed(j)) && job_is_stopped(j)){
@@ -339,31 +1072,117 @@ void spawn_job(job_t *j)
 }
 
 //fills the status of each processes with status
-//reported from waitpid()
+//reported from waitpid(): a foreground job is reaped as a process group,
+//each stage as it ends rather than in pipeline order, and a stage that
+//fails has the stages feeding it torn down
 void examineProcesses(job_t* j, activeJobNode* aj){
-   process_t* current = j->first_process;
-   while(current != NULL){
-     //get status
+   int status;
+   if(j->bg){ //if background job, don't wait on it
+      for(process_t* p = j->first_process; p != NULL; p = p->next){
+         if(!(p->completed) && p->pid > 0 && waitpid(p->pid, &status, WNOHANG) == p->pid){
+            noteStageStatus(aj, p, status);
+         }
+      }
+      return;
+   }
 
-     if(j->bg){ //if background job, don't wait on it
-        waitpid(current->pid, &(current->status), WNOHANG);
-     } else {   //if foreground job we wait on it as the parent
-        waitpid(current->pid, &(current->status), WUNTRACED);
-     }
-     //detemine meaning of status
-     if(WSTOPSIG(current->status) == SIGTSTP){ //suspended
-        current->stopped = true;
-     } else if(WIFEXITED(current->status)){    //if continued
-        if(WEXITSTATUS(current->status) == 0){ //if success
-           current->completed = true;
-        } else { //probably something that couldn't be run
-           aj->crashed = true;
-        }
-     }
-     
-     //examing next process
-     current = current->next;
+   //until every stage has ended or stopped (e.g. ctrl-z)
+   while(!job_is_stopped(j)){
+      pid_t pid = waitpid(-(j->pgid), &status, WUNTRACED);
+      if(pid < 0){
+         if(errno == EINTR){
+            continue;
+         }
+         //the group is empty, but a stage that is not in it (one that
+         //found no group left to join) may still be running
+         for(process_t* p = j->first_process; p != NULL; p = p->next){
+            while(!(p->completed) && !(p->stopped) && p->pid > 0){
+               pid_t got = waitpid(p->pid, &status, WUNTRACED);
+               if(got == p->pid){
+                  noteStageStatus(aj, p, status);
+               } else if(errno != EINTR){
+                  break; //reaped by jobs, its status is recorded
+               }
+            }
+         }
+         board_lock();
+         for(process_t* p = j->first_process; p != NULL; p = p->next){
+            p->completed |= !(p->stopped); //nothing left to wait for
+         }
+         board_unlock();
+         break;
+      }
+      process_t* p = findStage(j, pid);
+      if(p == NULL){ //not a stage of this job
+         recordProcessStatus(pid, status);
+         continue;
+      }
+      noteStageStatus(aj, p, status);
+      if(!WIFSTOPPED(status) && exitCode(status) != 0 && j->batchjobs == 0){
+         tearDownUpstream(j, p);
+      }
+   }
+   if(j->batchjobs > 0 && job_is_completed(j)){
+      waitpid(j->pgid, &status, WNOHANG); //the leading batch, if waitForBatch() left it
+   }
+   return;
+}
+
+//records a waitpid() status of stage p of the job of aj; a stage killed
+//by SIGPIPE because a later stage stopped reading is not a failure
+void noteStageStatus(activeJobNode* aj, process_t* p, int status){
+   board_lock(); //the job board reads the states from its own thread
+   p->status = status;
+   if(WIFSTOPPED(status)){
+      p->stopped = true;
+   } else {
+      p->completed = true;
+      if(WIFSIGNALED(status)){
+         if(WTERMSIG(status) != SIGPIPE || p->next == NULL){
+            aj->killed = true;
+         }
+      } else if(WEXITSTATUS(status) != 0){
+         aj->crashed = true;
+      }
+   }
+   board_unlock();
+   return;
+}
+
+//stage of j with this pid, NULL if there is none
+process_t* findStage(job_t* j, pid_t pid){
+   process_t* p = j->first_process;
+   while(p != NULL && p->pid != pid){
+      p = p->next;
+   }
+   return p;
+}
+
+//sends SIGPIPE to the stages before stage (all of them for NULL) that are
+//still running, as the kernel would on their next write to the pipe stage
+//no longer reads, so a producer that rarely writes stops burning CPU
+void tearDownUpstream(job_t* j, process_t* stage){
+   for(process_t* p = j->first_process; p != stage && p != NULL; p = p->next){
+      if(!(p->completed) && p->pid > 0){
+         DEBUG("tearing down %d (%s)", (int) p->pid, p->argv[0]);
+         kill(p->pid, SIGPIPE);
+         if(p->stopped){
+            kill(p->pid, SIGCONT);
+         }
+      }
+   }
+   return;
+}
+
+//sets $PIPESTATUS to the exit status of each stage of j, first to last
+void setPipeStatus(job_t* j){
+   char statuses[MAX_LEN_CMDLINE];
+   size_t len = 0;
+   statuses[0] = '\0';
+   for(process_t* p = j->first_process; p != NULL && len < sizeof(statuses); p = p->next){
+      len += snprintf(statuses + len, sizeof(statuses) - len, (len > 0) ? " %d" : "%d", exitCode(p->status));
    }
+   set_var("PIPESTATUS", statuses);
    return;
 }
 
@@ -373,17 +1192,21 @@ activeJobNode* newJobNode(job_t* j){
    node->job = j;
    node->crashed = false;
    node->killed = false;
+   node->timedOut = false;
    node->next = NULL;
    return node;
 }
 
 //adds job to active lise
 activeJobNode* addJobToActiveList(job_t* j){
+   activeJobNode* node = newJobNode(j);
+   board_lock(); //the job board reads the list from its own thread
    activeJobNode* current = activeList;
 
    //if first one
    if(current == NULL){ //comparing ptrs
-      activeList = newJobNode(j);
+      activeList = node;
+      board_unlock();
       return activeList;
    }
 
@@ -392,30 +1215,36 @@ activeJobNode* addJobToActiveList(job_t* j){
       current = current->next;
    }
 
-   current->next = newJobNode(j);
+   current->next = node;
+   board_unlock();
    return (current->next);
 }
 
 //updates jobs from active list
 void removeActiveJobFromList(activeJobNode* aj){
    activeJobNode* prev = NULL;
+   board_lock(); //the job board must not see the job being freed
    activeJobNode* current = activeList;
 
    //not first one, go through list
    while(current != NULL){    //iterate through list
       if(current == aj){      //if addresses match
          if(prev == NULL){    //if haven't move from first
-           activeList = NULL; //remove the only node on the lsit
+           activeList = current->next; //new head of the list
          } else {
            prev->next = current->next; //skip over current
          }
+         afterJobGone(current->job);   //after and wait still need its status
+         timeout_cancel(current->job->pgid); //before the thread can set timedOut
          freeActiveJob(current);
+         board_unlock();
          return;                       //to remove from list
       }
       prev = current;
       current = current->next;
    }
 
+   board_unlock();
    return;
 }
 
@@ -439,9 +1268,19 @@ void freeJob(job_t* j){
          free(p->argv);
          free(p->ifile);
          free(p->ofile);
+         free(p->efile);
+         free(p->keepfds);
+         for(int i = 0; i < p->nenv; i++){
+            free(p->env[i]);
+         }
+         free(p->env);
+         free(p->heredoc);
+         free(p->heredelim);
          free(p);
          p = pNext;
       }
+      free(j->commandinfo);
+      free(j);
    } else {
       return;
    }
@@ -463,6 +1302,7 @@ void continue_job(job_t *j, bool bg)
       }
       /////////////////////////makeAllComplete(j);
       j->bg = bg;
+      board_changed();
       if(bg){ //if bg, get the terminal
          seize_tty(getpid());
       }
@@ -473,12 +1313,14 @@ void continue_job(job_t *j, bool bg)
 //make all stopped processes in non-stopped state
 void unStopStoppedProcesses(job_t* j){
    process_t* current = j->first_process;
+   board_lock(); //the job board reads the states from its own thread
    while(current != NULL){
       if(current->stopped){
          current->stopped = false;
       }
       current = current->next;
    }
+   board_unlock();
    return;
 }
 
@@ -503,15 +1345,8 @@ bool builtin_cmd(job_t* job, int argc, char **argv){
    
    } else if (!strcmp("cd", argv[0])) {
    
-      //change directory
-      char* oldPath = getCurrentPath();
-
-      if(chdir(argv[1]) < 0){ //returns -1 if error
-         perror("Problem changing directory");
-      } else {
-         char* newPath = getCurrentPath();
-         printf("%s\n%s\n", oldPath, newPath);
-      }
+      //change directory, to a visited one matching the words if need be
+      cdCmd(argc, argv);
       return true;
    
    } else if (!strcmp("bg", argv[0])) {
@@ -540,28 +1375,134 @@ bool builtin_cmd(job_t* job, int argc, char **argv){
      }
      return true;
    
-   }
+   } else if (!strcmp("batchable", argv[0])) {
 
-   return false; /* not a builtin command */
-}
+     //list or mark commands that may be split over several execs
+     batchableCmd_(argc, argv);
+     return true;
 
-//gives back the job number
-job_t* getJobToWakeup(char* s){
-   if(s != NULL){
-      return findJobByPGID(atoi(s));
-   } else {
-      return find_last_job(activeList); //other case to handle
-   }
-   return NULL;
-}
+   } else if (!strcmp("forall", argv[0])) {
 
-//finds the job with the given pgid
-job_t* findJobByPGID(int pgid){
-   activeJobNode* current = activeList;
-   while(current != NULL){
-      if((current->job->pgid) == pgid){
-         return current->job;
-      }
+     //run the template for every line of the < list
+     forallCmd(job, argc, argv);
+     return true;
+
+   } else if (!strcmp("watch", argv[0])) {
+
+     //rerun the job whenever its inputs change
+     watchCmd(job, argc, argv);
+     return true;
+
+   } else if (!strcmp("coproc", argv[0])) {
+
+     //start, list or kill coprocesses
+     coprocCmd(job, argc, argv);
+     return true;
+
+   } else if (!strcmp("send", argv[0]) || !strcmp("recv", argv[0])
+              || !strcmp("ask", argv[0])) {
+
+     //talk to a coprocess
+     coprocIoCmd(argc, argv);
+     return true;
+
+   } else if (!strcmp("test", argv[0]) || !strcmp("[", argv[0])) {
+
+     //string, integer and file tests, without a fork
+     if(argv[0][0] == '[' && strcmp(argv[argc - 1], "]")){
+        fprintf(stderr, "%s\n", "[: missing ]");
+        lastStatus = 2;
+     } else {
+        lastStatus = testExpr(argc - 1 - (argv[0][0] == '['), argv + 1);
+     }
+     return true;
+
+   } else if (!strcmp("alias", argv[0]) || !strcmp("unalias", argv[0])) {
+
+     aliasCmd(argc, argv);
+     return true;
+
+   } else if (!strcmp("export", argv[0]) || !strcmp("unset", argv[0])) {
+
+     //names are exported before this, see is_export_job()
+     exportCmd(argc, argv);
+     return true;
+
+   } else if (!strcmp("true", argv[0]) || !strcmp("false", argv[0])) {
+
+     lastStatus = (argv[0][0] == 'f');
+     return true;
+
+   } else if (!strcmp("break", argv[0]) || !strcmp("continue", argv[0])) {
+
+     //leave or restart the loop being run
+     if(loopNesting > 0){
+        loopControl = (argv[0][0] == 'b') ? LOOP_BREAK : LOOP_CONTINUE;
+     }
+     return true;
+
+   } else if (!strcmp("cacheable", argv[0])) {
+
+     //list or mark commands that always go through the result cache
+     if(argc == 1){
+        cache_print_allowed();
+     }
+     for(int i = 1; i < argc; i++){
+        cache_allow(argv[i]);
+     }
+     return true;
+
+   } else if (!strcmp("after", argv[0])) {
+
+     //run a job once the jobs it depends on are done
+     afterCmd(job, argc, argv);
+     return true;
+
+   } else if (!strcmp("wait", argv[0])) {
+
+     //wait for background jobs
+     waitCmd(argc, argv);
+     return true;
+
+   } else if (!strcmp("mux", argv[0])) {
+
+     //whole-line output of concurrent jobs
+     muxCmd(argc, argv);
+     return true;
+
+   } else if (!strcmp("stats", argv[0])) {
+
+     //counters kept by the shell
+     cache_print_stats();
+     mux_print_stats();
+     timeout_print_stats();
+     prefetch_print_stats();
+     env_print_stats();
+     tee_print_stats();
+     return true;
+
+   }
+
+   return false; /* not a builtin command */
+}
+
+//gives back the job number
+job_t* getJobToWakeup(char* s){
+   if(s != NULL){
+      return findJobByPGID(atoi(s));
+   } else {
+      return find_last_job(activeList); //other case to handle
+   }
+   return NULL;
+}
+
+//finds the job with the given pgid
+job_t* findJobByPGID(int pgid){
+   activeJobNode* current = activeList;
+   while(current != NULL){
+      if((current->job->pgid) == pgid){
+         return current->job;
+      }
       current = current->next;
    }
    return NULL;
@@ -577,9 +1518,11 @@ void printActiveJobs(activeJobNode* list){
      printf("Active jobs:\n");
 
      activeJobNode* current = list;
+     activeJobNode* next;
      while(current != NULL){
+        next = current->next; //printing may remove current from the list
         printSingleActiveJob(current);
-        current = current->next;
+        current = next;
      }
    } else {
      printf("No active jobs.\n");
@@ -605,9 +1548,16 @@ void checkOnProcesses(activeJobNode* jobNode){
    int result;
 
    while(current != NULL){
-      result = waitpid(current->pid, &(current->status), WNOHANG);
+      if(current->completed){ //already reaped, status is recorded
+         current = current->next;
+         continue;
+      }
+      int status = current->status;
+      result = waitpid(current->pid, &status, WNOHANG);
 
       if(result != 0){ //dead process
+         board_lock(); //the job board reads the states from its own thread
+         current->status = status;
          if(WEXITSTATUS(current->status) != 0){ //if not exit code 0 (success)
             jobNode->crashed = true;    //not this for the printing
          } else if(WIFSIGNALED(current->status)){
@@ -615,6 +1565,7 @@ void checkOnProcesses(activeJobNode* jobNode){
          } else {
             current->completed = true;
          }
+         board_unlock();
       }
 
       current = current->next;
@@ -632,7 +1583,10 @@ void printSingleActiveJob(activeJobNode* jn){
       groundStr = backgroundStr;
    }
 
-   if(jn->crashed){
+   if(jn->timedOut && (jn->crashed || jn->killed || job_is_completed(jn->job))){
+      printf("\t[%d] (%s) ~ %s ~ %s\n", jn->job->pgid, groundStr, "TIMED OUT", jn->job->commandinfo);
+      removeActiveJobFromList(jn);
+   } else if(jn->crashed){
       printf("\t[%d] (%s) ~ %s ~ %s\n", jn->job->pgid, groundStr, " CRASHED ", jn->job->commandinfo);
       removeActiveJobFromList(jn);
    } else if(jn->killed){
@@ -652,7 +1606,7 @@ void printSingleActiveJob(activeJobNode* jn){
 
 /* Build prompt messaage */
 char* promptmsg(pid_t pid){
-  if(isatty(STDIN_FILENO)){ //if we have input from terminal
+  if(isatty(fileno(get_cmd_source()))){ //if we have input from terminal
     sprintf(promptString, "dsh[%d]$ ", (int) pid); //print prompt
   } else {
     sprintf(promptString, ""); //other wise we print blank (nothing)
@@ -660,12 +1614,2936 @@ char* promptmsg(pid_t pid){
 	return promptString;
 }
 
-//gets a pointer to a string of the current path
+//gets a copy of the current path (malloc'd)
 char* getCurrentPath(void){
-   char* buf = (char*) malloc(PATH_BUF_LEN * sizeof(char));
-   if(getcwd(buf, PATH_BUF_LEN) == (char*)-1) { //if failure
+   const char* cwd = shell_cwd();
+   if(*cwd == '\0'){ //if failure
       perror("Cannot get path");
-      buf = NULL;
+   }
+   return strdup(cwd);
+}
+
+//the shell's cwd, fetched once per cd; "" if it cannot be had
+const char* shell_cwd(void){
+   if(cwdCache == NULL){
+      cwdCache = getcwd(NULL, 0);
+   }
+   return (cwdCache != NULL) ? cwdCache : "";
+}
+
+//drops the cached cwd after a chdir()
+void cwd_changed(void){
+   free(cwdCache);
+   cwdCache = NULL;
+}
+
+//finds the active job node and process with the given pid
+activeJobNode* findNodeByPID(pid_t pid, process_t** proc){
+   activeJobNode* current = activeList;
+   process_t* p;
+   while(current != NULL){
+      for(p = current->job->first_process; p != NULL; p = p->next){
+         if(p->pid == pid){
+            *proc = p;
+            return current;
+         }
+      }
+      current = current->next;
+   }
+   return NULL;
+}
+
+//records a status reported by waitpid() against the process that owns it
+//so later polling (jobs) does not wait on an already reaped pid
+void recordProcessStatus(pid_t pid, int status){
+   process_t* p;
+   activeJobNode* node = findNodeByPID(pid, &p);
+   if(node == NULL){ //not one of ours
+      return;
+   }
+
+   board_lock(); //the job board reads the states from its own thread
+   p->status = status;
+   if(WIFSTOPPED(status)){
+      p->stopped = true;
+   } else {
+      p->completed = true;
+      if(WIFSIGNALED(status)){
+         node->killed = true;
+      } else if(WEXITSTATUS(status) != 0){
+         node->crashed = true;
+      }
+   }
+   board_unlock();
+   return;
+}
+
+//forall builtin: forall [-j N] [-n N] cmd [args] [{}] < list
+//runs cmd once per line of list (or once per batch of lines), keeping
+//up to -j children running at once through spawn_job()
+void forallCmd(job_t* job, int argc, char** argv){
+   int maxJobs = 1;                     //-j: children running at once
+   int maxBatch = FORALL_DEFAULT_BATCH; //-n: items per exec
+   int argi = 1;
+
+   while(argi < argc - 1 && argv[argi][0] == '-'){ //options
+      if(!strcmp(argv[argi], "-j")){
+         maxJobs = atoi(argv[argi + 1]);
+      } else if(!strcmp(argv[argi], "-n")){
+         maxBatch = atoi(argv[argi + 1]);
+      } else {
+         break;
+      }
+      argi += 2;
+   }
+
+   char* listFile = job->first_process->ifile;
+   if(argi >= argc || listFile == NULL || maxJobs < 1 || maxBatch < 1){
+      fprintf(stderr, "usage: forall [-j jobs] [-n items] cmd [args] [{}] < list\n");
+      return;
+   }
+
+   char** tmpl = argv + argi;
+   int tmplc = argc - argi;
+
+   //items can only be batched if they land as whole trailing words:
+   //either no placeholder at all or exactly one standalone "{}"
+   int holders = 0;
+   bool standalone = false;
+   for(int i = 0; i < tmplc; i++){
+      if(strstr(tmpl[i], FORALL_PLACEHOLDER) != NULL){
+         holders++;
+         standalone = !strcmp(tmpl[i], FORALL_PLACEHOLDER);
+      }
+   }
+   if(holders > 1 || (holders == 1 && !standalone)){
+      maxBatch = 1;
+   }
+
+   int listFd = open(listFile, INPUT_FILE_FLAGS);
+   if(listFd < 0){
+      perror("forall: cannot open list");
+      return;
+   }
+
+   pid_t* slots = (pid_t*) calloc(maxJobs, sizeof(pid_t));
+   size_t bufLen = FORALL_CHUNK_LEN;
+   char* buf = (char*) malloc(bufLen + 1);
+   char** items = (char**) malloc(maxBatch * sizeof(char*));
+   if(slots == NULL || buf == NULL || items == NULL){
+      fprintf(stderr, "%s\n", "malloc: no space");
+      free(slots); free(buf); free(items);
+      close(listFd);
+      return;
+   }
+
+   size_t filled = 0;  //bytes in buf
+   int running = 0;    //children alive
+   int spawned = 0;
+   bool eof = false;
+
+   while(!eof || filled > 0){
+      //top up the buffer with one big read
+      if(!eof){
+         if(filled == bufLen){ //a single line longer than the buffer
+            bufLen *= 2;
+            buf = (char*) realloc(buf, bufLen + 1);
+         }
+         ssize_t got = read(listFd, buf + filled, bufLen - filled);
+         if(got <= 0){
+            eof = true;
+         } else {
+            filled += got;
+         }
+      }
+
+      //hand out every complete line (and the tail once at eof); a batch
+      //never spans two reads, chunks are big enough for that not to matter
+      size_t pos = 0;
+      size_t batchBytes = 0;
+      int nItems = 0;
+      while(pos < filled || nItems > 0){
+         char* nl = (pos < filled) ? memchr(buf + pos, '\n', filled - pos) : NULL;
+         bool haveLine = (pos < filled) && (nl != NULL || eof);
+         if(haveLine){
+            size_t end = (nl != NULL) ? (size_t)(nl - buf) : filled;
+            buf[end] = '\0';
+            if(end > pos){ //skip empty lines
+               items[nItems++] = buf + pos;
+               batchBytes += end - pos + 1;
+            }
+            pos = end + 1;
+         }
+
+         bool full = (nItems == maxBatch || batchBytes >= FORALL_BATCH_BYTES);
+         if(nItems > 0 && (full || !haveLine)){
+            while(running >= maxJobs){
+               reapForallChild(slots, maxJobs, &running);
+            }
+            job_t* child = newForallJob(tmpl, tmplc, items, nItems);
+            if(child == NULL){
+               fprintf(stderr, "%s\n", "malloc: no space");
+               eof = true;
+               pos = filled;
+               break;
+            }
+            spawn_job(child);
+            for(int i = 0; i < maxJobs; i++){ //take a free slot
+               if(slots[i] == 0){
+                  slots[i] = child->pgid;
+                  break;
+               }
+            }
+            running++;
+            spawned++;
+            nItems = 0;
+            batchBytes = 0;
+         }
+         if(!haveLine && nItems == 0){
+            break; //partial line, wait for more input
+         }
+      }
+
+      //keep the partial line for the next read
+      if(pos > filled){
+         pos = filled;
+      }
+      memmove(buf, buf + pos, filled - pos);
+      filled -= pos;
+   }
+
+   while(running > 0){ //wait for the stragglers
+      reapForallChild(slots, maxJobs, &running);
+   }
+
+   free(items);
+   free(buf);
+   free(slots);
+   close(listFd);
+   DEBUG("forall: %d execs\n", spawned);
+   return;
+}
+
+//builds a managed job running the forall template over nItems items
+job_t* newForallJob(char** tmpl, int tmplc, char** items, int nItems){
+   job_t* j = (job_t*) malloc(sizeof(job_t));
+   process_t* p = (process_t*) malloc(sizeof(process_t));
+   if(j == NULL || p == NULL || !init_job(j) || !init_process(p)){
+      return NULL;
+   }
+   j->first_process = p;
+   j->bg = true;
+   j->managed = true;
+
+   //a standalone placeholder (or none at all) takes every item as its
+   //own word; anything else is a per-item substitution inside the word
+   int argc = tmplc + nItems;
+   free(p->argv);
+   p->argv = (char**) calloc(argc + 1, sizeof(char*));
+   if(p->argv == NULL){
+      return NULL;
+   }
+
+   bool placed = false;
+   for(int i = 0; i < tmplc; i++){
+      if(!strcmp(tmpl[i], FORALL_PLACEHOLDER)){
+         for(int k = 0; k < nItems; k++){
+            p->argv[p->argc++] = strdup(items[k]);
+         }
+         placed = true;
+      } else if(strstr(tmpl[i], FORALL_PLACEHOLDER) != NULL){
+         p->argv[p->argc++] = replacePlaceholder(tmpl[i], items[0]);
+         placed = true;
+      } else {
+         p->argv[p->argc++] = strdup(tmpl[i]);
+      }
+   }
+   if(!placed){ //like xargs: items go on the end
+      for(int k = 0; k < nItems; k++){
+         p->argv[p->argc++] = strdup(items[k]);
+      }
+   }
+   p->argv[p->argc] = NULL;
+   p->ifile = strdup(FORALL_STDIN_PATH);
+
+   //commandinfo is what jobs shows
+   size_t used = 0;
+   for(int i = 0; i < p->argc && used < MAX_LEN_CMDLINE - 1; i++){
+      used += snprintf(j->commandinfo + used, MAX_LEN_CMDLINE - used, "%s%s",
+                       (i > 0) ? " " : "", p->argv[i]);
+   }
+   return j;
+}
+
+//copies word with every placeholder replaced by item
+char* replacePlaceholder(char* word, char* item){
+   size_t holderLen = strlen(FORALL_PLACEHOLDER);
+   size_t itemLen = strlen(item);
+   size_t len = strlen(word);
+   char* hit;
+   char* from = word;
+
+   //count first so we only allocate once
+   int count = 0;
+   while((hit = strstr(from, FORALL_PLACEHOLDER)) != NULL){
+      count++;
+      from = hit + holderLen;
+   }
+
+   char* out = (char*) malloc(len + count * itemLen + 1);
+   char* to = out;
+   from = word;
+   while((hit = strstr(from, FORALL_PLACEHOLDER)) != NULL){
+      memcpy(to, from, hit - from);
+      to += hit - from;
+      memcpy(to, item, itemLen);
+      to += itemLen;
+      from = hit + holderLen;
+   }
+   strcpy(to, from);
+   return out;
+}
+
+//blocks until one forall child exits, frees its slot
+//other children reaped on the way get their status recorded for jobs
+void reapForallChild(pid_t* slots, int nSlots, int* running){
+   int status;
+   pid_t pid;
+
+   while((pid = waitpid(-1, &status, 0)) > 0){
+      recordProcessStatus(pid, status);
+      for(int i = 0; i < nSlots; i++){
+         if(slots[i] == pid){
+            mux_settle(pid);
+            slots[i] = 0;
+            (*running)--;
+            return;
+         }
+      }
+   }
+
+   //no children left at all, nothing is running
+   if(pid < 0 && errno == ECHILD){
+      memset(slots, 0, nSlots * sizeof(pid_t));
+      *running = 0;
+   }
+   return;
+}
+
+//true if the builtin only prints, so $(...) can run it without a fork
+//(recv and ask read from a coprocess, which only the shell can do)
+bool isPureBuiltin(char* name){
+   static char* pureBuiltins[] = { "jobs", "stats", "recv", "ask", NULL };
+   for(int i = 0; pureBuiltins[i] != NULL; i++){
+      if(!strcmp(name, pureBuiltins[i])){
+         return true;
+      }
+   }
+   return false;
+}
+
+//runs cmdline with its stdout captured, see dsh.h
+//jobs are run one after the other like a ; sequence
+char* capture_output(char* cmdline, size_t* len){
+   size_t cap = CAPTURE_BUF_LEN;
+   char* buf = (char*) malloc(cap);
+   *len = 0;
+   if(buf == NULL){
+      return NULL;
+   }
+
+   job_t* j = parse_cmdline(cmdline);
+   job_t* next;
+   bool ok = true;
+   while(j != NULL){
+      next = j->next;
+      j->next = NULL;
+      if(!ok || !expand_job(j) || j->first_process->argc == 0){
+         freeJob(j);
+      } else if(j->first_process->next == NULL
+                && j->first_process->ifile == NULL
+                && j->first_process->ofile == NULL
+                && j->first_process->efile == NULL
+                && !(j->first_process->errtoout)
+                && (isPureBuiltin(j->first_process->argv[0]) || isFunctionCall(j))){
+         ok = captureBuiltin(j, &buf, len, &cap);
+         freeJob(j);
+      } else {
+         ok = captureJob(j, &buf, len, &cap);
+      }
+      j = next;
+   }
+
+   if(!ok){
+      free(buf);
+      return NULL;
    }
    return buf;
-}
\ No newline at end of file
+}
+
+//runs a pure builtin (or a function) with stdout sent into a buffer; no
+//fork needed
+bool captureBuiltin(job_t* j, char** buf, size_t* len, size_t* cap){
+   int fd = anonymousFile();
+   if(fd < 0){
+      perror("Cannot capture builtin output");
+      return false;
+   }
+
+   fflush(stdout);
+   int savedStdout = dup(STDOUT_FILENO);
+   dup2(fd, STDOUT_FILENO);
+   if(isFunctionCall(j)){
+      callFunction(j);
+   } else {
+      builtin_cmd(j, j->first_process->argc, j->first_process->argv);
+   }
+   fflush(stdout);
+   dup2(savedStdout, STDOUT_FILENO);
+   close(savedStdout);
+
+   lseek(fd, 0, SEEK_SET);
+   bool ok = readAllInto(fd, buf, len, cap);
+   close(fd);
+   return ok;
+}
+
+//spawns j with stdout on a pipe and reads it all into a buffer
+bool captureJob(job_t* j, char** buf, size_t* len, size_t* cap){
+   int fds[2];
+   if(cloexecPipe(fds) == GENERAL_ERROR){
+      perror("Cannot capture output");
+      freeJob(j);
+      return false;
+   }
+
+   j->bg = true;
+   j->managed = true;
+   j->mystdout = fds[1];
+   spawn_job(j);
+   close(fds[1]); //only the children write now
+
+   bool ok = readAllInto(fds[0], buf, len, cap);
+   close(fds[0]);
+
+   //the substitution is internal, do not leave it in jobs
+   waitForJob(j);
+   activeJobNode* aj = findNodeByJob(j);
+   if(aj != NULL){
+      removeActiveJobFromList(aj);
+   }
+   return ok;
+}
+
+//reads fd until EOF onto the end of a growable buffer
+//once the output gets large it is spliced into a memfd in the kernel and
+//read back in one go, rather than realloc'ing and copying as it grows
+bool readAllInto(int fd, char** buf, size_t* len, size_t* cap){
+   ssize_t got;
+   while(*len < CAPTURE_SPLICE_THRESHOLD){
+      if(*len == *cap){
+         char* grown = (char*) realloc(*buf, *cap * 2);
+         if(grown == NULL){
+            return false;
+         }
+         *buf = grown;
+         *cap *= 2;
+      }
+      got = read(fd, *buf + *len, *cap - *len);
+      if(got < 0 && errno == EINTR){
+         continue;
+      } else if(got <= 0){
+         return got == 0;
+      }
+      *len += got;
+   }
+
+   //large output, finish it in the kernel
+   int spill = anonymousFile();
+   if(spill < 0){
+      return false;
+   }
+   size_t spilled = 0;
+#ifdef __linux__
+   while((got = splice(fd, NULL, spill, NULL, CAPTURE_SPLICE_THRESHOLD, SPLICE_F_MOVE)) > 0){
+      spilled += got;
+   }
+   if(got < 0 && errno == EINVAL) //fd is not a pipe, copy it the slow way
+#endif
+   {
+      char chunk[CAPTURE_BUF_LEN];
+      while((got = read(fd, chunk, sizeof(chunk))) > 0){
+         if(write(spill, chunk, got) != got){
+            got = GENERAL_ERROR;
+            break;
+         }
+         spilled += got;
+      }
+   }
+   if(got < 0){
+      close(spill);
+      return false;
+   }
+
+   char* grown = (char*) realloc(*buf, *len + spilled + 1);
+   if(grown == NULL){
+      close(spill);
+      return false;
+   }
+   *buf = grown;
+   *cap = *len + spilled + 1;
+   bool ok = (pread(spill, *buf + *len, spilled, 0) == (ssize_t) spilled);
+   *len += spilled;
+   close(spill);
+   return ok;
+}
+
+//blocks until every process of j has terminated
+void waitForJob(job_t* j){
+   process_t* p;
+   int status;
+   for(p = j->first_process; p != NULL; p = p->next){
+      while(!(p->completed) && p->pid > 0){
+         if(waitpid(p->pid, &status, 0) == p->pid){
+            recordProcessStatus(p->pid, status);
+            if(!WIFSTOPPED(status)){
+               p->completed = true; //even if the job was never registered
+            }
+         } else if(errno != EINTR){
+            p->completed = true; //already gone
+         }
+      }
+   }
+   return;
+}
+
+//finds the active job node for j
+activeJobNode* findNodeByJob(job_t* j){
+   activeJobNode* current = activeList;
+   while(current != NULL && current->job != j){
+      current = current->next;
+   }
+   return current;
+}
+
+//fills the job board entries from the active job list, see dsh.h
+//(runs on the board's thread while the shell cannot change the list)
+int board_collect(dsh_board_job_t* jobs, int max){
+   int total = 0;
+   for(activeJobNode* current = activeList; current != NULL; current = current->next){
+      if(total >= max){ //counted, but no room on the board
+         total++;
+         continue;
+      }
+      job_t* j = current->job;
+      dsh_board_job_t* e = &jobs[total++];
+      e->pgid = j->pgid;
+      e->flags = (j->bg ? DSH_JOB_BACKGROUND : 0) | (j->managed ? DSH_JOB_MANAGED : 0);
+      e->start_ns = j->start_ns;
+      if(current->crashed){
+         e->state = DSH_JOB_CRASHED;
+      } else if(current->killed){
+         e->state = DSH_JOB_KILLED;
+      } else if(job_is_completed(j)){
+         e->state = DSH_JOB_COMPLETED;
+      } else if(job_is_stopped(j)){
+         e->state = DSH_JOB_STOPPED;
+      } else {
+         e->state = DSH_JOB_RUNNING;
+      }
+
+      //reaped processes keep the time last sampled; their pid may be reused
+      e->nprocs = 0;
+      e->cpu_ns = 0;
+      for(process_t* p = j->first_process; p != NULL; p = p->next){
+         if(p->pid > 0 && !(p->completed) && (e->state == DSH_JOB_RUNNING || e->state == DSH_JOB_STOPPED)){
+            uint64_t cpu = board_cpu_ns(p->pid);
+            p->cpu_ns = (cpu > p->cpu_ns) ? cpu : p->cpu_ns;
+         }
+         e->nprocs++;
+         e->cpu_ns += p->cpu_ns;
+      }
+      strncpy(e->command, j->commandinfo, DSH_BOARD_CMD_LEN - 1);
+      e->command[DSH_BOARD_CMD_LEN - 1] = '\0';
+   }
+   return total;
+}
+
+//pipe() with both ends close-on-exec, so only the child that dup2()s an
+//end keeps it open across its exec
+int cloexecPipe(int fds[2]){
+#ifdef __linux__
+   return pipe2(fds, O_CLOEXEC);
+#else
+   if(pipe(fds) == GENERAL_ERROR){
+      return GENERAL_ERROR;
+   }
+   fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+   fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+   return 0;
+#endif
+}
+
+//file for captured output that never touches the filesystem if possible
+int anonymousFile(void){
+#ifdef __linux__
+   int fd = memfd_create("dsh-capture", MFD_CLOEXEC);
+   if(fd >= 0){
+      return fd;
+   }
+#endif
+   FILE* tmp = tmpfile(); //unlinked already
+   if(tmp == NULL){
+      return GENERAL_ERROR;
+   }
+   int fd2 = dup(fileno(tmp));
+   fclose(tmp);
+   if(fd2 >= 0){
+      fcntl(fd2, F_SETFD, FD_CLOEXEC);
+   }
+   return fd2;
+}
+
+//starts cmdline concurrently for <(...) or >(...), see dsh.h
+int open_proc_subst(char* cmdline, bool toCmd){
+   job_t* j = parse_cmdline(cmdline);
+   if(j == NULL){
+      return GENERAL_ERROR;
+   }
+   if(j->next != NULL){
+      fprintf(stderr, "%s\n", "process substitution: only a single pipeline is supported");
+      while(j != NULL){
+         job_t* next = j->next;
+         freeJob(j);
+         j = next;
+      }
+      return GENERAL_ERROR;
+   }
+   if(!expand_job(j) || j->first_process->argc == 0){
+      closeKeptFds(j);
+      freeJob(j);
+      return GENERAL_ERROR;
+   }
+
+   int fds[2];
+   if(cloexecPipe(fds) == GENERAL_ERROR){
+      perror("Cannot create pipe for process substitution");
+      freeJob(j);
+      return GENERAL_ERROR;
+   }
+
+   //the job gets one end as its stdin/stdout, we hand the other out
+   int shellEnd;
+   j->bg = true;
+   j->managed = true;
+   if(toCmd){
+      j->mystdin = fds[0];
+      shellEnd = fds[1];
+   } else {
+      j->mystdout = fds[1];
+      shellEnd = fds[0];
+   }
+   spawn_job(j);
+   close(toCmd ? fds[0] : fds[1]);
+
+   job_t** grown = (job_t**) realloc(procSubstJobs, (nProcSubstJobs + 1) * sizeof(job_t*));
+   if(grown != NULL){
+      procSubstJobs = grown;
+      procSubstJobs[nProcSubstJobs++] = j;
+   }
+   return shellEnd;
+}
+
+//waits for (or, for background jobs, lets go of) the <(...)/>(...) jobs
+//a foreground consumer is done by now, so producers see EPIPE and readers EOF
+void reapProcSubsts(bool bg){
+   for(int i = 0; i < nProcSubstJobs; i++){
+      if(!bg){
+         waitForJob(procSubstJobs[i]);
+         activeJobNode* aj = findNodeByJob(procSubstJobs[i]);
+         if(aj != NULL){
+            removeActiveJobFromList(aj);
+         }
+      } //background: they stay in jobs and are polled like any other
+   }
+   nProcSubstJobs = 0;
+   return;
+}
+
+//closes the shell's copies of the fds kept across exec by j's processes
+void closeKeptFds(job_t* j){
+   process_t* p;
+   for(p = j->first_process; p != NULL; p = p->next){
+      for(int i = 0; i < p->nkeepfds; i++){
+         close(p->keepfds[i]);
+      }
+      p->nkeepfds = 0;
+      if(p->herefd >= 0){
+         close(p->herefd);
+         p->herefd = -1;
+      }
+   }
+   return;
+}
+
+//runs a foreground job ending in wc or grep with that stage in the shell
+//(text.c): the stages before it are spawned as usual with their stdout on
+//a pipe the built-in reads, saving the exec of the tool; false if the job
+//has to be spawned as it is
+bool runTextBuiltin(job_t* j){
+   process_t* last = j->first_process;
+   process_t* prev = NULL;
+   while(last->next != NULL){
+      prev = last;
+      last = last->next;
+   }
+   if(j->bg || j->managed || last->efile != NULL || last->errtoout || last->nenv > 0
+      || !text_builtin(last->argc, last->argv)){
+      return false; //the built-ins report errors on the shell's stderr
+   }
+   if(jobDeadline(j) > 0){
+      return false; //a deadline can only stop a process of its own
+   }
+
+   //the stage's stdin and stdout, as new_child() would set them up
+   int in = STDIN_FILENO;
+   int out = STDOUT_FILENO;
+   if(last->ifile != NULL){
+      in = openRedirection(last->ifile, false, false, false);
+   } else if(last->herefd >= 0){
+      in = last->herefd; //closed with the kept fds
+   } else if(prev == NULL && j->mystdin != STDIN_FILENO && j->mystdin != INPUT_FD){
+      in = j->mystdin;
+   }
+   if(last->ofile != NULL){
+      out = openRedirection(last->ofile, true, last->oappend, false);
+   } else if(j->mystdout != STDOUT_FILENO && j->mystdout != OUTPUT_FD){
+      out = j->mystdout;
+   }
+   int fds[2] = {NO_PIPE, NO_PIPE};
+   if(in < 0 || out < 0 || (prev != NULL && cloexecPipe(fds) == GENERAL_ERROR)){
+      perror((in < 0) ? last->ifile : (out < 0) ? last->ofile : "pipe");
+      if(in > STDERR_FILENO && last->ifile != NULL){
+         close(in);
+      }
+      if(out > STDERR_FILENO && last->ofile != NULL){
+         close(out);
+      }
+      lastStatus = EXIT_FAILURE;
+      closeKeptFds(j);
+      freeJob(j);
+      return true;
+   }
+
+   //the stages before it write into the pipe; we reap them ourselves
+   if(prev != NULL){
+      prev->next = NULL;
+      j->mystdout = fds[1];
+      j->managed = true;
+      spawn_job(j);
+      close(fds[1]);
+      if(last->ifile == NULL && last->herefd < 0){
+         in = fds[0];
+      }
+      if(isatty(STDOUT_FILENO)){ //as set_child_pgid() would print it
+         printf("EXECUTING [%d] (foreground): %s\n", j->pgid, j->commandinfo);
+      }
+      seize_tty(j->pgid); //they may read the terminal
+   }
+
+   fflush(stdout);
+   int status = text_run(last->argc, last->argv, in, out);
+   if(fds[0] != NO_PIPE){
+      close(fds[0]); //a stage still writing gets SIGPIPE, as with the tool
+   }
+   if(last->ifile != NULL){
+      close(in);
+   }
+   if(last->ofile != NULL){
+      close(out);
+   }
+   lastStatus = status;
+
+   if(prev == NULL){ //nothing was spawned
+      closeKeptFds(j);
+      freeJob(j);
+      return true;
+   }
+   if(status != 0){ //as examineProcesses() does when a stage fails
+      tearDownUpstream(j, NULL);
+   }
+   waitForJob(j);
+   seize_tty(getpid());
+
+   //the stage we ran goes back into the job as a reaped process
+   board_lock(); //the job board walks the job's processes from its own thread
+   prev->next = last;
+   last->completed = true;
+   last->status = (status > 128) ? status - 128 : status << 8; //a waitpid() status
+   board_unlock();
+   setPipeStatus(j);
+   closeKeptFds(j);
+   activeJobNode* aj = findNodeByJob(j);
+   if(aj != NULL && (aj->crashed || status != 0)){ //as spawn_job() does
+      removeActiveJobFromList(aj);
+   }
+   return true;
+}
+
+//closes every descriptor above stderr except the ones p keeps across exec,
+//so pipe ends of other stages and substitutions do not leak into the child
+void closeInheritedFds(process_t* p){
+   //sort the kept fds so we can close the gaps between them
+   int* keep = p->keepfds;
+   for(int i = 1; i < p->nkeepfds; i++){
+      int fd = keep[i];
+      int k = i - 1;
+      while(k >= 0 && keep[k] > fd){
+         keep[k + 1] = keep[k];
+         k--;
+      }
+      keep[k + 1] = fd;
+   }
+
+   int low = STDERR_FILENO + 1;
+   for(int i = 0; i <= p->nkeepfds; i++){
+      int high = (i < p->nkeepfds) ? keep[i] - 1 : -1; //-1: to the end
+      if(high != -1 && high < low){
+         low = keep[i] + 1;
+         continue;
+      }
+#if defined(__linux__) && defined(SYS_close_range)
+      if(syscall(SYS_close_range, low, (high == -1) ? ~0U : (unsigned) high, 0) == 0){
+         if(i < p->nkeepfds){
+            low = keep[i] + 1;
+         }
+         continue;
+      }
+#endif
+      int last = (high == -1) ? MAX_SWEPT_FD : high;
+      for(int fd = low; fd <= last; fd++){
+         close(fd);
+      }
+      if(i < p->nkeepfds){
+         low = keep[i] + 1;
+      }
+   }
+
+   for(int i = 0; i < p->nkeepfds; i++){ //they were close-on-exec in the shell
+      fcntl(keep[i], F_SETFD, 0);
+   }
+   return;
+}
+
+//exit status of a finished job: the last stage of a pipeline, or for argv
+//batches the first batch that failed
+int jobStatus(job_t* j){
+   process_t* p;
+   int status = 0;
+   for(p = j->first_process; p != NULL; p = p->next){
+      if(j->batchjobs > 0 && status != 0){
+         break;
+      }
+      status = exitCode(p->status);
+   }
+   return status;
+}
+
+//sh style exit status (128+signal when killed) from a waitpid() status
+int exitCode(int status){
+   if(status == -1){ //never reported
+      return EXIT_FAILURE;
+   } else if(WIFSIGNALED(status)){
+      return SIGNAL_STATUS_BASE + WTERMSIG(status);
+   }
+   return WEXITSTATUS(status);
+}
+
+//batchable [-j N] [name...]
+//with no names lists the batchable commands, otherwise marks the names as
+//safe to split over several execs (running N batches at once)
+void batchableCmd_(int argc, char** argv){
+   int parallel = 1;
+   int argi = 1;
+   if(argc > 2 && !strcmp(argv[1], "-j")){
+      parallel = atoi(argv[2]);
+      argi = 3;
+   }
+   if(parallel < 1){
+      fprintf(stderr, "usage: batchable [-j N] [name...]\n");
+      lastStatus = EXIT_FAILURE;
+      return;
+   }
+
+   if(argi == argc){ //list them
+      findBatchable(""); //make sure the defaults are in
+      for(int i = 0; i < nBatchableCmds; i++){
+         printf("%s -j %d\n", batchableCmds[i].name, batchableCmds[i].parallel);
+      }
+      return;
+   }
+
+   for(; argi < argc; argi++){
+      batchableCmd* b = findBatchable(argv[argi]);
+      if(b == NULL){
+         batchableCmd* grown = (batchableCmd*) realloc(batchableCmds,
+                                  (nBatchableCmds + 1) * sizeof(batchableCmd));
+         if(grown == NULL){
+            fprintf(stderr, "%s\n", "malloc: no space");
+            return;
+         }
+         batchableCmds = grown;
+         b = &batchableCmds[nBatchableCmds++];
+         b->name = strdup(argv[argi]);
+      }
+      b->parallel = parallel;
+   }
+   return;
+}
+
+//finds the batchable entry for a command, NULL if it is not batchable
+//commands that treat each operand on its own are batchable out of the box
+batchableCmd* findBatchable(char* name){
+   static char* defaults[] = { "rm", "rmdir", "touch", "chmod", "chown", "chgrp",
+                               "mkdir", "cat", "gzip", "md5sum", "sha1sum",
+                               "sha256sum", NULL };
+   if(batchableCmds == NULL){
+      for(nBatchableCmds = 0; defaults[nBatchableCmds] != NULL; nBatchableCmds++);
+      batchableCmds = (batchableCmd*) malloc(nBatchableCmds * sizeof(batchableCmd));
+      if(batchableCmds == NULL){
+         nBatchableCmds = 0;
+         return NULL;
+      }
+      for(int i = 0; i < nBatchableCmds; i++){
+         batchableCmds[i].name = defaults[i];
+         batchableCmds[i].parallel = 1;
+      }
+   }
+
+   for(int i = 0; i < nBatchableCmds; i++){
+      if(!strcmp(batchableCmds[i].name, name)){
+         return &batchableCmds[i];
+      }
+   }
+   return NULL;
+}
+
+//bytes execve() needs for argv[from..to) (strings plus pointers)
+size_t argvBytes(char** argv, int from, int to){
+   size_t bytes = 0;
+   for(int i = from; i < to; i++){
+      bytes += strlen(argv[i]) + 1 + sizeof(char*);
+   }
+   return bytes;
+}
+
+//splits a batchable single command whose argv is over ARG_MAX into as few
+//execs as possible: each batch repeats argv[0] and the leading options and
+//is packed with as many of the remaining operands as fit
+void splitOversizedArgv(job_t* j){
+   process_t* p = j->first_process;
+   if(p->next != NULL || j->batchjobs > 0){ //pipelines are left alone
+      return;
+   }
+
+   long argMax = sysconf(_SC_ARG_MAX);
+   size_t envBytes = 0;
+   env_block(&envBytes);
+   envBytes += argvBytes(p->env, 0, p->nenv); //FOO=1 cmd
+   if(argMax <= 0 || argvBytes(p->argv, 0, p->argc) + sizeof(char*) + envBytes
+                     + ARGV_HEADROOM <= (size_t) argMax){
+      return; //fits
+   }
+
+   batchableCmd* b = findBatchable(p->argv[0]);
+   if(b == NULL){
+      return; //not ours to split, exec will report E2BIG
+   }
+
+   //argv[0] and leading options go to every batch
+   int fixed = 1;
+   while(fixed < p->argc && p->argv[fixed][0] == '-'){
+      if(!strcmp(p->argv[fixed++], "--")){
+         break;
+      }
+   }
+   size_t fixedBytes = argvBytes(p->argv, 0, fixed) + sizeof(char*) + envBytes + ARGV_HEADROOM;
+   if(fixedBytes >= (size_t) argMax){
+      return;
+   }
+   size_t room = argMax - fixedBytes;
+
+   //the shell opens the > and 2> files once so later batches do not
+   //truncate them; parallel batches append so their writes cannot land on
+   //each other
+   if(p->ofile != NULL){
+      int fd = openRedirection(p->ofile, true, p->oappend, true); //the batches' stdout
+      if(fd < 0){
+         perror("Cannot open output file");
+         return;
+      }
+      if(b->parallel > 1){
+         fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_APPEND);
+      }
+      j->mystdout = fd;
+      free(p->ofile);
+      p->ofile = NULL;
+   }
+   if(p->efile != NULL){
+      int fd = openRedirection(p->efile, true, p->eappend, false);
+      if(fd < 0){
+         perror("Cannot open error file");
+         return;
+      }
+      if(b->parallel > 1){
+         fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_APPEND);
+      }
+      j->mystderr = fd;
+      free(p->efile);
+      p->efile = NULL;
+   }
+
+   //greedy packing gives the fewest batches for operands kept in order
+   char** operands = p->argv;
+   int nOperands = p->argc;
+   process_t* last = NULL;
+   int next = fixed;
+   int batches = 0;
+   while(next < nOperands){
+      int end = next;
+      size_t used = 0;
+      while(end < nOperands){
+         size_t bytes = strlen(operands[end]) + 1 + sizeof(char*);
+         if(used + bytes > room && end > next){
+            break;
+         }
+         used += bytes;
+         end++;
+      }
+
+      process_t* batch = (last == NULL) ? p : (process_t*) malloc(sizeof(process_t));
+      if(batch != p){
+         if(batch == NULL || !init_process(batch)){
+            fprintf(stderr, "%s\n", "malloc: no space");
+            break;
+         }
+         batch->ifile = (p->ifile != NULL) ? strdup(p->ifile) : NULL;
+         batch->errtoout = p->errtoout;
+         if(p->nenv > 0 && (batch->env = (char**) calloc(p->nenv, sizeof(char*))) != NULL){
+            for(; batch->nenv < p->nenv; batch->nenv++){
+               batch->env[batch->nenv] = strdup(p->env[batch->nenv]);
+            }
+         }
+         last->next = batch;
+      }
+      char** argv = (char**) calloc(fixed + (end - next) + 1, sizeof(char*));
+      if(argv == NULL){
+         fprintf(stderr, "%s\n", "malloc: no space");
+         break;
+      }
+      for(int i = 0; i < fixed; i++){
+         argv[i] = strdup(operands[i]);
+      }
+      for(int i = next; i < end; i++){
+         argv[fixed + i - next] = operands[i]; //moved, not copied
+         operands[i] = NULL;
+      }
+      if(batch != p){
+         free(batch->argv);
+      }
+      batch->argv = argv;
+      batch->argc = fixed + (end - next);
+      last = batch;
+      next = end;
+      batches++;
+   }
+
+   //the original argv only holds the moved-out operands' slots now
+   for(int i = 0; i < nOperands; i++){
+      free(operands[i]);
+   }
+   free(operands);
+   j->batchjobs = b->parallel;
+   DEBUG("split %s into %d batches", p->argv[0], batches);
+   return;
+}
+
+//waits for one of the running batches of j, by pid. The batch that leads
+//the job's group is only noted (WNOWAIT) and left for examineProcesses() to
+//reap: the batches started after it join its group, which must still have
+//a process, a zombie will do, in it
+void waitForBatch(job_t* j){
+   while(1){
+      for(process_t* p = j->first_process; p != NULL && p->pid > 0; p = p->next){
+         if(p->completed){
+            continue;
+         }
+         int status = 0;
+         pid_t got;
+         if(p->pid == j->pgid){
+            siginfo_t info;
+            info.si_pid = 0;
+            got = waitid(P_PID, p->pid, &info, WEXITED | WNOHANG | WNOWAIT);
+            got = (got == 0) ? info.si_pid : got;
+            status = (info.si_code == CLD_EXITED) ? W_EXITCODE(info.si_status, 0) : W_EXITCODE(0, info.si_status);
+         } else {
+            got = waitpid(p->pid, &status, WNOHANG);
+         }
+         if(got == p->pid){
+            recordProcessStatus(p->pid, status);
+            return;
+         } else if(got < 0 && errno == ECHILD){ //reaped by jobs, its status is recorded
+            board_lock();
+            p->completed = true;
+            board_unlock();
+            return;
+         }
+      }
+      sleepOnBatches(j);
+   }
+}
+
+//blocks until a running batch of j may have ended: on their pidfds, or for
+//a while if pidfds are not available
+void sleepOnBatches(job_t* j){
+   int n = 0;
+   for(process_t* p = j->first_process; p != NULL; p = p->next){
+      n++;
+   }
+   struct pollfd* pfds = (struct pollfd*) calloc(n + 1, sizeof(struct pollfd));
+   int npfds = 0;
+   bool polled = (pfds != NULL);
+#if defined(__linux__) && defined(SYS_pidfd_open)
+   for(process_t* p = j->first_process; polled && p != NULL && p->pid > 0; p = p->next){
+      if(!(p->completed)){ //not the leader once it is a zombie, its pidfd stays readable
+         int fd = syscall(SYS_pidfd_open, p->pid, 0);
+         polled &= (fd >= 0);
+         pfds[npfds].fd = fd;
+         pfds[npfds++].events = POLLIN;
+      }
+   }
+#else
+   polled = false;
+#endif
+   if(polled && npfds > 0){
+      poll(pfds, npfds, -1); //an interrupted poll just means look again
+   } else {
+      usleep(WAIT_POLL_MS * 1000);
+   }
+   for(int i = 0; i < npfds; i++){
+      if(pfds[i].fd >= 0){
+         close(pfds[i].fd);
+      }
+   }
+   free(pfds);
+   return;
+}
+
+//runs the argv batches of a background job from a child of the shell: it
+//leads the job's group and starts the batches at most batchjobs at a time,
+//as spawn_job() does in the foreground, then exits with the status of the
+//first failed batch. The shell sees the job as that one process (the other
+//stages count as done), so & returns at once and the output is the same as
+//in the foreground. The batches write for themselves, not through mux.
+void spawnBatchRunner(job_t* j){
+   process_t* first = j->first_process;
+   env_block(NULL); //packed here once, not in the runner
+   fflush(stdout); //or the child inherits our buffered output
+   pid_t pid = fork();
+   if(pid == GENERAL_ERROR){
+      perror("fork");
+      exit(EXIT_FAILURE);
+   } else if(pid == 0){
+      //the runner: the shell's threads are not here, so no board or mux
+      first->pid = getpid();
+      set_child_pgid(j, first, true);
+      first->pid = 0;
+      int status;
+      int running = 0;
+      for(process_t* p = first; p != NULL; p = p->next){
+         while(running >= j->batchjobs){
+            pid_t got = waitpid(-1, &status, 0); //only batches are ours
+            for(process_t* q = first; got > 0 && q != p; q = q->next){
+               if(q->pid == got){
+                  q->status = status;
+                  q->completed = true;
+                  running--;
+               }
+            }
+            if(got < 0 && errno != EINTR){
+               running = 0;
+            }
+         }
+         fflush(stdout);
+         switch(p->pid = fork()){
+            case GENERAL_ERROR:
+               perror("fork");
+               p->completed = true;
+               p->status = EXIT_FAILURE << 8;
+               break;
+            case 0: {
+               p->pid = getpid();
+               int blackHole = new_child(j, p, NO_PIPE, NO_PIPE);
+               if(blackHole != NO_BLACKHOLE){
+                  close(blackHole);
+               }
+               perror("Failed to execute process");
+               fflush(stdout);
+               _exit(EXIT_FAILURE);
+            }
+            default:
+               set_child_pgid(j, p, false);
+               running++;
+         }
+      }
+      for(process_t* p = first; p != NULL; p = p->next){
+         while(!(p->completed) && p->pid > 0){
+            pid_t got = waitpid(p->pid, &status, 0);
+            if(got == p->pid){
+               p->status = status;
+               p->completed = true;
+            } else if(errno != EINTR){
+               p->completed = true;
+            }
+         }
+      }
+      _exit(jobStatus(j));
+   }
+
+   //the shell: the runner stands for the job
+   first->pid = pid;
+   set_child_pgid(j, first, false);
+   closeKeptFds(j); //the runner has them now
+   board_lock();
+   for(process_t* p = first->next; p != NULL; p = p->next){
+      p->completed = true;
+      p->status = 0;
+   }
+   board_unlock();
+   seize_tty(getpid()); //as for any background job
+   return;
+}
+
+//true if j is to be run through the result cache: it starts with the
+//cached prefix or with a command marked by the cacheable builtin
+bool isCachedJob(job_t* j){
+   char* name = j->first_process->argv[0];
+   if(j->first_process->nenv > 0){
+      return false; //the key does not cover FOO=1 cmd
+   }
+   return !strcmp(name, CACHED_PREFIX) || cache_allowed(name);
+}
+
+//cached [-c] [-e var]... [-i file]... cmd [args]
+//replays the stored stdout and exit status of j if nothing it reads has
+//changed since it last ran, otherwise runs it with its stdout captured into
+//a memfd, passes that on to the real stdout (or > file) and stores it
+void runCached(job_t* j){
+   process_t* p = j->first_process;
+   int argi = 0;
+   int nvars = 0;
+   int ninputs = 0;
+   bool byContent = false;
+   char** vars = (char**) malloc(p->argc * sizeof(char*));
+   char** inputs = (char**) malloc(p->argc * sizeof(char*));
+   char** prefix = (char**) malloc(p->argc * sizeof(char*));
+   if(vars == NULL || inputs == NULL || prefix == NULL){
+      fprintf(stderr, "%s\n", "malloc: no space");
+      free(vars); free(inputs); free(prefix);
+      return;
+   }
+
+   if(!strcmp(p->argv[0], CACHED_PREFIX)){
+      for(argi = 1; argi < p->argc && p->argv[argi][0] == '-'; argi++){
+         if(!strcmp(p->argv[argi], "--")){
+            argi++;
+            break;
+         } else if(!strcmp(p->argv[argi], "-c")){ //hash input contents
+            byContent = true;
+         } else if(!strcmp(p->argv[argi], "-e") && argi + 1 < p->argc){
+            vars[nvars++] = p->argv[++argi];
+         } else if(!strcmp(p->argv[argi], "-i") && argi + 1 < p->argc){
+            inputs[ninputs++] = p->argv[++argi];
+         } else {
+            break;
+         }
+      }
+      if(argi >= p->argc || p->argv[argi][0] == '-'){
+         fprintf(stderr, "usage: cached [-c] [-e var]... [-i file]... cmd [args]\n");
+         lastStatus = EXIT_FAILURE;
+         free(vars); free(inputs); free(prefix);
+         return;
+      }
+   }
+
+   //drop the prefix; its words are kept until the key is made
+   memcpy(prefix, p->argv, argi * sizeof(char*));
+   memmove(p->argv, p->argv + argi, (p->argc - argi + 1) * sizeof(char*));
+   p->argc -= argi;
+
+   //builtins are not worth caching
+   bool builtin = builtin_cmd(j, p->argc, p->argv);
+   cache_key_t key;
+   bool cacheable = !builtin && !(j->bg)
+                    && cache_make_key(j, vars, nvars, inputs, ninputs, byContent, &key);
+   for(int i = 0; i < argi; i++){
+      free(prefix[i]);
+   }
+   free(prefix);
+   free(vars);
+   free(inputs);
+
+   if(builtin){
+      closeKeptFds(j);
+      freeJob(j);
+      return;
+   } else if(!cacheable){
+      splitOversizedArgv(j);
+      spawn_job(j);
+      return;
+   }
+
+   //the shell writes the > file itself so hits can fill it too
+   process_t* last = p;
+   while(last->next != NULL){
+      last = last->next;
+   }
+   int out = STDOUT_FILENO;
+   if(last->ofile != NULL){
+      out = openRedirection(last->ofile, true, last->oappend, false);
+      if(out < 0){
+         perror("Cannot open output file");
+         lastStatus = EXIT_FAILURE;
+         return;
+      }
+      free(last->ofile);
+      last->ofile = NULL;
+   }
+
+   int status;
+   fflush(stdout);
+   if(cache_replay(&key, out, &status)){ //hit: nothing is spawned
+      lastStatus = status;
+      freeJob(j);
+   } else {
+      int capture = anonymousFile();
+      if(capture < 0){ //run it uncached
+         perror("Cannot capture output");
+         j->mystdout = out;
+         spawn_job(j);
+         if(out != STDOUT_FILENO){
+            close(out);
+         }
+         return;
+      }
+      j->mystdout = capture;
+      spawn_job(j);
+
+      //spawn_job() frees a job that failed, a stopped or killed one is kept
+      //without being completed; only a run to its end is worth storing
+      activeJobNode* aj = findNodeByJob(j);
+      bool finished = (aj == NULL || job_is_completed(j));
+      off_t len = lseek(capture, 0, SEEK_END);
+      if(len > 0 && !cache_copy(capture, 0, len, out)){
+         perror("cached: cannot write output");
+      } else if(finished && len >= 0){
+         cache_store(&key, lastStatus, capture, len);
+      }
+      close(capture);
+   }
+   if(out != STDOUT_FILENO){
+      close(out);
+   }
+   return;
+}
+
+//watch [-d ms] [-n runs] [-i path]... cmd [args] [< file]
+//runs the job, then subscribes to inotify on its < files and the -i paths
+//(directories cover everything in them) and reruns it through spawn_job()
+//once a burst of changes has been quiet for -d ms and the inputs really
+//differ, killing a run that is still going first. Ends after -n finished
+//runs, or on ctrl-c.
+void watchCmd(job_t* job, int argc, char** argv){
+#ifdef __linux__
+   process_t* p = job->first_process;
+   int debounce = WATCH_DEBOUNCE_MS;
+   int maxRuns = 0;
+   int argi = 1;
+   int nStages = 0;
+   for(process_t* q = p; q != NULL; q = q->next){
+      nStages++;
+   }
+   char** paths = (char**) malloc((argc + nStages) * sizeof(char*)); //-i paths and < files
+   int nPaths = 0;
+   if(paths == NULL){
+      fprintf(stderr, "%s\n", "malloc: no space");
+      return;
+   }
+
+   while(argi < argc - 1 && argv[argi][0] == '-'){ //options
+      if(!strcmp(argv[argi], "-d")){
+         debounce = atoi(argv[argi + 1]);
+      } else if(!strcmp(argv[argi], "-n")){
+         maxRuns = atoi(argv[argi + 1]);
+      } else if(!strcmp(argv[argi], "-i")){
+         paths[nPaths++] = argv[argi + 1];
+      } else {
+         break;
+      }
+      argi += 2;
+   }
+   if(argi >= argc || argv[argi][0] == '-' || debounce < 0 || maxRuns < 0){
+      fprintf(stderr, "usage: watch [-d ms] [-n runs] [-i path]... cmd [args] [< file]\n");
+      lastStatus = EXIT_FAILURE;
+      free(paths);
+      return;
+   }
+
+   //the job without the watch words is the template for every run
+   char** prefix = (char**) malloc(argi * sizeof(char*));
+   if(prefix == NULL){
+      fprintf(stderr, "%s\n", "malloc: no space");
+      free(paths);
+      return;
+   }
+   memcpy(prefix, p->argv, argi * sizeof(char*));
+   memmove(p->argv, p->argv + argi, (p->argc - argi + 1) * sizeof(char*));
+   p->argc -= argi;
+   for(process_t* q = p; q != NULL; q = q->next){
+      if(q->ifile != NULL){
+         paths[nPaths++] = q->ifile;
+      }
+   }
+
+   int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+   watchedInput* inputs = NULL;
+   int nInputs = 0;
+   if(ifd < 0){
+      perror("watch: inotify");
+   } else if(nPaths == 0){
+      fprintf(stderr, "%s\n", "watch: no inputs, give a < file or -i path");
+   }
+   for(int i = 0; ifd >= 0 && i < nPaths; i++){
+      addWatchedInput(ifd, paths[i], &inputs, &nInputs);
+   }
+   if(ifd < 0 || nInputs == 0){
+      lastStatus = EXIT_FAILURE;
+      if(ifd >= 0){
+         close(ifd);
+      }
+      for(int i = 0; i < argi; i++){
+         free(prefix[i]);
+      }
+      free(prefix);
+      free(paths);
+      return;
+   }
+
+   struct sigaction sa, oldSa;
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = watchInterrupt; //no SA_RESTART: poll() has to return
+   watchInterrupted = 0;
+   sigaction(SIGINT, &sa, &oldSa);
+
+   //what the inputs look like, so touching or rewriting the same bytes is
+   //not taken for a change
+   cache_key_t seen;
+   bool haveSeen = cache_make_key(job, NULL, 0, paths, nPaths, true, &seen);
+
+   int runs = 0;     //started
+   int finished = 0; //ran to the end
+   int doneFd = GENERAL_ERROR;
+   job_t* run = startWatchRun(job, &doneFd, ++runs);
+   while(!watchInterrupted && (maxRuns == 0 || finished < maxRuns)){
+      struct pollfd pfds[2] = { { ifd, POLLIN, 0 }, { doneFd, POLLIN, 0 } };
+      int timeout = (run != NULL && doneFd < 0) ? WATCH_POLL_MS : -1;
+      if(poll(pfds, 2, timeout) < 0){
+         if(errno == EINTR){
+            continue;
+         }
+         perror("watch: poll");
+         break;
+      }
+
+      if(run != NULL && watchRunDone(run, doneFd, 0)){
+         finishWatchRun(run, doneFd);
+         run = NULL;
+         doneFd = GENERAL_ERROR;
+         finished++;
+         continue;
+      }
+
+      bool dirChanged = false;
+      if(!(pfds[0].revents & POLLIN) || !readWatchEvents(ifd, inputs, nInputs, &dirChanged)){
+         continue;
+      }
+      //let the burst of a save settle
+      struct pollfd settle = { ifd, POLLIN, 0 };
+      while(!watchInterrupted && poll(&settle, 1, debounce) > 0){
+         readWatchEvents(ifd, inputs, nInputs, &dirChanged);
+      }
+
+      cache_key_t now;
+      bool haveNow = cache_make_key(job, NULL, 0, paths, nPaths, true, &now);
+      if(haveSeen && haveNow && now.hash == seen.hash && now.check == seen.check
+         && !dirChanged){
+         continue; //same bytes as before
+      }
+      seen = now;
+      haveSeen = haveNow;
+
+      if(run != NULL){ //stale now
+         printf("STOPPING [%d] (stale): %s\n", run->pgid, run->commandinfo);
+         kill(-(run->pgid), SIGTERM);
+         if(!watchRunDone(run, doneFd, WATCH_KILL_GRACE_MS)){
+            kill(-(run->pgid), SIGKILL);
+         }
+         finishWatchRun(run, doneFd);
+      }
+      run = startWatchRun(job, &doneFd, ++runs);
+   }
+
+   if(run != NULL){ //interrupted
+      kill(-(run->pgid), SIGTERM);
+      if(!watchRunDone(run, doneFd, WATCH_KILL_GRACE_MS)){
+         kill(-(run->pgid), SIGKILL);
+      }
+      finishWatchRun(run, doneFd);
+   }
+   if(watchInterrupted){
+      lastStatus = SIGNAL_STATUS_BASE + SIGINT;
+      printf("\n");
+   }
+
+   sigaction(SIGINT, &oldSa, NULL);
+   close(ifd);
+   for(int i = 0; i < nInputs; i++){
+      free(inputs[i].name);
+   }
+   free(inputs);
+   for(int i = 0; i < argi; i++){
+      free(prefix[i]);
+   }
+   free(prefix);
+   free(paths);
+#else
+   fprintf(stderr, "%s\n", "watch: needs inotify");
+   lastStatus = EXIT_FAILURE;
+#endif
+   return;
+}
+
+#ifdef __linux__
+//adds an inotify watch for path to the list of watched inputs; a file is
+//watched through its directory, so it may also not exist yet
+bool addWatchedInput(int ifd, char* path, watchedInput** inputs, int* nInputs){
+   struct stat sb;
+   char* dir;
+   char* name = NULL;
+   if(stat(path, &sb) == 0 && S_ISDIR(sb.st_mode)){
+      dir = strdup(path);
+   } else {
+      char* slash = strrchr(path, '/');
+      if(slash == NULL){
+         dir = strdup(".");
+         name = strdup(path);
+      } else {
+         dir = (slash == path) ? strdup("/") : strndup(path, slash - path);
+         name = strdup(slash + 1);
+      }
+   }
+
+   int wd = (dir != NULL) ? inotify_add_watch(ifd, dir, WATCH_EVENTS) : GENERAL_ERROR;
+   if(wd < 0){
+      perror(path);
+      free(dir);
+      free(name);
+      return false;
+   }
+   free(dir);
+
+   watchedInput* grown = (watchedInput*) realloc(*inputs, (*nInputs + 1) * sizeof(watchedInput));
+   if(grown == NULL){
+      free(name);
+      return false;
+   }
+   *inputs = grown;
+   (*inputs)[*nInputs].wd = wd;
+   (*inputs)[*nInputs].name = name;
+   (*nInputs)++;
+   return true;
+}
+
+//reads the pending inotify events; true if one was for a watched input
+//(*dirChanged is set for events in a directory that is an input itself)
+bool readWatchEvents(int ifd, watchedInput* inputs, int nInputs, bool* dirChanged){
+   char buf[WATCH_EVENT_BUF_LEN] __attribute__((aligned(__alignof__(struct inotify_event))));
+   bool relevant = false;
+   ssize_t got;
+   while((got = read(ifd, buf, sizeof(buf))) > 0){
+      for(char* at = buf; at < buf + got; ){
+         struct inotify_event* ev = (struct inotify_event*) at;
+         at += sizeof(struct inotify_event) + ev->len;
+         if(ev->mask & IN_Q_OVERFLOW){ //lost events, assume the worst
+            relevant = true;
+            *dirChanged = true;
+            continue;
+         }
+         for(int i = 0; i < nInputs; i++){
+            if(inputs[i].wd != ev->wd){
+               continue;
+            } else if(inputs[i].name == NULL){
+               relevant = true;
+               *dirChanged = true;
+            } else if(ev->len > 0 && !strcmp(inputs[i].name, ev->name)){
+               relevant = true;
+            }
+         }
+      }
+   }
+   return relevant;
+}
+#endif
+
+//spawns a copy of tmpl for a watched run; *doneFd becomes readable when its
+//last stage exits (a pidfd), or is -1 and the run has to be polled
+job_t* startWatchRun(job_t* tmpl, int* doneFd, int runs){
+   *doneFd = GENERAL_ERROR;
+   job_t* run = clone_job(tmpl);
+   if(run == NULL){
+      fprintf(stderr, "%s\n", "malloc: no space");
+      return NULL;
+   }
+   run->bg = true;      //the shell keeps the terminal to see ctrl-c
+   run->managed = true; //and reaps the run itself
+   spawn_job(run);
+   printf("WATCHING [%d] (run %d): %s\n", run->pgid, runs, run->commandinfo);
+   fflush(stdout);
+
+   process_t* last = run->first_process;
+   while(last->next != NULL){
+      last = last->next;
+   }
+#if defined(__linux__) && defined(SYS_pidfd_open)
+   *doneFd = syscall(SYS_pidfd_open, last->pid, 0);
+#endif
+   return run;
+}
+
+//true if the last stage of a watched run has exited, waiting up to timeout ms
+bool watchRunDone(job_t* run, int doneFd, int timeout){
+   process_t* last = run->first_process;
+   while(last->next != NULL){
+      last = last->next;
+   }
+   if(doneFd >= 0){
+      struct pollfd pfd = { doneFd, POLLIN, 0 };
+      return poll(&pfd, 1, timeout) > 0;
+   }
+
+   for(int waited = 0; ; waited += WATCH_POLL_MS){
+      int status;
+      if(last->completed){
+         return true;
+      } else if(waitpid(last->pid, &status, WNOHANG) == last->pid){
+         recordProcessStatus(last->pid, status);
+         last->status = status;
+         last->completed = true;
+         return true;
+      } else if(waited >= timeout){
+         return false;
+      }
+      usleep(WATCH_POLL_MS * 1000);
+   }
+}
+
+//reaps a watched run and drops it from the job list
+void finishWatchRun(job_t* run, int doneFd){
+   waitForJob(run);
+   lastStatus = jobStatus(run);
+   if(doneFd >= 0){
+      close(doneFd);
+   }
+   activeJobNode* aj = findNodeByJob(run);
+   if(aj != NULL){
+      removeActiveJobFromList(aj);
+   } else {
+      freeJob(run);
+   }
+   return;
+}
+
+//SIGINT during watch
+void watchInterrupt(int sig){
+   watchInterrupted = 1;
+}
+
+//coproc                 lists the coprocesses
+//coproc NAME cmd [args] starts cmd as coprocess NAME
+//coproc -k NAME         kills it
+//a coprocess is a managed background job with its stdin and stdout on pipes
+//held by the shell; send, recv and ask talk to it without a fork or exec
+void coprocCmd(job_t* job, int argc, char** argv){
+   if(argc == 1){ //list
+      for(int i = 0; i < nCoprocs; i++){
+         coproc* c = &coprocs[i];
+         bool alive = coprocAlive(c);
+         printf("%s [%d] %s (restarts %d): %s\n", c->name, alive ? c->job->pgid : -1,
+                alive ? "running" : "exited", c->restarts, c->tmpl->commandinfo);
+      }
+      return;
+   }
+
+   if(!strcmp(argv[1], "-k")){ //kill
+      coproc* c = (argc == 3) ? findCoproc(argv[2]) : NULL;
+      if(c == NULL){
+         fprintf(stderr, "coproc: no such coprocess\n");
+         lastStatus = EXIT_FAILURE;
+         return;
+      }
+      stopCoproc(c);
+      freeJob(c->tmpl);
+      free(c->name);
+      free(c->buf);
+      *c = coprocs[--nCoprocs];
+      return;
+   }
+
+   if(argc < 3 || argv[1][0] == '-'){
+      fprintf(stderr, "usage: coproc [NAME cmd [args] | -k NAME]\n");
+      lastStatus = EXIT_FAILURE;
+      return;
+   }
+   coproc* c = findCoproc(argv[1]);
+   if(c != NULL && coprocAlive(c)){
+      fprintf(stderr, "coproc: %s is already running\n", argv[1]);
+      lastStatus = EXIT_FAILURE;
+      return;
+   }
+
+   //the job without "coproc NAME" is what gets started
+   job_t* tmpl = clone_job(job);
+   if(tmpl == NULL){
+      fprintf(stderr, "%s\n", "malloc: no space");
+      return;
+   }
+   process_t* p = tmpl->first_process;
+   free(p->argv[0]);
+   free(p->argv[1]);
+   memmove(p->argv, p->argv + 2, (p->argc - 1) * sizeof(char*));
+   p->argc -= 2;
+   tmpl->bg = true;
+   tmpl->managed = true;
+
+   if(c == NULL){
+      coproc* grown = (coproc*) realloc(coprocs, (nCoprocs + 1) * sizeof(coproc));
+      if(grown == NULL){
+         fprintf(stderr, "%s\n", "malloc: no space");
+         freeJob(tmpl);
+         return;
+      }
+      if(coprocs == NULL){
+         coprocOwner = getpid();
+         atexit(killCoprocs);
+      }
+      coprocs = grown;
+      c = &coprocs[nCoprocs++];
+      memset(c, 0, sizeof(coproc));
+      c->name = strdup(argv[1]);
+      c->toFd = c->fromFd = NO_PIPE;
+   } else { //replacing one that exited
+      stopCoproc(c);
+      freeJob(c->tmpl);
+   }
+   c->tmpl = tmpl;
+   c->restarts = 0;
+   if(!startCoproc(c)){
+      lastStatus = EXIT_FAILURE;
+   }
+   return;
+}
+
+//send NAME [words]    writes the words as one line to NAME's stdin
+//recv NAME [lines]    prints the next line(s) NAME writes
+//ask NAME [words]     send then recv one line
+//a coprocess that died is restarted before the next send (a reply that
+//was lost with it makes recv fail)
+void coprocIoCmd(int argc, char** argv){
+   coproc* c = (argc > 1) ? findCoproc(argv[1]) : NULL;
+   if(c == NULL){
+      fprintf(stderr, "%s: no such coprocess\n", argv[0]);
+      lastStatus = EXIT_FAILURE;
+      return;
+   }
+
+   int lines = 1;
+   if(!strcmp(argv[0], "recv")){
+      lines = (argc > 2) ? atoi(argv[2]) : 1;
+   } else if(!ensureCoproc(c) || !sendToCoproc(c, argc - 2, argv + 2)){
+      lastStatus = EXIT_FAILURE;
+      return;
+   } else if(!strcmp(argv[0], "send")){
+      return;
+   }
+
+   char* line;
+   size_t len;
+   for(int i = 0; i < lines; i++){
+      if(!recvFromCoproc(c, &line, &len)){
+         fprintf(stderr, "%s: %s did not answer\n", argv[0], c->name);
+         lastStatus = EXIT_FAILURE;
+         return;
+      }
+      fwrite(line, 1, len, stdout);
+   }
+   c->restarts = 0; //it is answering
+   return;
+}
+
+//finds the coprocess called name
+coproc* findCoproc(char* name){
+   for(int i = 0; i < nCoprocs; i++){
+      if(!strcmp(coprocs[i].name, name)){
+         return &coprocs[i];
+      }
+   }
+   return NULL;
+}
+
+//starts (or restarts) the instance of c
+bool startCoproc(coproc* c){
+   int toChild[2];
+   int fromChild[2];
+   if(cloexecPipe(toChild) == GENERAL_ERROR){
+      perror("coproc: pipe");
+      return false;
+   }
+   if(cloexecPipe(fromChild) == GENERAL_ERROR){
+      perror("coproc: pipe");
+      close(toChild[0]);
+      close(toChild[1]);
+      return false;
+   }
+
+   job_t* j = clone_job(c->tmpl);
+   if(j == NULL){
+      fprintf(stderr, "%s\n", "malloc: no space");
+      close(toChild[0]); close(toChild[1]);
+      close(fromChild[0]); close(fromChild[1]);
+      return false;
+   }
+   j->mystdin = toChild[0];
+   j->mystdout = fromChild[1];
+   spawn_job(j);
+   close(toChild[0]);
+   close(fromChild[1]);
+
+   c->job = j;
+   c->toFd = toChild[1];
+   c->fromFd = fromChild[0];
+   c->len = 0;
+   c->handed = 0;
+   return true;
+}
+
+//kills and reaps the instance of c
+void stopCoproc(coproc* c){
+   if(c->toFd != NO_PIPE){
+      close(c->toFd); //EOF is the polite way to ask
+      close(c->fromFd);
+      c->toFd = c->fromFd = NO_PIPE;
+   }
+   if(c->job == NULL){
+      return;
+   }
+   if(coprocAlive(c)){
+      kill(-(c->job->pgid), SIGTERM);
+      for(int waited = 0; waited < COPROC_KILL_GRACE_MS && coprocAlive(c); waited += 10){
+         usleep(10 * 1000);
+      }
+      if(coprocAlive(c)){
+         kill(-(c->job->pgid), SIGKILL);
+      }
+   }
+   if(findNodeByJob(c->job) != NULL){
+      waitForJob(c->job);
+      removeActiveJobFromList(findNodeByJob(c->job));
+   }
+   c->job = NULL;
+   return;
+}
+
+//true if the instance of c is still running; reaps it if not
+bool coprocAlive(coproc* c){
+   if(c->job == NULL){
+      return false;
+   }
+   activeJobNode* aj = findNodeByJob(c->job);
+   if(aj == NULL){ //jobs saw it die and dropped it
+      c->job = NULL;
+      return false;
+   }
+
+   process_t* p;
+   int status;
+   for(p = c->job->first_process; p != NULL; p = p->next){
+      if(!(p->completed) && waitpid(p->pid, &status, WNOHANG) == p->pid){
+         recordProcessStatus(p->pid, status);
+         p->completed = true;
+      }
+      if(p->completed){ //one stage gone is the whole coprocess gone
+         waitForJob(c->job);
+         removeActiveJobFromList(aj);
+         c->job = NULL;
+         return false;
+      }
+   }
+   return true;
+}
+
+//restarts c if it died; false if it cannot be brought back
+bool ensureCoproc(coproc* c){
+   if(coprocAlive(c)){
+      return true;
+   }
+   stopCoproc(c); //closes the old pipes
+   if(c->restarts >= COPROC_MAX_RESTARTS){
+      fprintf(stderr, "coproc: %s keeps dying, not restarting it\n", c->name);
+      return false;
+   }
+   c->restarts++;
+   DEBUG("restarting coproc %s", c->name);
+   return startCoproc(c);
+}
+
+//writes argv as one line to c
+bool sendToCoproc(coproc* c, int argc, char** argv){
+   size_t len = 1;
+   for(int i = 0; i < argc; i++){
+      len += strlen(argv[i]) + 1;
+   }
+   char* line = (char*) malloc(len);
+   if(line == NULL){
+      fprintf(stderr, "%s\n", "malloc: no space");
+      return false;
+   }
+   size_t used = 0;
+   for(int i = 0; i < argc; i++){
+      used += sprintf(line + used, "%s%s", (i > 0) ? " " : "", argv[i]);
+   }
+   line[used++] = '\n';
+
+   //a coprocess dying under us must not take the shell with it
+   void (*oldPipe)(int) = signal(SIGPIPE, SIG_IGN);
+   bool ok = true;
+   for(size_t put = 0; ok && put < used; ){
+      ssize_t n = write(c->toFd, line + put, used - put);
+      if(n < 0 && errno == EINTR){
+         continue;
+      }
+      ok = (n > 0);
+      put += (n > 0) ? n : 0;
+   }
+   signal(SIGPIPE, oldPipe);
+   free(line);
+   if(!ok){
+      fprintf(stderr, "send: %s is gone\n", c->name);
+   }
+   return ok;
+}
+
+//reads a line (with its newline) from c into *line, valid until the next read
+bool recvFromCoproc(coproc* c, char** line, size_t* len){
+   if(c->fromFd == NO_PIPE){
+      return false;
+   }
+
+   //drop the line handed out last time
+   if(c->handed > 0){
+      memmove(c->buf, c->buf + c->handed, c->len - c->handed);
+      c->len -= c->handed;
+      c->handed = 0;
+   }
+
+   char* nl;
+   while((nl = (c->buf != NULL) ? memchr(c->buf, '\n', c->len) : NULL) == NULL){
+      if(c->len == c->cap){
+         size_t cap = c->cap ? c->cap * 2 : COPROC_BUF_LEN;
+         char* grown = (char*) realloc(c->buf, cap);
+         if(grown == NULL){
+            return false;
+         }
+         c->buf = grown;
+         c->cap = cap;
+      }
+      ssize_t got = read(c->fromFd, c->buf + c->len, c->cap - c->len);
+      if(got < 0 && errno == EINTR){
+         continue;
+      } else if(got <= 0){ //it died before answering
+         coprocAlive(c);
+         return false;
+      }
+      c->len += got;
+   }
+
+   *line = c->buf;
+   *len = c->handed = nl - c->buf + 1;
+   return true;
+}
+
+//kills every coprocess when the shell exits
+void killCoprocs(void){
+   for(int i = 0; getpid() == coprocOwner && i < nCoprocs; i++){
+      stopCoproc(&coprocs[i]);
+   }
+   return;
+}
+
+//exit status of the last job, for $?
+int last_status(void){
+   return lastStatus;
+}
+
+//true if the first word of j is word
+bool isKeyword(job_t* j, char* word){
+   process_t* p = j->first_process;
+   return p->argc > 0 && !strcmp(p->argv[0], word);
+}
+
+//true if j starts a loop (for or while, maybe after a do)
+bool loopOpens(job_t* j){
+   process_t* p = j->first_process;
+   int i = isKeyword(j, "do") ? 1 : 0;
+   return p->argc > i && (!strcmp(p->argv[i], "for") || !strcmp(p->argv[i], "while"));
+}
+
+//true if j ends a loop
+bool loopCloses(job_t* j){
+   return isKeyword(j, "done");
+}
+
+//loops opened but not done, and functions not closed, in the list of
+//jobs starting at j
+int loopDepth(job_t* j){
+   int depth = 0;
+   for(; j != NULL; j = j->next){
+      depth += loopOpens(j) - loopCloses(j) + func_opens(j) - func_closes(j);
+   }
+   return depth;
+}
+
+//for NAME in words; do body; done
+//while cmd; do body; done
+//the body is parsed once; each iteration runs a clone_job() copy of it
+//through cycleThroughEachJob(), where its words are expanded afresh
+job_t* runLoop(job_t* header){
+   //the body runs from the do up to the matching done
+   int depth = 0;
+   job_t* last = header;
+   job_t* done = NULL;
+   for(job_t* k = header; k != NULL; k = k->next){
+      depth += loopOpens(k) - loopCloses(k);
+      if(depth == 0){
+         done = k;
+         break;
+      }
+      last = k;
+   }
+   job_t* after = (done != NULL) ? done->next : NULL;
+   job_t* body = header->next;
+
+   process_t* hp = header->first_process;
+   bool isFor = !strcmp(hp->argv[0], "for");
+   bool ok = (done != NULL && body != done && isKeyword(body, "do"));
+   if(ok && isFor && (hp->argc < 3 || strcmp(hp->argv[2], "in"))){
+      ok = false;
+   }
+   if(!ok){
+      fprintf(stderr, "syntax error: %s\n",
+              isFor ? "for NAME in words; do ...; done" : "while cmd; do ...; done");
+      lastStatus = EXIT_FAILURE;
+   }
+
+   last->next = NULL; //the body is a list of its own now
+   if(ok){
+      dropWords(body, 1);
+      int status = 0;
+      loopNesting++;
+      if(isFor){
+         job_t* words = clone_job(header);
+         if(words != NULL){
+            dropWords(words, 3);
+            if(expand_job(words)){
+               process_t* wp = words->first_process;
+               for(int i = 0; i < wp->argc && loopControl != LOOP_BREAK && loopControl != LOOP_RETURN; i++){
+                  set_var(hp->argv[1], wp->argv[i]);
+                  runLoopBody(body);
+                  status = lastStatus;
+               }
+            } else {
+               status = EXIT_FAILURE;
+            }
+            closeKeptFds(words);
+            freeJob(words);
+         }
+      } else {
+         while(loopControl != LOOP_BREAK && loopControl != LOOP_RETURN){
+            job_t* cond = clone_job(header);
+            if(cond == NULL){
+               break;
+            }
+            dropWords(cond, 1);
+            cycleThroughEachJob(cond);
+            if(lastStatus != 0){
+               break;
+            }
+            runLoopBody(body);
+            status = lastStatus;
+         }
+      }
+      loopNesting--;
+      if(loopControl != LOOP_RETURN){ //a return leaves the function too
+         loopControl = LOOP_NONE;
+      }
+      lastStatus = status;
+   }
+
+   //the parsed loop is not needed any more
+   for(job_t* k = header; k != NULL; ){
+      job_t* next = k->next;
+      freeJob(k);
+      k = next;
+   }
+   if(done != NULL){
+      freeJob(done);
+   }
+   return after;
+}
+
+//runs a copy of the parsed loop body once
+void runLoopBody(job_t* body){
+   job_t* first = NULL;
+   job_t** tail = &first;
+   for(job_t* k = body; k != NULL; k = k->next){
+      if((*tail = clone_job(k)) == NULL){
+         fprintf(stderr, "%s\n", "malloc: no space");
+         break;
+      }
+      tail = &((*tail)->next);
+   }
+   cycleThroughEachJob(first);
+   if(loopControl == LOOP_CONTINUE){
+      loopControl = LOOP_NONE;
+   }
+   return;
+}
+
+//drops the first n words of the first process of j
+void dropWords(job_t* j, int n){
+   process_t* p = j->first_process;
+   if(n > p->argc){
+      n = p->argc;
+   }
+   for(int i = 0; i < n; i++){
+      free(p->argv[i]);
+   }
+   memmove(p->argv, p->argv + n, (p->argc - n + 1) * sizeof(char*));
+   p->argc -= n;
+   return;
+}
+
+//test EXPR and [ EXPR ]: 0 if true, 1 if false, 2 for a bad expression
+//supports ! EXPR, STRING, -n/-z STRING, -e/-f/-d/-r/-w/-x/-s FILE,
+//S1 = S2, S1 != S2 and N1 -eq/-ne/-lt/-le/-gt/-ge N2
+int testExpr(int argc, char** argv){
+   if(argc > 0 && !strcmp(argv[0], "!")){
+      int r = testExpr(argc - 1, argv + 1);
+      return (r == 2) ? 2 : !r;
+   }
+
+   if(argc == 0){
+      return 1;
+   } else if(argc == 1){
+      return argv[0][0] == '\0';
+   } else if(argc == 2 && argv[0][0] == '-' && argv[0][1] != '\0' && argv[0][2] == '\0'){
+      struct stat sb;
+      switch(argv[0][1]){
+         case 'n': return argv[1][0] == '\0';
+         case 'z': return argv[1][0] != '\0';
+         case 'e': return stat(argv[1], &sb) != 0;
+         case 'f': return stat(argv[1], &sb) != 0 || !S_ISREG(sb.st_mode);
+         case 'd': return stat(argv[1], &sb) != 0 || !S_ISDIR(sb.st_mode);
+         case 's': return stat(argv[1], &sb) != 0 || sb.st_size == 0;
+         case 'r': return access(argv[1], R_OK) != 0;
+         case 'w': return access(argv[1], W_OK) != 0;
+         case 'x': return access(argv[1], X_OK) != 0;
+      }
+   } else if(argc == 3){
+      char* op = argv[1];
+      if(!strcmp(op, "=") || !strcmp(op, "==")){
+         return strcmp(argv[0], argv[2]) != 0;
+      } else if(!strcmp(op, "!=")){
+         return strcmp(argv[0], argv[2]) == 0;
+      }
+
+      static char* numOps[] = { "-eq", "-ne", "-lt", "-le", "-gt", "-ge", NULL };
+      for(int i = 0; numOps[i] != NULL; i++){
+         if(strcmp(op, numOps[i])){
+            continue;
+         }
+         char* end1;
+         char* end2;
+         long long a = strtoll(argv[0], &end1, 10);
+         long long b = strtoll(argv[2], &end2, 10);
+         if(*argv[0] == '\0' || *end1 != '\0' || *argv[2] == '\0' || *end2 != '\0'){
+            fprintf(stderr, "test: integer expected\n");
+            return 2;
+         }
+         bool r[] = { a == b, a != b, a < b, a <= b, a > b, a >= b };
+         return !r[i];
+      }
+   }
+
+   fprintf(stderr, "%s\n", "test: unsupported expression");
+   return 2;
+}
+
+//after [-n name] dep[,dep...] cmd [args]
+//declares a background job that is spawned as soon as every prerequisite
+//(a pgid, or the name of an earlier after job; - for none) has finished
+//successfully, and skipped if one of them failed or was skipped
+void afterCmd(job_t* job, int argc, char** argv){
+   char* name = NULL;
+   int argi = 1;
+   if(argc > 2 && !strcmp(argv[1], "-n")){
+      name = argv[2];
+      argi = 3;
+   }
+   if(argi + 1 >= argc){
+      fprintf(stderr, "usage: after [-n name] pgid|name[,...]|- cmd [args]\n");
+      lastStatus = EXIT_FAILURE;
+      return;
+   }
+   if(name != NULL && findAfterJob(name) != NULL){
+      fprintf(stderr, "after: %s is already taken\n", name);
+      lastStatus = EXIT_FAILURE;
+      return;
+   }
+
+   //prerequisites must exist already, so the graph cannot have a cycle
+   char* list = argv[argi];
+   int ndeps = 0;
+   afterJob** deps = (afterJob**) malloc((strlen(list) / 2 + 1) * sizeof(afterJob*));
+   if(deps == NULL){
+      fprintf(stderr, "%s\n", "malloc: no space");
+      lastStatus = EXIT_FAILURE;
+      return;
+   }
+   char* save = NULL;
+   for(char* id = strtok_r(list, ",", &save); id != NULL; id = strtok_r(NULL, ",", &save)){
+      if(!strcmp(id, "-")){
+         continue;
+      }
+      afterJob* dep = findAfterJob(id);
+      if(dep == NULL){
+         fprintf(stderr, "after: no job %s\n", id);
+         free(deps);
+         lastStatus = EXIT_FAILURE;
+         return;
+      }
+      deps[ndeps++] = dep;
+   }
+
+   afterJob* a = (afterJob*) calloc(1, sizeof(afterJob));
+   if(a != NULL && name != NULL){
+      a->name = strdup(name); //before the words go
+   }
+   dropWords(job, argi + 1);
+   if(a == NULL || (a->job = clone_job(job)) == NULL){
+      fprintf(stderr, "%s\n", "malloc: no space");
+      if(a != NULL){
+         free(a->name);
+      }
+      free(a);
+      free(deps);
+      lastStatus = EXIT_FAILURE;
+      return;
+   }
+   a->job->bg = true;
+   a->deps = deps;
+   a->ndeps = ndeps;
+   a->pgid = GENERAL_ERROR;
+   a->state = AFTER_PENDING;
+   a->next = afterJobs;
+   afterJobs = a;
+   dispatchAfterJobs(); //the prerequisites may be done already
+   return;
+}
+
+//wait [-n] [pgid|name...]
+//waits for the given jobs (every background job and after job if none are
+//given) to finish, or with -n for the first of them to; the exit status is
+//that of the last job waited for, 127 for a job that does not exist
+void waitCmd(int argc, char** argv){
+   bool any = (argc > 1 && !strcmp(argv[1], "-n"));
+   int argi = any ? 2 : 1;
+
+   updateAfterJobs();
+   int ntargets = 0;
+   afterJob** targets = NULL;
+   if(argi < argc){
+      targets = (afterJob**) malloc((argc - argi) * sizeof(afterJob*));
+      for(int i = argi; targets != NULL && i < argc; i++){
+         afterJob* a = findAfterJob(argv[i]);
+         if(a == NULL){
+            fprintf(stderr, "wait: no job %s\n", argv[i]);
+            lastStatus = WAIT_UNKNOWN_STATUS;
+         } else {
+            targets[ntargets++] = a;
+         }
+      }
+   } else { //everything still running or yet to run
+      int n = 0;
+      for(activeJobNode* node = activeList; node != NULL; node = node->next){
+         n++;
+      }
+      for(afterJob* a = afterJobs; a != NULL; a = a->next){
+         n++;
+      }
+      targets = (afterJob**) malloc((n + 1) * sizeof(afterJob*));
+      char id[16];
+      for(activeJobNode* node = activeList; targets != NULL && node != NULL; node = node->next){
+         if(node->job->bg && !(node->job->managed) && !job_is_completed(node->job)){
+            snprintf(id, sizeof(id), "%d", (int) node->job->pgid);
+            afterJob* a = findAfterJob(id);
+            if(a != NULL && a->state == AFTER_RUNNING){
+               targets[ntargets++] = a;
+            }
+         }
+      }
+      for(afterJob* a = afterJobs; targets != NULL && a != NULL; a = a->next){
+         bool listed = false;
+         for(int i = 0; i < ntargets; i++){
+            listed |= (targets[i] == a);
+         }
+         if(!listed && (a->state == AFTER_PENDING || a->state == AFTER_RUNNING)){
+            targets[ntargets++] = a;
+         }
+      }
+   }
+   if(targets == NULL){
+      fprintf(stderr, "%s\n", "malloc: no space");
+      lastStatus = EXIT_FAILURE;
+      return;
+   }
+   if(ntargets == 0){
+      if(argi >= argc){
+         lastStatus = any ? WAIT_UNKNOWN_STATUS : 0;
+      }
+      free(targets);
+      return;
+   }
+
+   for(int i = 0; i < ntargets; i++){ //dispatchAfterJobs() must not forget them
+      targets[i]->waited = true;
+   }
+   while(1){
+      dispatchAfterJobs();
+      int done = 0;
+      afterJob* first = NULL;
+      for(int i = 0; i < ntargets; i++){
+         if(targets[i]->state == AFTER_DONE || targets[i]->state == AFTER_SKIPPED){
+            done++;
+            first = (first == NULL) ? targets[i] : first;
+         }
+      }
+      if(any && first != NULL){
+         lastStatus = first->status;
+         break;
+      } else if(done == ntargets){
+         lastStatus = targets[ntargets - 1]->status;
+         break;
+      }
+      sleepOnAfterJobs();
+   }
+   for(int i = 0; i < ntargets; i++){
+      targets[i]->waited = false;
+   }
+   free(targets);
+   return;
+}
+
+//finds the job of the dependency graph with this name or pgid; a running
+//background job gets an entry the first time it is asked for
+afterJob* findAfterJob(char* id){
+   char* end;
+   long pgid = strtol(id, &end, 10);
+   bool numeric = (*id != '\0' && *end == '\0');
+   for(afterJob* a = afterJobs; a != NULL; a = a->next){
+      if((a->name != NULL && !strcmp(a->name, id)) || (numeric && a->pgid == pgid)){
+         return a;
+      }
+   }
+   job_t* j = numeric ? findJobByPGID(pgid) : NULL;
+   afterJob* a = (j != NULL) ? (afterJob*) calloc(1, sizeof(afterJob)) : NULL;
+   if(a == NULL){
+      return NULL;
+   }
+   a->pgid = pgid;
+   a->state = AFTER_RUNNING;
+   a->next = afterJobs;
+   afterJobs = a;
+   updateAfterJobs(); //it may be over already
+   return a;
+}
+
+//reaps what ended of the running jobs of the dependency graph and marks the
+//jobs that are over as done
+void updateAfterJobs(void){
+   for(afterJob* a = afterJobs; a != NULL; a = a->next){
+      if(a->state != AFTER_RUNNING){
+         continue;
+      }
+      activeJobNode* node = findNodeByJob(findJobByPGID(a->pgid));
+      if(node == NULL){ //gone from the job list, afterJobGone() saw it
+         a->state = AFTER_DONE;
+         continue;
+      }
+      job_t* j = node->job;
+      for(process_t* p = j->first_process; p != NULL; p = p->next){
+         int status;
+         pid_t got = p->completed ? 0 : waitpid(p->pid, &status, WNOHANG);
+         if(got == p->pid){
+            noteStageStatus(node, p, status);
+         } else if(got < 0 && errno == ECHILD){
+            board_lock();
+            p->completed = true; //reaped by jobs, its status is recorded
+            board_unlock();
+         }
+      }
+      if(job_is_completed(j)){
+         a->state = AFTER_DONE;
+         a->status = jobStatus(j);
+         a->spawned = NULL;
+      }
+   }
+   return;
+}
+
+//spawns the pending jobs of the dependency graph whose prerequisites have
+//all succeeded and skips those with one that failed (or was skipped)
+void dispatchAfterJobs(void){
+   if(afterJobs == NULL){
+      return;
+   }
+   updateAfterJobs();
+   bool changed = true;
+   while(changed){ //a skip can make dependents skip in turn
+      changed = false;
+      for(afterJob* a = afterJobs; a != NULL; a = a->next){
+         if(a->state != AFTER_PENDING){
+            continue;
+         }
+         afterJob* failed = NULL;
+         bool ready = true;
+         for(int i = 0; i < a->ndeps; i++){
+            afterJob* d = a->deps[i];
+            if(d->state == AFTER_SKIPPED || (d->state == AFTER_DONE && d->status != 0)){
+               failed = d;
+            }
+            ready &= (d->state == AFTER_DONE);
+         }
+         if(failed != NULL){
+            printf("SKIPPED %s: a prerequisite failed\n", a->job->commandinfo);
+            a->state = AFTER_SKIPPED;
+            a->status = (failed->status != 0) ? failed->status : EXIT_FAILURE;
+            closeKeptFds(a->job);
+            freeJob(a->job);
+            a->job = NULL;
+            changed = true;
+         } else if(ready){
+            job_t* j = a->job;
+            a->job = NULL;
+            a->state = AFTER_RUNNING;
+            a->spawned = j; //spawn_job() frees it if it fails at once
+            splitOversizedArgv(j);
+            spawn_job(j);
+            if(a->spawned != NULL){ //still in the job list
+               a->pgid = a->spawned->pgid;
+            }
+            changed = true;
+         }
+      }
+   }
+   fflush(stdout);
+
+   //forget unnamed jobs that are over and nothing depends on any more
+   afterJob** link = &afterJobs;
+   while(*link != NULL){
+      afterJob* a = *link;
+      bool needed = (a->name != NULL || a->waited || a->state == AFTER_PENDING || a->state == AFTER_RUNNING);
+      for(afterJob* b = afterJobs; !needed && b != NULL; b = b->next){
+         for(int i = 0; b->state == AFTER_PENDING && i < b->ndeps; i++){
+            needed |= (b->deps[i] == a);
+         }
+      }
+      if(needed){
+         link = &a->next;
+      } else {
+         *link = a->next;
+         free(a->deps);
+         free(a);
+      }
+   }
+   return;
+}
+
+//blocks until a process of a running job of the dependency graph may have
+//ended: on their pidfds, or for a while if pidfds are not available
+void sleepOnAfterJobs(void){
+   int n = 0;
+   for(afterJob* a = afterJobs; a != NULL; a = a->next){
+      job_t* j = (a->state == AFTER_RUNNING) ? findJobByPGID(a->pgid) : NULL;
+      for(process_t* p = (j != NULL) ? j->first_process : NULL; p != NULL; p = p->next){
+         n++;
+      }
+   }
+   struct pollfd* pfds = (struct pollfd*) calloc(n + 1, sizeof(struct pollfd));
+   int npfds = 0;
+   bool polled = (pfds != NULL);
+#if defined(__linux__) && defined(SYS_pidfd_open)
+   for(afterJob* a = afterJobs; polled && a != NULL; a = a->next){
+      job_t* j = (a->state == AFTER_RUNNING) ? findJobByPGID(a->pgid) : NULL;
+      for(process_t* p = (j != NULL) ? j->first_process : NULL; p != NULL; p = p->next){
+         if(!(p->completed)){
+            int fd = syscall(SYS_pidfd_open, p->pid, 0);
+            polled &= (fd >= 0);
+            pfds[npfds].fd = fd;
+            pfds[npfds++].events = POLLIN;
+         }
+      }
+   }
+#else
+   polled = false;
+#endif
+   if(polled && npfds > 0){
+      poll(pfds, npfds, -1); //an interrupted poll just means look again
+   } else {
+      usleep(WAIT_POLL_MS * 1000);
+   }
+   for(int i = 0; i < npfds; i++){
+      if(pfds[i].fd >= 0){
+         close(pfds[i].fd);
+      }
+   }
+   free(pfds);
+   return;
+}
+
+//records the exit status of a job of the dependency graph that leaves the
+//job list (jobs prints and drops finished jobs)
+void afterJobGone(job_t* j){
+   for(afterJob* a = afterJobs; a != NULL; a = a->next){
+      if(a->state == AFTER_RUNNING && (a->spawned == j || a->pgid == j->pgid)){
+         a->pgid = j->pgid;
+         a->state = AFTER_DONE;
+         a->status = jobStatus(j);
+         a->spawned = NULL;
+      }
+   }
+   return;
+}
+
+//at the end of input: the jobs still waiting on prerequisites would never
+//run, so the shell stays until they have been spawned (or skipped)
+void drainAfterJobs(void){
+   while(1){
+      dispatchAfterJobs();
+      bool pending = false;
+      for(afterJob* a = afterJobs; a != NULL; a = a->next){
+         pending |= (a->state == AFTER_PENDING);
+      }
+      if(!pending){
+         return;
+      }
+      sleepOnAfterJobs();
+   }
+}
+
+//mux builtin: mux [on [-p] [-t] | off]
+//with mux on, the stdout and stderr of jobs that run alongside others go
+//through the output multiplexer, which writes them in whole lines, with
+//-p the job's [pgid] and with -t the time before each line
+void muxCmd(int argc, char** argv){
+   if(argc == 1){
+      mux_print();
+      return;
+   }
+   bool on = !strcmp(argv[1], "on");
+   bool tag = false;
+   bool stamp = false;
+   bool usage = !on && strcmp(argv[1], "off");
+   for(int i = 2; i < argc && !usage; i++){
+      if(on && !strcmp(argv[i], "-p")){
+         tag = true;
+      } else if(on && !strcmp(argv[i], "-t")){
+         stamp = true;
+      } else {
+         usage = true;
+      }
+   }
+   if(usage){
+      fprintf(stderr, "usage: mux [on [-p] [-t] | off]\n");
+      lastStatus = EXIT_FAILURE;
+      return;
+   }
+   mux_set(on, tag, stamp);
+   lastStatus = (mux_enabled() == on) ? EXIT_SUCCESS : EXIT_FAILURE;
+   return;
+}
+
+//with mux on, stage p of a job that runs alongside others (in the
+//background, or as one of parallel argv batches) writes its stdout (its
+//stderr for err) into a pipe of the multiplexer rather than to where it
+//goes; sets p->muxout (p->muxerr) to the child's end of the pipe and
+//returns ours, with *to where the lines go: the shell's stdout or stderr,
+//or a > or 2> file opened here. NO_PIPE if the stage writes for itself.
+int muxStage(job_t* j, process_t* p, bool err, int* to){
+   if(!mux_enabled() || !(j->bg || j->batchjobs > 1)){
+      return NO_PIPE;
+   }
+   int shared = err ? j->mystderr : j->mystdout;
+   if(!err && p->next != NULL && j->batchjobs == 0){
+      return NO_PIPE; //into the next stage
+   } else if(err && p->errtoout){
+      return NO_PIPE; //wherever stdout goes
+   } else if(!err && p->ofile != NULL){
+      *to = openRedirection(p->ofile, true, p->oappend, false);
+   } else if(err && p->efile != NULL){
+      *to = openRedirection(p->efile, true, p->eappend, false);
+   } else if(err ? (shared == STDERR_FILENO) : (shared == STDOUT_FILENO || shared == OUTPUT_FD)){
+      *to = err ? STDERR_FILENO : STDOUT_FILENO;
+   } else if(j->batchjobs > 0){
+      *to = dup(shared); //the > or 2> file the shell opened for the batches
+   } else {
+      return NO_PIPE; //a channel of the shell, e.g. a $(...) capture pipe
+   }
+
+   int fds[2];
+   if(*to < 0 || cloexecPipe(fds) == GENERAL_ERROR){
+      if(*to > STDERR_FILENO){
+         close(*to);
+      }
+      return NO_PIPE; //the child opens the file itself and reports why not
+   }
+   if(err){
+      p->muxerr = fds[1];
+   } else {
+      p->muxout = fds[1];
+   }
+   return fds[0];
+}
+
+//timeout DURATION cmd [args]
+//runs cmd with a deadline: when it is over the job's process group gets
+//SIGTERM, then SIGKILL after $DSH_TIMEOUT_GRACE (TIMEOUT_GRACE_MS if unset)
+bool takeTimeout(job_t* j){
+   process_t* p = j->first_process;
+   if(strcmp(p->argv[0], TIMEOUT_PREFIX)){
+      return true;
+   }
+   int64_t ns = (p->argc > 2) ? timeout_parse(p->argv[1]) : GENERAL_ERROR;
+   if(ns <= 0){
+      fprintf(stderr, "usage: timeout DURATION cmd [args]\n");
+      return false;
+   }
+   dropWords(j, 2);
+   j->timeout_ns = ns;
+   return true;
+}
+
+//how long j may run: its timeout prefix, or $DSH_TIMEOUT for the jobs the
+//user started (builtins' jobs, e.g. coprocesses, keep running); 0 for no limit
+int64_t jobDeadline(job_t* j){
+   if(j->timeout_ns > 0){
+      return j->timeout_ns;
+   }
+   const char* session = get_var("DSH_TIMEOUT");
+   if(j->managed || session == NULL || *session == '\0'){
+      return 0;
+   }
+   int64_t ns = timeout_parse(session);
+   return (ns > 0) ? ns : 0;
+}
+
+//time an overrun job has between SIGTERM and SIGKILL
+int64_t graceNs(void){
+   const char* grace = get_var("DSH_TIMEOUT_GRACE");
+   int64_t ns = (grace != NULL) ? timeout_parse(grace) : GENERAL_ERROR;
+   return (ns >= 0) ? ns : TIMEOUT_GRACE_MS * 1000000LL;
+}
+
+//cd [dir]            changes to dir ($HOME if none)
+//cd words...         or, when dir is not a directory or there are several
+//                    words, to the visited directory matching them with
+//                    the best frecency (see dirs.c)
+//cd -l [words...]    lists the visited directories matching the words
+//prints the old and the new path as before
+void cdCmd(int argc, char** argv){
+   if(argc > 1 && !strcmp(argv[1], "-l")){
+      dirs_list(argc - 2, argv + 2);
+      return;
+   }
+
+   char* oldPath = getCurrentPath();
+   const char* dir = (argc > 1) ? argv[1] : getenv("HOME");
+   char* jump = NULL;
+   if(argc > 2 || dir == NULL || chdir(dir) < 0){ //returns -1 if error
+      int err = (argc > 2 || dir == NULL) ? ENOENT : errno;
+      jump = dirs_match(argc - 1, argv + 1, oldPath);
+      if(jump == NULL || chdir(jump) < 0){
+         errno = err;
+         perror("Problem changing directory");
+         lastStatus = EXIT_FAILURE;
+         free(jump);
+         free(oldPath);
+         return;
+      }
+   }
+
+   //a jump lands on a path getcwd() gave before, no need to ask again
+   cwd_changed();
+   cwdCache = jump;
+   char* newPath = getCurrentPath();
+   dirs_visit(newPath);
+   printf("%s\n%s\n", oldPath, newPath);
+   free(oldPath);
+   free(newPath);
+   return;
+}
+
+//runs the rc file, from its snapshot when that is up to date: its
+//aliases and functions are taken as they are and its other command lines
+//run without being read or parsed again
+void loadRc(void){
+   const char* path = rc_path();
+   if(path == NULL){
+      return;
+   }
+   if(rc_load_snapshot(path)){
+      job_t* j;
+      while((j = rc_snapshot_next()) != NULL){
+         cycleThroughEachJob(j);
+         glob_cache_reset();
+      }
+      return;
+   }
+
+   FILE* in = fopen(path, "r");
+   if(in == NULL){
+      if(errno != ENOENT){
+         perror(path);
+      }
+      return;
+   }
+   fcntl(fileno(in), F_SETFD, FD_CLOEXEC); //not for the jobs it starts
+   bool recording = rc_record_start(path, in);
+   run_commands(in);
+   if(recording){
+      rc_record_end();
+   }
+   fclose(in);
+   return;
+}
+
+//name() { body }: packs the body up to the matching } into the function
+//name and frees the parsed jobs; returns the job after the }
+job_t* defineFunction(job_t* header){
+   job_t* close = func_end(header);
+   job_t* after = (close != NULL) ? close->next : NULL;
+   if(close == NULL){
+      fprintf(stderr, "%s\n", "syntax error: name() { ...; }");
+      lastStatus = EXIT_FAILURE;
+   } else {
+      lastStatus = func_define(header, close) ? 0 : EXIT_FAILURE;
+      close->next = NULL; //the rest is not ours to free
+   }
+   for(job_t* k = header; k != NULL; ){
+      job_t* next = k->next;
+      freeJob(k);
+      k = next;
+   }
+   return after;
+}
+
+//true if j calls a function the shell can run itself: a lone command in
+//the foreground (in a pipeline or in the background it fails to exec)
+bool isFunctionCall(job_t* j){
+   process_t* p = j->first_process;
+   return p->next == NULL && !(j->bg) && p->argc > 0 && func_exists(p->argv[0]);
+}
+
+//runs a fresh copy of the body of the function j calls through
+//cycleThroughEachJob(), with the words of j as $0, $1..., $# and $@;
+//its redirections hold for everything the function runs
+void callFunction(job_t* j){
+   process_t* p = j->first_process;
+   if(!func_push_args(p->argc, p->argv)){
+      fprintf(stderr, "%s: functions nested too deep\n", p->argv[0]);
+      lastStatus = EXIT_FAILURE;
+      return;
+   }
+
+   //the shell's own stdio goes where the call sends it, for the while
+   fflush(stdout);
+   char* files[3] = {p->ifile, p->ofile, p->efile};
+   bool append[3] = {false, p->oappend, p->eappend};
+   int saved[3] = {NO_PIPE, NO_PIPE, NO_PIPE};
+   bool ok = true;
+   for(int fd = STDIN_FILENO; fd <= STDERR_FILENO && ok; fd++){
+      if(files[fd] != NULL || (fd == STDERR_FILENO && p->errtoout)){
+         saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 3);
+         ok = (files[fd] == NULL
+               || changeStreamToFile(files[fd], fd, fd != STDIN_FILENO, append[fd], false) != GENERAL_ERROR);
+      } else if(fd == STDIN_FILENO && p->herefd >= 0){
+         saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 3);
+         ok = (dup2(p->herefd, fd) != GENERAL_ERROR);
+      }
+   }
+   if(ok && p->errtoout){
+      dup2(STDOUT_FILENO, STDERR_FILENO);
+   }
+
+   if(ok){
+      int loops = loopNesting;
+      loopNesting = 0; //break and continue do not reach the caller's loops
+      funcNesting++;
+      cycleThroughEachJob(func_body(p->argv[0]));
+      funcNesting--;
+      loopNesting = loops;
+      if(loopControl == LOOP_RETURN){
+         loopControl = LOOP_NONE;
+      }
+   } else {
+      lastStatus = EXIT_FAILURE;
+   }
+
+   fflush(stdout);
+   for(int fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++){
+      if(saved[fd] != NO_PIPE){
+         dup2(saved[fd], fd);
+         close(saved[fd]);
+      }
+   }
+   func_pop_args();
+   return;
+}
+
+//return [N]: leaves the function being run with status N, else with that
+//of the last command it ran
+void returnCmd(int argc, char** argv){
+   if(funcNesting == 0){
+      fprintf(stderr, "%s\n", "return: not in a function");
+      lastStatus = EXIT_FAILURE;
+      return;
+   }
+   if(argc > 1){
+      lastStatus = atoi(argv[1]) & 0xff;
+   }
+   loopControl = LOOP_RETURN;
+   return;
+}
+
+//alias lists the aliases, alias name... shows some, alias name=words makes
+//name stand for the words (the first is the rest of the = word);
+//unalias name... forgets them
+void aliasCmd(int argc, char** argv){
+   if(!strcmp(argv[0], "unalias")){
+      for(int i = 1; i < argc; i++){
+         if(!alias_unset(argv[i])){
+            fprintf(stderr, "unalias: %s: not an alias\n", argv[i]);
+            lastStatus = EXIT_FAILURE;
+         }
+      }
+      return;
+   }
+
+   char* eq = (argc > 1) ? strchr(argv[1], '=') : NULL;
+   if(eq == NULL){
+      for(int i = 1; i < argc; i++){
+         if(!alias_print(argv[i])){
+            fprintf(stderr, "alias: %s: not an alias\n", argv[i]);
+            lastStatus = EXIT_FAILURE;
+         }
+      }
+      if(argc == 1){
+         alias_print(NULL);
+      }
+      return;
+   } else if(eq == argv[1]){
+      fprintf(stderr, "%s\n", "usage: alias [name[=words...]]");
+      lastStatus = EXIT_FAILURE;
+      return;
+   }
+
+   size_t len = strlen(eq + 1) + 1;
+   for(int i = 2; i < argc; i++){
+      len += strlen(argv[i]) + 1;
+   }
+   char* value = (char*) malloc(len);
+   if(value == NULL){
+      fprintf(stderr, "%s\n", "malloc: no space");
+      lastStatus = EXIT_FAILURE;
+      return;
+   }
+   strcpy(value, eq + 1);
+   for(int i = 2; i < argc; i++){
+      strcat(value, " ");
+      strcat(value, argv[i]);
+   }
+   *eq = '\0';
+   if(!alias_set(argv[1], value)){
+      fprintf(stderr, "%s\n", "malloc: no space");
+      lastStatus = EXIT_FAILURE;
+   }
+   *eq = '=';
+   free(value);
+   return;
+}
+
+//export without names lists the environment; unset name... forgets them
+void exportCmd(int argc, char** argv){
+   if(!strcmp(argv[0], "unset")){
+      for(int i = 1; i < argc; i++){
+         unset_var(argv[i]);
+      }
+      return;
+   }
+   if(argc == 1){
+      env_print();
+      return;
+   }
+   for(int i = 1; i < argc; i++){ //what is_export_job() did not take
+      fprintf(stderr, "export: %s: not a valid name\n", argv[i]);
+   }
+   lastStatus = EXIT_FAILURE;
+}
+
+//where a tee stage at the end of j writes, as new_child() would set up its
+//stdout (a descriptor of its own), -1 if it cannot be opened
+int teeOutput(job_t* j, process_t* p){
+   int out;
+   if(p->ofile != NULL){
+      out = openRedirection(p->ofile, true, p->oappend, false);
+   } else if(j->mystdout != STDOUT_FILENO && j->mystdout != OUTPUT_FD){
+      out = fcntl(j->mystdout, F_DUPFD_CLOEXEC, 3);
+   } else if(j->bg && !(j->managed)){
+      out = open(DEV_NULL_PATH, O_WRONLY | O_CLOEXEC);
+   } else {
+      out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+   }
+   if(out < 0){
+      perror((p->ofile != NULL) ? p->ofile : "tee");
+   }
+   return out;
+}
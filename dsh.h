@@ -1,6 +1,10 @@
 #ifndef __DSH_H__         /* check if this header file is already defined elsewhere */
 #define __DSH_H__
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* pipe2(), memfd_create(), splice() */
+#endif
+
 #include <stdio.h>
 #include <sys/types.h>  /* pid_t */
 #include <unistd.h>     /* getpid()*/
@@ -11,6 +15,7 @@
 #include <string.h>     /* strncpy */
 #include <sys/stat.h>   /* file modes */
 #include <fcntl.h>      /* file open */
+#include <stdint.h>     /* uint64_t */
 
 /* Max length of input/output file name specified during I/O redirection */
 #define MAX_LEN_FILENAME 80
@@ -18,16 +23,17 @@
 /*Max length of the command line */
 #define MAX_LEN_CMDLINE	120
 
-#define MAX_ARGS 20 /* Maximum number of arguments to any command */
+#define MAX_ARGS 20 /* Initial argv capacity of a command; argv grows past it as needed */
 
 /*file descriptors for input and output; the range of fds are from 0 to 1023;
  * 0, 1, 2 are reserved for stdin, stdout, stderr */
 #define INPUT_FD  1000
 #define OUTPUT_FD 1001
 
-#define MAX_HISTORY 20 /* flush the completed jobs after reaching the MAX_HISTORY */
+/* mode of the files redirections create, less the umask */
+#define NEW_FILE_PERMISSIONS (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH)
 
-#define MAX_ARGS 20 /* Maximum number of arguments to any command */
+#define MAX_HISTORY 20 /* flush the completed jobs after reaching the MAX_HISTORY */
 
 #define PRINT_INFO 1 /* FLAG for print_job() and other debug info */
 
@@ -46,6 +52,20 @@ typedef struct process {
         int status;                 /* reported status value from job control; 0 on success and nonzero otherwise */
         char *ifile;                /* stores input file name when < is issued */
         char *ofile;                /* stores output file name when > is issued */
+        char *efile;                /* stores error file name when 2> is issued */
+        bool oappend;               /* true for >> (ofile is appended to) */
+        bool eappend;               /* true for 2>> */
+        bool errtoout;              /* true for 2>&1 and &>: stderr goes where stdout goes */
+        int *keepfds;               /* fds of <(...) and >(...) that stay open across exec */
+        int nkeepfds;
+        int muxout, muxerr;         /* child's ends of the output multiplexer's pipes, -1 if none */
+        char **env;                 /* NAME=value assignments before the command (FOO=1 cmd) */
+        int nenv;
+        char *heredoc;              /* body of <<WORD or <<< word, the command's stdin */
+        char *heredelim;            /* WORD of a << whose body is still to be read */
+        bool hereexpand;            /* $ in the body is expanded (WORD was not quoted) */
+        int herefd;                 /* sealed memfd holding the expanded body, -1 if none */
+        uint64_t cpu_ns;            /* CPU time last sampled for the job board */
 } process_t;
 
 /* A job is a process itself or a pipeline of processes.
@@ -60,6 +80,12 @@ typedef struct job {
         bool notified;              /* true if user was informed about stopped job */
         int mystdin, mystdout, mystderr;  /* standard i/o channels */
         bool bg;                    /* true when & is issued on the command line */
+        bool managed;               /* true when a builtin (e.g. forall) spawned the job and reaps it itself;
+                                     * such jobs never take the terminal and keep the shell's stdout */
+        int batchjobs;              /* >0 when the processes are argv batches of one command rather
+                                     * than a pipeline; at most this many run at once */
+        int64_t start_ns;           /* CLOCK_REALTIME when spawned, for the job board */
+        int64_t timeout_ns;         /* deadline of a timeout prefix, 0 for $DSH_TIMEOUT */
 } job_t;
 
 /* Finds a job for which the pgid is still -1 (indicates not processed);
@@ -75,6 +101,9 @@ bool job_is_completed(job_t *j);
 /* Find the last job.  */
 job_t *find_last_job();
 
+/* Frees j and its processes (not the jobs after it) */
+bool free_job(job_t *j);
+
 /* delete a given job j; We will simply loop from first_job since we do not
  * store prev pointer */
 void delete_job(job_t *j, job_t *first_job);
@@ -85,6 +114,10 @@ bool init_job(job_t *j);
 /* Initialize the members of process structure */
 bool init_process(process_t *p);
 
+/* Deep copy of the pipeline of j for spawning it again (watch, loops); the
+ * copy has not run yet, keeps no fds and is not linked to other jobs */
+job_t *clone_job(job_t *j);
+
 /* Prints the jobs in the list.  */
 void print_job();
 
@@ -109,6 +142,242 @@ int endswith(const char* haystack, const char* needle);
 
 job_t* readcmdline(char *msg);
 
+/* Makes readcmdline() read from in (stdin by default); returns the previous
+ * source so callers can nest sources */
+FILE* set_cmd_source(FILE *in);
+
+/* The stream readcmdline() currently reads from */
+FILE* get_cmd_source(void);
+
+/* Same as readcmdline() but parses a command line held in a string */
+job_t* parse_cmdline(char *cmdline);
+
+/* Expands the variables, $((...)) arithmetic, $(...), <(...) and >(...)
+ * substitutions and the glob patterns (*, ?, [...] and ** for any depth of
+ * directories) in the argv of every process of j right before it runs.
+ * Returns false if an expansion failed. */
+bool expand_job(job_t *j);
+
+/* Shell variables ($name and ${name} in expand_job()); get_var() falls back
+ * to the environment and returns NULL for unset names. set_var() passes
+ * the new value on to the environment if name is exported there;
+ * unset_var() forgets name in both. */
+const char *get_var(const char *name);
+bool set_var(const char *name, const char *value);
+void unset_var(const char *name);
+
+/* true if j is nothing but NAME=value words; assign_job() performs them with
+ * the values expanded ($((...)) arithmetic included) but not split */
+bool is_assignment_job(job_t *j);
+bool assign_job(job_t *j);
+
+/* true if j is export with NAME or NAME=value words (export alone is a
+ * builtin that lists the environment); export_job() sets and exports them,
+ * with the values expanded as for assign_job() */
+bool is_export_job(job_t *j);
+bool export_job(job_t *j);
+
+/* Exit status of the last job, for $? (implemented in dsh.c) */
+int last_status(void);
+
+/* Drops the directory listings cached by glob expansion; called once per
+ * command line so repeated patterns on one line list a directory once */
+void glob_cache_reset(void);
+
+/* The shell's cwd (implemented in dsh.c), cached between cd's so it is not
+ * fetched with getcwd() each time; "" if it cannot be had. cwd_changed()
+ * drops it after a chdir() made somewhere else. */
+const char *shell_cwd(void);
+void cwd_changed(void);
+
+/* Runs cmdline with its stdout captured (implemented in dsh.c) and returns
+ * the output in a malloc'd buffer of *len bytes, or NULL on failure. */
+char* capture_output(char *cmdline, size_t *len);
+
+/* Starts cmdline (a single pipeline) concurrently for <(...) (to_cmd false:
+ * we read its stdout) or >(...) (to_cmd true: we feed its stdin). Returns the
+ * shell's end of the pipe, or -1 on failure (implemented in dsh.c). */
+int open_proc_subst(char *cmdline, bool to_cmd);
+
+/* Reads, parses and runs command lines from in until it runs out; returns
+ * the exit status of the last foreground job (implemented in dsh.c) */
+int run_commands(FILE *in);
+
+/* Daemon mode: serves command lines and scripts submitted over the Unix
+ * domain socket at path (see serve.h); only returns on failure */
+int serve_commands(const char *path);
+
+/* Key of a job in the result cache (cache.c): hash names the entry, check
+ * is a second hash of the same inputs that must match when it is read */
+typedef struct cache_key {
+        uint64_t hash;
+        uint64_t check;
+} cache_key_t;
+
+/* Hashes what j reads into key: cwd, PATH and the nvars declared environment
+ * variables, every executable and argv word, the metadata of < files and of
+ * operands naming files, and the ninputs declared input files; file contents
+ * are hashed instead of metadata when by_content is set. Returns false if j
+ * cannot be cached (e.g. it reads a <(...) or a command is not found). */
+bool cache_make_key(job_t *j, char **vars, int nvars, char **inputs, int ninputs,
+                    bool by_content, cache_key_t *key);
+
+/* On a hit writes the stored stdout of key to out, sets *status to the
+ * stored exit status and returns true */
+bool cache_replay(const cache_key_t *key, int out, int *status);
+
+/* Stores len bytes of output (read from offset 0 of fd) and status under
+ * key, evicting the least recently used entries when the store is full */
+void cache_store(const cache_key_t *key, int status, int fd, size_t len);
+
+/* Copies len bytes of from (starting at offset) to to, in the kernel when
+ * possible; returns false on a short copy */
+bool cache_copy(int from, off_t offset, size_t len, int to);
+
+/* Finds the executable execvp() would run for name (into path) */
+bool resolve_command(const char *name, char *path, size_t len);
+
+/* Allowlist of commands that always go through the cache (cacheable builtin) */
+bool cache_allowed(const char *name);
+void cache_allow(const char *name);
+void cache_print_allowed(void);
+
+/* Prints the cache counters for the stats builtin */
+void cache_print_stats(void);
+
+/* Built-in wc and fixed-string grep (text.c): text_builtin() tells whether
+ * argv is one the shell can run itself with the tool's exact output;
+ * text_run() then runs it with in as its stdin and out as its stdout and
+ * returns the exit status the tool would have had */
+bool text_builtin(int argc, char **argv);
+int text_run(int argc, char **argv, int in, int out);
+
+/* Workload traces (trace.c): trace_record_start() starts writing the command
+ * lines read from source to path with their arrival times, cwds, run times
+ * and exit statuses. readcmdline() hands each line read to
+ * trace_record_line(), run_commands() calls trace_record_end() once the
+ * command line has run. trace_replay() runs a trace through run_commands(),
+ * at the recorded pace if paced is set, and reports the latency of each
+ * command line against the recording on stderr. */
+bool trace_record_start(const char *path, FILE *source);
+void trace_record_line(const char *line);
+void trace_record_end(FILE *in, int status);
+int trace_replay(const char *path, bool paced);
+
+/* Output multiplexer (mux.c): while mux_enabled(), spawn_job() gives the
+ * stages of jobs running alongside others pipes for their stdout and stderr
+ * and hands the read ends to mux_add() with where the output goes; a thread
+ * writes it out in whole lines, tagged with the pgid and time if set with
+ * mux_set(). mux_settle() waits for the last lines of a finished job. */
+bool mux_enabled(void);
+void mux_set(bool on, bool tag, bool stamp);
+void mux_print(void);
+bool mux_add(int from, int to, pid_t pgid);
+void mux_settle(pid_t pgid);
+void mux_print_stats(void);
+
+/* Job deadlines (timeout.c): timeout_arm() starts a timerfd for the job of
+ * pgid; if it expires a thread sends the group SIGTERM, sets *fired, and
+ * sends SIGKILL grace_ns later. timeout_cancel() drops the deadline of a
+ * job that is done. timeout_parse() reads a duration (10, 1.5s, 500ms, 2m,
+ * 1h) into ns, -1 if it is not one. */
+bool timeout_arm(pid_t pgid, int64_t ns, int64_t grace_ns, bool *fired);
+void timeout_cancel(pid_t pgid);
+int64_t timeout_parse(const char *s);
+void timeout_print_stats(void);
+
+/* Directory index for cd (dirs.c): dirs_visit() records a visit of dir (an
+ * absolute path) in a frecency database kept in an mmap'd file.
+ * dirs_match() returns (malloc'd) the existing directory other than skip
+ * whose path holds the words in order, the last in its last component,
+ * with the best frecency; NULL if there is none. dirs_list() prints the
+ * directories matching the words, best first. */
+void dirs_visit(const char *dir);
+char *dirs_match(int nwords, char **words, const char *skip);
+void dirs_list(int nwords, char **words);
+
+/* Executable prefetching (prefetch.c): prefetch_script() looks up the
+ * commands of the script read from in (if it is a regular file) and has a
+ * thread read ahead their executables and the libraries they need.
+ * spawn_job() calls prefetch_note_exec() for each command it runs, to count
+ * the ones that were prefetched in time. */
+void prefetch_script(FILE *in);
+void prefetch_note_exec(const char *name);
+void prefetch_print_stats(void);
+
+/* Aliases, functions and the rc file (rc.c): readprocessinfo() replaces the
+ * first word of a command that is an alias with alias_get()'s words. A
+ * function is name() { ... } over one or more lines: func_opens() and
+ * func_closes() tell its first and last jobs, func_end() finds the } of a
+ * header and func_define() packs the jobs in between as its body;
+ * func_body() unpacks a fresh copy to run, while func_push_args() makes
+ * the words of the call the $0..$9, $# and $@ that func_arg() returns.
+ * rc_path() is the rc file of the shell, if any; rc_load_snapshot() maps
+ * its snapshot if it is still good and rc_snapshot_next() then hands out
+ * its command lines other than aliases and functions, parsed. Otherwise
+ * the rc is run between rc_record_start() and rc_record_end(), with
+ * run_commands() passing each command line to rc_record() before it runs,
+ * and a new snapshot is written. */
+const char *alias_get(const char *name);
+bool alias_set(const char *name, const char *value);
+bool alias_unset(const char *name);
+bool alias_print(const char *name);
+bool func_opens(job_t *j);
+bool func_closes(job_t *j);
+job_t *func_end(job_t *header);
+bool func_define(job_t *header, job_t *close);
+bool func_exists(const char *name);
+job_t *func_body(const char *name);
+bool func_push_args(int argc, char **argv);
+void func_pop_args(void);
+const char *func_arg(char which);
+const char *rc_path(void);
+bool rc_load_snapshot(const char *path);
+job_t *rc_snapshot_next(void);
+bool rc_record_start(const char *path, FILE *source);
+void rc_record(FILE *in, job_t *j);
+void rc_record_end(void);
+
+/* Environment of the commands (env.c): env_export() and env_unset() change
+ * the shell's environment and bump its version; env_block() is the envp
+ * packed from it, rebuilt only after a change and shared by every spawn
+ * until then. new_child() calls env_exec() to install it, with the
+ * assignments of the process (FOO=1 cmd, see expand_job()) on top. */
+bool env_export(const char *name, const char *value);
+void env_unset(const char *name);
+bool env_exported(const char *name);
+char **env_block(size_t *bytes);
+void env_exec(process_t *p);
+void env_print(void);
+void env_print_stats(void);
+
+/* Built-in tee (tee.c): spawn_job() does not exec a stage after the first
+ * that tee_stage() takes, but has tee_start() copy the pipe before it to
+ * its output and files in a thread, with tee(2) and splice(2). tee_wait()
+ * waits for the copies of a finished foreground job. */
+bool tee_stage(int argc, char **argv);
+bool tee_start(int in, int out, int argc, char **argv, pid_t pgid);
+void tee_wait(pid_t pgid);
+void tee_print_stats(void);
+
+/* Job status board (board.c): publishes the job table into shared memory for
+ * external monitors, see dshboard.h. board_start() creates the segment and
+ * the thread that refreshes it. The job table is only changed between
+ * board_lock() and board_unlock(), which republishes the board;
+ * board_changed() does the same after a job changed state. */
+void board_start(void);
+void board_lock(void);
+void board_unlock(void);
+void board_changed(void);
+
+/* Fills up to max board entries from the job table (implemented in dsh.c,
+ * called with the board locked); returns the number of jobs in the table */
+struct dsh_board_job;
+int board_collect(struct dsh_board_job *jobs, int max);
+
+/* User + system CPU time used so far by process pid, 0 if it is gone */
+uint64_t board_cpu_ns(pid_t pid);
+
 #ifdef NDEBUG
         #define DEBUG(M, ...)
 #else
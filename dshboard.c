@@ -0,0 +1,176 @@
+/*
+ * dshboard.c
+ * Reader for the job status boards of running shells (see dshboard.h):
+ * prints the jobs of every dsh, or of the given pids, without disturbing
+ * the shells.
+ *
+ * usage: dshboard [-w ms] [-c] [pid...]
+ *   -w  redraw every ms milliseconds until interrupted
+ *   -c  remove the boards of shells that are gone (e.g. were killed)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dshboard.h"
+
+//where POSIX shared memory objects show up on Linux
+#define SHM_DIR "/dev/shm"
+
+//prefix of a board in SHM_DIR (DSH_BOARD_NAME_FMT without the '/' and pid)
+#define BOARD_PREFIX "dsh-board."
+
+//snapshot attempts before a board is reported as busy
+#define SNAPSHOT_TRIES 1000
+
+#define NSEC_PER_SEC 1000000000LL
+
+//prints the board of the shell with this pid; returns 0 if there is none
+static int showBoard(int pid, int clean);
+
+//state of a job as printed
+static const char* stateName(uint32_t state);
+
+//now on CLOCK_REALTIME in ns
+static int64_t nowNs(void);
+
+int main(int argc, char* argv[]){
+   int waitMs = 0;
+   int clean = 0;
+   int opt;
+
+   while((opt = getopt(argc, argv, "w:c")) != -1){
+      switch(opt){
+         case 'w': waitMs = atoi(optarg); break;
+         case 'c': clean = 1; break;
+         default:
+            fprintf(stderr, "usage: %s [-w ms] [-c] [pid...]\n", argv[0]);
+            exit(EXIT_FAILURE);
+      }
+   }
+
+   while(1){
+      if(waitMs > 0){
+         printf("\033[H\033[J"); //home and clear
+      }
+
+      int shown = 0;
+      if(optind < argc){
+         for(int i = optind; i < argc; i++){
+            if(!showBoard(atoi(argv[i]), clean)){
+               printf("dsh %s: no job board\n", argv[i]);
+            }
+            shown++;
+         }
+      } else {
+         DIR* dir = opendir(SHM_DIR);
+         struct dirent* ent;
+         while(dir != NULL && (ent = readdir(dir)) != NULL){
+            if(!strncmp(ent->d_name, BOARD_PREFIX, strlen(BOARD_PREFIX))){
+               shown += showBoard(atoi(ent->d_name + strlen(BOARD_PREFIX)), clean);
+            }
+         }
+         if(dir != NULL){
+            closedir(dir);
+         }
+      }
+      if(shown == 0){
+         printf("no shells are publishing a job board\n");
+      }
+
+      fflush(stdout);
+      if(waitMs <= 0){
+         break;
+      }
+      usleep(waitMs * 1000);
+   }
+   exit(EXIT_SUCCESS);
+}
+
+//prints the board of the shell with this pid; returns 0 if there is none
+static int showBoard(int pid, int clean){
+   char name[32];
+   snprintf(name, sizeof(name), DSH_BOARD_NAME_FMT, pid);
+
+   //a shell killed by a signal leaves its board behind
+   if(pid <= 0 || (kill(pid, 0) < 0 && errno == ESRCH)){
+      if(clean && shm_unlink(name) == 0){
+         printf("dsh %d: gone, removed its job board\n", pid);
+         return 1;
+      }
+      return 0;
+   }
+
+   int fd = shm_open(name, O_RDONLY, 0);
+   if(fd < 0){
+      return 0;
+   }
+   struct stat st;
+   void* mem = MAP_FAILED;
+   if(fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(dsh_board_t)){
+      mem = mmap(NULL, sizeof(dsh_board_t), PROT_READ, MAP_SHARED, fd, 0);
+   }
+   close(fd);
+   if(mem == MAP_FAILED){
+      return 0;
+   }
+
+   const dsh_board_t* board = (const dsh_board_t*) mem;
+   static dsh_board_t snap; //too big for the stack of some systems
+   if(board->magic != DSH_BOARD_MAGIC || board->version != DSH_BOARD_VERSION){
+      printf("dsh %d: job board of an unknown version\n", pid);
+   } else if(!dsh_board_snapshot(board, &snap, SNAPSHOT_TRIES)){
+      printf("dsh %d: job board busy\n", pid);
+   } else {
+      int64_t now = nowNs();
+      printf("dsh %d: %u job%s, updated %.1fs ago\n", pid, snap.njobs_total,
+             (snap.njobs_total == 1) ? "" : "s", (double) (now - snap.updated_ns) / NSEC_PER_SEC);
+      if(snap.njobs > 0){
+         printf("   %7s  %-9s %4s %9s %9s  %s\n", "PGID", "STATE", "PROC", "CPU", "AGE", "COMMAND");
+      }
+      for(uint32_t i = 0; i < snap.njobs; i++){
+         dsh_board_job_t* job = &snap.jobs[i];
+         size_t len = strnlen(job->command, DSH_BOARD_CMD_LEN - 1);
+         while(len > 0 && job->command[len - 1] == ' '){
+            len--;
+         }
+         job->command[len] = '\0';
+         printf("   %7d  %-9s %4u %8.2fs %8.1fs  %s%s\n", job->pgid, stateName(job->state), job->nprocs,
+                (double) job->cpu_ns / NSEC_PER_SEC, (double) (now - job->start_ns) / NSEC_PER_SEC,
+                job->command, (job->flags & DSH_JOB_BACKGROUND) ? " &" : "");
+      }
+      if(snap.njobs < snap.njobs_total){
+         printf("   ... and %u more\n", snap.njobs_total - snap.njobs);
+      }
+   }
+   munmap(mem, sizeof(dsh_board_t));
+   return 1;
+}
+
+//state of a job as printed
+static const char* stateName(uint32_t state){
+   switch(state){
+      case DSH_JOB_RUNNING: return "ACTIVE";
+      case DSH_JOB_STOPPED: return "SUSPENDED";
+      case DSH_JOB_COMPLETED: return "COMPLETED";
+      case DSH_JOB_CRASHED: return "CRASHED";
+      case DSH_JOB_KILLED: return "KILLED";
+      default: return "?";
+   }
+}
+
+//now on CLOCK_REALTIME in ns
+static int64_t nowNs(void){
+   struct timespec now;
+   clock_gettime(CLOCK_REALTIME, &now);
+   return (int64_t) now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
@@ -0,0 +1,88 @@
+#ifndef __DSH_BOARD_H__   /* check if this header file is already defined elsewhere */
+#define __DSH_BOARD_H__
+
+/* Layout of the job status board a dsh publishes in shared memory.
+ *
+ * Every dsh that runs commands, typed in or read from a script (not the
+ * --serve daemon, which only forks), creates the POSIX shared memory object named by
+ * DSH_BOARD_NAME_FMT and its pid (/dev/shm/dsh-board.<pid> on Linux) and
+ * keeps a dsh_board_t in it up to date with its job table: right away when
+ * a job starts, stops or goes away, and every DSH_BOARD_REFRESH_MS while
+ * jobs are running so their CPU time moves. Set DSH_BOARD=0 to turn it off.
+ *
+ * The board is guarded by a seqlock: the writer makes seq odd, updates the
+ * board and makes seq even again. A reader copies the board and keeps the
+ * copy only if seq was the same even number before and after, see
+ * dsh_board_snapshot(). Readers never block the shell and need no signals.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define DSH_BOARD_MAGIC 0x42485344u /* "DSHB" */
+#define DSH_BOARD_VERSION 1
+
+/* shm_open() name of the board of the dsh with this pid */
+#define DSH_BOARD_NAME_FMT "/dsh-board.%d"
+
+/* jobs on the board; njobs_total says how many the shell really has */
+#define DSH_BOARD_MAX_JOBS 256
+
+/* bytes of the command line kept per job (NUL terminated) */
+#define DSH_BOARD_CMD_LEN 120
+
+/* how often the board is refreshed while jobs are running (ms) */
+#define DSH_BOARD_REFRESH_MS 100
+
+/* state of a job */
+enum {
+        DSH_JOB_RUNNING = 1,
+        DSH_JOB_STOPPED = 2,
+        DSH_JOB_COMPLETED = 3,  /* every process exited with 0 */
+        DSH_JOB_CRASHED = 4,    /* a process exited with non-zero */
+        DSH_JOB_KILLED = 5      /* a process was killed by a signal */
+};
+
+/* job flags */
+#define DSH_JOB_BACKGROUND 0x1  /* started with & */
+#define DSH_JOB_MANAGED 0x2     /* run by a builtin (forall, watch, coproc, ...) */
+
+typedef struct dsh_board_job {
+        int32_t pgid;           /* process group, -1 before the first fork */
+        uint32_t state;         /* DSH_JOB_* */
+        uint32_t flags;         /* DSH_JOB_BACKGROUND | DSH_JOB_MANAGED */
+        uint32_t nprocs;        /* processes in the job */
+        int64_t start_ns;       /* CLOCK_REALTIME when it was spawned */
+        uint64_t cpu_ns;        /* user + system CPU time of its processes, as sampled */
+        char command[DSH_BOARD_CMD_LEN];
+} dsh_board_job_t;
+
+typedef struct dsh_board {
+        uint32_t magic;         /* DSH_BOARD_MAGIC */
+        uint32_t version;       /* DSH_BOARD_VERSION */
+        uint32_t seq;           /* seqlock: odd while the board is written */
+        int32_t pid;            /* of the shell */
+        uint64_t updates;       /* times the board was written */
+        int64_t updated_ns;     /* CLOCK_REALTIME of the last write */
+        uint32_t njobs;         /* entries used in jobs[] */
+        uint32_t njobs_total;   /* jobs in the shell's table */
+        dsh_board_job_t jobs[DSH_BOARD_MAX_JOBS];
+} dsh_board_t;
+
+/* Copies a consistent view of board into out; gives up (returning 0) after
+ * tries attempts that all raced with the writer, returns 1 on success */
+static inline int dsh_board_snapshot(const dsh_board_t *board, dsh_board_t *out, int tries)
+{
+        while(tries-- > 0) {
+                uint32_t before = __atomic_load_n(&board->seq, __ATOMIC_ACQUIRE);
+                if(before & 1)
+                        continue; /* being written */
+                memcpy(out, (const void *)board, sizeof(*out));
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if(__atomic_load_n(&board->seq, __ATOMIC_RELAXED) == before)
+                        return 1;
+        }
+        return 0;
+}
+
+#endif /* __DSH_BOARD_H__ */
@@ -0,0 +1,186 @@
+/*
+ * dshc.c
+ * Client for "dsh --serve <socket>": submits a command line or a script to
+ * the serving shell and exits with the script's exit status.
+ *
+ * usage: dshc [-s socket] [-n] [-c cmdline | script]
+ *   -s  socket of the server (default $DSH_SOCKET or DSH_SERVE_DEFAULT_SOCKET)
+ *   -n  do not pass our stdio; output is streamed back over the socket
+ *   -c  run cmdline; otherwise the script file (or stdin) is sent
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "serve.h"
+
+//initial size of the buffer a script is read into
+#define SCRIPT_BUF_LEN 4096
+
+//reads all of fd into a malloc'd buffer
+static char* slurp(int fd, size_t* len);
+
+//write() that carries on after short writes
+static int writeAll(int fd, const void* data, size_t len);
+
+//read() that fills the whole buffer unless EOF comes first
+static int readAll(int fd, void* data, size_t len);
+
+int main(int argc, char* argv[]){
+   const char* path = getenv("DSH_SOCKET");
+   const char* cmdline = NULL;
+   int passFds = 1;
+   int opt;
+
+   while((opt = getopt(argc, argv, "s:nc:")) != -1){
+      switch(opt){
+         case 's': path = optarg; break;
+         case 'n': passFds = 0; break;
+         case 'c': cmdline = optarg; break;
+         default:
+            fprintf(stderr, "usage: %s [-s socket] [-n] [-c cmdline | script]\n", argv[0]);
+            exit(EXIT_FAILURE);
+      }
+   }
+   if(path == NULL){
+      path = DSH_SERVE_DEFAULT_SOCKET;
+   }
+
+   //the script: -c, a file, or our stdin (which then cannot be the jobs' stdin)
+   char* script;
+   size_t len;
+   int stdinFd = STDIN_FILENO;
+   if(cmdline != NULL){
+      len = strlen(cmdline);
+      script = (char*) malloc(len + 2);
+      sprintf(script, "%s\n", cmdline);
+      len++;
+   } else {
+      int fd = (optind < argc) ? open(argv[optind], O_RDONLY) : STDIN_FILENO;
+      if(fd < 0){
+         perror(argv[optind]);
+         exit(EXIT_FAILURE);
+      }
+      script = slurp(fd, &len);
+      if(fd == STDIN_FILENO){
+         stdinFd = open("/dev/null", O_RDONLY);
+      } else {
+         close(fd);
+      }
+   }
+   if(script == NULL){
+      fprintf(stderr, "dshc: cannot read script\n");
+      exit(EXIT_FAILURE);
+   }
+
+   struct sockaddr_un addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+   int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+   if(conn < 0 || connect(conn, (struct sockaddr*) &addr, sizeof(addr)) < 0){
+      perror(path);
+      exit(EXIT_FAILURE);
+   }
+
+   //request header, with our stdio attached when asked to
+   dsh_request_t req = { DSH_SERVE_MAGIC, passFds ? DSH_SERVE_PASS_FDS : 0, (uint32_t) len };
+   int fds[DSH_SERVE_NFDS] = { stdinFd, STDOUT_FILENO, STDERR_FILENO };
+   char control[CMSG_SPACE(sizeof(fds))];
+   struct iovec iov = { &req, sizeof(req) };
+   struct msghdr msg;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   if(passFds){
+      memset(control, 0, sizeof(control));
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+      memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+   }
+   if(sendmsg(conn, &msg, 0) != (ssize_t) sizeof(req) || !writeAll(conn, script, len)){
+      perror("dshc: send");
+      exit(EXIT_FAILURE);
+   }
+
+   //output frames (if not passing fds) and the exit status
+   dsh_frame_t frame;
+   char buf[SCRIPT_BUF_LEN];
+   while(readAll(conn, &frame, sizeof(frame))){
+      if(frame.type == DSH_FRAME_EXIT){
+         int32_t code = EXIT_FAILURE;
+         readAll(conn, &code, sizeof(code));
+         exit(code);
+      }
+      int out = (frame.type == DSH_FRAME_STDERR) ? STDERR_FILENO : STDOUT_FILENO;
+      while(frame.len > 0){
+         size_t chunk = (frame.len < sizeof(buf)) ? frame.len : sizeof(buf);
+         if(!readAll(conn, buf, chunk)){
+            break;
+         }
+         writeAll(out, buf, chunk);
+         frame.len -= chunk;
+      }
+   }
+
+   fprintf(stderr, "dshc: server closed the connection\n");
+   exit(EXIT_FAILURE);
+}
+
+//reads all of fd into a malloc'd buffer
+static char* slurp(int fd, size_t* len){
+   size_t cap = SCRIPT_BUF_LEN;
+   char* buf = (char*) malloc(cap);
+   ssize_t got;
+   *len = 0;
+   while(buf != NULL && (got = read(fd, buf + *len, cap - *len)) > 0){
+      *len += got;
+      if(*len == cap){
+         cap *= 2;
+         buf = (char*) realloc(buf, cap);
+      }
+   }
+   return buf;
+}
+
+//write() that carries on after short writes
+static int writeAll(int fd, const void* data, size_t len){
+   const char* p = (const char*) data;
+   while(len > 0){
+      ssize_t put = write(fd, p, len);
+      if(put < 0 && errno == EINTR){
+         continue;
+      } else if(put <= 0){
+         return 0;
+      }
+      p += put;
+      len -= put;
+   }
+   return 1;
+}
+
+//read() that fills the whole buffer unless EOF comes first
+static int readAll(int fd, void* data, size_t len){
+   char* p = (char*) data;
+   while(len > 0){
+      ssize_t got = read(fd, p, len);
+      if(got < 0 && errno == EINTR){
+         continue;
+      } else if(got <= 0){
+         return 0;
+      }
+      p += got;
+      len -= got;
+   }
+   return 1;
+}
@@ -0,0 +1,119 @@
+/*
+ * env.c
+ * The environment of the commands the shell runs. export and unset change
+ * the shell's own environment (so getenv() in the shell agrees with what the
+ * commands get) and bump its version. The envp a child execs with is packed
+ * from it into one block, pointers then strings, the first time a spawn
+ * needs it after a change; until the next change every spawn shares that
+ * block as it is (a forked child only reads its copy on write pages), so
+ * spawning does not walk or copy the environment. The assignments of a
+ * command (FOO=1 cmd) are laid over it in the child.
+ */
+
+#include "dsh.h"
+
+//version of the shell's environment, and of the block packed from it
+static unsigned long envVersion = 1;
+static unsigned long blockVersion = 0;
+
+//the block, and the bytes execve() needs for it (strings plus pointers)
+static char** block = NULL;
+static size_t blockBytes = 0;
+
+//blocks packed, for the stats builtin
+static unsigned long statBuilds = 0;
+
+//packs the shell's environment into a new block
+static bool buildBlock(void);
+
+//exports name with value to the commands run from now on
+bool env_export(const char* name, const char* value){
+   const char* old = getenv(name);
+   if(old != NULL && !strcmp(old, value)){
+      return true; //the block stays as it is
+   }
+   if(setenv(name, value, 1) < 0){
+      perror("export");
+      return false;
+   }
+   envVersion++;
+   return true;
+}
+
+//takes name out of the environment of the commands run from now on
+void env_unset(const char* name){
+   if(getenv(name) != NULL){
+      unsetenv(name);
+      envVersion++;
+   }
+}
+
+//true if name is in the environment the commands get
+bool env_exported(const char* name){
+   return getenv(name) != NULL;
+}
+
+//the envp of the commands, packed again if the environment changed since;
+//*bytes (if not NULL) gets what execve() needs for it
+char** env_block(size_t* bytes){
+   if(blockVersion != envVersion && !buildBlock()){
+      extern char** environ;
+      return environ; //no block: the environment as it is
+   }
+   if(bytes != NULL){
+      *bytes = blockBytes;
+   }
+   return block;
+}
+
+//in the child about to exec p: the block, with the assignments of p on top
+void env_exec(process_t* p){
+   extern char** environ;
+   environ = env_block(NULL);
+   for(int i = 0; i < p->nenv; i++){
+      putenv(p->env[i]); //copies the pointer array, not the block
+   }
+}
+
+//prints the environment as export lines, for export without arguments
+void env_print(void){
+   for(char** e = env_block(NULL); *e != NULL; e++){
+      printf("export %s\n", *e);
+   }
+}
+
+//prints the counters for the stats builtin
+void env_print_stats(void){
+   printf("env version: %lu\n", envVersion);
+   printf("env blocks built: %lu\n", statBuilds);
+}
+
+//packs the shell's environment into a new block
+static bool buildBlock(void){
+   extern char** environ;
+   size_t count = 0;
+   size_t strings = 0;
+   for(char** e = environ; *e != NULL; e++, count++){
+      strings += strlen(*e) + 1;
+   }
+   char** fresh = (char**) malloc((count + 1) * sizeof(char*) + strings);
+   if(fresh == NULL){
+      fprintf(stderr, "%s\n", "malloc: no space");
+      return false;
+   }
+   char* at = (char*) (fresh + count + 1);
+   for(size_t i = 0; i < count; i++){
+      size_t len = strlen(environ[i]) + 1;
+      memcpy(at, environ[i], len);
+      fresh[i] = at;
+      at += len;
+   }
+   fresh[count] = NULL;
+
+   free(block); //children have their own copies
+   block = fresh;
+   blockBytes = (count + 1) * sizeof(char*) + strings;
+   blockVersion = envVersion;
+   statBuilds++;
+   return true;
+}
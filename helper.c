@@ -53,14 +53,22 @@ bool free_job(job_t *j)
 	if(!j)
 		return true;
 	free(j->commandinfo);
-	process_t *p;
-	for(p = j->first_process; p; p = p->next) {
+	process_t *p, *next;
+	for(p = j->first_process; p; p = next) {
 		int i;
+		next = p->next;
 		for(i = 0; i < p->argc; i++)
 			free(p->argv[i]);
 		   free(p->argv);
         	free(p->ifile);
         	free(p->ofile);
+        	free(p->efile);
+		for(i = 0; i < p->nenv; i++)
+			free(p->env[i]);
+		free(p->env);
+		free(p->heredoc);
+		free(p->heredelim);
+		free(p);
 	}
 	free(j);
 	return true;
@@ -176,7 +184,9 @@ void print_job(job_t *first_job)
 			fprintf(stdout, "Status: %d, Completed: %d, Stopped: %d\n", p->status, p->completed, p->stopped);
 			fprintf(stdout, "\n");
 			if(p->ifile != NULL) fprintf(stdout, "Input file name: %s\n", p->ifile);
-			if(p->ofile != NULL) fprintf(stdout, "Output file name: %s\n", p->ofile);
+			if(p->ofile != NULL) fprintf(stdout, "Output file name: %s%s\n", p->ofile, p->oappend ? " (append)" : "");
+			if(p->efile != NULL) fprintf(stdout, "Error file name: %s%s\n", p->efile, p->eappend ? " (append)" : "");
+			if(p->errtoout) fprintf(stdout, "Errors go to the output\n");
 		}
 		if(j->bg) fprintf(stdout, "Background job\n");	
 		else fprintf(stdout, "Foreground job\n");	
@@ -0,0 +1,449 @@
+/*
+ * mux.c
+ * Output multiplexer: with mux on, jobs that run alongside others
+ * (background jobs, forall children, argv batches run in parallel) write
+ * their stdout and stderr into pipes the shell owns rather than straight to
+ * the terminal or their > files. A thread reads the pipes, holds each one's
+ * partial line and writes whole lines only, tagged with the job's pgid and
+ * a timestamp if asked to, gathering every line ready for a destination
+ * into one writev(), so the lines of concurrent jobs never tear each other.
+ */
+
+#include "dsh.h"
+
+#include <pthread.h>    /* multiplexer thread */
+#include <poll.h>       /* poll() */
+#include <sys/uio.h>    /* writev() */
+#include <time.h>       /* clock_gettime(), localtime_r() */
+
+//output of a job held while its line is not finished; a longer line is
+//broken there
+#define MUX_BUF_LEN (64 * 1024)
+
+//iovecs gathered for one writev() (IOV_MAX on Linux)
+#define MUX_IOV_MAX 1024
+
+//room for "[pgid] hh:mm:ss.mmm " before a line
+#define MUX_PREFIX_LEN 48
+
+//longest mux_settle() waits for the last lines of a job
+#define MUX_SETTLE_MS 200
+
+#define NSEC_PER_SEC 1000000000LL
+#define NSEC_PER_MSEC 1000000LL
+
+//the stdout or stderr pipe of one stage
+typedef struct _muxSource {
+   int from;                  //our end of the pipe
+   int to;                    //where its lines go
+   bool ownTo;                //to was opened for this stage (a > file)
+   pid_t pgid;                //of its job, for the tag
+   char* buf;                 //output not written yet
+   size_t len;
+   size_t ready;              //bytes of buf going out in this round
+   bool eof;
+   int round;                 //last round its lines were gathered in
+   struct _muxSource* next;
+} muxSource;
+
+//set by the mux builtin
+static bool muxOn = false;
+static bool muxTag = false;
+static bool muxStamp = false;
+
+//the shell's stdout and stderr when mux was turned on (builtins point fd
+//1 elsewhere now and then); sources going there are grouped by these
+static int shellOut = -1;
+static int shellErr = -1;
+
+//guards everything below against the thread
+static pthread_mutex_t muxMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t muxDrained = PTHREAD_COND_INITIALIZER;
+
+//sources added and not yet taken by the thread
+static muxSource* incoming = NULL;
+
+//pgids of the sources not finished yet, one entry per source
+static pid_t* openPgids = NULL;
+static int nOpen = 0;
+static int openCap = 0;
+
+//wakes the thread out of poll() when a source is added
+static int wake[2] = { -1, -1 };
+
+//shell the thread runs in; a forked serve child needs its own
+static pid_t muxOwner = -1;
+
+//counters for the stats builtin
+static unsigned long statSources = 0;
+static unsigned long statLines = 0;
+static unsigned long statWrites = 0;
+static unsigned long long statBytes = 0;
+
+//starts the thread and its wake pipe if this process has none yet
+static bool startThread(void);
+
+//multiplexer thread: polls the sources and writes out their whole lines
+static void* multiplex(void* arg);
+
+//reads what source s has for us, noting when it is finished
+static void fill(muxSource* s);
+
+//writes the lines ready in all sources going where first goes
+static void emit(muxSource* first, int round, const char* stamp);
+
+//writev() of all of iov, going on after short writes
+static void writeAll(int fd, struct iovec* iov, int cnt);
+
+//forgets source s once it is finished, with its pgid
+static void finish(muxSource* s);
+
+//true if mux is on: jobs running alongside others write through it
+bool mux_enabled(void){
+   return muxOn;
+}
+
+//turns the multiplexer on (tagging lines with the pgid and time if asked
+//to) or off; sources already added go on until they are finished
+void mux_set(bool on, bool tag, bool stamp){
+   if(on && shellOut < 0){
+      shellOut = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+      shellErr = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3);
+   }
+   muxOn = on && shellOut >= 0 && shellErr >= 0;
+   muxTag = tag;
+   muxStamp = stamp;
+   if(on && !muxOn){
+      perror("mux");
+   }
+}
+
+//prints the mux settings
+void mux_print(void){
+   printf("mux %s%s%s\n", muxOn ? "on" : "off", (muxOn && muxTag) ? " -p" : "",
+          (muxOn && muxStamp) ? " -t" : "");
+}
+
+//hands the read end from of a stage's pipe to the thread, with to where
+//its lines go (STDOUT_FILENO and STDERR_FILENO are the shell's own, any
+//other fd is closed once the pipe is finished)
+bool mux_add(int from, int to, pid_t pgid){
+   muxSource* s = (muxSource*) malloc(sizeof(muxSource));
+   char* buf = (char*) malloc(MUX_BUF_LEN);
+   if(s == NULL || buf == NULL || !startThread()){
+      free(s);
+      free(buf);
+      return false;
+   }
+   fcntl(from, F_SETFL, fcntl(from, F_GETFL) | O_NONBLOCK);
+   s->from = from;
+   s->ownTo = (to != STDOUT_FILENO && to != STDERR_FILENO);
+   s->to = (to == STDOUT_FILENO) ? shellOut : (to == STDERR_FILENO) ? shellErr : to;
+   s->pgid = pgid;
+   s->buf = buf;
+   s->len = 0;
+   s->ready = 0;
+   s->eof = false;
+   s->round = 0;
+
+   pthread_mutex_lock(&muxMutex);
+   if(nOpen == openCap){
+      int cap = (openCap > 0) ? openCap * 2 : 16;
+      pid_t* grown = (pid_t*) realloc(openPgids, cap * sizeof(pid_t));
+      if(grown == NULL){
+         pthread_mutex_unlock(&muxMutex);
+         free(s);
+         free(buf);
+         return false;
+      }
+      openPgids = grown;
+      openCap = cap;
+   }
+   openPgids[nOpen++] = pgid;
+   s->next = incoming;
+   incoming = s;
+   statSources++;
+   pthread_mutex_unlock(&muxMutex);
+
+   char c = 0;
+   if(write(wake[1], &c, 1) < 0 && errno != EAGAIN){
+      perror("mux");
+   }
+   return true;
+}
+
+//waits (a little at most) until every pipe of job pgid has been read to
+//its end and written out, so a job that finished is not printed after the
+//next prompt
+void mux_settle(pid_t pgid){
+   struct timespec until;
+   clock_gettime(CLOCK_REALTIME, &until);
+   until.tv_nsec += MUX_SETTLE_MS * NSEC_PER_MSEC;
+   until.tv_sec += until.tv_nsec / NSEC_PER_SEC;
+   until.tv_nsec %= NSEC_PER_SEC;
+
+   pthread_mutex_lock(&muxMutex);
+   while(1){
+      bool pending = false;
+      for(int i = 0; i < nOpen && !pending; i++){
+         pending = (openPgids[i] == pgid);
+      }
+      if(!pending || muxOwner != getpid()
+         || pthread_cond_timedwait(&muxDrained, &muxMutex, &until) != 0){
+         break;
+      }
+   }
+   pthread_mutex_unlock(&muxMutex);
+}
+
+//prints the multiplexer counters for the stats builtin
+void mux_print_stats(void){
+   printf("mux pipes: %lu\n", statSources);
+   printf("mux lines: %lu\n", statLines);
+   printf("mux writes: %lu\n", statWrites);
+   printf("mux bytes: %llu\n", statBytes);
+}
+
+//starts the thread and its wake pipe if this process has none yet
+static bool startThread(void){
+   if(muxOwner == getpid()){
+      return true;
+   }
+   //a fork of a shell that had one: its sources are the parent's
+   pthread_mutex_init(&muxMutex, NULL);
+   incoming = NULL;
+   nOpen = 0;
+   if(wake[0] >= 0){
+      close(wake[0]);
+      close(wake[1]);
+   }
+   if(pipe2(wake, O_CLOEXEC | O_NONBLOCK) < 0){
+      perror("mux: pipe");
+      wake[0] = wake[1] = -1;
+      return false;
+   }
+
+   //signals are for the main thread only
+   sigset_t all, old;
+   sigfillset(&all);
+   pthread_sigmask(SIG_BLOCK, &all, &old);
+   pthread_t thread;
+   int failed = pthread_create(&thread, NULL, multiplex, NULL);
+   pthread_sigmask(SIG_SETMASK, &old, NULL);
+   if(failed){
+      errno = failed;
+      perror("mux: thread");
+      return false;
+   }
+   pthread_detach(thread);
+   muxOwner = getpid();
+   return true;
+}
+
+//multiplexer thread: polls the sources and writes out their whole lines
+static void* multiplex(void* arg){
+   muxSource* sources = NULL;
+   struct pollfd* fds = NULL;
+   int fdsCap = 0;
+   int round = 0;
+
+   while(1){
+      pthread_mutex_lock(&muxMutex);
+      while(incoming != NULL){
+         muxSource* s = incoming;
+         incoming = s->next;
+         s->next = sources;
+         sources = s;
+      }
+      pthread_mutex_unlock(&muxMutex);
+
+      int n = 1;
+      for(muxSource* s = sources; s != NULL; s = s->next){
+         n++;
+      }
+      if(n > fdsCap){
+         fdsCap = n * 2;
+         fds = (struct pollfd*) realloc(fds, fdsCap * sizeof(struct pollfd));
+      }
+      fds[0].fd = wake[0];
+      fds[0].events = POLLIN;
+      int i = 1;
+      for(muxSource* s = sources; s != NULL; s = s->next, i++){
+         fds[i].fd = s->from;
+         fds[i].events = POLLIN;
+      }
+      if(poll(fds, n, -1) < 0){
+         continue; //EINTR
+      }
+      char drain[64];
+      while(read(wake[0], drain, sizeof(drain)) > 0);
+
+      i = 1;
+      for(muxSource* s = sources; s != NULL; s = s->next, i++){
+         if(fds[i].revents != 0){
+            fill(s);
+         }
+      }
+
+      //whole lines out, grouped by where they go
+      char stamp[16] = "";
+      if(muxStamp){
+         struct timespec now;
+         struct tm local;
+         clock_gettime(CLOCK_REALTIME, &now);
+         localtime_r(&now.tv_sec, &local);
+         size_t len = strftime(stamp, sizeof(stamp), "%H:%M:%S", &local);
+         snprintf(stamp + len, sizeof(stamp) - len, ".%03d ", (int) (now.tv_nsec / NSEC_PER_MSEC));
+      }
+      round++;
+      for(muxSource* s = sources; s != NULL; s = s->next){
+         if(s->round != round){
+            emit(s, round, stamp);
+         }
+      }
+
+      //drop the finished sources
+      muxSource** link = &sources;
+      while(*link != NULL){
+         muxSource* s = *link;
+         if(s->eof && s->len == 0){
+            *link = s->next;
+            finish(s);
+         } else {
+            link = &s->next;
+         }
+      }
+   }
+   return NULL; /* NOT REACHED */
+}
+
+//reads what source s has for us, noting when it is finished
+static void fill(muxSource* s){
+   ssize_t got = read(s->from, s->buf + s->len, MUX_BUF_LEN - s->len);
+   if(got > 0){
+      s->len += got;
+   } else if(got == 0 || (errno != EAGAIN && errno != EINTR)){
+      s->eof = true; //every writer is gone
+   }
+}
+
+//writes the lines ready in first and the later sources going to the same
+//fd in as few writev() calls as iovecs allow: a line is one iovec (two
+//with its prefix) unless lines are not prefixed, then every whole line of
+//a source is one
+static void emit(muxSource* first, int round, const char* stamp){
+   static struct iovec iov[MUX_IOV_MAX];
+   static char prefixes[MUX_IOV_MAX / 2][MUX_PREFIX_LEN];
+   static char newline[] = "\n";
+   bool prefixed = muxTag || muxStamp;
+   int cnt = 0;
+   int nPrefixes = 0;
+
+   for(muxSource* s = first; s != NULL; s = s->next){
+      if(s->round == round || s->to != first->to){
+         continue;
+      }
+      s->round = round;
+
+      //up to the last newline; all of it at the end, or when a line
+      //fills the buffer
+      char* last = memrchr(s->buf, '\n', s->len);
+      s->ready = (last != NULL) ? (size_t) (last - s->buf) + 1 : 0;
+      if(s->eof || (s->ready == 0 && s->len == MUX_BUF_LEN)){
+         s->ready = s->len;
+      }
+
+      size_t pos = 0;
+      while(pos < s->ready){
+         char* nl = memchr(s->buf + pos, '\n', s->ready - pos);
+         size_t end = prefixed ? ((nl != NULL) ? (size_t) (nl - s->buf) + 1 : s->ready) : s->ready;
+         if(cnt + 3 > MUX_IOV_MAX){
+            writeAll(s->to, iov, cnt);
+            cnt = 0;
+            nPrefixes = 0;
+         }
+         if(prefixed){
+            char* prefix = prefixes[nPrefixes++];
+            int len = 0;
+            if(muxTag){
+               len = snprintf(prefix, MUX_PREFIX_LEN, "[%d] ", (int) s->pgid);
+            }
+            snprintf(prefix + len, MUX_PREFIX_LEN - len, "%s", stamp);
+            iov[cnt].iov_base = prefix;
+            iov[cnt++].iov_len = strlen(prefix);
+         }
+         iov[cnt].iov_base = s->buf + pos;
+         iov[cnt++].iov_len = end - pos;
+         statBytes += end - pos;
+
+         //count the lines; a last one without its newline gets one
+         for(char* c = s->buf + pos; (c = memchr(c, '\n', s->buf + end - c)) != NULL; c++){
+            statLines++;
+         }
+         if(s->buf[end - 1] != '\n'){
+            iov[cnt].iov_base = newline;
+            iov[cnt++].iov_len = 1;
+            statLines++;
+         }
+         pos = end;
+      }
+   }
+   if(cnt > 0){
+      writeAll(first->to, iov, cnt);
+   }
+
+   //keep what is left of the lines not finished yet
+   for(muxSource* s = first; s != NULL; s = s->next){
+      if(s->to == first->to && s->ready > 0){
+         memmove(s->buf, s->buf + s->ready, s->len - s->ready);
+         s->len -= s->ready;
+         s->ready = 0;
+      }
+   }
+}
+
+//writev() of all of iov, going on after short writes
+static void writeAll(int fd, struct iovec* iov, int cnt){
+   statWrites++;
+   while(cnt > 0){
+      ssize_t done = writev(fd, iov, cnt);
+      if(done < 0){
+         if(errno == EINTR){
+            continue;
+         } else if(errno == EAGAIN){ //a non-blocking terminal or pipe
+            struct pollfd out = { fd, POLLOUT, 0 };
+            poll(&out, 1, -1);
+            continue;
+         }
+         return; //nowhere to write to, the lines are lost
+      }
+      while(cnt > 0 && (size_t) done >= iov->iov_len){
+         done -= iov->iov_len;
+         iov++;
+         cnt--;
+      }
+      if(cnt > 0){
+         iov->iov_base = (char*) iov->iov_base + done;
+         iov->iov_len -= done;
+      }
+   }
+}
+
+//forgets source s once it is finished, with its pgid
+static void finish(muxSource* s){
+   close(s->from);
+   if(s->ownTo){
+      close(s->to);
+   }
+   pthread_mutex_lock(&muxMutex);
+   for(int i = 0; i < nOpen; i++){
+      if(openPgids[i] == s->pgid){
+         openPgids[i] = openPgids[--nOpen];
+         break;
+      }
+   }
+   pthread_cond_broadcast(&muxDrained);
+   pthread_mutex_unlock(&muxMutex);
+   free(s->buf);
+   free(s);
+}
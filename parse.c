@@ -1,6 +1,127 @@
 #include "dsh.h"
 
-int isspace(int c); //check whether the char c is a space
+#include <dirent.h>     /* DT_DIR and friends, readdir() fallback */
+#include <ctype.h>      /* isspace(), isalpha() and friends */
+#include <sys/mman.h>   /* memfd_create() */
+#include <limits.h>     /* LLONG_MIN */
+#ifdef __linux__
+#include <sys/syscall.h> /* SYS_getdents64 */
+#endif
+
+/* Glob expansion: bytes of directory listings kept in the per command line
+ * cache before it is flushed, read size for getdents64() and the deepest
+ * directory ** descends into */
+#define GLOB_CACHE_MAX_BYTES (8 << 20)
+#define GLOB_DENTS_BUF_LEN 32768
+#define GLOB_MAX_DEPTH 64
+
+/* Buckets of the shell variable table */
+#define VAR_BUCKETS 256
+
+/* Aliases expanded one into the other at most for a command */
+#define ALIAS_MAX_DEPTH 16
+
+/* Prompt for the lines of a here-document typed at the terminal */
+#define HEREDOC_PROMPT "> "
+
+
+/* Returns the length of the substitution opener at s ("$(", "<(" or ">(")
+ * or 0 when s does not start a substitution. Everything up to the matching
+ * ')' is kept verbatim by the parser and left to expand_job(). */
+static int subst_opener(const char *s)
+{
+	if((s[0] == '$' || s[0] == '<' || s[0] == '>') && s[1] == '(')
+		return 2;
+	return 0;
+}
+
+/* Returns the length of the variable reference at s ($name, ${name} or $?)
+ * and where its name starts and how long it is; 0 if s is not one */
+static size_t var_ref(const char *s, size_t *name_off, size_t *name_len)
+{
+	if(s[0] != '$')
+		return 0;
+	if(s[1] == '?' || isdigit((unsigned char)s[1]) || s[1] == '#' || s[1] == '@') {
+		*name_off = 1;      /* $?, and $1, $# and $@ of a function */
+		*name_len = 1;
+		return 2;
+	}
+	bool braced = (s[1] == '{');
+	size_t i = braced ? 2 : 1;
+	if(!isalpha((unsigned char)s[i]) && s[i] != '_')
+		return 0;
+	size_t start = i;
+	while(isalnum((unsigned char)s[i]) || s[i] == '_')
+		++i;
+	if(braced && s[i] != '}')
+		return 0;
+	*name_off = start;
+	*name_len = i - start;
+	return braced ? i + 1 : i;
+}
+
+/* true if word contains a substitution or variable reference */
+static bool has_subst(const char *word)
+{
+	size_t off, len;
+	for(; *word; ++word)
+		if(subst_opener(word) || var_ref(word, &off, &len))
+			return true;
+	return false;
+}
+
+/* Tracks the parenthesis depth of substitutions while scanning; returns the
+ * number of characters at s that belong to a substitution (0 if none) */
+static int subst_span(const char *s, int *depth)
+{
+	int open = subst_opener(s);
+	if(open) {
+		++*depth;
+		return open;
+	}
+	if(*depth == 0)
+		return 0;
+	if(*s == '(')
+		++*depth;
+	else if(*s == ')')
+		--*depth;
+	return 1;
+}
+
+/* Appends n bytes of s to the growable string *buf */
+static bool str_append(char **buf, size_t *len, size_t *cap, const char *s, size_t n)
+{
+	if(*len + n + 1 > *cap) {
+		size_t newcap = (*cap) ? *cap : MAX_LEN_CMDLINE;
+		while(*len + n + 1 > newcap)
+			newcap *= 2;
+		char *grown = (char *)realloc(*buf, newcap);
+		if(!grown)
+			return false;
+		*buf = grown;
+		*cap = newcap;
+	}
+	memcpy(*buf + *len, s, n);
+	*len += n;
+	(*buf)[*len] = '\0';
+	return true;
+}
+
+/* Appends word to the growable, NULL terminated argv */
+static bool argv_push(char ***argv, int *argc, int *cap, char *word)
+{
+	if(*argc + 2 > *cap) {
+		int newcap = (*cap) ? *cap * 2 : MAX_ARGS;
+		char **grown = (char **)realloc(*argv, newcap * sizeof(char *));
+		if(!grown)
+			return false;
+		*argv = grown;
+		*cap = newcap;
+	}
+	(*argv)[(*argc)++] = word;
+	(*argv)[*argc] = NULL;
+	return true;
+}
 
 /* Initialize the members of job structure */
 bool init_job(job_t *j) 
@@ -15,6 +136,10 @@ bool init_job(job_t *j)
 	j->mystdout = STDOUT_FILENO;	/* 1 */ 
 	j->mystderr = STDERR_FILENO;	/* 2 */
 	j->bg = false;
+	j->managed = false;
+	j->batchjobs = 0;
+	j->start_ns = 0;
+	j->timeout_ns = 0;
 	return true;
 }
 
@@ -29,12 +154,150 @@ bool init_process(process_t *p)
 	p->next = NULL;
 	p->ifile = NULL;
 	p->ofile = NULL;
+	p->efile = NULL;
+	p->oappend = false;
+	p->eappend = false;
+	p->errtoout = false;
+	p->keepfds = NULL;
+	p->nkeepfds = 0;
+	p->muxout = -1;
+	p->muxerr = -1;
+	p->env = NULL;
+	p->nenv = 0;
+	p->heredoc = NULL;
+	p->heredelim = NULL;
+	p->hereexpand = false;
+	p->herefd = -1;
+	p->cpu_ns = 0;
 
 	if(!(p->argv = (char **)calloc(MAX_ARGS,sizeof(char *))))
 		return false;
 	return true;
 }
 
+/* Deep copy of the pipeline of j that can be spawned on its own: pgid, statuses
+ * and kept fds are those of a job that has not run yet and next is NULL */
+job_t *clone_job(job_t *j)
+{
+	job_t *copy = (job_t *)malloc(sizeof(job_t));
+	if(!copy || !init_job(copy)) {
+		free(copy);
+		return NULL;
+	}
+	memcpy(copy->commandinfo, j->commandinfo, MAX_LEN_CMDLINE);
+	copy->mystdin = j->mystdin;
+	copy->mystdout = j->mystdout;
+	copy->mystderr = j->mystderr;
+	copy->bg = j->bg;
+	copy->managed = j->managed;
+	copy->timeout_ns = j->timeout_ns;
+
+	process_t *p, **tail = &copy->first_process;
+	for(p = j->first_process; p; p = p->next) {
+		process_t *q = (process_t *)malloc(sizeof(process_t));
+		if(!q || !init_process(q)) {
+			free(q);
+			goto fail;
+		}
+		*tail = q;
+		tail = &q->next;
+		free(q->argv);
+		if(!(q->argv = (char **)calloc(p->argc + 1, sizeof(char *))))
+			goto fail;
+		for(q->argc = 0; q->argc < p->argc; q->argc++)
+			if(!(q->argv[q->argc] = strdup(p->argv[q->argc])))
+				goto fail;
+		if((p->ifile && !(q->ifile = strdup(p->ifile)))
+		   || (p->ofile && !(q->ofile = strdup(p->ofile)))
+		   || (p->efile && !(q->efile = strdup(p->efile))))
+			goto fail;
+		q->oappend = p->oappend;
+		q->eappend = p->eappend;
+		q->errtoout = p->errtoout;
+		if(p->heredoc && !(q->heredoc = strdup(p->heredoc)))
+			goto fail;
+		q->hereexpand = p->hereexpand;
+		if(p->nenv && !(q->env = (char **)calloc(p->nenv, sizeof(char *))))
+			goto fail;
+		for(q->nenv = 0; q->nenv < p->nenv; q->nenv++)
+			if(!(q->env[q->nenv] = strdup(p->env[q->nenv])))
+				goto fail;
+	}
+	return copy;
+
+fail:	/* free what was copied so far */
+	for(p = copy->first_process; p; ) {
+		process_t *next = p->next;
+		int i;
+		for(i = 0; i < p->argc; i++)
+			free(p->argv[i]);
+		free(p->argv);
+		free(p->ifile);
+		free(p->ofile);
+		free(p->efile);
+		for(i = 0; i < p->nenv; i++)
+			free(p->env[i]);
+		free(p->env);
+		free(p->heredoc);
+		free(p);
+		p = next;
+	}
+	free(copy->commandinfo);
+	free(copy);
+	return NULL;
+}
+
+/* Replaces the first word of p with the words of the alias it names, and
+ * again while that gives another alias; one that is being expanded already
+ * (alias ls=ls -F) is left as the command */
+static void expand_alias(process_t *p)
+{
+	char *seen[ALIAS_MAX_DEPTH];
+	int nseen = 0;
+	const char *value;
+	while(p->argc > 0 && nseen < ALIAS_MAX_DEPTH && (value = alias_get(p->argv[0]))) {
+		int i;
+		for(i = 0; i < nseen && strcmp(seen[i], p->argv[0]); i++)
+			;
+		if(i < nseen)
+			break;
+
+		char **argv = NULL;
+		int argc = 0, cap = 0;
+		bool ok = true;
+		while(ok && *value) {
+			value += strspn(value, " \t");
+			size_t n = strcspn(value, " \t");
+			if(n > 0) {
+				char *word = strndup(value, n);
+				ok = word && argv_push(&argv, &argc, &cap, word);
+				if(!ok)
+					free(word);
+			}
+			value += n;
+		}
+		for(i = 1; ok && i < p->argc; i++) {
+			ok = argv_push(&argv, &argc, &cap, p->argv[i]);
+			if(ok)
+				p->argv[i] = NULL;  /* moved over */
+		}
+		if(ok && !argv)     /* an alias of nothing, called with no words */
+			ok = (argv = (char **)calloc(1, sizeof(char *))) != NULL;
+		if(!ok) {
+			fprintf(stderr, "%s\n", "malloc: no space");
+			break;
+		}
+		seen[nseen++] = p->argv[0];
+		for(i = 1; i < p->argc; i++)
+			free(p->argv[i]);
+		free(p->argv);
+		p->argv = argv;
+		p->argc = argc;
+	}
+	while(nseen > 0)
+		free(seen[--nseen]);
+}
+
 /*
  * Reads the process level information in the cases of single process or
  * cmdline with pipelines 
@@ -47,24 +310,207 @@ bool readprocessinfo(process_t *p, char *cmd)
 	int cmd_pos = 0;    /*iterator for command; */
 	int args_pos = 0;   /* iterator for arguments*/
 
-	int argc = 0;
+	int depth = 0;      /* substitutions keep their spaces */
+	char **argv = NULL; /* grows with the words, no cap on their number */
+	int argc = 0, cap = 0;
 	
 	while (isspace(cmd[cmd_pos])){++cmd_pos;} /* ignore any spaces */
 	if(cmd[cmd_pos] == '\0')
 		return true;
 	
 	while(cmd[cmd_pos] != '\0'){
-		if(!(p->argv[argc] = (char *)calloc(MAX_LEN_CMDLINE, sizeof(char))))
-			return false;
-		while(cmd[cmd_pos] != '\0' && !isspace(cmd[cmd_pos])) 
-			p->argv[argc][args_pos++] = cmd[cmd_pos++];
-		p->argv[argc][args_pos] = '\0';
+		char *word = (char *)calloc(MAX_LEN_CMDLINE, sizeof(char));
+		if(!word || !argv_push(&argv, &argc, &cap, word)) {
+			free(word);
+			break;
+		}
+		while(cmd[cmd_pos] != '\0' && (depth > 0 || !isspace(cmd[cmd_pos]))) {
+			int span = subst_span(cmd + cmd_pos, &depth);
+			do
+				word[args_pos++] = cmd[cmd_pos++];
+			while(--span > 0);
+		}
+		word[args_pos] = '\0';
 		args_pos = 0;
-		++argc;
 		while (isspace(cmd[cmd_pos])){++cmd_pos;} /* ignore any spaces */
 	}
-	p->argv[argc] = NULL; /* required for exec_() calls */
+
+	int i;
+	for(i = 0; i < p->argc; i++)
+		free(p->argv[i]);
+	free(p->argv);
+	p->argv = argv;     /* NULL terminated as required for exec_() calls */
 	p->argc = argc;
+	expand_alias(p);
+	return cmd[cmd_pos] == '\0';
+}
+
+/* where readcmdline() reads command lines from; NULL for stdin */
+static FILE *cmd_source = NULL;
+
+/* Makes readcmdline() read from in; returns the previous source */
+FILE* set_cmd_source(FILE *in)
+{
+	FILE *prev = get_cmd_source();
+	cmd_source = in;
+	return prev;
+}
+
+/* The stream readcmdline() reads from */
+FILE* get_cmd_source(void)
+{
+	return cmd_source ? cmd_source : stdin;
+}
+
+/* Reads the bodies of the here-documents of a parsed command line */
+static bool read_heredocs(job_t *first_job);
+
+/* Prints the prompt and parses the next line from the command source (stdin
+ * unless set_cmd_source() said otherwise); see parse_cmdline() */
+job_t* readcmdline(char *msg) 
+{
+
+	fprintf(stdout, "%s", msg);
+
+	char *cmdline = (char *)calloc(MAX_LEN_CMDLINE, sizeof(char));
+	if(!cmdline) {
+	    	fprintf(stderr, "%s\n","malloc: no space");
+        	return NULL;
+    	}
+	if(!fgets(cmdline, MAX_LEN_CMDLINE, get_cmd_source())) {
+		free(cmdline);
+		return NULL;
+	}
+	trace_record_line(cmdline);
+
+	job_t *first_job = parse_cmdline(cmdline);
+	free(cmdline);
+	if(first_job && !read_heredocs(first_job)) {
+		while(first_job) {
+			job_t *next = first_job->next;
+			free_job(first_job);
+			first_job = next;
+		}
+	}
+	return first_job;
+}
+
+/* Reads the bodies of the here-documents of the jobs from the command
+ * source, in the order of their << on the line: the lines up to one that is
+ * just the WORD. The lines are not limited to MAX_LEN_CMDLINE. Returns
+ * false if one could not be stored. */
+static bool read_heredocs(job_t *first_job)
+{
+	FILE *in = get_cmd_source();
+	const char *prompt = isatty(fileno(in)) ? HEREDOC_PROMPT : "";
+	job_t *j;
+	process_t *p;
+	for(j = first_job; j; j = j->next) {
+		for(p = j->first_process; p; p = p->next) {
+			if(!p->heredelim)
+				continue;
+			char *body = NULL, *line = NULL;
+			size_t body_len = 0, body_cap = 0, line_cap = 0;
+			ssize_t len;
+			bool ended = false;
+			while(fputs(prompt, stdout), fflush(stdout),
+			      (len = getline(&line, &line_cap, in)) > 0) {
+				trace_record_line(line);
+				size_t text = (line[len - 1] == '\n') ? len - 1 : len;
+				if(text == strlen(p->heredelim) && !strncmp(line, p->heredelim, text)) {
+					ended = true;
+					break;
+				}
+				if(!str_append(&body, &body_len, &body_cap, line, len)) {
+					free(line);
+					free(body);
+					return false;
+				}
+			}
+			free(line);
+			if(!ended)
+				fprintf(stderr, "here-document ended by end of file (wanted %s)\n", p->heredelim);
+			free(p->heredelim);
+			p->heredelim = NULL;
+			p->heredoc = body ? body : strdup("");
+			if(!p->heredoc)
+				return false;
+		}
+	}
+	return true;
+}
+
+/* Reads the file name of a redirection at cmdline[*pos], just past the
+ * operator, and the spaces around it; NULL if it is too long or malloc fails */
+static char *redirect_file(char *cmdline, int *pos)
+{
+	char *file = (char *) calloc(MAX_LEN_FILENAME, sizeof(char));
+	if(!file)
+		return NULL;
+	while (isspace(cmdline[*pos])){++*pos;} /* ignore any spaces */
+	int seek = 0;
+	while(cmdline[*pos] != '\0' && !isspace(cmdline[*pos])){
+		if(MAX_LEN_FILENAME == seek) {
+			free(file);
+			return NULL;
+		}
+		file[seek++] = cmdline[(*pos)++];
+	}
+	file[seek] = '\0';
+	while(isspace(cmdline[*pos])) {
+		if(cmdline[*pos] == '\n')
+			break;
+		++*pos;
+	}
+	return file;
+}
+
+/* Reads the WORD of <<WORD at cmdline[*pos] into p: a quoted WORD
+ * ('EOF' or "EOF") keeps the body as it is, otherwise its $ are expanded */
+static bool heredoc_word(process_t *p, char *cmdline, int *pos)
+{
+	char *word = redirect_file(cmdline, pos);
+	if(!word)
+		return false;
+	size_t len = strlen(word);
+	p->hereexpand = true;
+	if(len >= 2 && (word[0] == '\'' || word[0] == '"') && word[len - 1] == word[0]) {
+		memmove(word, word + 1, len - 2);
+		word[len - 2] = '\0';
+		p->hereexpand = false;
+	}
+	free(p->heredelim);
+	free(p->heredoc);
+	free(p->ifile);
+	p->heredelim = word;
+	p->heredoc = NULL;
+	p->ifile = NULL;
+	return true;
+}
+
+/* Reads the word of <<< word at cmdline[*pos] into p as its body, with a
+ * newline after it */
+static bool herestring_word(process_t *p, char *cmdline, int *pos)
+{
+	char *word = redirect_file(cmdline, pos);
+	if(!word)
+		return false;
+	size_t len = strlen(word);
+	char *body = (char *)malloc(len + 2);
+	if(!body) {
+		free(word);
+		return false;
+	}
+	memcpy(body, word, len);
+	memcpy(body + len, "\n", 2);
+	free(word);
+	free(p->heredelim);
+	free(p->heredoc);
+	free(p->ifile);
+	p->heredelim = NULL;
+	p->heredoc = body;
+	p->hereexpand = true;
+	p->ifile = NULL;
 	return true;
 }
 
@@ -76,20 +522,13 @@ bool readprocessinfo(process_t *p, char *cmd)
  * will always return NULL. 
  *
  * The parser supports these symbols: <, >, |, &, ;
+ * $(...), <(...) and >(...) are kept verbatim inside their word and expanded
+ * by expand_job().
  */
 
-job_t* readcmdline(char *msg) 
+job_t* parse_cmdline(char *cmdline) 
 {
 
-	fprintf(stdout, "%s", msg);
-
-	char *cmdline = (char *)calloc(MAX_LEN_CMDLINE, sizeof(char));
-	if(!cmdline) {
-	    	fprintf(stderr, "%s\n","malloc: no space");
-        	return NULL;
-    	}
-	fgets(cmdline, MAX_LEN_CMDLINE, stdin);
-
 	/* sequence is true only when the command line contains ; */
 	bool sequence = false;
 	/* seq_pos is used for storing the command line before ; */
@@ -103,14 +542,14 @@ job_t* readcmdline(char *msg)
 		job_t *current_job = find_last_job(first_job);
 
 		int cmd_pos = 0;        /* iterator for a command */
-		int iofile_seek = 0;    /*iofile_seek for file */
 		bool valid_input = true; /* check for valid input */
 		bool end_of_input = false; /* check for end of input */
+		int subst_depth = 0;     /* nesting of $( ) being copied */
 
 		/* cmdline is NOOP, i.e., just return with spaces */
 		while (isspace(cmdline[cmdline_pos])){++cmdline_pos;} /* ignore any spaces */
-		if(cmdline[cmdline_pos] == '\n' || cmdline[cmdline_pos] == '\0' || feof(stdin))
-			return NULL;
+		if(cmdline[cmdline_pos] == '\n' || cmdline[cmdline_pos] == '\0')
+			return first_job; /* NULL unless a ; came before */
 
 		/* Check for invalid special symbols (characters) */
 		if(cmdline[cmdline_pos] == ';' || cmdline[cmdline_pos] == '&' 
@@ -165,61 +604,58 @@ job_t* readcmdline(char *msg)
 
 		while(cmdline[cmdline_pos] != '\n' && cmdline[cmdline_pos] != '\0') {
 
+			/* inside a substitution nothing is special until the matching ) */
+			int span = subst_span(cmdline + cmdline_pos, &subst_depth);
+			if(span) {
+				if(!valid_input || cmd_pos + span >= MAX_LEN_CMDLINE-1) {
+					fprintf(stderr,"%s\n","reading cmdline: could not fathom input");
+					delete_job(current_job,first_job);
+					return NULL;
+				}
+				while(span-- > 0)
+					cmd[cmd_pos++] = cmdline[cmdline_pos++];
+				continue;
+			}
+
 			switch (cmdline[cmdline_pos]) {
 
-			    case '<': /* input redirection */
-				current_process->ifile = (char *) calloc(MAX_LEN_FILENAME, sizeof(char));
-				if(!current_process->ifile) {
+			    case '<': /* input redirection, <<WORD here-document, <<< here-string */
+				if(cmdline[cmdline_pos+1] == '<') {
+					bool string = (cmdline[cmdline_pos+2] == '<');
+					cmdline_pos += string ? 3 : 2;
+					if(!(string ? herestring_word(current_process, cmdline, &cmdline_pos)
+						    : heredoc_word(current_process, cmdline, &cmdline_pos))) {
+						fprintf(stderr, "%s\n","malloc: no space");
+						delete_job(current_job,first_job);
+						return NULL;
+					}
+					valid_input = false;
+					break;
+				}
+				++cmdline_pos;
+				free(current_process->ifile);
+				free(current_process->heredoc);
+				free(current_process->heredelim);
+				current_process->heredoc = current_process->heredelim = NULL;
+				if(!(current_process->ifile = redirect_file(cmdline, &cmdline_pos))) {
 					fprintf(stderr, "%s\n","malloc: no space");
 					delete_job(current_job,first_job);
 					return NULL;
                 		}
-				++cmdline_pos;
-				while (isspace(cmdline[cmdline_pos])){++cmdline_pos;} /* ignore any spaces */
-				iofile_seek = 0;
-				while(cmdline[cmdline_pos] != '\0' && !isspace(cmdline[cmdline_pos])){
-					if(MAX_LEN_FILENAME == iofile_seek) {
-	                    			fprintf(stderr, "%s\n","malloc: no space");
-			            		delete_job(current_job,first_job);
-                        			return NULL;
-                    			}
-					current_process->ifile[iofile_seek++] = cmdline[cmdline_pos++];
-				}
-				current_process->ifile[iofile_seek] = '\0';
 				current_job->mystdin = INPUT_FD;
-				while(isspace(cmdline[cmdline_pos])) {
-					if(cmdline[cmdline_pos] == '\n')
-						break;
-					++cmdline_pos;
-				}
 				valid_input = false;
 				break;
 			
-			    case '>': /* output redirection */
-				current_process->ofile = (char *) calloc(MAX_LEN_FILENAME, sizeof(char));
-				if(!current_process->ofile) {
+			    case '>': /* output redirection: > truncates, >> appends */
+				current_process->oappend = (cmdline[cmdline_pos+1] == '>');
+				cmdline_pos += current_process->oappend ? 2 : 1;
+				free(current_process->ofile);
+				if(!(current_process->ofile = redirect_file(cmdline, &cmdline_pos))) {
 	                		fprintf(stderr, "%s\n","malloc: no space");
 			        	delete_job(current_job,first_job);
                     			return NULL;
                 		}
-				++cmdline_pos;
-				while (isspace(cmdline[cmdline_pos])){++cmdline_pos;} /* ignore any spaces */
-				iofile_seek = 0;
-				while(cmdline[cmdline_pos] != '\0' && !isspace(cmdline[cmdline_pos])){
-					if(MAX_LEN_FILENAME == iofile_seek) {
-	                    			fprintf(stderr, "%s\n","malloc: no space");
-			            		delete_job(current_job,first_job);
-                        			return NULL;
-                    			}
-					current_process->ofile[iofile_seek++] = cmdline[cmdline_pos++];
-				}
-				current_process->ofile[iofile_seek] = '\0';
 				current_job->mystdout = OUTPUT_FD;
-				while(isspace(cmdline[cmdline_pos])) {
-					if(cmdline[cmdline_pos] == '\n')
-						break;
-					++cmdline_pos;
-				}
 				valid_input = false;
 				break;
 
@@ -248,7 +684,24 @@ job_t* readcmdline(char *msg)
 				valid_input = true;	
 				break;
 
-			   case '&': /* background job */
+			   case '&': /* &> and &>> send stdout and stderr to a file */
+				if(cmdline[cmdline_pos+1] == '>') {
+					current_process->oappend = (cmdline[cmdline_pos+2] == '>');
+					cmdline_pos += current_process->oappend ? 3 : 2;
+					free(current_process->ofile);
+					free(current_process->efile);
+					current_process->efile = NULL;
+					current_process->errtoout = true;
+					if(!(current_process->ofile = redirect_file(cmdline, &cmdline_pos))) {
+						fprintf(stderr, "%s\n","malloc: no space");
+						delete_job(current_job,first_job);
+						return NULL;
+					}
+					current_job->mystdout = OUTPUT_FD;
+					valid_input = false;
+					break;
+				}
+				/* background job */
 				current_job->bg = true;
 				while (isspace(cmdline[cmdline_pos])){++cmdline_pos;} /* ignore any spaces */
 				if(cmdline[cmdline_pos+1] != '\n' && cmdline[cmdline_pos+1] != '\0')
@@ -262,10 +715,35 @@ job_t* readcmdline(char *msg)
 				seq_pos = cmdline_pos + 1;
 				break;	
 
-			   case '#': /* comment */
-				end_of_input = true;
-				break;
-
+			   case '2': /* 2>, 2>> and 2>&1 when 2 starts a word */
+				if(cmdline[cmdline_pos+1] == '>'
+				   && (cmd_pos == 0 || isspace(cmd[cmd_pos-1]) || !valid_input)) {
+					free(current_process->efile);
+					current_process->efile = NULL;
+					current_process->errtoout = !strncmp(cmdline + cmdline_pos, "2>&1", 4);
+					if(current_process->errtoout) {
+						cmdline_pos += 4;
+						while(isspace(cmdline[cmdline_pos]) && cmdline[cmdline_pos] != '\n')
+							++cmdline_pos;
+					} else {
+						current_process->eappend = (cmdline[cmdline_pos+2] == '>');
+						cmdline_pos += current_process->eappend ? 3 : 2;
+						if(!(current_process->efile = redirect_file(cmdline, &cmdline_pos))) {
+							fprintf(stderr, "%s\n","malloc: no space");
+							delete_job(current_job,first_job);
+							return NULL;
+						}
+					}
+					valid_input = false;
+					break;
+				}
+				/* fall through: just a 2 */
+			   case '#': /* a comment when it starts a word, else just a # ($#) */
+				if(cmdline[cmdline_pos] == '#' && (cmd_pos == 0 || isspace(cmd[cmd_pos-1]))) {
+					end_of_input = true;
+					break;
+				}
+				/* fall through */
 			   default:
 				if(!valid_input) {
 					fprintf(stderr, "%s\n", "reading cmdline: could not fathom input");
@@ -284,6 +762,12 @@ job_t* readcmdline(char *msg)
 				break;
 		}
 		cmd[cmd_pos] = '\0';
+
+		if(subst_depth != 0) {
+			fprintf(stderr,"%s\n","reading cmdline: unbalanced substitution");
+			delete_job(current_job,first_job);
+			return NULL;
+		}
 		
 		if(!readprocessinfo(current_process, cmd)) {
 			fprintf(stderr,"%s\n","read process info: error");
@@ -299,3 +783,1002 @@ job_t* readcmdline(char *msg)
 	}
 	return first_job;
 }
+
+/* A cached directory listing for glob expansion */
+typedef struct glob_dir {
+	struct glob_dir *next;
+	char *path;             /* as listed, "." for the cwd */
+	char **names;           /* entry names, . and .. left out */
+	unsigned char *types;   /* d_type of each entry */
+	int count;
+	size_t bytes;           /* memory held, for the cache bound */
+} glob_dir_t;
+
+static glob_dir_t *glob_cache = NULL; /* listings read for this command line */
+static size_t glob_cache_bytes = 0;
+
+/* Drops the directory listings cached while expanding a command line */
+void glob_cache_reset(void)
+{
+	glob_dir_t *d = glob_cache;
+	while(d) {
+		glob_dir_t *next = d->next;
+		int i;
+		for(i = 0; i < d->count; i++)
+			free(d->names[i]);
+		free(d->names);
+		free(d->types);
+		free(d->path);
+		free(d);
+		d = next;
+	}
+	glob_cache = NULL;
+	glob_cache_bytes = 0;
+}
+
+/* Adds one directory entry to a listing being read */
+static bool glob_dir_add(glob_dir_t *d, int *cap, const char *name, unsigned char type)
+{
+	if(!strcmp(name, ".") || !strcmp(name, ".."))
+		return true;
+	if(d->count == *cap) {
+		*cap = (*cap) ? *cap * 2 : 64;
+		char **names = (char **)realloc(d->names, *cap * sizeof(char *));
+		unsigned char *types = (unsigned char *)realloc(d->types, *cap);
+		if(names)
+			d->names = names;
+		if(types)
+			d->types = types;
+		if(!names || !types)
+			return false;
+	}
+	if(!(d->names[d->count] = strdup(name)))
+		return false;
+	d->types[d->count++] = type;
+	d->bytes += strlen(name) + 1 + sizeof(char *) + 1;
+	return true;
+}
+
+/* Returns the listing of path, reading it with getdents64() (readdir()
+ * elsewhere) the first time it is asked for on this command line */
+static glob_dir_t *glob_list_dir(const char *path)
+{
+	glob_dir_t *d;
+	for(d = glob_cache; d; d = d->next)
+		if(!strcmp(d->path, path))
+			return d;
+
+	if(!(d = (glob_dir_t *)calloc(1, sizeof(glob_dir_t))))
+		return NULL;
+	d->path = strdup(path);
+	int cap = 0;
+	bool ok = (d->path != NULL);
+
+#ifdef __linux__
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(fd < 0) {
+		ok = false;
+	} else {
+		char *buf = (char *)malloc(GLOB_DENTS_BUF_LEN);
+		long got;
+		while(ok && buf && (got = syscall(SYS_getdents64, fd, buf, GLOB_DENTS_BUF_LEN)) > 0) {
+			long off = 0;
+			while(ok && off < got) {
+				/* struct linux_dirent64: ino, off, reclen, type, name */
+				unsigned short reclen;
+				memcpy(&reclen, buf + off + 16, sizeof(reclen));
+				ok = glob_dir_add(d, &cap, buf + off + 19, (unsigned char)buf[off + 18]);
+				off += reclen;
+			}
+		}
+		free(buf);
+		close(fd);
+	}
+#else
+	DIR *dir = opendir(path);
+	if(!dir) {
+		ok = false;
+	} else {
+		struct dirent *e;
+		while(ok && (e = readdir(dir)))
+			ok = glob_dir_add(d, &cap, e->d_name, e->d_type);
+		closedir(dir);
+	}
+#endif
+
+	/* keep even a failed (or partial) listing so we do not retry it */
+	if(!ok)
+		DEBUG("glob: could not list %s", path);
+	d->bytes += sizeof(glob_dir_t) + strlen(path) + 1;
+	d->next = glob_cache;
+	glob_cache = d;
+	glob_cache_bytes += d->bytes;
+	return d;
+}
+
+/* true if word has glob wildcards (a [ needs its ], so "[" alone as used by
+ * test is not one) */
+static bool has_glob(const char *word)
+{
+	const char *bracket = strchr(word, '[');
+	return strpbrk(word, "*?") != NULL || (bracket && strchr(bracket, ']'));
+}
+
+/* Matches one bracket expression at *pat against c; advances *pat past it.
+ * Returns -1 for a malformed (unterminated) bracket, which matches '['. */
+static int glob_bracket(const char **pat, char c)
+{
+	const char *p = *pat + 1;
+	bool negate = (*p == '!' || *p == '^');
+	bool matched = false;
+	if(negate)
+		++p;
+	const char *start = p;
+	while(*p && (*p != ']' || p == start)) {
+		if(p[1] == '-' && p[2] && p[2] != ']') {
+			if(c >= p[0] && c <= p[2])
+				matched = true;
+			p += 3;
+		} else {
+			if(c == *p)
+				matched = true;
+			++p;
+		}
+	}
+	if(*p != ']')
+		return -1;
+	*pat = p + 1;
+	return matched != negate;
+}
+
+/* Wildcard match of a single path component: *, ? and [...]. Greedy with
+ * backtracking to the last star only, so it is linear for the usual cases */
+static bool glob_match(const char *pat, const char *name)
+{
+	const char *star_pat = NULL, *star_name = NULL;
+
+	while(*name) {
+		if(*pat == '*') {
+			star_pat = ++pat;
+			star_name = name;
+			continue;
+		}
+		if(*pat == '[') {
+			const char *p = pat;
+			int r = glob_bracket(&p, *name);
+			if(r == 1) {
+				pat = p;
+				++name;
+				continue;
+			}
+			if(r == -1 && *name == '[') {
+				++pat;
+				++name;
+				continue;
+			}
+		} else if(*pat && (*pat == '?' || *pat == *name)) {
+			++pat;
+			++name;
+			continue;
+		}
+		if(!star_pat)
+			return false;
+		pat = star_pat;          /* let the last star eat one more */
+		name = ++star_name;
+	}
+	while(*pat == '*')
+		++pat;
+	return *pat == '\0';
+}
+
+/* Joins a directory prefix ("" for the cwd) and a name */
+static char *glob_join(const char *base, const char *name)
+{
+	size_t blen = strlen(base);
+	char *path = (char *)malloc(blen + strlen(name) + 2);
+	if(!path)
+		return NULL;
+	if(blen == 0)
+		strcpy(path, name);
+	else if(base[blen - 1] == '/')
+		sprintf(path, "%s%s", base, name);
+	else
+		sprintf(path, "%s/%s", base, name);
+	return path;
+}
+
+/* true if entry i of d is a directory (following symlinks like sh) */
+static bool glob_is_dir(glob_dir_t *d, int i, const char *path)
+{
+	if(d->types[i] == DT_DIR)
+		return true;
+	if(d->types[i] != DT_UNKNOWN && d->types[i] != DT_LNK)
+		return false;
+	struct stat st;
+	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/* Expands the pattern components segs[i..n) below base onto argv */
+static bool glob_walk(const char *base, char **segs, int i, int n, int depth,
+		char ***argv, int *argc, int *cap)
+{
+	if(i == n)
+		return argv_push(argv, argc, cap, strdup(base));
+	if(depth > GLOB_MAX_DEPTH)
+		return true;
+
+	const char *seg = segs[i];
+	bool ok = true;
+
+	if(!has_glob(seg)) { /* literal component: no listing needed */
+		char *path = glob_join(base, seg);
+		struct stat st;
+		if(!path)
+			return false;
+		if(lstat(path, &st) == 0)
+			ok = glob_walk(path, segs, i + 1, n, depth, argv, argc, cap);
+		free(path);
+		return ok;
+	}
+
+	/* ** matches any number of directories; as the last component it
+	 * matches everything below base */
+	bool recurse = !strcmp(seg, "**");
+	bool last = (i == n - 1);
+	if(recurse && !last && !glob_walk(base, segs, i + 1, n, depth, argv, argc, cap))
+		return false; /* ** matching no directory at all */
+
+	glob_dir_t *d = glob_list_dir(*base ? base : ".");
+	if(!d)
+		return false;
+
+	int k;
+	for(k = 0; ok && k < d->count; k++) {
+		const char *name = d->names[k];
+		if(name[0] == '.' && seg[0] != '.')
+			continue; /* hidden files need an explicit dot */
+		if(!recurse && !glob_match(seg, name))
+			continue;
+
+		char *path = glob_join(base, name);
+		if(!path)
+			return false;
+		if(recurse) {
+			if(last)
+				ok = argv_push(argv, argc, cap, strdup(path));
+			if(ok && glob_is_dir(d, k, path))
+				ok = glob_walk(path, segs, i, n, depth + 1, argv, argc, cap);
+		} else if(last) {
+			ok = argv_push(argv, argc, cap, path);
+			path = NULL;
+		} else if(glob_is_dir(d, k, path)) {
+			ok = glob_walk(path, segs, i + 1, n, depth + 1, argv, argc, cap);
+		}
+		free(path);
+	}
+	return ok;
+}
+
+static int glob_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Pushes word onto argv, replaced by the sorted paths it matches if it is
+ * a glob pattern. Patterns matching nothing are passed on as they are.
+ * Takes ownership of word. */
+static bool glob_push(char *word, char ***argv, int *argc, int *cap)
+{
+	if(!has_glob(word))
+		return argv_push(argv, argc, cap, word);
+
+	/* the cache only grows while a word expands, so bound it in between */
+	if(glob_cache_bytes > GLOB_CACHE_MAX_BYTES)
+		glob_cache_reset();
+
+	/* split into components; a leading / anchors at the root */
+	char *copy = strdup(word);
+	char **segs = (char **)malloc((strlen(word) / 2 + 2) * sizeof(char *));
+	if(!copy || !segs) {
+		free(copy);
+		free(segs);
+		free(word);
+		return false;
+	}
+	int nsegs = 0;
+	char *save = NULL;
+	char *seg;
+	for(seg = strtok_r(copy, "/", &save); seg; seg = strtok_r(NULL, "/", &save))
+		segs[nsegs++] = seg;
+
+	int first = *argc;
+	bool ok = glob_walk(word[0] == '/' ? "/" : "", segs, 0, nsegs, 0, argv, argc, cap);
+	free(segs);
+	free(copy);
+
+	if(ok && *argc == first) /* no match: keep the pattern */
+		return argv_push(argv, argc, cap, word);
+	free(word);
+	if(ok)
+		qsort(*argv + first, *argc - first, sizeof(char *), glob_cmp);
+	return ok;
+}
+
+/* Shell variables, in a chained hash table that owns names and values */
+typedef struct shell_var {
+	struct shell_var *next;
+	char *name;
+	char *value;
+} shell_var_t;
+
+static shell_var_t *var_table[VAR_BUCKETS];
+
+static unsigned var_hash(const char *name, size_t len)
+{
+	unsigned h = 2166136261u; /* FNV-1a */
+	while(len--)
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+	return h % VAR_BUCKETS;
+}
+
+static shell_var_t *var_find(const char *name, size_t len)
+{
+	shell_var_t *v;
+	for(v = var_table[var_hash(name, len)]; v; v = v->next)
+		if(!strncmp(v->name, name, len) && v->name[len] == '\0')
+			return v;
+	return NULL;
+}
+
+/* Value of the len bytes long name: a shell variable, else the environment,
+ * else NULL. $? is the status of the last job, $0..$9, $# and $@ are the
+ * words of the function being run. */
+static const char *var_lookup(const char *name, size_t len)
+{
+	static char status[16];
+	if(len == 1 && name[0] == '?') {
+		snprintf(status, sizeof(status), "%d", last_status());
+		return status;
+	}
+	if(len == 1 && (isdigit((unsigned char)name[0]) || name[0] == '#' || name[0] == '@'))
+		return func_arg(name[0]);
+	shell_var_t *v = var_find(name, len);
+	if(v)
+		return v->value;
+
+	char key[MAX_LEN_CMDLINE];
+	if(len >= sizeof(key))
+		return NULL;
+	memcpy(key, name, len);
+	key[len] = '\0';
+	return getenv(key);
+}
+
+/* Value of shell variable (or environment variable) name, NULL if unset */
+const char *get_var(const char *name)
+{
+	return var_lookup(name, strlen(name));
+}
+
+/* Sets shell variable name to value */
+bool set_var(const char *name, const char *value)
+{
+	size_t len = strlen(name);
+	shell_var_t *v = var_find(name, len);
+	char *copy = strdup(value);
+	if(!copy)
+		return false;
+	if(!v) {
+		if(!(v = (shell_var_t *)calloc(1, sizeof(shell_var_t))) || !(v->name = strdup(name))) {
+			free(v);
+			free(copy);
+			return false;
+		}
+		unsigned h = var_hash(name, len);
+		v->next = var_table[h];
+		var_table[h] = v;
+	}
+	free(v->value);
+	v->value = copy;
+	return !env_exported(name) || env_export(name, value);
+}
+
+/* Forgets shell variable name and takes it out of the environment */
+void unset_var(const char *name)
+{
+	size_t len = strlen(name);
+	shell_var_t **link = &var_table[var_hash(name, len)];
+	while(*link && strcmp((*link)->name, name))
+		link = &(*link)->next;
+	if(*link) {
+		shell_var_t *v = *link;
+		*link = v->next;
+		free(v->name);
+		free(v->value);
+		free(v);
+	}
+	env_unset(name);
+}
+
+/* Length of the variable name word starts with, 0 if it does not */
+static size_t name_prefix(const char *word)
+{
+	size_t i = 0;
+	if(!isalpha((unsigned char)word[0]) && word[0] != '_')
+		return 0;
+	while(isalnum((unsigned char)word[i]) || word[i] == '_')
+		++i;
+	return i;
+}
+
+/* Length of the NAME in a NAME=value word, 0 if word is not an assignment */
+static size_t assignment_name(const char *word)
+{
+	size_t i = name_prefix(word);
+	return (i && word[i] == '=') ? i : 0;
+}
+
+/* true if j is nothing but NAME=value words */
+bool is_assignment_job(job_t *j)
+{
+	process_t *p = j->first_process;
+	int i;
+	if(p->next || p->argc == 0 || p->ifile || p->ofile || p->efile || p->errtoout)
+		return false;
+	for(i = 0; i < p->argc; i++)
+		if(!assignment_name(p->argv[i]))
+			return false;
+	return true;
+}
+
+/* Arithmetic of $((...)): C integer operators on long long, variables by
+ * name (with or without $) and =, +=, -=, *=, /=, %= */
+typedef struct arith {
+	const char *s;  /* next character */
+	const char *err; /* first error, NULL while fine */
+} arith_t;
+
+static long long arith_assign(arith_t *a);
+
+static void arith_space(arith_t *a)
+{
+	while(isspace((unsigned char)*a->s))
+		++a->s;
+}
+
+/* value of a variable as a number; unset or empty is 0 */
+static long long arith_var(arith_t *a, const char *name, size_t len)
+{
+	const char *value = var_lookup(name, len);
+	if(!value || !*value)
+		return 0;
+	char *end;
+	long long n = strtoll(value, &end, 0);
+	while(isspace((unsigned char)*end))
+		++end;
+	if(*end && !a->err)
+		a->err = "not a number";
+	return n;
+}
+
+static long long arith_unary(arith_t *a)
+{
+	arith_space(a);
+	char c = *a->s;
+	if(c == '-' || c == '+' || c == '!' || c == '~') {
+		++a->s;
+		long long v = arith_unary(a);
+		return c == '-' ? -v : c == '+' ? v : c == '!' ? !v : ~v;
+	}
+	if(c == '(') {
+		++a->s;
+		long long v = arith_assign(a);
+		arith_space(a);
+		if(*a->s == ')')
+			++a->s;
+		else if(!a->err)
+			a->err = "missing )";
+		return v;
+	}
+	if(isdigit((unsigned char)c)) {
+		char *end;
+		long long v = strtoll(a->s, &end, 0);
+		a->s = end;
+		return v;
+	}
+	if(c == '$')
+		++a->s;
+	const char *name = a->s;
+	while(isalnum((unsigned char)*a->s) || *a->s == '_')
+		++a->s;
+	if(a->s == name) {
+		if(!a->err)
+			a->err = "syntax error";
+		return 0;
+	}
+	return arith_var(a, name, a->s - name);
+}
+
+/* binary operators with their precedence, longest spelling first */
+static const struct { const char *op; int prec; } arith_ops[] = {
+	{ "||", 1 }, { "&&", 2 }, { "==", 6 }, { "!=", 6 }, { "<=", 7 }, { ">=", 7 },
+	{ "<<", 8 }, { ">>", 8 }, { "|", 3 }, { "^", 4 }, { "&", 5 }, { "<", 7 },
+	{ ">", 7 }, { "+", 9 }, { "-", 9 }, { "*", 10 }, { "/", 10 }, { "%", 10 },
+	{ NULL, 0 }
+};
+
+/* why lhs op rhs has no value (it would trap or be undefined), else NULL */
+static const char *arith_invalid(const char *op, long long lhs, long long rhs)
+{
+	if((*op == '/' || *op == '%') && !op[1]) {
+		if(rhs == 0)
+			return "division by zero";
+		if(lhs == LLONG_MIN && rhs == -1)
+			return "division overflow";
+	}
+	if((!strcmp(op, "<<") || !strcmp(op, ">>")) && (rhs < 0 || rhs >= 64))
+		return "shift count out of range";
+	return NULL;
+}
+
+/* lhs op rhs; + - * wrap around rather than overflow */
+static long long arith_apply(const char *op, long long lhs, long long rhs)
+{
+	if(!strcmp(op, "||")) return lhs || rhs;
+	if(!strcmp(op, "&&")) return lhs && rhs;
+	if(!strcmp(op, "==")) return lhs == rhs;
+	if(!strcmp(op, "!=")) return lhs != rhs;
+	if(!strcmp(op, "<=")) return lhs <= rhs;
+	if(!strcmp(op, ">=")) return lhs >= rhs;
+	if(!strcmp(op, "<<")) return (long long)((unsigned long long)lhs << rhs);
+	if(!strcmp(op, ">>")) return lhs >> rhs;
+	switch(*op) {
+	case '|': return lhs | rhs;
+	case '^': return lhs ^ rhs;
+	case '&': return lhs & rhs;
+	case '<': return lhs < rhs;
+	case '>': return lhs > rhs;
+	case '+': return (long long)((unsigned long long)lhs + (unsigned long long)rhs);
+	case '-': return (long long)((unsigned long long)lhs - (unsigned long long)rhs);
+	case '*': return (long long)((unsigned long long)lhs * (unsigned long long)rhs);
+	case '/': return lhs / rhs;
+	default:  return lhs % rhs;
+	}
+}
+
+/* precedence climbing over arith_ops */
+static long long arith_binary(arith_t *a, int min_prec)
+{
+	long long lhs = arith_unary(a);
+	while(!a->err) {
+		arith_space(a);
+		int i;
+		for(i = 0; arith_ops[i].op; i++)
+			if(!strncmp(a->s, arith_ops[i].op, strlen(arith_ops[i].op)))
+				break;
+		const char *op = arith_ops[i].op;
+		if(!op || arith_ops[i].prec < min_prec || (!op[1] && a->s[1] == '='))
+			break; /* not ours, or a compound assignment */
+		a->s += strlen(op);
+		long long rhs = arith_binary(a, arith_ops[i].prec + 1);
+		const char *invalid = arith_invalid(op, lhs, rhs);
+		if(invalid) {
+			if(!a->err)
+				a->err = invalid;
+			return 0;
+		}
+		lhs = arith_apply(op, lhs, rhs);
+	}
+	return lhs;
+}
+
+/* NAME = expr and NAME op= expr, else a plain expression */
+static long long arith_assign(arith_t *a)
+{
+	arith_space(a);
+	const char *start = a->s;
+	const char *name = a->s;
+	size_t len = 0;
+	while(isalnum((unsigned char)name[len]) || name[len] == '_')
+		++len;
+	if(len > 0 && !isdigit((unsigned char)name[0])) {
+		a->s = name + len;
+		arith_space(a);
+		char op = 0;
+		if(a->s[0] == '=' && a->s[1] != '=') {
+			op = '=';
+			a->s += 1;
+		} else if(strchr("+-*/%", a->s[0]) && a->s[0] && a->s[1] == '=') {
+			op = a->s[0];
+			a->s += 2;
+		}
+		if(op) {
+			long long rhs = arith_assign(a);
+			long long v = rhs;
+			if(a->err)
+				return 0;
+			if(op != '=') {
+				char spelled[2] = { op, '\0' };
+				long long lhs = arith_var(a, name, len);
+				const char *invalid = arith_invalid(spelled, lhs, rhs);
+				if(invalid || a->err) {
+					if(!a->err)
+						a->err = invalid;
+					return 0;
+				}
+				v = arith_apply(spelled, lhs, rhs);
+			}
+			char key[MAX_LEN_CMDLINE], num[32];
+			snprintf(key, sizeof(key), "%.*s", (int)len, name);
+			snprintf(num, sizeof(num), "%lld", v);
+			set_var(key, num);
+			return v;
+		}
+	}
+	a->s = start;
+	return arith_binary(a, 1);
+}
+
+/* Evaluates the text of a $((...)) into a malloc'd decimal string */
+static char *arith_eval(const char *expr)
+{
+	arith_t a = { expr, NULL };
+	long long v = arith_assign(&a);
+	arith_space(&a);
+	if(!a.err && *a.s)
+		a.err = "syntax error";
+	if(a.err) {
+		fprintf(stderr, "arithmetic: %s in %s\n", a.err, expr);
+		return NULL;
+	}
+	char num[32];
+	snprintf(num, sizeof(num), "%lld", v);
+	return strdup(num);
+}
+
+/* Starts the process substitution inner as a concurrent job and appends
+ * /dev/fd/N naming the shell's end of its pipe to the word; p keeps fd N
+ * open across its exec. */
+static bool expand_proc_subst(process_t *p, char *inner, bool to_cmd,
+		char **cur, size_t *cur_len, size_t *cur_cap)
+{
+	int fd = open_proc_subst(inner, to_cmd);
+	if(fd < 0)
+		return false;
+
+	int *grown = (int *)realloc(p->keepfds, (p->nkeepfds + 1) * sizeof(int));
+	if(!grown) {
+		close(fd);
+		return false;
+	}
+	p->keepfds = grown;
+	p->keepfds[p->nkeepfds++] = fd;
+
+	char path[MAX_LEN_FILENAME];
+	int n = snprintf(path, sizeof(path), "/dev/fd/%d", fd);
+	return str_append(cur, cur_len, cur_cap, path, n);
+}
+
+/* Appends out to the word being assembled. When splitting, out is split on
+ * white space into fields: text around it sticks to the first and last field
+ * like in sh, and every finished field is globbed onto argv. */
+static bool push_fields(const char *out, size_t out_len, bool split,
+		char **cur, size_t *cur_len, size_t *cur_cap, bool *have_word,
+		char ***argv, int *argc, int *cap)
+{
+	if(!split) {
+		*have_word = true;
+		return str_append(cur, cur_len, cur_cap, out, out_len);
+	}
+
+	size_t i = 0;
+	while(i < out_len) {
+		if(isspace((unsigned char)out[i]) || out[i] == '\0') {
+			if(*have_word) { /* field boundary */
+				if(!glob_push(*cur ? *cur : strdup(""), argv, argc, cap))
+					return false;
+				*cur = NULL;
+				*cur_len = *cur_cap = 0;
+				*have_word = false;
+			}
+			++i;
+			continue;
+		}
+		size_t j = i;
+		while(j < out_len && !isspace((unsigned char)out[j]) && out[j] != '\0')
+			++j;
+		if(!str_append(cur, cur_len, cur_cap, out + i, j - i))
+			return false;
+		*have_word = true;
+		i = j;
+	}
+	return true;
+}
+
+/* Expands the substitutions and variables of a single word of p onto argv.
+ * The output of $(...) and the value of $name are split on white space
+ * (unless split is false: then the word stays one word and is not globbed,
+ * as for the value of an assignment); $((...)) is always one field. <(...)
+ * and >(...) become a single /dev/fd path. The resulting words are then
+ * globbed. */
+static bool expand_word(process_t *p, char *word, bool split,
+		char ***argv, int *argc, int *cap)
+{
+	if(!has_subst(word))
+		return split ? glob_push(strdup(word), argv, argc, cap)
+		             : argv_push(argv, argc, cap, strdup(word));
+
+	char *cur = NULL;       /* word being assembled */
+	size_t cur_len = 0, cur_cap = 0;
+	bool have_word = false; /* cur holds a (possibly empty) word */
+	int pos = 0;
+
+	while(word[pos] != '\0') {
+		size_t name_off, name_len;
+		size_t ref = var_ref(word + pos, &name_off, &name_len);
+		if(ref) {
+			const char *value = var_lookup(word + pos + name_off, name_len);
+			pos += ref;
+			if(value && !push_fields(value, strlen(value), split, &cur, &cur_len,
+						&cur_cap, &have_word, argv, argc, cap))
+				return false;
+			continue;
+		}
+
+		int open = subst_opener(word + pos);
+		if(!open) {
+			if(!str_append(&cur, &cur_len, &cur_cap, word + pos, 1))
+				return false;
+			have_word = true;
+			++pos;
+			continue;
+		}
+
+		/* find the matching ) */
+		int depth = 0;
+		int end = pos;
+		do
+			end += subst_span(word + end, &depth);
+		while(depth > 0 && word[end] != '\0');
+		char kind = word[pos];
+		char *inner = strndup(word + pos + open, end - pos - open - 1);
+		pos = end;
+
+		if(kind != '$') { /* process substitution */
+			bool ok = expand_proc_subst(p, inner, kind == '>', &cur, &cur_len, &cur_cap);
+			free(inner);
+			if(!ok)
+				return false;
+			have_word = true;
+			continue;
+		}
+
+		size_t inner_len = strlen(inner);
+		if(inner_len >= 2 && inner[0] == '(' && inner[inner_len - 1] == ')') {
+			/* $((...)) arithmetic */
+			inner[inner_len - 1] = '\0';
+			char *num = arith_eval(inner + 1);
+			free(inner);
+			if(!num || !str_append(&cur, &cur_len, &cur_cap, num, strlen(num))) {
+				free(num);
+				return false;
+			}
+			free(num);
+			have_word = true;
+			continue;
+		}
+
+		size_t out_len;
+		char *out = capture_output(inner, &out_len);
+		free(inner);
+		if(!out)
+			return false;
+		if(!split) /* one word: only the trailing newlines go */
+			while(out_len > 0 && out[out_len - 1] == '\n')
+				--out_len;
+		bool ok = push_fields(out, out_len, split, &cur, &cur_len, &cur_cap,
+				      &have_word, argv, argc, cap);
+		free(out);
+		if(!ok)
+			return false;
+	}
+
+	if(!split)
+		return argv_push(argv, argc, cap, cur ? cur : strdup(""));
+	if(have_word)
+		return glob_push(cur ? cur : strdup(""), argv, argc, cap);
+	return true;
+}
+
+/* NAME=value word with its value expanded into one word (malloc'd), NULL
+ * if the expansion failed */
+static char *expand_assignment(process_t *p, const char *word)
+{
+	size_t len = assignment_name(word);
+	char **argv = NULL;
+	int argc = 0, cap = 0;
+	if(!expand_word(p, (char *)word + len + 1, false, &argv, &argc, &cap)) {
+		fprintf(stderr, "%s\n", "expanding cmdline: error");
+		return NULL;
+	}
+	char *done = (char *)malloc(len + 1 + strlen(argv[0]) + 1);
+	if(done)
+		sprintf(done, "%.*s=%s", (int)len, word, argv[0]);
+	free(argv[0]);
+	free(argv);
+	return done;
+}
+
+/* Sets (and exports, if export is true) the variable of a NAME=value word */
+static bool assign_word(process_t *p, const char *word, bool export)
+{
+	char *done = expand_assignment(p, word);
+	if(!done)
+		return false;
+	char *value = strchr(done, '=');
+	*value++ = '\0';
+	bool ok = set_var(done, value) && (!export || env_export(done, value));
+	free(done);
+	return ok;
+}
+
+/* Performs the NAME=value words of an assignment job (see
+ * is_assignment_job()); values are expanded but stay one word each */
+bool assign_job(job_t *j)
+{
+	process_t *p = j->first_process;
+	int i;
+	for(i = 0; i < p->argc; i++)
+		if(!assign_word(p, p->argv[i], false))
+			return false;
+	return true;
+}
+
+/* true if j is export with NAME or NAME=value words */
+bool is_export_job(job_t *j)
+{
+	process_t *p = j->first_process;
+	int i;
+	if(p->next || p->argc < 2 || strcmp(p->argv[0], "export"))
+		return false;
+	for(i = 1; i < p->argc; i++) {
+		size_t len = name_prefix(p->argv[i]);
+		if(!len || (p->argv[i][len] != '\0' && p->argv[i][len] != '='))
+			return false;
+	}
+	return true;
+}
+
+/* Exports the words of an export job: NAME=value sets and exports NAME,
+ * NAME exports the value it has as a shell variable (nothing if unset) */
+bool export_job(job_t *j)
+{
+	process_t *p = j->first_process;
+	int i;
+	for(i = 1; i < p->argc; i++) {
+		if(assignment_name(p->argv[i])) {
+			if(!assign_word(p, p->argv[i], true))
+				return false;
+		} else {
+			const char *value = get_var(p->argv[i]);
+			if(value && !env_export(p->argv[i], value))
+				return false;
+		}
+	}
+	return true;
+}
+
+/* Moves the leading NAME=value words of p (all but its last word) to
+ * p->env with their values expanded, for new_child() to put in the
+ * environment of the command alone */
+static bool take_assignments(process_t *p)
+{
+	int n = 0;
+	while(n < p->argc - 1 && assignment_name(p->argv[n]))
+		++n;
+	if(n == 0)
+		return true;
+	char **env = (char **)realloc(p->env, (p->nenv + n) * sizeof(char *));
+	if(!env)
+		return false;
+	p->env = env;
+	int i;
+	for(i = 0; i < n; i++) {
+		if(!(p->env[p->nenv] = expand_assignment(p, p->argv[i])))
+			return false;
+		p->nenv++;
+	}
+	for(i = 0; i < n; i++)
+		free(p->argv[i]);
+	memmove(p->argv, p->argv + n, (p->argc - n + 1) * sizeof(char *));
+	p->argc -= n;
+	return true;
+}
+
+/* Writes the body of the here-document or here-string of p, expanded unless
+ * its WORD was quoted, into a sealed memfd (p->herefd) that new_child() puts
+ * on the command's stdin: the body never touches the filesystem, and the
+ * seals let nothing change it once written */
+static bool here_open(process_t *p)
+{
+	const char *text = p->heredoc;
+	char **argv = NULL;
+	int argc = 0, cap = 0;
+	if(p->hereexpand && has_subst(text)) {
+		if(!expand_word(p, p->heredoc, false, &argv, &argc, &cap))
+			return false;
+		text = argv[0];
+	}
+	size_t len = strlen(text), done = 0;
+	int fd = memfd_create("dsh-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	while(fd >= 0 && done < len) {
+		ssize_t n = write(fd, text + done, len - done);
+		if(n < 0 && errno != EINTR) {
+			close(fd);
+			fd = -1;
+		} else if(n > 0) {
+			done += n;
+		}
+	}
+	if(fd >= 0 && (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0
+		       || lseek(fd, 0, SEEK_SET) < 0)) {
+		close(fd);
+		fd = -1;
+	}
+	if(argv) {
+		free(argv[0]);
+		free(argv);
+	}
+	if(fd < 0) {
+		perror("here-document");
+		return false;
+	}
+	if(p->herefd >= 0)
+		close(p->herefd);
+	p->herefd = fd;
+	return true;
+}
+
+/* Expands the variables and the $((...)), $(...), <(...) and >(...)
+ * substitutions and the glob patterns in the argv of every process of j,
+ * after moving its leading NAME=value words to its env, and writes the
+ * body of its here-document, if any, into a memfd. Called right
+ * before the job runs so the inner commands see the state left by the
+ * jobs before it. Returns false if an expansion failed. */
+bool expand_job(job_t *j)
+{
+	process_t *p;
+	for(p = j->first_process; p; p = p->next) {
+		int i;
+		if(!take_assignments(p)) {
+			fprintf(stderr, "%s\n", "expanding cmdline: error");
+			return false;
+		}
+		if(p->heredoc && !here_open(p))
+			return false;
+		bool needed = false;
+		for(i = 0; i < p->argc; i++)
+			if(has_subst(p->argv[i]) || has_glob(p->argv[i]))
+				needed = true;
+		if(!needed)
+			continue;
+
+		char **argv = NULL;
+		int argc = 0, cap = 0;
+		for(i = 0; i < p->argc; i++) {
+			if(!expand_word(p, p->argv[i], true, &argv, &argc, &cap)) {
+				fprintf(stderr, "%s\n", "expanding cmdline: error");
+				return false;
+			}
+		}
+		if(!argv && !(argv = (char **)calloc(1, sizeof(char *)))) /* empty expansion */
+			return false;
+
+		for(i = 0; i < p->argc; i++)
+			free(p->argv[i]);
+		free(p->argv);
+		p->argv = argv;
+		p->argc = argc;
+	}
+	return true;
+}
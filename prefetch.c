@@ -0,0 +1,484 @@
+/*
+ * prefetch.c
+ * Executable prefetching for scripts: when dsh starts reading a script
+ * from a file, the command names it will run are looked up on $PATH and a
+ * thread asks the kernel to read ahead (posix_fadvise(WILLNEED)) each
+ * executable, its program interpreter and the shared libraries it needs
+ * (DT_NEEDED, recursively), so the page cache misses of the first exec of
+ * each command overlap with the lines that run before it. $DSH_PREFETCH=0
+ * turns it off.
+ *
+ * Only the first word of each command is looked at (after ;, |, &, && and
+ * ||, and at the start of a line), so commands run by forall, after or
+ * loops' $-expanded names are not prefetched. Libraries are looked for in
+ * DT_RPATH/DT_RUNPATH ($ORIGIN expanded), $LD_LIBRARY_PATH, the new format
+ * /etc/ld.so.cache and the default directories, for 64 bit ELF files only.
+ */
+
+#include "dsh.h"
+
+#include <pthread.h>    /* prefetch thread */
+#include <elf.h>        /* Elf64_Ehdr, Elf64_Phdr, Elf64_Dyn */
+#include <limits.h>     /* PATH_MAX */
+#include <sys/mman.h>   /* mmap() of ld.so.cache */
+
+//longest script looked at for command names
+#define PREFETCH_MAX_SCRIPT (4 << 20)
+
+//program headers and dynamic entries read from one ELF file at most
+#define PREFETCH_MAX_PHDRS 64
+#define PREFETCH_MAX_DYN 512
+
+//first bytes of the ld.so.cache format prefetch can read
+#define LD_CACHE_PATH "/etc/ld.so.cache"
+#define LD_CACHE_MAGIC "glibc-ld.so.cache1.1"
+
+//where libraries are when nothing else says
+static const char* defaultLibDirs[] = { "/lib/x86_64-linux-gnu", "/usr/lib/x86_64-linux-gnu",
+                                        "/lib64", "/usr/lib64", "/lib", "/usr/lib", NULL };
+
+//what happened to a file queued for prefetching
+typedef enum { PREFETCH_QUEUED, PREFETCH_DONE, PREFETCH_MISSING } prefetchState;
+
+//a command of a script, or a file it needs
+typedef struct {
+   char* name;                //command name as written, NULL for a library
+   char* path;                //resolved file
+   prefetchState state;
+   bool used;                 //its command has been spawned
+} prefetchFile;
+
+//the files queued so far, guarded against the thread
+static pthread_mutex_t prefetchMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetchWake = PTHREAD_COND_INITIALIZER;
+static prefetchFile* files = NULL;
+static int nFiles = 0;
+static int filesCap = 0;
+
+//shell the thread runs in; a forked child has none and may have forked
+//while it held the mutex
+static pid_t prefetchOwner = -1;
+
+//$LD_LIBRARY_PATH as it was when the thread started (export changes the
+//environment under it), the thread's own copy
+static const char* libraryPath = NULL;
+
+//ld.so.cache, mapped once by the thread
+static const char* ldCache = NULL;
+static size_t ldCacheLen = 0;
+
+//counters for the stats builtin
+static unsigned long statFiles = 0;
+static unsigned long long statBytes = 0;
+static unsigned long statHits = 0;
+static unsigned long statLate = 0;
+
+//adds a file unless it is queued already; called with prefetchMutex held
+static void queueFile(const char* name, const char* path);
+
+//prefetch thread: reads ahead every queued file; arg is its libraryPath
+static void* prefetchFiles(void* arg);
+
+//reads ahead the file at path and queues what it needs; false if it is
+//not there
+static bool readAhead(const char* path);
+
+//queues the interpreter and the DT_NEEDED libraries of ELF file fd
+static void queueNeeded(int fd, const char* path);
+
+//finds library name the way ld.so would, for an object in dir with the
+//search path rpath; false if it is nowhere
+static bool findLibrary(const char* name, const char* rpath, const char* dir, char* found, size_t len);
+
+//looks name up in ld.so.cache
+static bool cachedLibrary(const char* name, char* found, size_t len);
+
+//true if a word starting a command ends here
+static bool isSeparator(char c);
+
+//true if command name is queued already; called with prefetchMutex held
+static bool queuedName(const char* name);
+
+//queues the executables of the commands of the script being read from in
+void prefetch_script(FILE* in){
+   const char* enabled = get_var("DSH_PREFETCH");
+   int fd = fileno(in);
+   struct stat st;
+   if((enabled != NULL && !strcmp(enabled, "0")) || fd < 0 || isatty(fd)
+      || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)){
+      return; //typed in, or a pipe we cannot read ahead of
+   }
+   off_t from = ftell(in);
+   if(from < 0 || st.st_size <= from){
+      return;
+   }
+   size_t len = (st.st_size - from < PREFETCH_MAX_SCRIPT) ? st.st_size - from : PREFETCH_MAX_SCRIPT;
+   char* script = (char*) malloc(len + 1);
+   ssize_t got = (script != NULL) ? pread(fd, script, len, from) : -1;
+   if(got <= 0){
+      free(script);
+      return;
+   }
+   script[got] = '\0';
+
+   //the first word of each command
+   pthread_mutex_lock(&prefetchMutex);
+   char word[MAX_LEN_FILENAME * 4];
+   bool commandStart = true;
+   for(char* c = script; *c != '\0'; ){
+      if(*c == '#' && commandStart){ //comment
+         while(*c != '\0' && *c != '\n'){
+            c++;
+         }
+         continue;
+      } else if(isSeparator(*c)){
+         commandStart = true;
+         c++;
+         continue;
+      } else if(*c == ' ' || *c == '\t' || *c == '<' || *c == '>' || *c == ')'){
+         c++;
+         continue;
+      }
+      size_t n = strcspn(c, " \t\n;|&()<>");
+      if(commandStart && n < sizeof(word) && strcspn(c, "=$`'\"*?[{") >= n){ //a literal name
+         memcpy(word, c, n);
+         word[n] = '\0';
+         char path[PATH_MAX];
+         if(!queuedName(word)){ //names not on $PATH are kept too, to be looked up once
+            queueFile(word, resolve_command(word, path, sizeof(path)) ? path : "");
+         }
+      }
+      commandStart = false;
+      c += n;
+   }
+   if(prefetchOwner != getpid()){
+      const char* ldPath = getenv("LD_LIBRARY_PATH");
+      char* copy = (ldPath != NULL) ? strdup(ldPath) : NULL;
+      //signals are for the main thread only
+      sigset_t all, old;
+      sigfillset(&all);
+      pthread_sigmask(SIG_BLOCK, &all, &old);
+      pthread_t thread;
+      if(pthread_create(&thread, NULL, prefetchFiles, copy) == 0){
+         pthread_detach(thread);
+         prefetchOwner = getpid();
+      } else {
+         free(copy);
+      }
+      pthread_sigmask(SIG_SETMASK, &old, NULL);
+   }
+   pthread_cond_signal(&prefetchWake);
+   pthread_mutex_unlock(&prefetchMutex);
+   free(script);
+}
+
+//notes that the command name is being spawned: a hit if its executable
+//was read ahead already, late if it is still queued
+void prefetch_note_exec(const char* name){
+   if(prefetchOwner != getpid()){
+      return; //no script prefetched here
+   }
+   pthread_mutex_lock(&prefetchMutex);
+   for(int i = 0; i < nFiles; i++){
+      prefetchFile* f = &files[i];
+      if(f->name != NULL && !(f->used) && !strcmp(f->name, name)){
+         f->used = true; //only the first exec is cold
+         statHits += (f->state == PREFETCH_DONE);
+         statLate += (f->state == PREFETCH_QUEUED);
+         break;
+      }
+   }
+   pthread_mutex_unlock(&prefetchMutex);
+}
+
+//prints the prefetch counters for the stats builtin
+void prefetch_print_stats(void){
+   printf("prefetch files: %lu\n", statFiles);
+   printf("prefetch bytes: %llu\n", statBytes);
+   printf("prefetch hits: %lu\n", statHits);
+   printf("prefetch late: %lu\n", statLate);
+}
+
+//adds a file unless it is queued already; called with prefetchMutex held
+static void queueFile(const char* name, const char* path){
+   for(int i = 0; i < nFiles; i++){
+      if(!strcmp(files[i].path, path) && (name == NULL || (files[i].name != NULL && !strcmp(files[i].name, name)))){
+         return;
+      }
+   }
+   if(nFiles == filesCap){
+      int cap = (filesCap > 0) ? filesCap * 2 : 32;
+      prefetchFile* grown = (prefetchFile*) realloc(files, cap * sizeof(prefetchFile));
+      if(grown == NULL){
+         return;
+      }
+      files = grown;
+      filesCap = cap;
+   }
+   prefetchFile* f = &files[nFiles];
+   f->name = (name != NULL) ? strdup(name) : NULL;
+   f->path = strdup(path);
+   f->state = PREFETCH_QUEUED;
+   f->used = false;
+   if(f->path != NULL){
+      nFiles++;
+   } else {
+      free(f->name);
+   }
+}
+
+//prefetch thread: reads ahead every queued file, libraries queued on
+//the way included; arg is its libraryPath
+static void* prefetchFiles(void* arg){
+   pthread_mutex_lock(&prefetchMutex);
+   libraryPath = (const char*) arg;
+   int fd = open(LD_CACHE_PATH, O_RDONLY | O_CLOEXEC);
+   struct stat st;
+   if(fd >= 0 && fstat(fd, &st) == 0 && st.st_size > (off_t) strlen(LD_CACHE_MAGIC)){
+      void* mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(mem != MAP_FAILED && !memcmp(mem, LD_CACHE_MAGIC, strlen(LD_CACHE_MAGIC))){
+         ldCache = (const char*) mem;
+         ldCacheLen = st.st_size;
+      } else if(mem != MAP_FAILED){
+         munmap(mem, st.st_size);
+      }
+   }
+   if(fd >= 0){
+      close(fd);
+   }
+
+   int next = 0;
+   while(1){
+      while(next == nFiles){
+         pthread_cond_wait(&prefetchWake, &prefetchMutex);
+      }
+      for(; next < nFiles; next++){
+         if(files[next].state != PREFETCH_QUEUED){
+            continue;
+         }
+         //the same file as a command name seen before
+         bool seen = false;
+         for(int i = 0; i < next && !seen; i++){
+            seen = !strcmp(files[i].path, files[next].path) && files[i].state != PREFETCH_QUEUED;
+         }
+         char path[PATH_MAX];
+         snprintf(path, sizeof(path), "%s", files[next].path);
+         bool there = (path[0] != '\0');
+         if(!seen && there){
+            pthread_mutex_unlock(&prefetchMutex); //the shell goes on meanwhile
+            there = readAhead(path);
+            pthread_mutex_lock(&prefetchMutex);
+         }
+         files[next].state = there ? PREFETCH_DONE : PREFETCH_MISSING;
+      }
+   }
+   return NULL; /* NOT REACHED */
+}
+
+//reads ahead the file at path and queues what it needs; false if it is
+//not there
+static bool readAhead(const char* path){
+   int fd = open(path, O_RDONLY | O_CLOEXEC);
+   struct stat st;
+   if(fd < 0 || fstat(fd, &st) < 0){
+      if(fd >= 0){
+         close(fd);
+      }
+      return false;
+   }
+   posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+   pthread_mutex_lock(&prefetchMutex);
+   statFiles++;
+   statBytes += st.st_size;
+   pthread_mutex_unlock(&prefetchMutex);
+
+   char head[PATH_MAX];
+   ssize_t got = pread(fd, head, sizeof(head) - 1, 0);
+   if(got > 2 && head[0] == '#' && head[1] == '!'){ //a script: its interpreter
+      head[got] = '\0';
+      char* interp = head + 2 + strspn(head + 2, " \t");
+      interp[strcspn(interp, " \t\n")] = '\0';
+      if(interp[0] == '/'){
+         pthread_mutex_lock(&prefetchMutex);
+         queueFile(NULL, interp);
+         pthread_mutex_unlock(&prefetchMutex);
+      }
+   } else {
+      queueNeeded(fd, path);
+   }
+   close(fd);
+   return true;
+}
+
+//file offset of the virtual address addr of an ELF file with the program
+//headers ph; -1 if no segment loads it
+static off_t fileOffset(Elf64_Phdr* ph, int n, Elf64_Addr addr){
+   for(int i = 0; i < n; i++){
+      if(ph[i].p_type == PT_LOAD && addr >= ph[i].p_vaddr && addr < ph[i].p_vaddr + ph[i].p_filesz){
+         return ph[i].p_offset + (addr - ph[i].p_vaddr);
+      }
+   }
+   return -1;
+}
+
+//queues the interpreter and the DT_NEEDED libraries of ELF file fd
+static void queueNeeded(int fd, const char* path){
+   Elf64_Ehdr eh;
+   if(pread(fd, &eh, sizeof(eh), 0) != sizeof(eh) || memcmp(eh.e_ident, ELFMAG, SELFMAG)
+      || eh.e_ident[EI_CLASS] != ELFCLASS64 || eh.e_phentsize != sizeof(Elf64_Phdr)){
+      return;
+   }
+   Elf64_Phdr ph[PREFETCH_MAX_PHDRS];
+   int nph = (eh.e_phnum < PREFETCH_MAX_PHDRS) ? eh.e_phnum : PREFETCH_MAX_PHDRS;
+   if(pread(fd, ph, nph * sizeof(Elf64_Phdr), eh.e_phoff) != (ssize_t) (nph * sizeof(Elf64_Phdr))){
+      return;
+   }
+
+   char found[PATH_MAX];
+   Elf64_Dyn dyn[PREFETCH_MAX_DYN];
+   int ndyn = 0;
+   for(int i = 0; i < nph; i++){
+      if(ph[i].p_type == PT_INTERP && ph[i].p_filesz < sizeof(found)){
+         if(pread(fd, found, ph[i].p_filesz, ph[i].p_offset) == (ssize_t) ph[i].p_filesz){
+            found[ph[i].p_filesz] = '\0';
+            pthread_mutex_lock(&prefetchMutex);
+            queueFile(NULL, found);
+            pthread_mutex_unlock(&prefetchMutex);
+         }
+      } else if(ph[i].p_type == PT_DYNAMIC){
+         size_t size = (ph[i].p_filesz < sizeof(dyn)) ? ph[i].p_filesz : sizeof(dyn);
+         ssize_t got = pread(fd, dyn, size, ph[i].p_offset);
+         ndyn = (got > 0) ? got / sizeof(Elf64_Dyn) : 0;
+      }
+   }
+
+   //the string table holds the names of the libraries and the search path
+   Elf64_Addr strtab = 0;
+   Elf64_Xword strsz = 0;
+   Elf64_Xword rpath = 0;
+   bool haveRpath = false;
+   for(int i = 0; i < ndyn && dyn[i].d_tag != DT_NULL; i++){
+      if(dyn[i].d_tag == DT_STRTAB){
+         strtab = dyn[i].d_un.d_ptr;
+      } else if(dyn[i].d_tag == DT_STRSZ){
+         strsz = dyn[i].d_un.d_val;
+      } else if(dyn[i].d_tag == DT_RUNPATH || dyn[i].d_tag == DT_RPATH){
+         rpath = dyn[i].d_un.d_val;
+         haveRpath = true;
+      }
+   }
+   off_t at = fileOffset(ph, nph, strtab);
+   if(at < 0 || strsz == 0 || strsz > PREFETCH_MAX_SCRIPT){
+      return;
+   }
+   char* strings = (char*) malloc(strsz + 1);
+   if(strings == NULL || pread(fd, strings, strsz, at) != (ssize_t) strsz){
+      free(strings);
+      return;
+   }
+   strings[strsz] = '\0';
+
+   char dir[PATH_MAX];
+   snprintf(dir, sizeof(dir), "%s", path);
+   char* slash = strrchr(dir, '/');
+   if(slash != NULL){
+      *slash = '\0';
+   }
+   for(int i = 0; i < ndyn && dyn[i].d_tag != DT_NULL; i++){
+      if(dyn[i].d_tag != DT_NEEDED || dyn[i].d_un.d_val >= strsz){
+         continue;
+      }
+      const char* lib = strings + dyn[i].d_un.d_val;
+      if(findLibrary(lib, haveRpath && rpath < strsz ? strings + rpath : NULL, dir, found, sizeof(found))){
+         pthread_mutex_lock(&prefetchMutex);
+         queueFile(NULL, found);
+         pthread_mutex_unlock(&prefetchMutex);
+      }
+   }
+   free(strings);
+}
+
+//finds library name the way ld.so would, for an object in dir with the
+//search path rpath; false if it is nowhere. A candidate path that does not
+//fit in found is skipped, cut short it could name another file
+static bool findLibrary(const char* name, const char* rpath, const char* dir, char* found, size_t len){
+   if(strchr(name, '/') != NULL){
+      int n = snprintf(found, len, "%s", name);
+      return n >= 0 && (size_t) n < len && access(found, R_OK) == 0;
+   }
+
+   //the object's own search path, then the user's
+   const char* paths[] = { rpath, libraryPath };
+   for(int k = 0; k < 2; k++){
+      for(const char* p = paths[k]; p != NULL && *p != '\0'; ){
+         size_t n = strcspn(p, ":");
+         int written;
+         if(n >= 7 && !strncmp(p, "$ORIGIN", 7)){
+            written = snprintf(found, len, "%s%.*s/%s", dir, (int) (n - 7), p + 7, name);
+         } else {
+            written = snprintf(found, len, "%.*s/%s", (int) n, p, name);
+         }
+         if(n > 0 && written >= 0 && (size_t) written < len && access(found, R_OK) == 0){
+            return true;
+         }
+         p += n + (p[n] == ':');
+      }
+   }
+   if(cachedLibrary(name, found, len)){
+      return true;
+   }
+   for(int i = 0; defaultLibDirs[i] != NULL; i++){
+      int written = snprintf(found, len, "%s/%s", defaultLibDirs[i], name);
+      if(written >= 0 && (size_t) written < len && access(found, R_OK) == 0){
+         return true;
+      }
+   }
+   return false;
+}
+
+//looks name up in ld.so.cache: after the header come nlibs entries of
+//flags, key and value (offsets of the name and the path) and hwcaps
+static bool cachedLibrary(const char* name, char* found, size_t len){
+   typedef struct {
+      int32_t flags;
+      uint32_t key;
+      uint32_t value;
+      uint32_t osVersion;
+      uint64_t hwcap;
+   } ldEntry;
+   size_t header = strlen(LD_CACHE_MAGIC) + 2 * sizeof(uint32_t) + 4 + 4 * sizeof(uint32_t);
+   if(ldCache == NULL || ldCacheLen < header){
+      return false;
+   }
+   uint32_t nlibs;
+   memcpy(&nlibs, ldCache + strlen(LD_CACHE_MAGIC), sizeof(nlibs));
+   if(header + (size_t) nlibs * sizeof(ldEntry) > ldCacheLen){
+      return false;
+   }
+   const ldEntry* e = (const ldEntry*) (ldCache + header);
+   for(uint32_t i = 0; i < nlibs; i++){
+      if(e[i].key < ldCacheLen && e[i].value < ldCacheLen
+         && strnlen(ldCache + e[i].key, ldCacheLen - e[i].key) < ldCacheLen - e[i].key
+         && strnlen(ldCache + e[i].value, ldCacheLen - e[i].value) < ldCacheLen - e[i].value
+         && !strcmp(ldCache + e[i].key, name)){
+         int written = snprintf(found, len, "%s", ldCache + e[i].value);
+         return written >= 0 && (size_t) written < len && access(found, R_OK) == 0;
+      }
+   }
+   return false;
+}
+
+//true if a word starting a command ends here
+static bool isSeparator(char c){
+   return c == '\n' || c == ';' || c == '|' || c == '&' || c == '(';
+}
+
+//true if command name is queued already; called with prefetchMutex held
+static bool queuedName(const char* name){
+   for(int i = 0; i < nFiles; i++){
+      if(files[i].name != NULL && !strcmp(files[i].name, name)){
+         return true;
+      }
+   }
+   return false;
+}
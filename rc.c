@@ -0,0 +1,819 @@
+/*
+ * rc.c
+ * Aliases, shell functions and the rc file. An alias replaces the first
+ * word of a command with its words as the command is parsed. A function
+ * (name() { ... }) is kept packed, a flat copy of its parsed body; each
+ * call unpacks a fresh copy that the shell runs itself, with the words of
+ * the call as $1, $2...
+ *
+ * The rc file ($DSH_RC, else ~/.dshrc when the shell reads a terminal) is
+ * parsed and run once while a snapshot of it is written: its aliases, its
+ * functions, and its other command lines parsed and packed the same way.
+ * Later shells map the snapshot ($XDG_CACHE_HOME/dshrc.snap, else
+ * ~/.cache/dshrc.snap) instead of reading the rc: aliases and functions
+ * point into the mapping and the other command lines are unpacked and run
+ * in their place, so nothing is read line by line or parsed again. A
+ * snapshot is good for the rc file with the same device, inode, size and
+ * mtime, or the same content hash when only the mtime moved.
+ *    rcHeader | 'A' name value | 'F' name length body | 'R' length jobs ...
+ */
+
+#include "dsh.h"
+
+#include <sys/mman.h>   /* mmap() of the snapshot */
+#include <limits.h>     /* PATH_MAX */
+
+//first word of a snapshot, "dshr" when read as text on little endian
+#define RC_MAGIC 0x72687364
+#define RC_VERSION 2
+
+//buckets of the alias and function tables to start with; they double
+//when they hold as many entries
+#define RC_BUCKETS 256
+
+//function calls nested at most, a function calling itself for ever stops
+#define FUNC_MAX_DEPTH 100
+
+//packed process flags
+#define PACK_IFILE 0x01
+#define PACK_OFILE 0x02
+#define PACK_EFILE 0x04
+#define PACK_OAPPEND 0x08
+#define PACK_EAPPEND 0x10
+#define PACK_ERRTOOUT 0x20
+#define PACK_HEREDOC 0x40
+#define PACK_HEREEXPAND 0x80
+
+#define FNV_PRIME 0x100000001b3ULL
+#define FNV_BASIS 0xcbf29ce484222325ULL
+
+//what a snapshot is good for
+typedef struct {
+   uint32_t magic;
+   uint32_t version;
+   uint64_t dev;              //of the rc file
+   uint64_t ino;
+   uint64_t size;
+   int64_t mtime;             //ns
+   uint64_t hash;             //FNV-1a of the rc's content
+   uint64_t payloadLen;       //bytes of records after the header
+} rcHeader;
+
+//an alias or a function; name and what it stands for are malloc'd, or
+//point into the snapshot when mapped
+typedef struct _rcEntry {
+   const char* name;
+   const char* value;         //the words of an alias, the packed body of a function
+   size_t len;                //of a packed body
+   bool mapped;
+   struct _rcEntry* next;
+} rcEntry;
+
+//a growable buffer jobs are packed into
+typedef struct {
+   char* data;
+   size_t len;
+   size_t cap;
+   bool failed;               //out of memory on the way
+} rcBuf;
+
+//where unpacking is; failed once it would run past end
+typedef struct {
+   const char* at;
+   const char* end;
+   bool failed;
+} rcCursor;
+
+//words of a function being run, for $0, $1..., $# and $@
+typedef struct {
+   int argc;
+   char** argv;
+   char* all;                 //$@, joined on first use
+} funcFrame;
+
+//a chained hash table of entries
+typedef struct {
+   rcEntry** buckets;
+   size_t nBuckets;
+   size_t count;
+} rcTable;
+
+static rcTable aliases = { NULL, 0, 0 };
+static rcTable functions = { NULL, 0, 0 };
+
+static funcFrame frames[FUNC_MAX_DEPTH];
+static int nFrames = 0;
+
+//the rc being run and snapshotted, and the records packed so far
+static FILE* recordSource = NULL;
+static struct stat recordStat;
+static rcBuf recorded;
+
+//the mapped snapshot and how far rc_snapshot_next() got in it
+static rcCursor snapshot;
+
+//the entry for name in table, NULL if there is none
+static rcEntry* findEntry(rcTable* table, const char* name);
+
+//makes name stand for value in table (taking over the strings, which are
+//freed later unless mapped)
+static bool putEntry(rcTable* table, const char* name, const char* value, size_t len, bool mapped);
+
+//appends len bytes of data, a string with its NUL, a 32 bit number
+static void put(rcBuf* b, const void* data, size_t len);
+static void putString(rcBuf* b, const char* s);
+static void putU32(rcBuf* b, uint32_t n);
+
+//appends job j, leaving out the first skip words of its first process
+static void packJob(rcBuf* b, job_t* j, int skip);
+
+//appends the jobs of the body of the function header opens, up to close
+static void packBody(rcBuf* b, job_t* header, job_t* close);
+
+//reads a string (pointing into the packed data), a byte, a 32 bit number
+static const char* getString(rcCursor* c);
+static uint8_t getU8(rcCursor* c);
+static uint32_t getU32(rcCursor* c);
+
+//unpacks the jobs of len bytes at data into a list, NULL on garbage
+static job_t* unpackJobs(const char* data, size_t len);
+
+//true if j is just alias name=value (with nothing to expand), the kind
+//of command line a snapshot keeps as an alias
+static bool isPlainAlias(job_t* j);
+
+//FNV-1a of len bytes at data
+static uint64_t hashBytes(const char* data, size_t len);
+
+//FNV-1a of the content of the len bytes long file fd
+static uint64_t hashFile(int fd, size_t len);
+
+//where the snapshot goes (into path, len bytes)
+static bool snapshotPath(char* path, size_t len);
+
+//the rc file of this shell, NULL if it has none
+const char* rc_path(void){
+   static char path[PATH_MAX];
+   char* env = getenv("DSH_RC");
+   if(env != NULL){
+      return (*env != '\0') ? env : NULL; //DSH_RC= for none
+   }
+   if(!isatty(STDIN_FILENO) || (env = getenv("HOME")) == NULL || *env == '\0'){
+      return NULL; //scripts get the aliases they define themselves
+   }
+   snprintf(path, sizeof(path), "%s/.dshrc", env);
+   return path;
+}
+
+//the words alias name stands for, NULL if it is not an alias
+const char* alias_get(const char* name){
+   rcEntry* e = findEntry(&aliases, name);
+   return (e != NULL) ? e->value : NULL;
+}
+
+//makes name an alias of value (words separated by spaces)
+bool alias_set(const char* name, const char* value){
+   char* n = strdup(name);
+   char* v = strdup(value);
+   if(n == NULL || v == NULL || !putEntry(&aliases, n, v, 0, false)){
+      free(n);
+      free(v);
+      return false;
+   }
+   return true;
+}
+
+//forgets alias name; false if there was none
+bool alias_unset(const char* name){
+   if(aliases.count == 0){
+      return false;
+   }
+   size_t h = hashBytes(name, strlen(name)) % aliases.nBuckets;
+   for(rcEntry** link = &aliases.buckets[h]; *link != NULL; link = &(*link)->next){
+      rcEntry* e = *link;
+      if(!strcmp(e->name, name)){
+         *link = e->next;
+         aliases.count--;
+         if(!(e->mapped)){
+            free((char*) e->name);
+            free((char*) e->value);
+         }
+         free(e);
+         return true;
+      }
+   }
+   return false;
+}
+
+//entries of the alias list by name
+static int entryCmp(const void* a, const void* b){
+   return strcmp((*(rcEntry* const*) a)->name, (*(rcEntry* const*) b)->name);
+}
+
+//prints alias name, or all of them sorted when name is NULL, the way they
+//are defined; false if name is not an alias
+bool alias_print(const char* name){
+   if(name != NULL){
+      const char* value = alias_get(name);
+      if(value != NULL){
+         printf("alias %s=%s\n", name, value);
+      }
+      return value != NULL;
+   }
+   rcEntry** sorted = (rcEntry**) malloc((aliases.count + 1) * sizeof(rcEntry*));
+   if(sorted == NULL){
+      fprintf(stderr, "%s\n", "malloc: no space");
+      return false;
+   }
+   int n = 0;
+   for(size_t i = 0; i < aliases.nBuckets; i++){
+      for(rcEntry* e = aliases.buckets[i]; e != NULL; e = e->next){
+         sorted[n++] = e;
+      }
+   }
+   qsort(sorted, n, sizeof(rcEntry*), entryCmp);
+   for(int i = 0; i < n; i++){
+      printf("alias %s=%s\n", sorted[i]->name, sorted[i]->value);
+   }
+   free(sorted);
+   return true;
+}
+
+//true if j opens a function: name() { [first command of the body]
+bool func_opens(job_t* j){
+   process_t* p = j->first_process;
+   return p->argc >= 2 && !strcmp(p->argv[1], "{") && strlen(p->argv[0]) > 2
+          && endswith(p->argv[0], "()");
+}
+
+//true if j closes a function
+bool func_closes(job_t* j){
+   process_t* p = j->first_process;
+   return p->argc == 1 && p->next == NULL && !strcmp(p->argv[0], "}");
+}
+
+//the } that closes the function header opens, NULL if it is not there
+job_t* func_end(job_t* header){
+   int depth = 0;
+   for(job_t* k = header; k != NULL; k = k->next){
+      depth += func_opens(k) - func_closes(k);
+      if(depth == 0){
+         return k;
+      }
+   }
+   return NULL;
+}
+
+//packs the body of the function header opens, up to close, and defines it
+//(replacing one of the same name); the jobs are left to the caller
+bool func_define(job_t* header, job_t* close){
+   rcBuf body = { NULL, 0, 0, false };
+   packBody(&body, header, close);
+   process_t* hp = header->first_process;
+   char* name = strndup(hp->argv[0], strlen(hp->argv[0]) - 2);
+   if(body.failed || name == NULL || !putEntry(&functions, name, (body.data != NULL) ? body.data : strdup(""), body.len, false)){
+      fprintf(stderr, "%s\n", "malloc: no space");
+      free(body.data);
+      free(name);
+      return false;
+   }
+   return true;
+}
+
+//true if name is a function
+bool func_exists(const char* name){
+   return findEntry(&functions, name) != NULL;
+}
+
+//a fresh copy of the body of function name to run, NULL if it is empty
+//(or cannot be unpacked)
+job_t* func_body(const char* name){
+   rcEntry* e = findEntry(&functions, name);
+   return (e != NULL && e->len > 0) ? unpackJobs(e->value, e->len) : NULL;
+}
+
+//makes argv the words of the function about to run; false if calls are
+//nested too deep
+bool func_push_args(int argc, char** argv){
+   if(nFrames == FUNC_MAX_DEPTH){
+      return false;
+   }
+   frames[nFrames].argc = argc;
+   frames[nFrames].argv = argv;
+   frames[nFrames].all = NULL;
+   nFrames++;
+   return true;
+}
+
+//back to the words of the function that called the one that is done
+void func_pop_args(void){
+   if(nFrames > 0){
+      free(frames[--nFrames].all);
+   }
+}
+
+//$0...$9, $# or $@ of the function being run ("" past its words), NULL
+//outside of functions
+const char* func_arg(char which){
+   static char count[16];
+   if(nFrames == 0){
+      return NULL;
+   }
+   funcFrame* f = &frames[nFrames - 1];
+   if(which == '#'){
+      snprintf(count, sizeof(count), "%d", f->argc - 1);
+      return count;
+   } else if(which == '@'){
+      if(f->all == NULL){
+         size_t len = 1;
+         for(int i = 1; i < f->argc; i++){
+            len += strlen(f->argv[i]) + 1;
+         }
+         if((f->all = (char*) calloc(len, 1)) == NULL){
+            return "";
+         }
+         for(int i = 1; i < f->argc; i++){
+            strcat(f->all, f->argv[i]);
+            if(i + 1 < f->argc){
+               strcat(f->all, " ");
+            }
+         }
+      }
+      return f->all;
+   }
+   int i = which - '0';
+   return (i < f->argc) ? f->argv[i] : "";
+}
+
+//starts writing a snapshot of the rc file at path, run from source
+bool rc_record_start(const char* path, FILE* source){
+   if(fstat(fileno(source), &recordStat) < 0){
+      perror(path);
+      return false;
+   }
+   recordSource = source;
+   recorded.len = 0;
+   recorded.failed = false;
+   rcHeader h;
+   memset(&h, 0, sizeof(h));
+   put(&recorded, &h, sizeof(h)); //filled in at the end
+   return true;
+}
+
+//adds the command line j read from in (before it runs) to the snapshot: a
+//lone alias or function definition as such, anything else as jobs to run
+void rc_record(FILE* in, job_t* j){
+   if(recordSource == NULL || in != recordSource || j == NULL){
+      return; //not the rc
+   }
+   if(isPlainAlias(j)){
+      process_t* p = j->first_process;
+      char* eq = strchr(p->argv[1], '=');
+      put(&recorded, "A", 1);
+      put(&recorded, p->argv[1], eq - p->argv[1]);
+      put(&recorded, "", 1);
+      put(&recorded, eq + 1, strlen(eq + 1));
+      for(int i = 2; i < p->argc; i++){
+         put(&recorded, " ", 1);
+         put(&recorded, p->argv[i], strlen(p->argv[i]));
+      }
+      put(&recorded, "", 1);
+      return;
+   }
+
+   rcBuf jobs = { NULL, 0, 0, false };
+   job_t* close = func_opens(j) ? func_end(j) : NULL;
+   if(close != NULL && close->next == NULL){ //just a function definition
+      process_t* hp = j->first_process;
+      packBody(&jobs, j, close);
+      put(&recorded, "F", 1);
+      put(&recorded, hp->argv[0], strlen(hp->argv[0]) - 2);
+      put(&recorded, "", 1);
+   } else {
+      for(job_t* k = j; k != NULL; k = k->next){
+         packJob(&jobs, k, 0);
+      }
+      put(&recorded, "R", 1);
+   }
+   putU32(&recorded, jobs.len);
+   put(&recorded, jobs.data, jobs.len);
+   recorded.failed |= jobs.failed;
+   free(jobs.data);
+}
+
+//writes the snapshot of the rc run since rc_record_start()
+void rc_record_end(void){
+   if(recordSource == NULL){
+      return;
+   }
+   int fd = fileno(recordSource);
+   recordSource = NULL;
+   char path[PATH_MAX];
+   if(recorded.failed || !snapshotPath(path, sizeof(path))){
+      return;
+   }
+
+   rcHeader h;
+   h.magic = RC_MAGIC;
+   h.version = RC_VERSION;
+   h.dev = recordStat.st_dev;
+   h.ino = recordStat.st_ino;
+   h.size = recordStat.st_size;
+   h.mtime = (int64_t) recordStat.st_mtim.tv_sec * 1000000000LL + recordStat.st_mtim.tv_nsec;
+   h.hash = hashFile(fd, recordStat.st_size);
+   h.payloadLen = recorded.len - sizeof(h);
+   memcpy(recorded.data, &h, sizeof(h));
+
+   //into a temporary file renamed over the old one, so other shells see
+   //either snapshot whole
+   char tmp[PATH_MAX + 16];
+   snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid());
+   int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+   bool ok = (out >= 0 && write(out, recorded.data, recorded.len) == (ssize_t) recorded.len);
+   if(out >= 0){
+      close(out);
+   }
+   if(!ok || rename(tmp, path) < 0){
+      unlink(tmp);
+   }
+   free(recorded.data);
+   recorded.data = NULL;
+   recorded.cap = 0;
+}
+
+//maps the snapshot of the rc file at path if it is still good for it;
+//rc_snapshot_next() then runs through it
+bool rc_load_snapshot(const char* path){
+   char snap[PATH_MAX];
+   struct stat rc, st;
+   if(stat(path, &rc) < 0 || !snapshotPath(snap, sizeof(snap))){
+      return false;
+   }
+   int fd = open(snap, O_RDONLY | O_CLOEXEC);
+   if(fd < 0){
+      return false;
+   }
+   if(fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(rcHeader)){
+      close(fd);
+      return false;
+   }
+   void* mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if(mem == MAP_FAILED){
+      return false;
+   }
+   const rcHeader* h = (const rcHeader*) mem;
+   bool good = h->magic == RC_MAGIC && h->version == RC_VERSION
+               && h->payloadLen == st.st_size - sizeof(rcHeader)
+               && h->dev == (uint64_t) rc.st_dev && h->ino == (uint64_t) rc.st_ino
+               && h->size == (uint64_t) rc.st_size;
+   int64_t mtime = (int64_t) rc.st_mtim.tv_sec * 1000000000LL + rc.st_mtim.tv_nsec;
+   if(good && h->mtime != mtime){ //touched, maybe not changed
+      int in = open(path, O_RDONLY | O_CLOEXEC);
+      good = (in >= 0 && hashFile(in, rc.st_size) == h->hash);
+      if(in >= 0){
+         close(in);
+      }
+   }
+   if(!good){
+      munmap(mem, st.st_size);
+      return false;
+   }
+   //stays mapped: aliases and functions point into it
+   snapshot.at = (const char*) (h + 1);
+   snapshot.end = snapshot.at + h->payloadLen;
+   snapshot.failed = false;
+   return true;
+}
+
+//defines the aliases and functions of the snapshot up to its next other
+//command line and returns that, unpacked; NULL at the end
+job_t* rc_snapshot_next(void){
+   rcCursor* c = &snapshot;
+   while(c->at != NULL && c->at < c->end && !(c->failed)){
+      char kind = (char) getU8(c);
+      if(kind == 'A'){
+         const char* name = getString(c);
+         const char* value = getString(c);
+         if(!(c->failed)){
+            putEntry(&aliases, name, value, 0, true);
+         }
+         continue;
+      }
+      const char* name = (kind == 'F') ? getString(c) : NULL;
+      uint32_t len = getU32(c);
+      if(c->failed || (kind != 'F' && kind != 'R') || len > (size_t) (c->end - c->at)){
+         break;
+      }
+      const char* data = c->at;
+      c->at += len;
+      if(kind == 'F'){
+         putEntry(&functions, name, data, len, true);
+         continue;
+      }
+      job_t* j = unpackJobs(data, len);
+      if(j != NULL){
+         return j;
+      }
+   }
+   c->at = NULL;
+   return NULL;
+}
+
+//the entry for name in table, NULL if there is none
+static rcEntry* findEntry(rcTable* table, const char* name){
+   if(table->count == 0){
+      return NULL;
+   }
+   for(rcEntry* e = table->buckets[hashBytes(name, strlen(name)) % table->nBuckets]; e != NULL; e = e->next){
+      if(!strcmp(e->name, name)){
+         return e;
+      }
+   }
+   return NULL;
+}
+
+//makes name stand for value in table
+static bool putEntry(rcTable* table, const char* name, const char* value, size_t len, bool mapped){
+   if(value == NULL){
+      return false;
+   }
+   if(table->count >= table->nBuckets){ //rehash into twice the buckets
+      size_t n = (table->nBuckets > 0) ? table->nBuckets * 2 : RC_BUCKETS;
+      rcEntry** buckets = (rcEntry**) calloc(n, sizeof(rcEntry*));
+      if(buckets == NULL){
+         return false;
+      }
+      for(size_t i = 0; i < table->nBuckets; i++){
+         for(rcEntry* e = table->buckets[i]; e != NULL; ){
+            rcEntry* next = e->next;
+            size_t h = hashBytes(e->name, strlen(e->name)) % n;
+            e->next = buckets[h];
+            buckets[h] = e;
+            e = next;
+         }
+      }
+      free(table->buckets);
+      table->buckets = buckets;
+      table->nBuckets = n;
+   }
+   rcEntry* e = findEntry(table, name);
+   if(e == NULL){
+      if((e = (rcEntry*) malloc(sizeof(rcEntry))) == NULL){
+         return false;
+      }
+      size_t h = hashBytes(name, strlen(name)) % table->nBuckets;
+      e->next = table->buckets[h];
+      table->buckets[h] = e;
+      table->count++;
+   } else if(!(e->mapped)){
+      free((char*) e->name);
+      free((char*) e->value);
+   }
+   e->name = name;
+   e->value = value;
+   e->len = len;
+   e->mapped = mapped;
+   return true;
+}
+
+//appends len bytes of data
+static void put(rcBuf* b, const void* data, size_t len){
+   if(b->failed){
+      return;
+   }
+   if(b->len + len > b->cap){
+      size_t cap = (b->cap > 0) ? b->cap : 4096;
+      while(b->len + len > cap){
+         cap *= 2;
+      }
+      char* grown = (char*) realloc(b->data, cap);
+      if(grown == NULL){
+         b->failed = true;
+         return;
+      }
+      b->data = grown;
+      b->cap = cap;
+   }
+   memcpy(b->data + b->len, data, len);
+   b->len += len;
+}
+
+//appends a string with its NUL
+static void putString(rcBuf* b, const char* s){
+   put(b, s, strlen(s) + 1);
+}
+
+//appends a 32 bit number
+static void putU32(rcBuf* b, uint32_t n){
+   put(b, &n, sizeof(n));
+}
+
+//appends job j, leaving out the first skip words of its first process:
+//bg, mystdin, mystdout, commandinfo, processes, then per process argc,
+//argv, flags and the files (and here-document) the flags say it has
+static void packJob(rcBuf* b, job_t* j, int skip){
+   const char* info = j->commandinfo;
+   for(int i = 0; i < skip; i++){ //the words left out are not shown either
+      info += strspn(info, " \t");
+      info += strcspn(info, " \t");
+   }
+   info += strspn(info, " \t");
+
+   uint8_t bg = j->bg;
+   put(b, &bg, 1);
+   putU32(b, j->mystdin);
+   putU32(b, j->mystdout);
+   putString(b, info);
+   uint32_t n = 0;
+   for(process_t* p = j->first_process; p != NULL; p = p->next){
+      n++;
+   }
+   putU32(b, n);
+   for(process_t* p = j->first_process; p != NULL; p = p->next){
+      int from = (p == j->first_process) ? skip : 0;
+      putU32(b, (p->argc > from) ? p->argc - from : 0);
+      for(int i = from; i < p->argc; i++){
+         putString(b, p->argv[i]);
+      }
+      uint8_t flags = (p->ifile ? PACK_IFILE : 0) | (p->ofile ? PACK_OFILE : 0)
+                      | (p->efile ? PACK_EFILE : 0) | (p->oappend ? PACK_OAPPEND : 0)
+                      | (p->eappend ? PACK_EAPPEND : 0) | (p->errtoout ? PACK_ERRTOOUT : 0)
+                      | (p->heredoc ? PACK_HEREDOC : 0) | (p->hereexpand ? PACK_HEREEXPAND : 0);
+      put(b, &flags, 1);
+      char* files[] = { p->ifile, p->ofile, p->efile, p->heredoc };
+      for(int i = 0; i < 4; i++){
+         if(files[i] != NULL){
+            putString(b, files[i]);
+         }
+      }
+   }
+}
+
+//appends the jobs of the body of the function header opens, up to close
+static void packBody(rcBuf* b, job_t* header, job_t* close){
+   process_t* hp = header->first_process;
+   if(hp->argc > 2 || hp->next != NULL){ //the body starts on the same line
+      packJob(b, header, 2);
+   }
+   for(job_t* k = header->next; k != close && k != NULL; k = k->next){
+      packJob(b, k, 0);
+   }
+}
+
+//reads a string, pointing into the packed data
+static const char* getString(rcCursor* c){
+   const char* s = c->at;
+   const char* nul = (c->failed) ? NULL : (const char*) memchr(s, '\0', c->end - s);
+   if(nul == NULL){
+      c->failed = true;
+      return "";
+   }
+   c->at = nul + 1;
+   return s;
+}
+
+//reads a byte
+static uint8_t getU8(rcCursor* c){
+   if(c->failed || c->at + 1 > c->end){
+      c->failed = true;
+      return 0;
+   }
+   return (uint8_t) *(c->at++);
+}
+
+//reads a 32 bit number
+static uint32_t getU32(rcCursor* c){
+   uint32_t n = 0;
+   if(c->failed || c->at + sizeof(n) > c->end){
+      c->failed = true;
+      return 0;
+   }
+   memcpy(&n, c->at, sizeof(n));
+   c->at += sizeof(n);
+   return n;
+}
+
+//unpacks the jobs of len bytes at data into a list, NULL on garbage
+static job_t* unpackJobs(const char* data, size_t len){
+   rcCursor c = { data, data + len, false };
+   job_t* first = NULL;
+   job_t** tail = &first;
+   while(c.at < c.end && !c.failed){
+      job_t* j = (job_t*) malloc(sizeof(job_t));
+      if(j == NULL || !init_job(j)){
+         free(j);
+         break;
+      }
+      *tail = j;
+      tail = &j->next;
+      j->bg = getU8(&c);
+      j->mystdin = (int) getU32(&c);
+      j->mystdout = (int) getU32(&c);
+      strncpy(j->commandinfo, getString(&c), MAX_LEN_CMDLINE - 1);
+      process_t** ptail = &j->first_process;
+      for(uint32_t n = getU32(&c); n > 0 && !c.failed; n--){
+         process_t* p = (process_t*) malloc(sizeof(process_t));
+         if(p == NULL || !init_process(p)){
+            free(p);
+            c.failed = true;
+            break;
+         }
+         *ptail = p;
+         ptail = &p->next;
+         uint32_t argc = getU32(&c);
+         if(argc > (size_t) (c.end - c.at)){ //a word takes a byte at least
+            c.failed = true;
+            break;
+         }
+         free(p->argv);
+         if((p->argv = (char**) calloc(argc + 1, sizeof(char*))) == NULL){
+            c.failed = true;
+            break;
+         }
+         for(p->argc = 0; p->argc < (int) argc; p->argc++){
+            p->argv[p->argc] = strdup(getString(&c));
+         }
+         uint8_t flags = getU8(&c);
+         p->ifile = (flags & PACK_IFILE) ? strdup(getString(&c)) : NULL;
+         p->ofile = (flags & PACK_OFILE) ? strdup(getString(&c)) : NULL;
+         p->efile = (flags & PACK_EFILE) ? strdup(getString(&c)) : NULL;
+         p->oappend = (flags & PACK_OAPPEND) != 0;
+         p->eappend = (flags & PACK_EAPPEND) != 0;
+         p->errtoout = (flags & PACK_ERRTOOUT) != 0;
+         p->heredoc = (flags & PACK_HEREDOC) ? strdup(getString(&c)) : NULL;
+         p->hereexpand = (flags & PACK_HEREEXPAND) != 0;
+      }
+      if(j->first_process == NULL){
+         c.failed = true;
+      }
+   }
+   if(c.failed){
+      while(first != NULL){
+         job_t* next = first->next;
+         free_job(first);
+         first = next;
+      }
+   }
+   return first;
+}
+
+//true if j is just alias name=value, the kind of command line a
+//snapshot keeps as an alias
+static bool isPlainAlias(job_t* j){
+   process_t* p = j->first_process;
+   if(j->next != NULL || j->bg || p->next != NULL || p->ifile || p->ofile || p->efile || p->errtoout
+      || p->argc < 2 || strcmp(p->argv[0], "alias") || strchr(p->argv[1], '=') == NULL
+      || p->argv[1][0] == '='){
+      return false;
+   }
+   for(int i = 1; i < p->argc; i++){
+      if(strchr(p->argv[i], '$') != NULL){
+         return false; //expanded when it runs
+      }
+   }
+   return true;
+}
+
+//FNV-1a of len bytes at data
+static uint64_t hashBytes(const char* data, size_t len){
+   uint64_t h = FNV_BASIS;
+   for(size_t i = 0; i < len; i++){
+      h = (h ^ (unsigned char) data[i]) * FNV_PRIME;
+   }
+   return h;
+}
+
+//FNV-1a of the content of the len bytes long file fd
+static uint64_t hashFile(int fd, size_t len){
+   if(len == 0){
+      return FNV_BASIS;
+   }
+   void* mem = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+   if(mem == MAP_FAILED){
+      return 0;
+   }
+   uint64_t h = hashBytes((const char*) mem, len);
+   munmap(mem, len);
+   return h;
+}
+
+//where the snapshot goes: $XDG_CACHE_HOME/dshrc.snap, else
+//$HOME/.cache/dshrc.snap (beside the result cache, not in it)
+static bool snapshotPath(char* path, size_t len){
+   char* env;
+   if((env = getenv("XDG_CACHE_HOME")) != NULL && *env){
+      snprintf(path, len, "%s/dshrc.snap", env);
+   } else if((env = getenv("HOME")) != NULL && *env){
+      snprintf(path, len, "%s/.cache/dshrc.snap", env);
+   } else {
+      return false;
+   }
+   char* slash = strrchr(path, '/');
+   if(slash != NULL && slash != path){ //make sure the directory is there
+      *slash = '\0';
+      mkdir(path, S_IRWXU);
+      *slash = '/';
+   }
+   return true;
+}
@@ -0,0 +1,375 @@
+/*
+ * serve.c
+ * Daemon mode: "dsh --serve <socket>" keeps one warm shell around and runs
+ * command lines submitted by local clients (see serve.h for the protocol).
+ */
+
+#include "dsh.h"
+#include "serve.h"
+
+#include <sys/socket.h> /* socket(), SCM_RIGHTS */
+#include <sys/un.h>     /* sockaddr_un */
+#include <poll.h>       /* poll() for relaying output */
+
+//connections waiting to be accepted
+#define SERVE_BACKLOG 128
+
+//bytes relayed per output frame when the client did not pass its fds
+#define SERVE_RELAY_LEN 16384
+
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC 0 //fds are dup2()'d onto stdio right away anyway
+#endif
+
+//exit status of the last foreground job, kept by dsh.c
+extern int lastStatus;
+
+//socket the exit frame goes to in a worker
+static int replyFd = -1;
+
+//makes way for the socket at path: true if nothing is there or it is the
+//socket of a server that is gone, which is removed
+static bool clearStaleSocket(const struct sockaddr_un* addr);
+
+//true if the peer of conn runs as the same user as the server
+static bool peerIsOwner(int conn);
+
+//reaps workers that have finished their connection
+static void reapWorkers(int sig);
+
+//runs one connection: reads the request and script and replies
+static int serveConnection(int conn);
+
+//reads the request and any fds passed with it
+static bool readRequest(int conn, dsh_request_t* req, int* fds, int* nFds);
+
+//runs the script in a child with its stdout/stderr relayed as frames
+static int relayScript(int conn, FILE* in);
+
+//sends one reply frame
+static bool sendFrame(int conn, uint32_t type, const void* data, uint32_t len);
+
+//sends the exit frame when a worker exits (also through the quit builtin)
+static void sendExitFrame(void);
+
+//write() that carries on after short writes
+static bool writeAll(int fd, const void* data, size_t len);
+
+//read() that fills the whole buffer unless EOF comes first
+static bool readAll(int fd, void* data, size_t len);
+
+//daemon mode entry point, see dsh.h
+int serve_commands(const char* path){
+   struct sockaddr_un addr;
+   if(strlen(path) >= sizeof(addr.sun_path)){
+      fprintf(stderr, "dsh: socket path too long: %s\n", path);
+      return EXIT_FAILURE;
+   }
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, path);
+
+   int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if(listenFd < 0){
+      perror("dsh: socket");
+      return EXIT_FAILURE;
+   }
+   fcntl(listenFd, F_SETFD, FD_CLOEXEC);
+   if(!clearStaleSocket(&addr)){
+      close(listenFd);
+      return EXIT_FAILURE;
+   }
+   mode_t oldMask = umask(S_IRWXG | S_IRWXO); //the socket is for its owner only
+   int bound = bind(listenFd, (struct sockaddr*) &addr, sizeof(addr));
+   umask(oldMask);
+   if(bound < 0 || listen(listenFd, SERVE_BACKLOG) < 0){
+      perror("dsh: cannot listen");
+      close(listenFd);
+      return EXIT_FAILURE;
+   }
+
+   //a client going away must not take the server with it
+   signal(SIGPIPE, SIG_IGN);
+   struct sigaction sa;
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = reapWorkers;
+   sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+   sigaction(SIGCHLD, &sa, NULL);
+
+   fprintf(stderr, "dsh: serving on %s\n", path);
+
+   //every connection gets a fork of this warm shell, so clients run
+   //concurrently and never pay for exec and start up of a new dsh
+   while(1){
+      int conn = accept(listenFd, NULL, NULL);
+      if(conn < 0){
+         if(errno != EINTR && errno != ECONNABORTED){
+            perror("dsh: accept");
+         }
+         continue;
+      }
+      if(!peerIsOwner(conn)){ //runs commands as us
+         close(conn);
+         continue;
+      }
+
+      switch(fork()){
+         case -1:
+            perror("dsh: fork");
+            close(conn);
+            break;
+         case 0: //worker
+            close(listenFd);
+            signal(SIGCHLD, SIG_DFL);
+            exit(serveConnection(conn));
+         default:
+            close(conn);
+      }
+   }
+   return EXIT_FAILURE; /* NOT REACHED */
+}
+
+//makes way for the socket at path: true if nothing is there or it is the
+//socket of a server that is gone, which is removed. Anything else (a file,
+//or the socket of a live server) is left alone
+static bool clearStaleSocket(const struct sockaddr_un* addr){
+   struct stat st;
+   if(lstat(addr->sun_path, &st) < 0){
+      return errno == ENOENT;
+   }
+   if(!S_ISSOCK(st.st_mode)){
+      fprintf(stderr, "dsh: %s exists and is not a socket\n", addr->sun_path);
+      return false;
+   }
+   int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if(probe < 0){
+      perror("dsh: socket");
+      return false;
+   }
+   int connected = connect(probe, (const struct sockaddr*) addr, sizeof(*addr));
+   int why = errno;
+   close(probe);
+   if(connected == 0){
+      fprintf(stderr, "dsh: a server is already running on %s\n", addr->sun_path);
+      return false;
+   } else if(why != ECONNREFUSED){
+      errno = why;
+      perror("dsh: cannot tell if the socket is in use");
+      return false;
+   }
+   unlink(addr->sun_path); //a stale socket from an earlier server
+   return true;
+}
+
+//true if the peer of conn runs as the same user as the server
+static bool peerIsOwner(int conn){
+#ifdef SO_PEERCRED
+   struct ucred cred;
+   socklen_t len = sizeof(cred);
+   if(getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.uid != getuid()){
+      fprintf(stderr, "dsh: refusing a client of another user\n");
+      return false;
+   }
+#endif
+   return true; //without SO_PEERCRED the 0600 socket has to do
+}
+
+//reaps workers that have finished their connection
+static void reapWorkers(int sig){
+   int savedErrno = errno;
+   while(waitpid(-1, NULL, WNOHANG) > 0);
+   errno = savedErrno;
+}
+
+//runs one connection: reads the request and script and replies
+static int serveConnection(int conn){
+   dsh_request_t req;
+   int fds[DSH_SERVE_NFDS];
+   int nFds = 0;
+
+   if(!readRequest(conn, &req, fds, &nFds)){
+      close(conn);
+      return EXIT_FAILURE;
+   }
+
+   char* script = (char*) malloc(req.script_len + 1);
+   if(script == NULL || !readAll(conn, script, req.script_len)){
+      close(conn);
+      return EXIT_FAILURE;
+   }
+   script[req.script_len] = '\0';
+
+   //an empty script still needs a (one NUL byte) buffer for fmemopen()
+   FILE* in = fmemopen(script, req.script_len ? req.script_len : 1, "r");
+   if(in == NULL){
+      perror("dsh: fmemopen");
+      close(conn);
+      return EXIT_FAILURE;
+   }
+
+   if(nFds != DSH_SERVE_NFDS){ //no stdio of its own: stream it back
+      return relayScript(conn, in);
+   }
+
+   //jobs use the client's stdio directly
+   for(int i = 0; i < DSH_SERVE_NFDS; i++){
+      dup2(fds[i], i);
+      close(fds[i]);
+   }
+   replyFd = conn;
+   atexit(sendExitFrame);
+   run_commands(in);
+   return lastStatus; //exit() sends the frame
+}
+
+//reads the request and any fds passed with it
+static bool readRequest(int conn, dsh_request_t* req, int* fds, int* nFds){
+   char control[CMSG_SPACE(DSH_SERVE_NFDS * sizeof(int))];
+   struct iovec iov = { req, sizeof(*req) };
+   struct msghdr msg;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = control;
+   msg.msg_controllen = sizeof(control);
+
+   ssize_t got = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+   if(got <= 0){
+      return false;
+   }
+
+   struct cmsghdr* cmsg;
+   for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+      if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+         *nFds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+         if(*nFds > DSH_SERVE_NFDS){
+            *nFds = DSH_SERVE_NFDS;
+         }
+         memcpy(fds, CMSG_DATA(cmsg), *nFds * sizeof(int));
+      }
+   }
+
+   //the rest of a short first read
+   if(got < (ssize_t) sizeof(*req) && !readAll(conn, (char*) req + got, sizeof(*req) - got)){
+      return false;
+   }
+   if(req->magic != DSH_SERVE_MAGIC || req->script_len > DSH_SERVE_MAX_SCRIPT){
+      fprintf(stderr, "dsh: bad request\n");
+      return false;
+   }
+   return true;
+}
+
+//runs the script in a child with its stdout/stderr relayed as frames
+static int relayScript(int conn, FILE* in){
+   int out[2];
+   int err[2];
+   if(pipe(out) < 0 || pipe(err) < 0){
+      perror("dsh: pipe");
+      return EXIT_FAILURE;
+   }
+
+   pid_t pid = fork();
+   if(pid < 0){
+      perror("dsh: fork");
+      return EXIT_FAILURE;
+   } else if(pid == 0){
+      int devNull = open("/dev/null", O_RDONLY);
+      dup2(devNull, STDIN_FILENO);
+      dup2(out[1], STDOUT_FILENO);
+      dup2(err[1], STDERR_FILENO);
+      close(devNull);
+      close(out[0]); close(out[1]);
+      close(err[0]); close(err[1]);
+      close(conn);
+      exit(run_commands(in));
+   }
+   close(out[1]);
+   close(err[1]);
+
+   struct pollfd pfds[2] = { { out[0], POLLIN, 0 }, { err[0], POLLIN, 0 } };
+   uint32_t types[2] = { DSH_FRAME_STDOUT, DSH_FRAME_STDERR };
+   char buf[SERVE_RELAY_LEN];
+   int openPipes = 2;
+   while(openPipes > 0){
+      if(poll(pfds, 2, -1) < 0){
+         if(errno == EINTR){
+            continue;
+         }
+         break;
+      }
+      for(int i = 0; i < 2; i++){
+         if(pfds[i].fd < 0 || pfds[i].revents == 0){
+            continue;
+         }
+         ssize_t got = read(pfds[i].fd, buf, sizeof(buf));
+         if(got <= 0){
+            close(pfds[i].fd);
+            pfds[i].fd = -1; //poll() skips it from now on
+            openPipes--;
+         } else if(!sendFrame(conn, types[i], buf, got)){
+            kill(pid, SIGTERM); //client is gone
+         }
+      }
+   }
+
+   int status;
+   int32_t code = EXIT_FAILURE;
+   if(waitpid(pid, &status, 0) == pid){
+      code = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+   }
+   sendFrame(conn, DSH_FRAME_EXIT, &code, sizeof(code));
+   close(conn);
+   return code;
+}
+
+//sends one reply frame
+static bool sendFrame(int conn, uint32_t type, const void* data, uint32_t len){
+   dsh_frame_t frame = { type, len };
+   return writeAll(conn, &frame, sizeof(frame)) && writeAll(conn, data, len);
+}
+
+//sends the exit frame when a worker exits (also through the quit builtin)
+static void sendExitFrame(void){
+   if(replyFd < 0){
+      return;
+   }
+   fflush(stdout);
+   fflush(stderr);
+   int32_t code = lastStatus;
+   sendFrame(replyFd, DSH_FRAME_EXIT, &code, sizeof(code));
+   close(replyFd);
+   replyFd = -1;
+}
+
+//write() that carries on after short writes
+static bool writeAll(int fd, const void* data, size_t len){
+   const char* p = (const char*) data;
+   while(len > 0){
+      ssize_t put = write(fd, p, len);
+      if(put < 0 && errno == EINTR){
+         continue;
+      } else if(put <= 0){
+         return false;
+      }
+      p += put;
+      len -= put;
+   }
+   return true;
+}
+
+//read() that fills the whole buffer unless EOF comes first
+static bool readAll(int fd, void* data, size_t len){
+   char* p = (char*) data;
+   while(len > 0){
+      ssize_t got = read(fd, p, len);
+      if(got < 0 && errno == EINTR){
+         continue;
+      } else if(got <= 0){
+         return false;
+      }
+      p += got;
+      len -= got;
+   }
+   return true;
+}
@@ -0,0 +1,45 @@
+#ifndef __DSH_SERVE_H__   /* check if this header file is already defined elsewhere */
+#define __DSH_SERVE_H__
+
+/* Wire format between "dsh --serve <socket>" and its clients (dshc).
+ *
+ * A client connects to the Unix domain socket and sends a dsh_request_t,
+ * followed by script_len bytes of script (one or more command lines). When
+ * DSH_SERVE_PASS_FDS is set the request carries the client's stdin, stdout
+ * and stderr as SCM_RIGHTS ancillary data and the jobs use them directly.
+ * Otherwise stdout and stderr come back as DSH_FRAME_STDOUT/STDERR frames.
+ * Either way the last frame is DSH_FRAME_EXIT with the int32_t exit status
+ * of the script.
+ */
+
+#include <stdint.h>
+
+#define DSH_SERVE_MAGIC 0x31485344u /* "DSH1" */
+
+/* socket used by dshc when neither -s nor $DSH_SOCKET says otherwise */
+#define DSH_SERVE_DEFAULT_SOCKET "/tmp/dsh.sock"
+
+/* largest script accepted in one request */
+#define DSH_SERVE_MAX_SCRIPT (16 << 20)
+
+/* request flags */
+#define DSH_SERVE_PASS_FDS 0x1 /* stdin, stdout, stderr ride along */
+
+/* number of fds passed with DSH_SERVE_PASS_FDS */
+#define DSH_SERVE_NFDS 3
+
+typedef struct dsh_request {
+        uint32_t magic;         /* DSH_SERVE_MAGIC */
+        uint32_t flags;         /* DSH_SERVE_* */
+        uint32_t script_len;    /* bytes of script following the request */
+} dsh_request_t;
+
+/* reply frame types */
+enum { DSH_FRAME_STDOUT = 1, DSH_FRAME_STDERR = 2, DSH_FRAME_EXIT = 3 };
+
+typedef struct dsh_frame {
+        uint32_t type;          /* DSH_FRAME_* */
+        uint32_t len;           /* bytes of payload following the frame */
+} dsh_frame_t;
+
+#endif /* __DSH_SERVE_H__ */
@@ -0,0 +1,300 @@
+/*
+ * tee.c
+ * Built-in tee: a tee [-a] file... stage after another one in a pipeline
+ * is not exec'd. The shell hands the pipe from the stage before, the output
+ * of the stage (the pipe to the stage after, or where the job's output
+ * goes) and the files to a thread of its own, which copies with tee(2) and
+ * splice(2): each file gets a tee() of what is in the pipe, moved into it
+ * through a scratch pipe, then the data is spliced on to the output, so
+ * the bytes are never copied through user space (a terminal, which takes
+ * no splice(), is written to from a buffer).
+ *
+ * Like tee, the copy stops (and the stages before get SIGPIPE) when the
+ * output goes away, and goes on without a file that could not be written.
+ */
+
+#include "dsh.h"
+
+#include <pthread.h>    /* copy threads */
+
+//most bytes moved per tee()/splice()
+#define TEE_CHUNK (1 << 20)
+
+//bytes read and written at once for an output that takes no splice()
+#define TEE_BUF_LEN (64 * 1024)
+
+//one tee stage being copied
+typedef struct _teeCopy {
+   int in;                    //read end of the pipe from the stage before
+   int out;                   //the stage's output
+   int* files;                //-1 once one could not be written
+   int nfiles;
+   pid_t pgid;                //of the job, for tee_wait()
+   bool done;
+   struct _teeCopy* next;
+} teeCopy;
+
+//guards the list; teeDone is signalled when a copy is done
+static pthread_mutex_t teeMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t teeDone = PTHREAD_COND_INITIALIZER;
+static teeCopy* copies = NULL;
+
+//shell the copies run in; a forked serve child starts a list of its own
+static pid_t teeOwner = -1;
+
+//for the stats builtin
+static unsigned long statCopies = 0;
+static unsigned long statBytes = 0;
+
+//copy thread: runs one copy and marks it done
+static void* runCopy(void* arg);
+
+//moves len bytes from pipe from to fd (a file, pipe or terminal) with
+//splice(), or through buf if fd takes no splice(); false if fd failed
+static bool moveOut(int from, int fd, size_t len, char* buf);
+
+//frees the copies that are done, of any job; called with teeMutex held
+static void reapCopies(void);
+
+//true if the stage tee argc argv is one the shell copies itself: plain
+//tee, with -a or --append at most
+bool tee_stage(int argc, char** argv){
+   if(strcmp(argv[0], "tee")){
+      return false;
+   }
+   for(int i = 1; i < argc; i++){
+      if(argv[i][0] == '-' && strcmp(argv[i], "-a") && strcmp(argv[i], "--append")){
+         return false; //the real tee knows the other options
+      }
+   }
+   return true;
+}
+
+//starts copying from pipe in to out and to the files of tee argc argv for
+//the job of pgid; in and out are the thread's from now on. False if a
+//file could not be opened (the copy goes on without it, as tee does)
+bool tee_start(int in, int out, int argc, char** argv, pid_t pgid){
+   bool append = false;
+   for(int i = 1; i < argc; i++){
+      append |= (argv[i][0] == '-');
+   }
+   teeCopy* c = (teeCopy*) calloc(1, sizeof(teeCopy));
+   int* files = (int*) malloc(argc * sizeof(int));
+   if(c == NULL || files == NULL){
+      fprintf(stderr, "%s\n", "malloc: no space");
+      free(c);
+      free(files);
+      close(in);
+      close(out);
+      return false;
+   }
+   bool ok = true;
+   for(int i = 1; i < argc; i++){
+      if(argv[i][0] == '-'){
+         continue;
+      }
+      int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC);
+      int fd = open(argv[i], flags, NEW_FILE_PERMISSIONS);
+      if(fd < 0){
+         fprintf(stderr, "tee: %s: %s\n", argv[i], strerror(errno));
+         ok = false;
+         continue;
+      }
+      files[c->nfiles++] = fd;
+   }
+   c->in = in;
+   c->out = out;
+   c->files = files;
+   c->pgid = pgid;
+
+   if(teeOwner != getpid()){ //a fork of a shell that had copies: they are the parent's
+      pthread_mutex_init(&teeMutex, NULL);
+      pthread_cond_init(&teeDone, NULL);
+      copies = NULL;
+      teeOwner = getpid();
+   }
+   pthread_mutex_lock(&teeMutex);
+   reapCopies(); //background jobs are never waited for
+   c->next = copies;
+   copies = c;
+   statCopies++;
+   pthread_mutex_unlock(&teeMutex);
+
+   //signals are for the main thread only (SIGPIPE too: a write to an
+   //output that went away fails with EPIPE)
+   sigset_t all, old;
+   sigfillset(&all);
+   pthread_sigmask(SIG_BLOCK, &all, &old);
+   pthread_t thread;
+   int failed = pthread_create(&thread, NULL, runCopy, c);
+   pthread_sigmask(SIG_SETMASK, &old, NULL);
+   if(failed){
+      errno = failed;
+      perror("tee: thread");
+      runCopy(c); //the shell does it then
+      return false;
+   }
+   pthread_detach(thread);
+   return ok;
+}
+
+//waits until the copies of the job of pgid are done, so what they write
+//comes out before the next prompt
+void tee_wait(pid_t pgid){
+   if(teeOwner != getpid()){
+      return;
+   }
+   pthread_mutex_lock(&teeMutex);
+   while(1){
+      reapCopies();
+      bool pending = false;
+      for(teeCopy* c = copies; c != NULL; c = c->next){
+         pending |= (c->pgid == pgid);
+      }
+      if(!pending){
+         break;
+      }
+      pthread_cond_wait(&teeDone, &teeMutex);
+   }
+   pthread_mutex_unlock(&teeMutex);
+}
+
+//prints the counters for the stats builtin
+void tee_print_stats(void){
+   printf("tee copies: %lu\n", statCopies);
+   printf("tee bytes: %lu\n", statBytes);
+}
+
+//copy thread: runs one copy and marks it done
+static void* runCopy(void* arg){
+   teeCopy* c = (teeCopy*) arg;
+   int scratch[2] = {-1, -1};
+   char* buf = NULL;
+   if(c->nfiles > 0 && pipe2(scratch, O_CLOEXEC) < 0){
+      perror("tee: pipe");
+      c->nfiles = 0;
+   }
+
+   while(1){
+      //the files first: what is in the pipe is duplicated into the
+      //scratch pipe and moved on from there, the pipe keeps its data
+      ssize_t n = 0;
+      bool teed = false;
+      for(int i = 0; i < c->nfiles; i++){
+         if(c->files[i] < 0){
+            continue;
+         }
+         ssize_t got;
+         while((got = tee(c->in, scratch[1], teed ? (size_t) n : TEE_CHUNK, 0)) < 0 && errno == EINTR);
+         if(got <= 0){
+            break; //end of input
+         }
+         n = teed ? n : got;
+         teed = true;
+         if(!moveOut(scratch[0], c->files[i], got, NULL)){
+            DEBUG("tee: dropping a file: %s", strerror(errno));
+            close(c->files[i]);
+            c->files[i] = -1;
+            close(scratch[0]); //with what the file did not take
+            close(scratch[1]);
+            if(pipe2(scratch, O_CLOEXEC) < 0){
+               perror("tee: pipe");
+               scratch[0] = scratch[1] = -1;
+               c->nfiles = 0;
+            }
+         }
+      }
+
+      //then on to the output, taking the data out of the pipe
+      if(!teed){
+         while((n = splice(c->in, NULL, c->out, NULL, TEE_CHUNK, SPLICE_F_MOVE)) < 0 && errno == EINTR);
+         if(n < 0 && errno == EINVAL){ //no splice() into out: read and write
+            if(buf == NULL && (buf = (char*) malloc(TEE_BUF_LEN)) == NULL){
+               break;
+            }
+            while((n = read(c->in, buf, TEE_BUF_LEN)) < 0 && errno == EINTR);
+            if(n > 0 && !moveOut(-1, c->out, n, buf)){
+               break;
+            }
+         }
+         if(n <= 0){
+            break; //end of input, or the output went away
+         }
+      } else if(!moveOut(c->in, c->out, n, buf)){
+         break;
+      }
+      pthread_mutex_lock(&teeMutex);
+      statBytes += n;
+      pthread_mutex_unlock(&teeMutex);
+   }
+
+   //ends the input of the stage after, and gives the stages before a
+   //SIGPIPE if they are still writing
+   close(c->in);
+   close(c->out);
+   for(int i = 0; i < c->nfiles; i++){
+      if(c->files[i] >= 0){
+         close(c->files[i]);
+      }
+   }
+   if(scratch[0] >= 0){
+      close(scratch[0]);
+      close(scratch[1]);
+   }
+   free(c->files);
+   free(buf);
+
+   pthread_mutex_lock(&teeMutex);
+   c->done = true;
+   pthread_cond_broadcast(&teeDone);
+   pthread_mutex_unlock(&teeMutex);
+   return NULL;
+}
+
+//frees the copies that are done, of any job; called with teeMutex held
+static void reapCopies(void){
+   teeCopy** link = &copies;
+   while(*link != NULL){
+      teeCopy* c = *link;
+      if(c->done){
+         *link = c->next;
+         free(c);
+      } else {
+         link = &c->next;
+      }
+   }
+}
+
+//moves len bytes from pipe from (or, if from is -1, from buf) to fd with
+//splice(), or through buf if fd takes no splice(); false if fd failed
+static bool moveOut(int from, int fd, size_t len, char* buf){
+   char local[TEE_BUF_LEN];
+   while(len > 0){
+      ssize_t n = -1;
+      if(from >= 0){
+         n = splice(from, NULL, fd, NULL, len, SPLICE_F_MOVE);
+         if(n < 0 && errno == EINVAL){ //a terminal: read and write it
+            buf = (buf != NULL) ? buf : local;
+            n = read(from, buf, (len < TEE_BUF_LEN) ? len : TEE_BUF_LEN);
+            if(n > 0){
+               if(!moveOut(-1, fd, n, buf)){
+                  return false;
+               }
+               len -= n;
+               continue;
+            }
+         }
+      } else {
+         n = write(fd, buf, len);
+         buf += (n > 0) ? n : 0;
+      }
+      if(n < 0 && errno == EINTR){
+         continue;
+      }
+      if(n <= 0){
+         return false;
+      }
+      len -= n;
+   }
+   return true;
+}
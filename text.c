@@ -0,0 +1,1081 @@
+/*
+ * text.c
+ * Built-in wc and fixed-string grep. When a foreground pipeline ends in one
+ * of them (or one is the whole command) the shell runs it itself on the
+ * pipe's read end instead of exec'ing coreutils or grep, with the same
+ * output and exit status as the tools. The newline, word boundary and
+ * substring scans use AVX2 or SSE2 when the CPU has them and plain C
+ * otherwise. Options or locales the built-ins do not handle exactly like
+ * the tools leave the command to the external binary.
+ */
+
+#include "dsh.h"
+
+#include <ctype.h>      /* isalnum() */
+#include <limits.h>     /* PATH_MAX */
+#include <stdarg.h>     /* outPrintf() */
+#include <strings.h>    /* strncasecmp() */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>  /* SSE2 and AVX2 intrinsics */
+#define TEXT_X86 1
+#endif
+
+//the kernels run at full speed even in the -g3 (unoptimized) builds of dsh
+#if defined(__GNUC__) && !defined(__clang__)
+#define TEXT_HOT __attribute__((optimize("O2")))
+#else
+#define TEXT_HOT
+#endif
+
+//bytes read from an input at a time (a longer line grows the buffer)
+#define TEXT_BUF_LEN (256 << 10)
+
+//bytes of output gathered before a write()
+#define TEXT_OUT_BUF_LEN (64 << 10)
+
+//grep exit statuses
+#define GREP_SELECTED 0
+#define GREP_NONE 1
+#define GREP_TROUBLE 2
+
+//sh style status of a tool killed by SIGPIPE
+#define TEXT_EPIPE_STATUS (128 + SIGPIPE)
+
+//what grep calls stdin
+#define GREP_STDIN_NAME "(standard input)"
+
+//what wc calls stdin in error messages
+#define WC_STDIN_NAME "standard input"
+
+//how the environment's locale affects the built-ins
+typedef enum { LOCALE_C, LOCALE_UTF8, LOCALE_OTHER } textLocale;
+
+//counts kept by wc over one input
+typedef struct _wcCounts {
+   uint64_t lines;
+   uint64_t words;
+   uint64_t bytes;
+   bool inWord; //the last non-neutral byte was part of a word
+} wcCounts;
+
+//parsed wc or grep command line
+typedef struct _textCmd {
+   bool grep;
+   //wc: what to print (chars are bytes in the C locale)
+   bool lines, words, chars, bytes;
+   //grep
+   const char* pattern;
+   size_t patternLen;
+   bool invert, count, number, quiet, list;
+   bool noMessages; //-s
+   int withName;    //-H (1), -h (0) or neither (-1)
+   bool utf8;       //lines with encoding errors are not printed
+   //operands, pointing into argv
+   char** files;
+   int nFiles;
+} textCmd;
+
+//buffered output of a built-in
+typedef struct _textOut {
+   int fd;
+   char buf[TEXT_OUT_BUF_LEN];
+   size_t len;
+   int error; //errno of a failed write; nothing more is written then
+} textOut;
+
+//one grep input being scanned
+typedef struct _grepInput {
+   const char* name;
+   bool showName;
+   uint64_t lineNo;      //with -n: lines before the part being scanned
+   uint64_t selected;    //lines selected so far
+   uint64_t selectedAtNul; //selected when the first NUL was seen
+   bool binary;          //a NUL was seen: NULs end lines from now on
+   bool encodingError;   //a selected line was not printed, being invalid UTF-8
+   bool outQuiet;        //selected lines are not printed (-c, -l, -q, binary)
+   bool doneOnMatch;     //the first selected line is all we need (-l, -q, binary)
+   bool done;            //nothing more to learn from this input
+} grepInput;
+
+//kernels picked for this CPU on first use
+static void (*countKernel)(const unsigned char* p, size_t n, wcCounts* c, bool words) = NULL;
+static const char* (*findKernel)(const char* s, size_t n, const char* needle, size_t k) = NULL;
+
+//picks the kernels for this CPU
+static void pickKernels(void);
+
+//newline (and word) counting kernels
+static void countScalar(const unsigned char* p, size_t n, wcCounts* c, bool words);
+#ifdef TEXT_X86
+static void countSse2(const unsigned char* p, size_t n, wcCounts* c, bool words);
+static void countAvx2(const unsigned char* p, size_t n, wcCounts* c, bool words);
+#endif
+
+//substring search kernels, memmem() semantics
+static const char* findScalar(const char* s, size_t n, const char* needle, size_t k);
+#ifdef TEXT_X86
+static const char* findSse2(const char* s, size_t n, const char* needle, size_t k);
+static const char* findAvx2(const char* s, size_t n, const char* needle, size_t k);
+#endif
+
+//newlines in n bytes at p
+static uint64_t countNewlines(const char* p, size_t n);
+
+//true if some byte of n at p is >= 0x80
+static bool hasHighBytes(const char* p, size_t n);
+
+//true if n bytes at p are all valid UTF-8
+static bool validUtf8(const unsigned char* p, size_t n);
+
+//locale the tools would run in, from LC_ALL, LC_CTYPE and LANG
+static textLocale environmentLocale(void);
+
+//parses a wc or grep command line into cmd (freed with freeTextCmd());
+//false if the tool has to be exec'd
+static bool parseTextCmd(int argc, char** argv, textCmd* cmd);
+static bool parseWcOption(textCmd* cmd, const char* arg);
+static bool parseGrepOptions(textCmd* cmd, char** argv, int* i, int argc, bool* fixed);
+static void freeTextCmd(textCmd* cmd);
+
+//runs wc over the operands (or in); returns the exit status
+static int runWc(textCmd* cmd, int in, textOut* out);
+
+//counts one wc input; false (with errno set) on a read error
+static bool wcInput(textCmd* cmd, int fd, struct stat* st, char* buf, wcCounts* c);
+
+//prints one line of wc counts
+static void wcPrint(textCmd* cmd, textOut* out, wcCounts* c, int width, const char* name);
+
+//runs grep over the operands (or in); returns the exit status
+static int runGrep(textCmd* cmd, int in, textOut* out);
+
+//scans one grep input; false (with errno set) on a read error
+static bool grepFd(textCmd* cmd, int fd, grepInput* gi, textOut* out);
+
+//selects lines in [p, end), which holds whole lines (the last may lack its \n)
+static void grepLines(textCmd* cmd, grepInput* gi, char* p, char* end, textOut* out);
+
+//selects the lines in [p, end), none of which has the pattern (-v)
+static void grepRange(textCmd* cmd, grepInput* gi, const char* p, const char* end, textOut* out);
+
+//a selected line [line, end): prints it unless it is only counted
+static void grepSelect(textCmd* cmd, grepInput* gi, const char* line, const char* end, textOut* out);
+
+//file name as coreutils quotes it in error messages
+static const char* quoteName(const char* name, char* buf, size_t len);
+
+//true if fd is /dev/null, which grep treats like -q
+static bool isDevNull(int fd);
+
+//buffered output
+static void outWrite(textOut* out, const void* data, size_t len);
+static void outPrintf(textOut* out, const char* fmt, ...);
+static void outFlush(textOut* out);
+
+//true if argv is a wc or grep the shell can run itself, see dsh.h
+bool text_builtin(int argc, char** argv){
+   textCmd cmd;
+   bool ok = parseTextCmd(argc, argv, &cmd);
+   freeTextCmd(&cmd);
+   return ok;
+}
+
+//runs a wc or grep accepted by text_builtin(), see dsh.h
+int text_run(int argc, char** argv, int in, int out){
+   textCmd cmd;
+   textOut* o = (textOut*) malloc(sizeof(textOut));
+   if(!parseTextCmd(argc, argv, &cmd) || o == NULL){
+      freeTextCmd(&cmd);
+      free(o);
+      return GREP_TROUBLE;
+   }
+   pickKernels();
+   o->fd = out;
+   o->len = 0;
+   o->error = 0;
+
+   //a reader that goes away must not take the shell with it
+   void (*oldPipe)(int) = signal(SIGPIPE, SIG_IGN);
+   int status = cmd.grep ? runGrep(&cmd, in, o) : runWc(&cmd, in, o);
+   outFlush(o);
+   signal(SIGPIPE, oldPipe);
+   if(o->error == EPIPE){
+      status = TEXT_EPIPE_STATUS; //the tool would have died of SIGPIPE
+   } else if(o->error != 0){
+      fprintf(stderr, "%s: write error: %s\n", argv[0], strerror(o->error));
+      status = cmd.grep ? GREP_TROUBLE : EXIT_FAILURE;
+   }
+   free(o);
+   freeTextCmd(&cmd);
+   return status;
+}
+
+//picks the kernels for this CPU
+static void pickKernels(void){
+   if(countKernel != NULL){
+      return;
+   }
+   countKernel = countScalar;
+   findKernel = findScalar;
+#ifdef TEXT_X86
+   __builtin_cpu_init();
+   if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")){
+      countKernel = countAvx2;
+      findKernel = findAvx2;
+   } else if(__builtin_cpu_supports("sse2")){
+      countKernel = countSse2;
+      findKernel = findSse2;
+   }
+#endif
+}
+
+/* Words are counted the way coreutils wc counts them in the C locale:
+ * space, \t, \n, \v, \f and \r end a word, printable characters start or
+ * continue one, and anything else (controls, bytes >= 0x80) is neutral and
+ * changes nothing. A word is counted where it starts, so a block of spaces
+ * and printables only has its words at the printables that follow a space
+ * (or the end of a word in the block before). Blocks with neutral bytes
+ * are rare in text and are counted one byte at a time. */
+
+//scalar count, also used for the tails and for blocks with neutral bytes
+TEXT_HOT
+static void countScalar(const unsigned char* p, size_t n, wcCounts* c, bool words){
+   c->bytes += n;
+   if(!words){
+      const unsigned char* end = p + n;
+      while((p = memchr(p, '\n', end - p)) != NULL){
+         c->lines++;
+         p++;
+      }
+      return;
+   }
+   for(size_t i = 0; i < n; i++){
+      unsigned char b = p[i];
+      if(b == ' ' || (b >= '\t' && b <= '\r')){
+         c->lines += (b == '\n');
+         c->inWord = false;
+      } else if(b > ' ' && b < 0x7f){
+         c->words += !(c->inWord);
+         c->inWord = true;
+      }
+   }
+}
+
+#ifdef TEXT_X86
+//SSE2 count, 16 bytes at a time
+__attribute__((target("sse2")))
+TEXT_HOT
+static void countSse2(const unsigned char* p, size_t n, wcCounts* c, bool words){
+   const __m128i nl = _mm_set1_epi8('\n');
+   const __m128i sp = _mm_set1_epi8(' ');
+   const __m128i tab = _mm_set1_epi8('\t');
+   const __m128i ctlSpan = _mm_set1_epi8('\r' - '\t');
+   const __m128i bang = _mm_set1_epi8('!');
+   const __m128i printSpan = _mm_set1_epi8('~' - '!');
+   size_t i = 0;
+
+   for(; i + 16 <= n; i += 16){
+      __m128i v = _mm_loadu_si128((const __m128i*) (p + i));
+      if(words){
+         //unsigned x <= k as min(x, k) == x
+         __m128i ctl = _mm_sub_epi8(v, tab);
+         __m128i space = _mm_or_si128(_mm_cmpeq_epi8(v, sp),
+                                      _mm_cmpeq_epi8(_mm_min_epu8(ctl, ctlSpan), ctl));
+         __m128i vis = _mm_sub_epi8(v, bang);
+         __m128i print = _mm_cmpeq_epi8(_mm_min_epu8(vis, printSpan), vis);
+         uint32_t s = _mm_movemask_epi8(space);
+         uint32_t w = _mm_movemask_epi8(print);
+         if((s | w) != 0xffff){
+            countScalar(p + i, 16, c, true);
+            continue;
+         }
+         uint32_t afterSpace = (s << 1) | !(c->inWord);
+         c->words += __builtin_popcount(w & afterSpace & 0xffff);
+         c->inWord = (w >> 15) & 1;
+      }
+      c->lines += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+      c->bytes += 16;
+   }
+   countScalar(p + i, n - i, c, words);
+}
+
+//AVX2 count, 32 bytes at a time; lines alone are added up per byte lane
+//and folded with SAD every 255 blocks, before a lane could overflow
+__attribute__((target("avx2,popcnt")))
+TEXT_HOT
+static void countAvx2(const unsigned char* p, size_t n, wcCounts* c, bool words){
+   const __m256i nl = _mm256_set1_epi8('\n');
+   size_t i = 0;
+
+   if(!words){
+      const __m256i zero = _mm256_setzero_si256();
+      while(i + 32 <= n){
+         __m256i acc = zero;
+         size_t stop = i + 255 * 32;
+         for(; i + 32 <= n && i < stop; i += 32){
+            __m256i v = _mm256_loadu_si256((const __m256i*) (p + i));
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, nl));
+         }
+         __m256i sums = _mm256_sad_epu8(acc, zero);
+         c->lines += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1)
+                     + _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+      }
+      c->bytes += i;
+      countScalar(p + i, n - i, c, false);
+      return;
+   }
+
+   const __m256i sp = _mm256_set1_epi8(' ');
+   const __m256i tab = _mm256_set1_epi8('\t');
+   const __m256i ctlSpan = _mm256_set1_epi8('\r' - '\t');
+   const __m256i bang = _mm256_set1_epi8('!');
+   const __m256i printSpan = _mm256_set1_epi8('~' - '!');
+   for(; i + 32 <= n; i += 32){
+      __m256i v = _mm256_loadu_si256((const __m256i*) (p + i));
+      __m256i ctl = _mm256_sub_epi8(v, tab);
+      __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(v, sp),
+                                      _mm256_cmpeq_epi8(_mm256_min_epu8(ctl, ctlSpan), ctl));
+      __m256i vis = _mm256_sub_epi8(v, bang);
+      __m256i print = _mm256_cmpeq_epi8(_mm256_min_epu8(vis, printSpan), vis);
+      uint32_t s = (uint32_t) _mm256_movemask_epi8(space);
+      uint32_t w = (uint32_t) _mm256_movemask_epi8(print);
+      if((s | w) != 0xffffffffu){
+         countScalar(p + i, 32, c, true);
+         continue;
+      }
+      uint32_t afterSpace = (s << 1) | !(c->inWord);
+      c->words += _mm_popcnt_u32(w & afterSpace);
+      c->inWord = w >> 31;
+      c->lines += _mm_popcnt_u32((uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl)));
+      c->bytes += 32;
+   }
+   countScalar(p + i, n - i, c, true);
+}
+#endif
+
+//newlines in n bytes at p
+TEXT_HOT
+static uint64_t countNewlines(const char* p, size_t n){
+   wcCounts c = { 0, 0, 0, false };
+   countKernel((const unsigned char*) p, n, &c, false);
+   return c.lines;
+}
+
+//true if some byte of n at p is >= 0x80
+TEXT_HOT
+static bool hasHighBytes(const char* p, size_t n){
+   for(size_t i = 0; i < n; i++){
+      if((unsigned char) p[i] >= 0x80){
+         return true;
+      }
+   }
+   return false;
+}
+
+//true if n bytes at p are all valid UTF-8 (no overlong forms, surrogates
+//or code points past U+10FFFF)
+TEXT_HOT
+static bool validUtf8(const unsigned char* p, size_t n){
+   size_t i = 0;
+   while(i < n){
+      unsigned char b = p[i];
+      int more;
+      uint32_t min;
+      uint32_t cp;
+      if(b < 0x80){
+         i++;
+         continue;
+      } else if((b & 0xe0) == 0xc0){
+         more = 1; min = 0x80; cp = b & 0x1f;
+      } else if((b & 0xf0) == 0xe0){
+         more = 2; min = 0x800; cp = b & 0x0f;
+      } else if((b & 0xf8) == 0xf0){
+         more = 3; min = 0x10000; cp = b & 0x07;
+      } else {
+         return false;
+      }
+      if(i + more >= n){ //cut short
+         return false;
+      }
+      for(int k = 1; k <= more; k++){
+         if((p[i + k] & 0xc0) != 0x80){
+            return false;
+         }
+         cp = (cp << 6) | (p[i + k] & 0x3f);
+      }
+      if(cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)){
+         return false;
+      }
+      i += more + 1;
+   }
+   return true;
+}
+
+//scalar substring search
+TEXT_HOT
+static const char* findScalar(const char* s, size_t n, const char* needle, size_t k){
+   return (const char*) memmem(s, n, needle, k);
+}
+
+#ifdef TEXT_X86
+/* The SIMD searches compare the first and the last byte of the needle with
+ * every position of a block at once and memcmp() only the positions where
+ * both match, which are rare in real text. */
+
+//SSE2 substring search
+__attribute__((target("sse2")))
+TEXT_HOT
+static const char* findSse2(const char* s, size_t n, const char* needle, size_t k){
+   if(k < 2 || k > n){
+      return (k == 1) ? (const char*) memchr(s, needle[0], n) : findScalar(s, n, needle, k);
+   }
+   const __m128i first = _mm_set1_epi8(needle[0]);
+   const __m128i last = _mm_set1_epi8(needle[k - 1]);
+   size_t i = 0;
+   for(; i + k - 1 + 16 <= n; i += 16){
+      __m128i f = _mm_loadu_si128((const __m128i*) (s + i));
+      __m128i l = _mm_loadu_si128((const __m128i*) (s + i + k - 1));
+      uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(f, first),
+                                                      _mm_cmpeq_epi8(l, last)));
+      while(mask != 0){
+         int bit = __builtin_ctz(mask);
+         if(!memcmp(s + i + bit + 1, needle + 1, k - 2)){
+            return s + i + bit;
+         }
+         mask &= mask - 1;
+      }
+   }
+   return findScalar(s + i, n - i, needle, k);
+}
+
+//AVX2 substring search
+__attribute__((target("avx2")))
+TEXT_HOT
+static const char* findAvx2(const char* s, size_t n, const char* needle, size_t k){
+   if(k < 2 || k > n){
+      return (k == 1) ? (const char*) memchr(s, needle[0], n) : findScalar(s, n, needle, k);
+   }
+   const __m256i first = _mm256_set1_epi8(needle[0]);
+   const __m256i last = _mm256_set1_epi8(needle[k - 1]);
+   size_t i = 0;
+   for(; i + k - 1 + 32 <= n; i += 32){
+      __m256i f = _mm256_loadu_si256((const __m256i*) (s + i));
+      __m256i l = _mm256_loadu_si256((const __m256i*) (s + i + k - 1));
+      uint32_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(f, first),
+                                                                       _mm256_cmpeq_epi8(l, last)));
+      while(mask != 0){
+         int bit = __builtin_ctz(mask);
+         if(!memcmp(s + i + bit + 1, needle + 1, k - 2)){
+            return s + i + bit;
+         }
+         mask &= mask - 1;
+      }
+   }
+   return findSse2(s + i, n - i, needle, k);
+}
+#endif
+
+//locale the tools would run in, from LC_ALL, LC_CTYPE and LANG
+static textLocale environmentLocale(void){
+   const char* vars[] = { "LC_ALL", "LC_CTYPE", "LANG" };
+   for(int i = 0; i < 3; i++){
+      const char* value = getenv(vars[i]);
+      if(value == NULL || value[0] == '\0'){
+         continue;
+      }
+      if(!strcmp(value, "C") || !strcmp(value, "POSIX")){
+         return LOCALE_C;
+      }
+      const char* codeset = strchr(value, '.');
+      if(codeset != NULL && (!strncasecmp(codeset + 1, "UTF-8", 5) || !strncasecmp(codeset + 1, "utf8", 4))){
+         return LOCALE_UTF8;
+      }
+      return LOCALE_OTHER;
+   }
+   return LOCALE_C;
+}
+
+//parses a wc or grep command line; false if the tool has to be exec'd
+static bool parseTextCmd(int argc, char** argv, textCmd* cmd){
+   memset(cmd, 0, sizeof(*cmd));
+   cmd->withName = -1;
+   if(argc < 1 || (strcmp(argv[0], "wc") && strcmp(argv[0], "grep"))){
+      return false;
+   }
+   cmd->grep = (argv[0][0] == 'g');
+   cmd->files = (char**) malloc(argc * sizeof(char*));
+   if(cmd->files == NULL){
+      return false;
+   }
+
+   //options may follow operands, as with GNU getopt
+   bool fixed = false;
+   bool ok = true;
+   bool optionsDone = false;
+   for(int i = 1; i < argc && ok; i++){
+      char* arg = argv[i];
+      if(optionsDone || arg[0] != '-' || arg[1] == '\0'){
+         if(cmd->grep && cmd->pattern == NULL){
+            cmd->pattern = arg;
+         } else {
+            cmd->files[cmd->nFiles++] = arg;
+         }
+      } else if(!strcmp(arg, "--")){
+         optionsDone = true;
+      } else if(cmd->grep){
+         ok = parseGrepOptions(cmd, argv, &i, argc, &fixed);
+      } else {
+         ok = parseWcOption(cmd, arg);
+      }
+   }
+   if(!ok){
+      return false;
+   }
+
+   textLocale locale = environmentLocale();
+   if(cmd->grep){
+      if(cmd->pattern == NULL || locale == LOCALE_OTHER || (cmd->list && cmd->count)){
+         return false;
+      }
+      cmd->patternLen = strlen(cmd->pattern);
+      //only fixed strings: no newline (that is several patterns) and, for
+      //a basic regular expression, none of its special characters
+      if(strchr(cmd->pattern, '\n') != NULL || (!fixed && strpbrk(cmd->pattern, "\\.[*^$") != NULL)){
+         return false;
+      }
+      cmd->utf8 = (locale == LOCALE_UTF8);
+   } else {
+      if(!(cmd->lines || cmd->words || cmd->chars || cmd->bytes)){
+         cmd->lines = cmd->words = cmd->bytes = true;
+      }
+      //words and characters depend on the multibyte locale
+      if(locale != LOCALE_C && (cmd->words || cmd->chars)){
+         return false;
+      }
+   }
+   return true;
+}
+
+//parses one wc option (or cluster of them)
+static bool parseWcOption(textCmd* cmd, const char* arg){
+   if(arg[1] == '-'){
+      if(!strcmp(arg, "--lines")){
+         cmd->lines = true;
+      } else if(!strcmp(arg, "--words")){
+         cmd->words = true;
+      } else if(!strcmp(arg, "--chars")){
+         cmd->chars = true;
+      } else if(!strcmp(arg, "--bytes")){
+         cmd->bytes = true;
+      } else {
+         return false;
+      }
+      return true;
+   }
+   for(const char* o = arg + 1; *o != '\0'; o++){
+      switch(*o){
+         case 'l': cmd->lines = true; break;
+         case 'w': cmd->words = true; break;
+         case 'm': cmd->chars = true; break;
+         case 'c': cmd->bytes = true; break;
+         default: return false;
+      }
+   }
+   return true;
+}
+
+//parses one cluster of grep options at argv[*i] (-e takes the rest of the
+//word or the next one)
+static bool parseGrepOptions(textCmd* cmd, char** argv, int* i, int argc, bool* fixed){
+   const char* arg = argv[*i];
+   if(arg[1] == '-'){ //long options are left to grep
+      return false;
+   }
+   for(const char* o = arg + 1; *o != '\0'; o++){
+      switch(*o){
+         case 'F': *fixed = true; break;
+         case 'v': cmd->invert = true; break;
+         case 'c': cmd->count = true; break;
+         case 'n': cmd->number = true; break;
+         case 'q': cmd->quiet = true; break;
+         case 'l': cmd->list = true; break;
+         case 's': cmd->noMessages = true; break;
+         case 'H': cmd->withName = 1; break;
+         case 'h': cmd->withName = 0; break;
+         case 'e':
+            if(cmd->pattern != NULL){ //several patterns, or -e after the operand
+               return false;
+            }
+            if(o[1] != '\0'){
+               cmd->pattern = o + 1;
+            } else if(*i + 1 < argc){
+               cmd->pattern = argv[++(*i)];
+            } else {
+               return false;
+            }
+            return true;
+         default:
+            return false;
+      }
+   }
+   return true;
+}
+
+//frees what parseTextCmd() allocated
+static void freeTextCmd(textCmd* cmd){
+   free(cmd->files);
+   cmd->files = NULL;
+}
+
+/* wc follows coreutils: counts are right aligned to the width of the
+ * total size of the regular files among the operands (at least 7 if one
+ * is not a regular file), unless a single count of a single input is
+ * printed; a total line follows when there are several operands. */
+
+//runs wc over the operands (or in); returns the exit status
+static int runWc(textCmd* cmd, int in, textOut* out){
+   int nInputs = (cmd->nFiles > 0) ? cmd->nFiles : 1;
+   struct stat* st = (struct stat*) calloc(nInputs, sizeof(struct stat));
+   int* statFailed = (int*) calloc(nInputs, sizeof(int));
+   char* buf = (char*) malloc(TEXT_BUF_LEN);
+   if(st == NULL || statFailed == NULL || buf == NULL){
+      fprintf(stderr, "wc: %s\n", strerror(ENOMEM));
+      free(st); free(statFailed); free(buf);
+      return EXIT_FAILURE;
+   }
+
+   int width = 1;
+   int printed = cmd->lines + cmd->words + cmd->chars + cmd->bytes;
+   if(!(nInputs == 1 && printed == 1)){
+      int minimum = 1;
+      uint64_t regularTotal = 0;
+      for(int i = 0; i < nInputs; i++){
+         const char* name = (cmd->nFiles > 0) ? cmd->files[i] : "-";
+         statFailed[i] = strcmp(name, "-") ? stat(name, &st[i]) : fstat(in, &st[i]);
+         if(statFailed[i] == 0){
+            if(S_ISREG(st[i].st_mode)){
+               regularTotal += st[i].st_size;
+            } else {
+               minimum = 7;
+            }
+         }
+      }
+      for(; regularTotal >= 10; regularTotal /= 10){
+         width++;
+      }
+      width = (width < minimum) ? minimum : width;
+   } else {
+      statFailed[0] = 1; //looked up when counting if it is needed
+   }
+
+   bool ok = true;
+   wcCounts total = { 0, 0, 0, false };
+   char quoted[PATH_MAX + 8];
+   for(int i = 0; i < nInputs; i++){
+      const char* name = (cmd->nFiles > 0) ? cmd->files[i] : NULL;
+      bool stdinInput = (name == NULL || !strcmp(name, "-"));
+      int fd = stdinInput ? in : open(name, O_RDONLY | O_CLOEXEC);
+      if(fd < 0){
+         fprintf(stderr, "wc: %s: %s\n", quoteName(name, quoted, sizeof(quoted)), strerror(errno));
+         ok = false;
+         continue;
+      }
+      if(statFailed[i] != 0 && fstat(fd, &st[i]) != 0){
+         st[i].st_mode = 0;
+      }
+
+      wcCounts c = { 0, 0, 0, false };
+      if(!wcInput(cmd, fd, &st[i], buf, &c)){
+         fprintf(stderr, "wc: %s: %s\n", quoteName(name ? name : WC_STDIN_NAME, quoted, sizeof(quoted)),
+                 strerror(errno));
+         ok = false;
+      }
+      if(!stdinInput){
+         close(fd);
+      }
+      wcPrint(cmd, out, &c, width, name);
+      total.lines += c.lines;
+      total.words += c.words;
+      total.bytes += c.bytes;
+   }
+   if(nInputs > 1){
+      wcPrint(cmd, out, &total, width, "total");
+   }
+
+   free(st);
+   free(statFailed);
+   free(buf);
+   return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+//counts one wc input; false (with errno set) on a read error
+static bool wcInput(textCmd* cmd, int fd, struct stat* st, char* buf, wcCounts* c){
+   bool words = cmd->words;
+
+   //only bytes of a regular file: its size says it all
+   if(!(cmd->lines || cmd->words) && S_ISREG(st->st_mode) && st->st_size > 0){
+      off_t pos = lseek(fd, 0, SEEK_CUR);
+      if(pos >= 0 && pos < st->st_size && lseek(fd, 0, SEEK_END) >= 0){
+         c->bytes = st->st_size - pos;
+      }
+   }
+
+   ssize_t got;
+   while((got = read(fd, buf, TEXT_BUF_LEN)) != 0){
+      if(got < 0){
+         if(errno == EINTR){
+            continue;
+         }
+         return false;
+      }
+      countKernel((const unsigned char*) buf, got, c, words);
+   }
+   return true;
+}
+
+//prints one line of wc counts: lines, words, characters, bytes and name
+static void wcPrint(textCmd* cmd, textOut* out, wcCounts* c, int width, const char* name){
+   const char* sep = "";
+   if(cmd->lines){
+      outPrintf(out, "%s%*llu", sep, width, (unsigned long long) c->lines);
+      sep = " ";
+   }
+   if(cmd->words){
+      outPrintf(out, "%s%*llu", sep, width, (unsigned long long) c->words);
+      sep = " ";
+   }
+   if(cmd->chars){
+      outPrintf(out, "%s%*llu", sep, width, (unsigned long long) c->bytes);
+      sep = " ";
+   }
+   if(cmd->bytes){
+      outPrintf(out, "%s%*llu", sep, width, (unsigned long long) c->bytes);
+   }
+   if(name != NULL){
+      char quoted[PATH_MAX + 8];
+      outPrintf(out, " %s", strchr(name, '\n') ? quoteName(name, quoted, sizeof(quoted)) : name);
+   }
+   outWrite(out, "\n", 1);
+}
+
+/* grep follows GNU grep: lines are printed with the file name when there
+ * are several operands (or -H) and the line number with -n. A NUL makes
+ * an input binary: from then on NULs end lines too, nothing more is
+ * printed and the first line selected after it ends the input with
+ * "binary file matches" on stderr. In a UTF-8 locale a selected line that
+ * is not valid UTF-8 is not printed and gets the same message. GNU grep
+ * looks for NULs a buffer at a time, so with a late NUL in a large input
+ * the last lines printed before the message may differ. */
+
+//runs grep over the operands (or in); returns the exit status
+static int runGrep(textCmd* cmd, int in, textOut* out){
+   int nInputs = (cmd->nFiles > 0) ? cmd->nFiles : 1;
+   bool showName = (cmd->withName >= 0) ? cmd->withName : (cmd->nFiles > 1);
+   bool devNull = isDevNull(out->fd);
+   bool trouble = false;
+   bool selected = false;
+
+   for(int i = 0; i < nInputs; i++){
+      const char* name = (cmd->nFiles > 0) ? cmd->files[i] : "-";
+      bool stdinInput = !strcmp(name, "-");
+      int fd = stdinInput ? in : open(name, O_RDONLY | O_CLOEXEC);
+      grepInput gi;
+      memset(&gi, 0, sizeof(gi));
+      gi.name = stdinInput ? GREP_STDIN_NAME : name;
+      gi.showName = showName;
+      gi.doneOnMatch = cmd->quiet || cmd->list || devNull;
+      gi.outQuiet = cmd->count || gi.doneOnMatch;
+      bool origOutQuiet = gi.outQuiet;
+
+      if(fd < 0 || !grepFd(cmd, fd, &gi, out)){
+         if(!(cmd->noMessages)){
+            fprintf(stderr, "grep: %s: %s\n", gi.name, strerror(errno));
+         }
+         trouble = true;
+      }
+      if(fd >= 0 && !stdinInput){
+         close(fd);
+      }
+      if(!origOutQuiet && (gi.encodingError || (gi.binary && gi.selected > gi.selectedAtNul))){
+         outFlush(out);
+         fprintf(stderr, "grep: %s: binary file matches\n", gi.name);
+      }
+
+      if(cmd->count){
+         if(showName){
+            outPrintf(out, "%s:", gi.name);
+         }
+         outPrintf(out, "%llu\n", (unsigned long long) gi.selected);
+      }
+      if(cmd->list && gi.selected > 0){
+         outPrintf(out, "%s\n", gi.name);
+      }
+      selected |= (gi.selected > 0);
+      if(cmd->quiet && selected){
+         return GREP_SELECTED; //grep -q exits on the first selected line
+      }
+      if(out->error){
+         break;
+      }
+   }
+   return trouble ? GREP_TROUBLE : (selected ? GREP_SELECTED : GREP_NONE);
+}
+
+//scans one grep input; false (with errno set) on a read error
+static bool grepFd(textCmd* cmd, int fd, grepInput* gi, textOut* out){
+   size_t cap = TEXT_BUF_LEN;
+   size_t have = 0;
+   char* buf = (char*) malloc(cap);
+   if(buf == NULL){
+      errno = ENOMEM;
+      return false;
+   }
+
+   while(!(gi->done) && !(out->error)){
+      ssize_t got = read(fd, buf + have, cap - have);
+      if(got < 0){
+         if(errno == EINTR){
+            continue;
+         }
+         int savedErrno = errno;
+         free(buf);
+         errno = savedErrno;
+         return false;
+      } else if(got == 0){ //the last line may lack its newline
+         if(have > 0){
+            grepLines(cmd, gi, buf, buf + have, out);
+         }
+         break;
+      }
+
+      //scan the whole lines, keep the start of the last one for later
+      char* nl = (char*) memrchr(buf + have, '\n', got);
+      have += got;
+      if(nl == NULL){
+         if(have == cap){ //one long line
+            char* bigger = (char*) realloc(buf, cap * 2);
+            if(bigger == NULL){
+               free(buf);
+               errno = ENOMEM;
+               return false;
+            }
+            buf = bigger;
+            cap *= 2;
+         }
+         continue;
+      }
+      size_t whole = nl + 1 - buf;
+      grepLines(cmd, gi, buf, buf + whole, out);
+      memmove(buf, buf + whole, have - whole);
+      have -= whole;
+   }
+   free(buf);
+   return true;
+}
+
+//selects lines in [p, end), which holds whole lines (the last may lack its \n)
+static void grepLines(textCmd* cmd, grepInput* gi, char* p, char* end, textOut* out){
+   if(!(gi->binary) && memchr(p, '\0', end - p) != NULL){
+      gi->binary = true;
+      gi->selectedAtNul = gi->selected;
+      if(!(cmd->count)){
+         gi->doneOnMatch = gi->outQuiet = true;
+      }
+   }
+   if(gi->binary){ //NULs end lines, like GNU grep's zapping
+      for(char* z = p; (z = memchr(z, '\0', end - z)) != NULL; z++){
+         *z = '\n';
+      }
+   }
+
+   const char* pos = p;
+   while(pos < end && !(gi->done)){
+      const char* match = findKernel(pos, end - pos, cmd->pattern, cmd->patternLen);
+      const char* lineStart = end;
+      const char* lineEnd = end;
+      if(match != NULL){
+         const char* before = (const char*) memrchr(pos, '\n', match - pos);
+         lineStart = (before != NULL) ? before + 1 : pos;
+         lineEnd = (const char*) memchr(match, '\n', end - match);
+         lineEnd = (lineEnd != NULL) ? lineEnd + 1 : end;
+      }
+
+      if(cmd->invert){
+         grepRange(cmd, gi, pos, lineStart, out);
+         gi->lineNo += (match != NULL); //the line with the pattern
+      } else if(match != NULL){
+         if(cmd->number){
+            gi->lineNo += countNewlines(pos, lineStart - pos);
+         }
+         grepSelect(cmd, gi, lineStart, lineEnd, out);
+         gi->lineNo++;
+      } else if(cmd->number){
+         gi->lineNo += countNewlines(pos, end - pos);
+      }
+      pos = lineEnd;
+   }
+}
+
+//selects the lines in [p, end), none of which has the pattern (-v)
+static void grepRange(textCmd* cmd, grepInput* gi, const char* p, const char* end, textOut* out){
+   if(p >= end){
+      return;
+   }
+
+   //nothing printed per line: count them all at once
+   if(gi->outQuiet){
+      uint64_t lines = countNewlines(p, end - p) + (end[-1] != '\n');
+      gi->selected += lines;
+      gi->lineNo += lines;
+      if(gi->doneOnMatch){
+         gi->done = true;
+      }
+      return;
+   }
+
+   //printed as they are: one write for the lot
+   if(!(gi->showName) && !(cmd->number) && !(cmd->utf8 && hasHighBytes(p, end - p))){
+      uint64_t lines = countNewlines(p, end - p) + (end[-1] != '\n');
+      gi->selected += lines;
+      gi->lineNo += lines;
+      outWrite(out, p, end - p);
+      if(end[-1] != '\n'){
+         outWrite(out, "\n", 1);
+      }
+      return;
+   }
+
+   while(p < end && !(gi->done)){
+      const char* lineEnd = (const char*) memchr(p, '\n', end - p);
+      lineEnd = (lineEnd != NULL) ? lineEnd + 1 : end;
+      grepSelect(cmd, gi, p, lineEnd, out);
+      gi->lineNo++;
+      p = lineEnd;
+   }
+}
+
+//a selected line [line, end): prints it unless it is only counted
+static void grepSelect(textCmd* cmd, grepInput* gi, const char* line, const char* end, textOut* out){
+   gi->selected++;
+   if(gi->doneOnMatch){
+      gi->done = true;
+   }
+   if(gi->outQuiet){
+      return;
+   }
+   if(cmd->utf8 && hasHighBytes(line, end - line) && !validUtf8((const unsigned char*) line, end - line)){
+      gi->encodingError = true;
+      return;
+   }
+
+   if(gi->showName){
+      outPrintf(out, "%s:", gi->name);
+   }
+   if(cmd->number){
+      outPrintf(out, "%llu:", (unsigned long long) gi->lineNo + 1);
+   }
+   outWrite(out, line, end - line);
+   if(end == line || end[-1] != '\n'){
+      outWrite(out, "\n", 1);
+   }
+}
+
+//file name as coreutils quotes it in error messages: as it is if it only
+//has characters the shell leaves alone, otherwise in quotes
+static const char* quoteName(const char* name, char* buf, size_t len){
+   const char* plain = "%+,-./=@_^";
+   bool safe = (name[0] != '\0');
+   bool single = true;
+   for(const char* c = name; *c != '\0'; c++){
+      if(!isalnum((unsigned char) *c) && strchr(plain, *c) == NULL
+         && !(c != name && (*c == '~' || *c == '#'))){
+         safe = false;
+      }
+      if(*c == '\''){
+         single = false;
+      }
+   }
+   if(safe){
+      return name;
+   }
+   if(single){
+      snprintf(buf, len, "'%s'", name);
+   } else if(strpbrk(name, "\"$`\\") == NULL){
+      snprintf(buf, len, "\"%s\"", name);
+   } else { //'it'\''s'
+      size_t used = 0;
+      buf[used++] = '\'';
+      for(const char* c = name; *c != '\0' && used + 6 < len; c++){
+         if(*c == '\''){
+            memcpy(buf + used, "'\\''", 4);
+            used += 4;
+         } else {
+            buf[used++] = *c;
+         }
+      }
+      buf[used++] = '\'';
+      buf[used] = '\0';
+   }
+   return buf;
+}
+
+//true if fd is /dev/null, which grep treats like -q
+static bool isDevNull(int fd){
+   struct stat fdSt;
+   struct stat nullSt;
+   return fstat(fd, &fdSt) == 0 && S_ISCHR(fdSt.st_mode) && stat("/dev/null", &nullSt) == 0
+          && fdSt.st_rdev == nullSt.st_rdev;
+}
+
+//adds len bytes to the output, writing them straight through if large
+static void outWrite(textOut* out, const void* data, size_t len){
+   if(out->len + len > sizeof(out->buf)){
+      outFlush(out);
+   }
+   if(len >= sizeof(out->buf)){
+      const char* p = (const char*) data;
+      while(len > 0 && !(out->error)){
+         ssize_t put = write(out->fd, p, len);
+         if(put < 0 && errno == EINTR){
+            continue;
+         } else if(put <= 0){
+            out->error = (put < 0) ? errno : EIO;
+            break;
+         }
+         p += put;
+         len -= put;
+      }
+      return;
+   }
+   memcpy(out->buf + out->len, data, len);
+   out->len += len;
+}
+
+//printf() into the output
+static void outPrintf(textOut* out, const char* fmt, ...){
+   char line[PATH_MAX + 64];
+   va_list args;
+   va_start(args, fmt);
+   int len = vsnprintf(line, sizeof(line), fmt, args);
+   va_end(args);
+   if(len > 0){
+      outWrite(out, line, ((size_t) len < sizeof(line)) ? (size_t) len : sizeof(line) - 1);
+   }
+}
+
+//writes out what the output has gathered
+static void outFlush(textOut* out){
+   size_t done = 0;
+   while(done < out->len && !(out->error)){
+      ssize_t put = write(out->fd, out->buf + done, out->len - done);
+      if(put < 0 && errno == EINTR){
+         continue;
+      } else if(put <= 0){
+         out->error = (put < 0) ? errno : EIO;
+         break;
+      }
+      done += put;
+   }
+   out->len = 0;
+}
@@ -0,0 +1,260 @@
+/*
+ * timeout.c
+ * Job deadlines: every job given one (timeout DURATION cmd, or $DSH_TIMEOUT
+ * for all the jobs of the session) has a timerfd here. A thread polls the
+ * timerfds; when one expires the job's process group gets SIGTERM, and
+ * SIGKILL if it is still around after the grace period, so neither the
+ * prompt nor the job list is held up by a stage that hangs.
+ */
+
+#include "dsh.h"
+
+#include <pthread.h>    /* deadline thread */
+#include <poll.h>       /* poll() */
+#include <sys/timerfd.h> /* timerfd_create(), timerfd_settime() */
+
+#define NSEC_PER_SEC 1000000000LL
+
+//the deadline of one job
+typedef struct _deadline {
+   pid_t pgid;
+   int fd;                    //timerfd, armed for the SIGTERM then the SIGKILL
+   int64_t grace;             //ns between the two
+   bool termed;               //SIGTERM sent, the SIGKILL is next
+   bool done;                 //cancelled or SIGKILL sent: the thread drops it
+   bool* fired;               //set when the job overran
+   struct _deadline* next;
+} deadline;
+
+//guards the list (and what fired points to) against the thread
+static pthread_mutex_t deadlineMutex = PTHREAD_MUTEX_INITIALIZER;
+static deadline* deadlines = NULL;
+
+//wakes the thread out of poll() when the list changed
+static int wake[2] = { -1, -1 };
+
+//shell the thread runs in; a forked serve child needs its own
+static pid_t deadlineOwner = -1;
+
+//jobs that overran, for the stats builtin
+static unsigned long statTimeouts = 0;
+static unsigned long statKills = 0;
+
+//starts the thread and its wake pipe if this process has none yet
+static bool startThread(void);
+
+//deadline thread: polls the timerfds and signals the jobs that overran
+static void* watchDeadlines(void* arg);
+
+//sets timer fd to go off once, ns from now
+static bool arm(int fd, int64_t ns);
+
+//has the thread look at the list again
+static void wakeThread(void);
+
+//gives the job of pgid ns to run (and grace_ns more after SIGTERM) and sets
+//*fired if it does not make it; false if no timer could be set up
+bool timeout_arm(pid_t pgid, int64_t ns, int64_t grace_ns, bool* fired){
+   deadline* d = (deadline*) malloc(sizeof(deadline));
+   if(d == NULL || !startThread()){
+      free(d);
+      return false;
+   }
+   d->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+   if(d->fd < 0 || !arm(d->fd, ns)){
+      perror("timeout: timerfd");
+      if(d->fd >= 0){
+         close(d->fd);
+      }
+      free(d);
+      return false;
+   }
+   d->pgid = pgid;
+   d->grace = grace_ns;
+   d->termed = false;
+   d->done = false;
+   d->fired = fired;
+
+   pthread_mutex_lock(&deadlineMutex);
+   d->next = deadlines;
+   deadlines = d;
+   pthread_mutex_unlock(&deadlineMutex);
+   wakeThread();
+   return true;
+}
+
+//drops the deadline of the job of pgid, which is done; its fired flag is
+//not touched after this returns
+void timeout_cancel(pid_t pgid){
+   if(deadlineOwner != getpid()){
+      return;
+   }
+   bool found = false;
+   pthread_mutex_lock(&deadlineMutex);
+   for(deadline* d = deadlines; d != NULL; d = d->next){
+      if(d->pgid == pgid && !(d->done)){
+         d->done = true;
+         found = true;
+      }
+   }
+   pthread_mutex_unlock(&deadlineMutex);
+   if(found){
+      wakeThread();
+   }
+}
+
+//a duration in ns: a number (fractions allowed) of seconds, or of ms, s,
+//m, h or d with that suffix; -1 if s is not one
+int64_t timeout_parse(const char* s){
+   char* unit;
+   errno = 0;
+   double n = strtod(s, &unit);
+   if(unit == s || errno != 0 || n < 0){
+      return -1;
+   }
+   double scale;
+   if(!strcmp(unit, "ms")){
+      scale = 1e6;
+   } else if(!strcmp(unit, "") || !strcmp(unit, "s")){
+      scale = 1e9;
+   } else if(!strcmp(unit, "m")){
+      scale = 60e9;
+   } else if(!strcmp(unit, "h")){
+      scale = 3600e9;
+   } else if(!strcmp(unit, "d")){
+      scale = 86400e9;
+   } else {
+      return -1;
+   }
+   return (int64_t) (n * scale);
+}
+
+//prints the deadline counters for the stats builtin
+void timeout_print_stats(void){
+   printf("timeouts: %lu\n", statTimeouts);
+   printf("timeouts killed: %lu\n", statKills);
+}
+
+//starts the thread and its wake pipe if this process has none yet
+static bool startThread(void){
+   if(deadlineOwner == getpid()){
+      return true;
+   }
+   //a fork of a shell that had one: its deadlines are the parent's
+   pthread_mutex_init(&deadlineMutex, NULL);
+   deadlines = NULL;
+   if(wake[0] >= 0){
+      close(wake[0]);
+      close(wake[1]);
+   }
+   if(pipe2(wake, O_CLOEXEC | O_NONBLOCK) < 0){
+      perror("timeout: pipe");
+      wake[0] = wake[1] = -1;
+      return false;
+   }
+
+   //signals are for the main thread only
+   sigset_t all, old;
+   sigfillset(&all);
+   pthread_sigmask(SIG_BLOCK, &all, &old);
+   pthread_t thread;
+   int failed = pthread_create(&thread, NULL, watchDeadlines, NULL);
+   pthread_sigmask(SIG_SETMASK, &old, NULL);
+   if(failed){
+      errno = failed;
+      perror("timeout: thread");
+      return false;
+   }
+   pthread_detach(thread);
+   deadlineOwner = getpid();
+   return true;
+}
+
+//deadline thread: polls the timerfds and signals the jobs that overran;
+//only this thread frees deadlines, so the ones polled stay valid
+static void* watchDeadlines(void* arg){
+   struct pollfd* fds = NULL;
+   deadline** polled = NULL;
+   int cap = 0;
+
+   pthread_mutex_lock(&deadlineMutex);
+   while(1){
+      //drop the finished ones and poll the rest
+      int n = 1;
+      deadline** link = &deadlines;
+      while(*link != NULL){
+         deadline* d = *link;
+         if(d->done){
+            *link = d->next;
+            close(d->fd);
+            free(d);
+            continue;
+         }
+         n++;
+         link = &d->next;
+      }
+      if(n > cap){
+         cap = n * 2;
+         fds = (struct pollfd*) realloc(fds, cap * sizeof(struct pollfd));
+         polled = (deadline**) realloc(polled, cap * sizeof(deadline*));
+      }
+      fds[0].fd = wake[0];
+      fds[0].events = POLLIN;
+      int i = 1;
+      for(deadline* d = deadlines; d != NULL; d = d->next, i++){
+         fds[i].fd = d->fd;
+         fds[i].events = POLLIN;
+         polled[i] = d;
+      }
+      pthread_mutex_unlock(&deadlineMutex);
+
+      int ready = poll(fds, n, -1);
+      char drain[64];
+      while(read(wake[0], drain, sizeof(drain)) > 0);
+
+      pthread_mutex_lock(&deadlineMutex);
+      for(i = 1; ready > 0 && i < n; i++){
+         deadline* d = polled[i];
+         uint64_t expirations;
+         if(fds[i].revents == 0 || read(d->fd, &expirations, sizeof(expirations)) < 0 || d->done){
+            continue;
+         }
+         if(!(d->termed)){ //overran: ask it to stop, and wake it to hear it
+            DEBUG("job %d timed out", (int) d->pgid);
+            kill(-(d->pgid), SIGTERM);
+            kill(-(d->pgid), SIGCONT);
+            *(d->fired) = true;
+            d->termed = true;
+            statTimeouts++;
+            if(d->grace > 0 && arm(d->fd, d->grace)){
+               continue;
+            }
+         }
+         if(kill(-(d->pgid), SIGKILL) == 0){ //it had its grace period
+            statKills++;
+         }
+         d->done = true;
+      }
+   }
+   return NULL; /* NOT REACHED */
+}
+
+//sets timer fd to go off once, ns from now
+static bool arm(int fd, int64_t ns){
+   struct itimerspec when;
+   memset(&when, 0, sizeof(when));
+   when.it_value.tv_sec = ns / NSEC_PER_SEC;
+   when.it_value.tv_nsec = ns % NSEC_PER_SEC;
+   if(ns <= 0){
+      when.it_value.tv_nsec = 1; //all zero would disarm it
+   }
+   return timerfd_settime(fd, 0, &when, NULL) == 0;
+}
+
+//has the thread look at the list again
+static void wakeThread(void){
+   char c = 0;
+   if(write(wake[1], &c, 1) < 0 && errno != EAGAIN){
+      perror("timeout");
+   }
+}
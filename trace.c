@@ -0,0 +1,253 @@
+/*
+ * trace.c
+ * Workload traces: dsh --record writes every command line read, when it
+ * arrived, the cwd it was typed in, how long it ran and its exit status;
+ * dsh --replay runs a trace again, as fast as it can or at the recorded
+ * pace, and reports how the latency of each command line moved.
+ *
+ * A trace is text, one command line per record after a header:
+ *    #dsh-trace 1 <unix time of the start>
+ *    <us since the last arrival>\t<us it ran>\t<status>\t<cwd>\t<command>
+ * The cwd is left empty while it does not change; tabs, newlines (of loops
+ * typed over several lines) and backslashes are escaped as \t, \n and \\.
+ */
+
+#include "dsh.h"
+
+#include <ctype.h>      /* isspace() */
+#include <time.h>       /* clock_gettime(), clock_nanosleep() */
+#include <limits.h>     /* PATH_MAX */
+
+//first line of a trace
+#define TRACE_HEADER "#dsh-trace 1"
+
+#define NSEC_PER_SEC 1000000000LL
+#define NSEC_PER_USEC 1000LL
+
+//the trace being recorded, and the stream whose lines go into it
+static FILE* traceOut = NULL;
+static FILE* traceSource = NULL;
+
+//lines read for the command line being run (a loop takes several)
+static char* pending = NULL;
+static size_t pendingLen = 0;
+static size_t pendingCap = 0;
+
+//when the pending command line arrived and the cwd it arrived in
+static int64_t pendingArrival = 0;
+static char pendingCwd[PATH_MAX];
+
+//arrival of the last record and the last cwd written
+static int64_t lastArrival = 0;
+static char lastCwd[PATH_MAX];
+
+//writes n bytes of s to out with tabs, newlines and backslashes escaped
+static void writeEscaped(FILE* out, const char* s, size_t n);
+
+//undoes writeEscaped() in place; returns the new length
+static size_t unescape(char* s);
+
+//now on CLOCK_MONOTONIC in ns
+static int64_t nowNs(void);
+
+//starts recording the command lines read from source into path
+bool trace_record_start(const char* path, FILE* source){
+   traceOut = fopen(path, "w");
+   if(traceOut == NULL){
+      perror(path);
+      return false;
+   }
+   fprintf(traceOut, "%s %lld\n", TRACE_HEADER, (long long) time(NULL));
+   fflush(traceOut);
+   traceSource = source;
+   lastArrival = nowNs();
+   lastCwd[0] = '\0';
+   return true;
+}
+
+//adds a line read by readcmdline() to the command line being recorded
+void trace_record_line(const char* line){
+   if(traceOut == NULL || get_cmd_source() != traceSource){
+      return; //not recording, or a script run by a builtin
+   }
+   const char* c = line;
+   while(isspace((unsigned char) *c)){
+      c++;
+   }
+   if(*c == '\0' && pendingLen == 0){
+      return; //blank lines are not worth a record (inside a here-document they count)
+   }
+
+   size_t len = strlen(line);
+   if(pendingLen + len + 2 > pendingCap){
+      size_t cap = (pendingCap > 0) ? pendingCap * 2 : MAX_LEN_CMDLINE * 2;
+      while(cap < pendingLen + len + 2){
+         cap *= 2;
+      }
+      char* grown = (char*) realloc(pending, cap);
+      if(grown == NULL){
+         return;
+      }
+      pending = grown;
+      pendingCap = cap;
+   }
+   if(pendingLen == 0){
+      pendingArrival = nowNs();
+      snprintf(pendingCwd, sizeof(pendingCwd), "%s", shell_cwd());
+   }
+   memcpy(pending + pendingLen, line, len);
+   pendingLen += len;
+   if(pending[pendingLen - 1] != '\n'){ //the last line of a file
+      pending[pendingLen++] = '\n';
+   }
+   pending[pendingLen] = '\0';
+}
+
+//writes the record of the command line read from in once it has run
+void trace_record_end(FILE* in, int status){
+   if(traceOut == NULL || in != traceSource || pendingLen == 0){
+      return;
+   }
+   int64_t now = nowNs();
+   bool moved = (pendingCwd[0] != '\0' && strcmp(pendingCwd, lastCwd));
+
+   fprintf(traceOut, "%lld\t%lld\t%d\t", (long long) ((pendingArrival - lastArrival) / NSEC_PER_USEC),
+           (long long) ((now - pendingArrival) / NSEC_PER_USEC), status);
+   if(moved){
+      writeEscaped(traceOut, pendingCwd, strlen(pendingCwd));
+      strcpy(lastCwd, pendingCwd);
+   }
+   fputc('\t', traceOut);
+   writeEscaped(traceOut, pending, pendingLen - 1); //without the last \n
+   fputc('\n', traceOut);
+   fflush(traceOut); //a killed shell still leaves a whole trace
+
+   lastArrival = pendingArrival;
+   pendingLen = 0;
+}
+
+//runs the trace at path; see dsh.h
+int trace_replay(const char* path, bool paced){
+   FILE* trace = fopen(path, "r");
+   if(trace == NULL){
+      perror(path);
+      return EXIT_FAILURE;
+   }
+   char* line = NULL;
+   size_t lineCap = 0;
+   if(getline(&line, &lineCap, trace) < 0 || strncmp(line, TRACE_HEADER, strlen(TRACE_HEADER))){
+      fprintf(stderr, "%s: not a dsh trace\n", path);
+      free(line);
+      fclose(trace);
+      return EXIT_FAILURE;
+   }
+
+   int64_t start = nowNs();
+   int64_t due = start;            //when the current record arrived, replayed
+   int64_t recordedTotal = 0;      //us, summed over the records
+   int64_t replayedTotal = 0;
+   int records = 0;
+   int changed = 0;                //records whose exit status changed
+   ssize_t got;
+   while((got = getline(&line, &lineCap, trace)) > 0){
+      if(line[got - 1] == '\n'){
+         line[--got] = '\0';
+      }
+      //delta, duration and status, then cwd and command after the tabs
+      char* fields[5];
+      char* f = line;
+      int nFields = 0;
+      while(nFields < 4 && (fields[nFields] = f) != NULL && (f = strchr(f, '\t')) != NULL){
+         *f++ = '\0';
+         nFields++;
+      }
+      if(nFields < 4){
+         fprintf(stderr, "%s: bad record: %s\n", path, line);
+         continue;
+      }
+      fields[4] = f;
+      long long delta = strtoll(fields[0], NULL, 10);
+      long long recorded = strtoll(fields[1], NULL, 10);
+      int status = atoi(fields[2]);
+      unescape(fields[3]);
+      size_t cmdLen = unescape(fields[4]);
+
+      due += delta * NSEC_PER_USEC;
+      if(paced){ //wait for when it came in the recording
+         struct timespec until = { due / NSEC_PER_SEC, due % NSEC_PER_SEC };
+         while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR);
+      }
+      if(fields[3][0] != '\0' && chdir(fields[3]) < 0){
+         fprintf(stderr, "replay: cd %s: %s\n", fields[3], strerror(errno));
+      }
+      cwd_changed();
+
+      //through readcmdline() and cycleThroughEachJob() as when it was typed
+      FILE* in = fmemopen(fields[4], cmdLen, "r");
+      if(in == NULL){
+         perror("replay");
+         break;
+      }
+      int64_t began = nowNs();
+      int replayedStatus = run_commands(in);
+      int64_t replayed = (nowNs() - began) / NSEC_PER_USEC;
+      fclose(in);
+
+      records++;
+      changed += (replayedStatus != status);
+      recordedTotal += recorded;
+      replayedTotal += replayed;
+      fflush(stdout);
+      char* nl = strchr(fields[4], '\n');
+      fprintf(stderr, "replay: [%d] %.3fms -> %.3fms (%+.1f%%) status %d", records, recorded / 1000.0,
+              replayed / 1000.0, (recorded > 0) ? 100.0 * (replayed - recorded) / recorded : 0.0,
+              replayedStatus);
+      if(replayedStatus != status){
+         fprintf(stderr, " (was %d)", status);
+      }
+      fprintf(stderr, ": %.*s%s\n", (nl != NULL) ? (int) (nl - fields[4]) : (int) cmdLen, fields[4],
+              (nl != NULL) ? " ..." : "");
+   }
+   free(line);
+   fclose(trace);
+
+   fprintf(stderr, "replay: %d command lines in %.3fs, ran %.3fs (recorded %.3fs, %+.1f%%), "
+           "%d exit statuses changed\n", records, (nowNs() - start) / (double) NSEC_PER_SEC,
+           replayedTotal / 1e6, recordedTotal / 1e6,
+           (recordedTotal > 0) ? 100.0 * (replayedTotal - recordedTotal) / recordedTotal : 0.0, changed);
+   return EXIT_SUCCESS;
+}
+
+//writes n bytes of s to out with tabs, newlines and backslashes escaped
+static void writeEscaped(FILE* out, const char* s, size_t n){
+   for(size_t i = 0; i < n; i++){
+      switch(s[i]){
+         case '\t': fputs("\\t", out); break;
+         case '\n': fputs("\\n", out); break;
+         case '\\': fputs("\\\\", out); break;
+         default: fputc(s[i], out);
+      }
+   }
+}
+
+//undoes writeEscaped() in place; returns the new length
+static size_t unescape(char* s){
+   char* to = s;
+   for(char* from = s; *from != '\0'; from++){
+      if(*from == '\\' && from[1] != '\0'){
+         from++;
+         *to++ = (*from == 't') ? '\t' : (*from == 'n') ? '\n' : *from;
+      } else {
+         *to++ = *from;
+      }
+   }
+   *to = '\0';
+   return to - s;
+}
+
+//now on CLOCK_MONOTONIC in ns
+static int64_t nowNs(void){
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (int64_t) now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}